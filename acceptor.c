@@ -0,0 +1,161 @@
+/*
+ * Dedicated acceptor threads. Every thread owns its own SO_REUSEPORT listener,
+ * so the kernel spreads incoming connections over the threads, and accepts them
+ * in batches. Accepted sockets are handed to the server loop through a pipe,
+ * which the loop polls like any other descriptor.
+ */
+
+#define _GNU_SOURCE
+#include "acceptor.h"
+#include "error_reporting.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+
+struct acceptor_args
+{
+    socket_info* listener;
+    int handoff_fd;
+    int accept_batch;
+};
+
+/// Writes all accepted descriptors to the handoff pipe. Writes are at most
+/// PIPE_BUF bytes, so they are atomic even with several acceptor threads.
+/// The write end is blocking, so a loop that falls behind slows the acceptor down.
+static void hand_off(int handoff_fd, const int* socket_fds, int count)
+{
+    const int chunk = PIPE_BUF / (int) sizeof(int);
+
+    for(int i = 0; i < count; i += chunk)
+    {
+        int n = count - i < chunk ? count - i : chunk;
+        ssize_t written;
+
+        do
+        {
+            written = write(handoff_fd, socket_fds + i, (size_t) n * sizeof(int));
+        } while(written < 0 && errno == EINTR);
+
+        if(written < 0)
+        {
+            print_error("acceptor: Could not hand off connections.");
+            for(int j = i; j < count; j++)
+            {
+                close(socket_fds[j]);
+            }
+            return;
+        }
+    }
+}
+
+/// Runs pinned already, its batch buffer is allocated on the local node.
+static void* acceptor_thread(void* arguments)
+{
+    struct acceptor_args* args = (struct acceptor_args*) arguments;
+    int* socket_fds = malloc((size_t) args->accept_batch * sizeof(int));
+    struct pollfd listener_fd = {args->listener->socket_fd, POLLIN, 0};
+
+    if(socket_fds == NULL)
+    {
+        print_error("acceptor: Could not allocate memory.");
+        return NULL;
+    }
+
+    for(;;)
+    {
+        if(poll(&listener_fd, 1, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            print_error("acceptor: poll() failed");
+            break;
+        }
+
+        int accepted = accept_connections(&args->listener, socket_fds, args->accept_batch);
+        if(accepted < 0)
+        {
+            // Typically EMFILE; give the loop a moment to close descriptors
+            usleep(1000);
+            continue;
+        }
+
+        hand_off(args->handoff_fd, socket_fds, accepted);
+    }
+
+    free(socket_fds);
+    return NULL;
+}
+
+/// Starts acceptor threads, each with its own SO_REUSEPORT listener on port.
+/// \param number_of_threads - Number of acceptor threads [1-n]
+/// \param port - Port to listen on
+/// \param options - Listener options; reuse_port is forced on
+/// \param accept_batch - Maximum number of connections accepted per wake-up
+/// \param cpus - CPUs the threads are pinned to round-robin, may be empty
+/// \return read end of the handoff pipe (non-blocking) - success; -1 - failure
+int start_acceptor_threads(int number_of_threads, uint16_t port, const struct listen_options* options,
+                           int accept_batch, const struct cpu_list* cpus)
+{
+    int handoff[2];
+    struct listen_options reuse_options = *options;
+    reuse_options.reuse_port = 1;
+
+    if(pipe2(handoff, O_CLOEXEC) == -1)
+    {
+        print_error("start_acceptor_threads(): Could not create handoff pipe.");
+        return -1;
+    }
+
+    fcntl(handoff[0], F_SETFL, O_NONBLOCK);
+
+    for(int i = 0; i < number_of_threads; i++)
+    {
+        struct acceptor_args* args = malloc(sizeof(struct acceptor_args));
+        pthread_t thread;
+
+        if(args == NULL || create_passive_socket_with_options(&args->listener, port, &reuse_options) != 0)
+        {
+            free(args);
+            return -1;
+        }
+
+        args->handoff_fd = handoff[1];
+        args->accept_batch = accept_batch;
+
+        if(cpu_thread_create(&thread, cpu_list_pick(cpus, i), "Acceptor", acceptor_thread, args) != 0)
+        {
+            print_error("start_acceptor_threads(): Could not create thread.");
+            destroy_socket(&args->listener);
+            free(args);
+            return -1;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return handoff[0];
+}
+
+/// Reads up to max_connections descriptors that acceptor threads handed off.
+/// \param handoff_fd - Read end returned by start_acceptor_threads()
+/// \param socket_fds - Array receiving the descriptors
+/// \param max_connections - Size of socket_fds
+/// \return number of received descriptors, 0 if none are pending
+int receive_accepted_connections(int handoff_fd, int* socket_fds, int max_connections)
+{
+    ssize_t received = read(handoff_fd, socket_fds, (size_t) max_connections * sizeof(int));
+
+    if(received <= 0)
+    {
+        return 0;
+    }
+
+    // Descriptors are written in one piece (4 bytes < PIPE_BUF), so no partial ints
+    return (int) (received / (ssize_t) sizeof(int));
+}
@@ -0,0 +1,20 @@
+#ifndef CHAT_ACCEPTOR_H
+#define CHAT_ACCEPTOR_H
+
+#include <stdint.h>
+#include "tcp_socket.h"
+#include "cpu_affinity.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int start_acceptor_threads(int number_of_threads, uint16_t port, const struct listen_options* options,
+                           int accept_batch, const struct cpu_list* cpus);
+int receive_accepted_connections(int handoff_fd, int* socket_fds, int max_connections);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_ACCEPTOR_H
@@ -0,0 +1,242 @@
+#include "broadcast_log.h"
+#include "error_reporting.h"
+#include "monotonic_clock.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define CACHE_LINE 64
+
+/// The state of a slot tells which record it holds: 2 * position + 1 while
+/// the record at position is written, 2 * position + 2 once it is complete
+struct log_slot
+{
+    _Atomic uint64_t state;
+    struct broadcast_record record;
+};
+
+struct worker_flag
+{
+    _Atomic uint32_t sleeping;  // the worker waits on its eventfd
+    char pad[CACHE_LINE - sizeof(uint32_t)];
+};
+
+struct broadcast_log
+{
+    _Atomic uint64_t next;      // next position to reserve
+    char pad0[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint32_t next_sequence;
+    _Atomic uint32_t next_id;
+    char pad1[CACHE_LINE - 2 * sizeof(uint32_t)];
+    int workers;
+    int wake_fds[BROADCAST_LOG_MAX_WORKERS];
+    struct worker_flag flags[BROADCAST_LOG_MAX_WORKERS];
+    struct log_slot slots[BROADCAST_LOG_SLOTS];
+};
+
+/// Creates the log in anonymous shared memory, together with one eventfd per
+/// worker. Must be called before the workers are forked.
+/// \param workers - Number of worker processes, at most BROADCAST_LOG_MAX_WORKERS
+/// \return log - success; NULL - failure
+broadcast_log* broadcast_log_create(int workers)
+{
+    if(workers < 1 || workers > BROADCAST_LOG_MAX_WORKERS)
+    {
+        return NULL;
+    }
+
+    broadcast_log* log = mmap(NULL, sizeof(broadcast_log), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(log == MAP_FAILED)
+    {
+        print_error("broadcast_log_create(): Could not map shared memory.");
+        return NULL;
+    }
+
+    // Fresh anonymous memory is zero: positions, ids and flags start at 0
+    atomic_store(&log->next_sequence, 1);
+    atomic_store(&log->next_id, 1);
+    log->workers = workers;
+    for(int worker = 0; worker < workers; worker++)
+    {
+        log->wake_fds[worker] = eventfd(0, EFD_NONBLOCK);
+        if(log->wake_fds[worker] == -1)
+        {
+            print_error("broadcast_log_create(): Could not create eventfd.");
+            return NULL;
+        }
+    }
+
+    return log;
+}
+
+/// Appends a record and wakes the workers that sleep. Records with more
+/// payload than BROADCAST_LOG_PAYLOAD are refused.
+/// \param log - Log to append to
+/// \param record - Record with its origin set
+/// \return 0 - success; -1 - payload too large
+int broadcast_log_append(broadcast_log* log, const struct broadcast_record* record)
+{
+    if(record->length > BROADCAST_LOG_PAYLOAD)
+    {
+        return -1;
+    }
+
+    uint64_t position = atomic_fetch_add(&log->next, 1);
+    struct log_slot* slot = &log->slots[position % BROADCAST_LOG_SLOTS];
+
+    atomic_store_explicit(&slot->state, 2 * position + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->record, record, offsetof(struct broadcast_record, payload) + record->length);
+    atomic_store_explicit(&slot->state, 2 * position + 2, memory_order_release);
+
+    // Pairs with the fence in broadcast_log_sleep()
+    atomic_thread_fence(memory_order_seq_cst);
+    for(int worker = 0; worker < log->workers; worker++)
+    {
+        if(worker != record->origin &&
+           atomic_load_explicit(&log->flags[worker].sleeping, memory_order_relaxed) &&
+           atomic_exchange(&log->flags[worker].sleeping, 0))
+        {
+            uint64_t one = 1;
+            if(write(log->wake_fds[worker], &one, sizeof(one)) != sizeof(one))
+            {
+                // The counter cannot overflow in practice, the worker is awake anyway
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// Positions a cursor at the end of the log, so only new records are read.
+void broadcast_cursor_init(broadcast_log* log, broadcast_cursor* cursor)
+{
+    memset(cursor, 0, sizeof(broadcast_cursor));
+    cursor->position = atomic_load(&log->next);
+    cursor->stalled_position = UINT64_MAX;
+}
+
+/// Reads the next record another worker appended.
+/// \param log - Log to read
+/// \param cursor - Read position of the calling worker
+/// \param worker - Calling worker, its own records are skipped
+/// \param record - Receives the record
+/// \return 1 - a record was read; 0 - no complete record is available
+int broadcast_log_read(broadcast_log* log, broadcast_cursor* cursor, int worker, struct broadcast_record* record)
+{
+    for(;;)
+    {
+        uint64_t next = atomic_load_explicit(&log->next, memory_order_acquire);
+        if(cursor->position >= next)
+        {
+            return 0;
+        }
+        if(next - cursor->position > BROADCAST_LOG_SLOTS)
+        {
+            cursor->lost += next - BROADCAST_LOG_SLOTS - cursor->position;
+            cursor->position = next - BROADCAST_LOG_SLOTS;
+        }
+
+        struct log_slot* slot = &log->slots[cursor->position % BROADCAST_LOG_SLOTS];
+        uint64_t expected = 2 * cursor->position + 2;
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+        if(state < expected)
+        {
+            // Reserved but not complete yet; a writer that died leaves it so
+            uint64_t now = monotonic_time_ns();
+            if(cursor->stalled_position != cursor->position)
+            {
+                cursor->stalled_position = cursor->position;
+                cursor->stalled_since = now;
+                return 0;
+            }
+            if(now - cursor->stalled_since < BROADCAST_LOG_STALL_NS)
+            {
+                return 0;
+            }
+            LOG_WARN("Broadcast log: skipping record %llu, its writer did not finish\n",
+                     (unsigned long long) cursor->position);
+            cursor->lost++;
+            cursor->position++;
+            continue;
+        }
+
+        // Copy, then check that no writer lapped the slot meanwhile
+        int complete = state == expected;
+        if(complete)
+        {
+            memcpy(record, &slot->record, offsetof(struct broadcast_record, payload));
+            if(record->length > BROADCAST_LOG_PAYLOAD)
+            {
+                record->length = BROADCAST_LOG_PAYLOAD;
+            }
+            memcpy(record->payload, slot->record.payload, record->length);
+            atomic_thread_fence(memory_order_acquire);
+            complete = atomic_load_explicit(&slot->state, memory_order_relaxed) == expected;
+        }
+
+        cursor->position++;
+        if(!complete)
+        {
+            cursor->lost++;
+        }
+        else if(record->origin != worker)
+        {
+            return 1;
+        }
+    }
+}
+
+/// \return a sequence number that is unique across all workers
+uint32_t broadcast_log_next_sequence(broadcast_log* log)
+{
+    return atomic_fetch_add(&log->next_sequence, 1);
+}
+
+/// \return a connection id that is unique across all workers
+uint32_t broadcast_log_next_id(broadcast_log* log)
+{
+    return atomic_fetch_add(&log->next_id, 1);
+}
+
+/// \return eventfd a worker waits on for new records
+int broadcast_log_wake_fd(broadcast_log* log, int worker)
+{
+    return log->wake_fds[worker];
+}
+
+/// Announces that a worker is about to wait on its eventfd.
+/// \return 0 - may sleep; 1 - records arrived meanwhile, do not sleep
+int broadcast_log_sleep(broadcast_log* log, const broadcast_cursor* cursor, int worker)
+{
+    atomic_store_explicit(&log->flags[worker].sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&log->next, memory_order_relaxed) > cursor->position;
+}
+
+/// Withdraws the announcement of broadcast_log_sleep().
+/// \param signalled - the eventfd was readable, its counter is reset
+void broadcast_log_awake(broadcast_log* log, int worker, int signalled)
+{
+    uint64_t count;
+
+    atomic_store_explicit(&log->flags[worker].sleeping, 0, memory_order_relaxed);
+    if(signalled)
+    {
+        while(read(log->wake_fds[worker], &count, sizeof(count)) == sizeof(count))
+        {
+        }
+    }
+}
+
+/// \return number of records appended by all workers
+unsigned long long broadcast_log_appended(broadcast_log* log)
+{
+    return atomic_load(&log->next);
+}
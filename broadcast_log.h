@@ -0,0 +1,62 @@
+#ifndef CHAT_BROADCAST_LOG_H
+#define CHAT_BROADCAST_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Multi-producer broadcast log in shared memory, the bus between the worker
+/// processes of the prefork server. Every worker appends the broadcasts of
+/// its own clients and reads those of all others. The log is a ring of fixed
+/// slots: a reader that falls more than BROADCAST_LOG_SLOTS behind loses the
+/// oldest records, and a record whose writer died half-way is skipped after
+/// BROADCAST_LOG_STALL_NS.
+#define BROADCAST_LOG_SLOTS 4096
+#define BROADCAST_LOG_PAYLOAD 3968
+#define BROADCAST_LOG_MAX_WORKERS 64
+#define BROADCAST_LOG_STALL_NS (100ULL * 1000 * 1000)
+
+typedef struct broadcast_log broadcast_log;
+
+/// One broadcast, as the event server's chat messages describe it
+struct broadcast_record
+{
+    int origin;             // worker that appended the record
+    uint8_t type;           // enum wire_frame_type
+    uint16_t room;
+    uint32_t sender;
+    uint32_t sequence;
+    int sender_fd;
+    char sender_peer[48];
+    uint32_t length;
+    char payload[BROADCAST_LOG_PAYLOAD];
+};
+
+/// Read position of one worker
+typedef struct broadcast_cursor
+{
+    uint64_t position;
+    uint64_t stalled_position;  // incomplete record the reader is waiting for
+    uint64_t stalled_since;
+    unsigned long long lost;    // records overwritten or abandoned before they were read
+} broadcast_cursor;
+
+broadcast_log* broadcast_log_create(int workers);
+int broadcast_log_append(broadcast_log* log, const struct broadcast_record* record);
+void broadcast_cursor_init(broadcast_log* log, broadcast_cursor* cursor);
+int broadcast_log_read(broadcast_log* log, broadcast_cursor* cursor, int worker, struct broadcast_record* record);
+uint32_t broadcast_log_next_sequence(broadcast_log* log);
+uint32_t broadcast_log_next_id(broadcast_log* log);
+int broadcast_log_wake_fd(broadcast_log* log, int worker);
+int broadcast_log_sleep(broadcast_log* log, const broadcast_cursor* cursor, int worker);
+void broadcast_log_awake(broadcast_log* log, int worker, int signalled);
+unsigned long long broadcast_log_appended(broadcast_log* log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_BROADCAST_LOG_H
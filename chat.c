@@ -8,6 +8,7 @@
 //#include "chat_server_event.h"
 
 #include "chat_server_threads.h"
+#include "chat_server_coroutines.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -16,6 +17,13 @@
 #include <arpa/inet.h>
 #include "software_information.h"
 #include "chat_server_poll.h"
+#include "error_reporting.h"
+#include "server_config.h"
+#include "multicast.h"
+#include "broadcast_log.h"
+
+/// Value of multithread_flag for -o, --coroutine (1 - threads, 0 - event loop)
+#define SERVER_COROUTINES 2
 
 /// Prints the name, copyright info and version of the program.
 void version(void)
@@ -37,17 +45,156 @@ void help(void)
     "\t-c, --client  \tchat client is started, connects to chat server\n"\
     "\t\t\tARGUMENT needs to be ip:port of the chat server (IPv4)\n\n"\
     "If --s or --server are used the following options are also available:\n"\
-    "\t-t, --thread \tuse multithreading\n"\
+    "\t-t, --thread \tuse multithreading: one blocking thread per client,\n"\
+    "\t\t\tthe one server outside the reactor\n"\
     "\t\t\tARGUMENT needs to be the number of threads to start [1-n]\n\n"\
     "\t-e, --event  \tuse event loop (default when omitted)\n\n"
+    "\t-o, --coroutine\tone coroutine per client direction on a reactor\n"\
+    "\t\t\tscheduler; supports --reactor\n\n"\
+    "\t--reactor\tI/O backend of -e and -o: poll or epoll\n"\
+    "\t\t\t(default: epoll for -o and for -e with --max-connections\n"\
+    "\t\t\tabove 960, poll otherwise)\n"\
+    "\t--max-connections\tclients -e and -o serve at once (default 198\n"\
+    "\t\t\tfor -e, unlimited for -o); raises the open files limit up to\n"\
+    "\t\t\tthe hard limit. Idle clients hold no buffers, so 100000\n"\
+    "\t\t\tmostly idle clients fit in a few dozen megabytes\n\n"
+    "\t-l, --log-level\tconsole output level: error, warn, info (default)\n"\
+    "\t\t\tor debug; debug also echoes every chat message\n\n"\
+    "All servers run the same chat core; -t, -e and -o only choose\n"\
+    "how it is driven. Its outbound queues take:\n"\
+    "\t--outbound-hwm\tbytes queued for one client before it counts as a slow\n"\
+    "\t\t\tconsumer (default 256k)\n"\
+    "\t--outbound-lwm\tbytes below which a slow consumer recovers (default 64k)\n"\
+    "\t--backpressure\tpolicy for slow consumers: drop-oldest (default),\n"\
+    "\t\t\tdrop-new or disconnect\n\n"\
+    "The event loop server additionally supports, -t and -o reject these:\n"\
+    "\t--coalesce[=USEC]\tflush each client once per loop iteration with a\n"\
+    "\t\t\tsingle sendmsg(), or hold messages up to USEC microseconds\n"\
+    "\t\t\tto collect more (default: one send per message);\n"\
+    "\t\t\timplies TCP_NODELAY on client sockets\n"\
+    "\t--multicast\tip:port of a multicast group, e.g. 239.1.2.3:5000;\n"\
+    "\t\t\tbinary clients may ask to get broadcasts from it\n"\
+    "\t--multicast-if\taddress of the interface for the group, or \"any\"\n"\
+    "\t\t\t(default 127.0.0.1: loopback only)\n"\
+    "\t--multicast-history\tbroadcasts kept to resend to listeners that\n"\
+    "\t\t\tmissed datagrams (default 4096)\n"\
+    "\t--shm-ring\tbytes per direction of the shared memory rings that\n"\
+    "\t\t\tbinary clients on --unix may ask for (default 1m)\n"\
+    "\t--workers\tnumber of worker processes sharing the port through\n"\
+    "\t\t\tSO_REUSEPORT; broadcasts reach all of them through shared\n"\
+    "\t\t\tmemory and a crashed worker is restarted. Worker 0 serves\n"\
+    "\t\t\tthe console and --unix (default 0: single process)\n"\
+    "\t--node-id\tid of this server among federated servers [1-255];\n"\
+    "\t\t\trequired by --federation-port and --peer\n"\
+    "\t--federation-port\tport other servers link to\n"\
+    "\t--peer\t\tip:port of a server to link to, may be repeated; linked\n"\
+    "\t\t\tservers should form a full mesh and share their rooms\n"\
+    "\t--handoff\tUnix socket for hot restarts: a server started with the\n"\
+    "\t\t\tsame path takes over the listeners and clients of the\n"\
+    "\t\t\trunning one, which then exits; clients stay connected,\n"\
+    "\t\t\tthose on shared memory rings are dropped\n"\
+    "\t--rate-limit\tmessages per second a client may send; reads of a\n"\
+    "\t\t\tclient over it pause until its budget refilled (default 0:\n"\
+    "\t\t\tunlimited). Bursts of one second are allowed\n"\
+    "\t--rate-limit-bytes\tbytes per second a client may send, e.g. 64k\n"\
+    "\t\t\t(default 0: unlimited)\n"\
+    "\t--zerocopy[=BYTES]\tsend messages of at least BYTES (default 16k)\n"\
+    "\t\t\twith MSG_ZEROCOPY: the kernel sends from the shared message\n"\
+    "\t\t\tinstead of copying it per client. TCP only; pays off with\n"\
+    "\t\t\tlarge binary frames on real NICs, on loopback the kernel\n"\
+    "\t\t\tcopies anyway\n"\
+    "\t--spool\t\tdirectory that files binary clients upload are kept in\n"\
+    "\t\t\tuntil the server exits; they are shared with the room and\n"\
+    "\t\t\tstreamed to those who ask with sendfile()\n"\
+    "\t--spool-max\tlargest file accepted (default 256m)\n"\
+    "\t--file-rate\tbytes per second of file content to one client, e.g.\n"\
+    "\t\t\t1m (default 0: unlimited)\n"\
+    "\t--presence-interval\tannounce joins and leaves once per MS\n"\
+    "\t\t\tmilliseconds as one delta per room, e.g. '+15 joined,\n"\
+    "\t\t\t-3 left' (default 0: every one on its own)\n"\
+    "\t--presence-snapshot\tnewcomers get the members of their room\n"\
+    "\t\t\twith the next delta (needs --presence-interval)\n"\
+    "\t--trace\t\trecord queued and dispatched events and everything the\n"\
+    "\t\t\thandlers read into FILE\n"\
+    "\t--replay\trun the trace in FILE through the handlers as fast as\n"\
+    "\t\t\tthey go, with in-memory sockets instead of clients, and\n"\
+    "\t\t\tprint the stats\n\n"\
+    "Both servers support:\n"\
+    "\t--backlog\tlength of the listen queue (default SOMAXCONN)\n"\
+    "\t--accept-batch\tconnections accepted per wake-up (default 64)\n"\
+    "\t--acceptors\tnumber of acceptor threads, each with its own\n"\
+    "\t\t\tSO_REUSEPORT listener (default 0: the server accepts itself)\n"\
+    "\t--socket-profile\tsocket tuning: default, latency or throughput,\n"\
+    "\t\t\toptionally followed by overrides, e.g. latency,sndbuf=262144\n"\
+    "\t\t\t(keys: nodelay, sndbuf, rcvbuf, cork, defer_accept, busy_poll;\n"\
+    "\t\t\tdefer_accept only suits clients that send first)\n"\
+    "\t--unix\t\talso listen on a Unix domain socket at this path;\n"\
+    "\t\t\ta leading @ selects the abstract namespace, e.g. @chat\n"\
+    "\t--idle-timeout\tseconds without data from a client before it is\n"\
+    "\t\t\tdisconnected (default 0: never)\n"\
+    "\t--heartbeat\tseconds without data to a client before an empty\n"\
+    "\t\t\tline is sent to probe it (default 0: never)\n"\
+    "\t--write-stall-timeout\tseconds a client may leave pending data\n"\
+    "\t\t\tunread before it is disconnected (default 30, 0: never)\n"\
+    "\t--cpus-accept\tCPUs the acceptor threads are pinned to, one each\n"\
+    "\t\t\tround-robin, e.g. 0-3,8; irq:IFACE takes the CPUs that\n"\
+    "\t\t\tserve the interrupts of a network interface, e.g. irq:eth0\n"\
+    "\t--cpus-io\tCPUs of the server loop (one per --workers process);\n"\
+    "\t\t\tof the thread server, the thread reading all clients\n"\
+    "\t--cpus-worker\tthread server: CPUs of the client threads\n\n"\
+    "While the event loop server runs, SIGUSR1 or typing /stats on the\n"\
+    "server console prints latency statistics.\n\n"\
     "Example calls:\n"\
     "\tchat -s 8080\n"\
     "\tchat --thread  -s 8080\n"\
-    "\tchat -c 127.0.0.1:8080\n\n");
+    "\tchat -c 127.0.0.1:8080\n"\
+    "\tchat -e -s 8080 --handoff /tmp/chat.handoff\n\n");
 
 }
 
 
+/// Values of options that only have a long form
+enum long_only_options
+{
+    OPTION_OUTBOUND_HWM = 256,
+    OPTION_OUTBOUND_LWM,
+    OPTION_BACKPRESSURE,
+    OPTION_BACKLOG,
+    OPTION_ACCEPT_BATCH,
+    OPTION_ACCEPTORS,
+    OPTION_SOCKET_PROFILE,
+    OPTION_UNIX,
+    OPTION_IDLE_TIMEOUT,
+    OPTION_HEARTBEAT,
+    OPTION_WRITE_STALL_TIMEOUT,
+    OPTION_COALESCE,
+    OPTION_MULTICAST,
+    OPTION_MULTICAST_IF,
+    OPTION_MULTICAST_HISTORY,
+    OPTION_SHM_RING,
+    OPTION_WORKERS,
+    OPTION_NODE_ID,
+    OPTION_FEDERATION_PORT,
+    OPTION_PEER,
+    OPTION_HANDOFF,
+    OPTION_REACTOR,
+    OPTION_CPUS_ACCEPT,
+    OPTION_CPUS_IO,
+    OPTION_CPUS_WORKER,
+    OPTION_MAX_CONNECTIONS,
+    OPTION_RATE_LIMIT,
+    OPTION_RATE_LIMIT_BYTES,
+    OPTION_ZEROCOPY,
+    OPTION_SPOOL,
+    OPTION_SPOOL_MAX,
+    OPTION_FILE_RATE,
+    OPTION_PRESENCE_INTERVAL,
+    OPTION_PRESENCE_SNAPSHOT,
+    OPTION_TRACE,
+    OPTION_REPLAY
+};
+
+
 /// Print message to stdout and exit
 /// \param error_message - String that is printed to stdout
 void argument_error(const char* error_message)
@@ -179,8 +326,47 @@ int main(int argc, char *argv[])
             {"client", required_argument, NULL, 'c'},
             {"thread", optional_argument, NULL, 't'},
             {"event", no_argument, NULL, 'e'},
+            {"coroutine", no_argument, NULL, 'o'},
             {"help", no_argument, NULL, 'h'},
-            {"version", no_argument, NULL, 'v'}
+            {"version", no_argument, NULL, 'v'},
+            {"log-level", required_argument, NULL, 'l'},
+            {"outbound-hwm", required_argument, NULL, OPTION_OUTBOUND_HWM},
+            {"outbound-lwm", required_argument, NULL, OPTION_OUTBOUND_LWM},
+            {"backpressure", required_argument, NULL, OPTION_BACKPRESSURE},
+            {"backlog", required_argument, NULL, OPTION_BACKLOG},
+            {"accept-batch", required_argument, NULL, OPTION_ACCEPT_BATCH},
+            {"acceptors", required_argument, NULL, OPTION_ACCEPTORS},
+            {"socket-profile", required_argument, NULL, OPTION_SOCKET_PROFILE},
+            {"unix", required_argument, NULL, OPTION_UNIX},
+            {"idle-timeout", required_argument, NULL, OPTION_IDLE_TIMEOUT},
+            {"heartbeat", required_argument, NULL, OPTION_HEARTBEAT},
+            {"write-stall-timeout", required_argument, NULL, OPTION_WRITE_STALL_TIMEOUT},
+            {"coalesce", optional_argument, NULL, OPTION_COALESCE},
+            {"multicast", required_argument, NULL, OPTION_MULTICAST},
+            {"multicast-if", required_argument, NULL, OPTION_MULTICAST_IF},
+            {"multicast-history", required_argument, NULL, OPTION_MULTICAST_HISTORY},
+            {"shm-ring", required_argument, NULL, OPTION_SHM_RING},
+            {"workers", required_argument, NULL, OPTION_WORKERS},
+            {"node-id", required_argument, NULL, OPTION_NODE_ID},
+            {"federation-port", required_argument, NULL, OPTION_FEDERATION_PORT},
+            {"peer", required_argument, NULL, OPTION_PEER},
+            {"handoff", required_argument, NULL, OPTION_HANDOFF},
+            {"reactor", required_argument, NULL, OPTION_REACTOR},
+            {"cpus-accept", required_argument, NULL, OPTION_CPUS_ACCEPT},
+            {"cpus-io", required_argument, NULL, OPTION_CPUS_IO},
+            {"cpus-worker", required_argument, NULL, OPTION_CPUS_WORKER},
+            {"max-connections", required_argument, NULL, OPTION_MAX_CONNECTIONS},
+            {"rate-limit", required_argument, NULL, OPTION_RATE_LIMIT},
+            {"rate-limit-bytes", required_argument, NULL, OPTION_RATE_LIMIT_BYTES},
+            {"zerocopy", optional_argument, NULL, OPTION_ZEROCOPY},
+            {"spool", required_argument, NULL, OPTION_SPOOL},
+            {"spool-max", required_argument, NULL, OPTION_SPOOL_MAX},
+            {"file-rate", required_argument, NULL, OPTION_FILE_RATE},
+            {"presence-interval", required_argument, NULL, OPTION_PRESENCE_INTERVAL},
+            {"presence-snapshot", no_argument, NULL, OPTION_PRESENCE_SNAPSHOT},
+            {"trace", required_argument, NULL, OPTION_TRACE},
+            {"replay", required_argument, NULL, OPTION_REPLAY},
+            {NULL, 0, NULL, 0}
         };
 
     int option_index = 0;
@@ -189,8 +375,10 @@ int main(int argc, char *argv[])
     int port = 0;
     char* ip = NULL;
     int number_of_threads = 1;
+    int number_of_workers = 0;
+    const char* event_option = NULL;    // last option only the event loop has
 
-    while ((opt = getopt_long(argc, argv, "s:c:t:ehv", long_options, &option_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "s:c:t:eohvl:", long_options, &option_index)) != -1)
     {
 
         if((opt == 's' || opt == 'c') && server_flag != -1)
@@ -198,10 +386,19 @@ int main(int argc, char *argv[])
             free(ip);
             argument_error("There may only be one occurence of either -s, --server or -c, --client");
         }
-        else if((opt == 't' || opt == 'e') && multithread_flag != -1)
+        else if((opt == 't' || opt == 'e' || opt == 'o') && multithread_flag != -1)
         {
             free(ip);
-            argument_error("There may only be one occurence of either -t, --thread or -e, --event");
+            argument_error("There may only be one occurence of either -t, --thread, -e, --event or -o, --coroutine");
+        }
+
+        if(opt == OPTION_COALESCE || opt == OPTION_MULTICAST || opt == OPTION_MULTICAST_IF
+           || opt == OPTION_MULTICAST_HISTORY || opt == OPTION_SHM_RING || opt == OPTION_RATE_LIMIT
+           || opt == OPTION_RATE_LIMIT_BYTES || opt == OPTION_ZEROCOPY || opt == OPTION_SPOOL
+           || opt == OPTION_SPOOL_MAX || opt == OPTION_FILE_RATE || opt == OPTION_PRESENCE_INTERVAL
+           || opt == OPTION_PRESENCE_SNAPSHOT)
+        {
+            event_option = long_options[option_index].name;
         }
 
         switch (opt)
@@ -235,6 +432,270 @@ int main(int argc, char *argv[])
             case 'e':
                 multithread_flag = 0;
                 break;
+            case 'o':
+                multithread_flag = SERVER_COROUTINES;
+                break;
+            case 'l':
+                if(parse_log_level(optarg, &log_level))
+                {
+                    free(ip);
+                    argument_error("Argument after -l or --log-level has to be error, warn, info or debug.");
+                }
+                break;
+            case OPTION_OUTBOUND_HWM:
+                if(parse_size(optarg, &server_config.outbound_high_water))
+                {
+                    free(ip);
+                    argument_error("Argument after --outbound-hwm is not a byte count.");
+                }
+                break;
+            case OPTION_OUTBOUND_LWM:
+                if(parse_size(optarg, &server_config.outbound_low_water))
+                {
+                    free(ip);
+                    argument_error("Argument after --outbound-lwm is not a byte count.");
+                }
+                break;
+            case OPTION_BACKPRESSURE:
+                if(parse_backpressure_policy(optarg, &server_config.backpressure_policy))
+                {
+                    free(ip);
+                    argument_error("Argument after --backpressure has to be drop-oldest, drop-new or disconnect.");
+                }
+                break;
+            case OPTION_BACKLOG:
+                if(string_to_int(optarg, &server_config.listen_backlog) || server_config.listen_backlog < 1)
+                {
+                    free(ip);
+                    argument_error("Argument after --backlog is not a positive integer.");
+                }
+                break;
+            case OPTION_ACCEPT_BATCH:
+                if(string_to_int(optarg, &server_config.accept_batch) || server_config.accept_batch < 1)
+                {
+                    free(ip);
+                    argument_error("Argument after --accept-batch is not a positive integer.");
+                }
+                break;
+            case OPTION_ACCEPTORS:
+                if(string_to_int(optarg, &server_config.acceptor_threads) || server_config.acceptor_threads < 0)
+                {
+                    free(ip);
+                    argument_error("Argument after --acceptors is not a non-negative integer.");
+                }
+                break;
+            case OPTION_SOCKET_PROFILE:
+                if(parse_socket_profile(optarg, &server_config.socket_profile))
+                {
+                    free(ip);
+                    argument_error("Argument after --socket-profile is not a valid profile.");
+                }
+                break;
+            case OPTION_UNIX:
+                server_config.unix_socket_path = optarg;
+                break;
+            case OPTION_IDLE_TIMEOUT:
+                if(string_to_int(optarg, &server_config.idle_timeout) || server_config.idle_timeout < 0)
+                {
+                    free(ip);
+                    argument_error("Argument after --idle-timeout is not a non-negative integer.");
+                }
+                break;
+            case OPTION_HEARTBEAT:
+                if(string_to_int(optarg, &server_config.heartbeat_interval) || server_config.heartbeat_interval < 0)
+                {
+                    free(ip);
+                    argument_error("Argument after --heartbeat is not a non-negative integer.");
+                }
+                break;
+            case OPTION_WRITE_STALL_TIMEOUT:
+                if(string_to_int(optarg, &server_config.write_stall_timeout) || server_config.write_stall_timeout < 0)
+                {
+                    free(ip);
+                    argument_error("Argument after --write-stall-timeout is not a non-negative integer.");
+                }
+                break;
+            case OPTION_COALESCE:
+                if(optarg != NULL
+                   && (string_to_int(optarg, &server_config.coalesce_budget_us) || server_config.coalesce_budget_us < 0))
+                {
+                    free(ip);
+                    argument_error("Argument after --coalesce is not a non-negative number of microseconds.");
+                }
+                server_config.coalesce_sends = 1;
+                break;
+            case OPTION_MULTICAST:
+            {
+                struct sockaddr_in group;
+                if(parse_multicast_group(optarg, &group))
+                {
+                    free(ip);
+                    argument_error("Argument after --multicast is not ip:port of a multicast group, e.g. '239.1.2.3:5000'.");
+                }
+                server_config.multicast_group = optarg;
+                break;
+            }
+            case OPTION_MULTICAST_IF:
+                if(strcmp(optarg, "any") == 0)
+                {
+                    server_config.multicast_interface = NULL;
+                }
+                else if(is_valid_ip(optarg))
+                {
+                    server_config.multicast_interface = optarg;
+                }
+                else
+                {
+                    free(ip);
+                    argument_error("Argument after --multicast-if is not an IPv4 address or 'any'.");
+                }
+                break;
+            case OPTION_MULTICAST_HISTORY:
+                if(string_to_int(optarg, &server_config.multicast_history) || server_config.multicast_history < 1)
+                {
+                    free(ip);
+                    argument_error("Argument after --multicast-history is not a positive integer.");
+                }
+                break;
+            case OPTION_SHM_RING:
+                if(parse_size(optarg, &server_config.shm_ring_size) || server_config.shm_ring_size < 4096
+                   || server_config.shm_ring_size > 1024 * 1024 * 1024)
+                {
+                    free(ip);
+                    argument_error("Argument after --shm-ring is not a byte count between 4k and 1g.");
+                }
+                break;
+            case OPTION_WORKERS:
+                if(string_to_int(optarg, &number_of_workers) || number_of_workers < 0
+                   || number_of_workers > BROADCAST_LOG_MAX_WORKERS)
+                {
+                    free(ip);
+                    argument_error("Argument after --workers is not an integer between 0 and 64.");
+                }
+                break;
+            case OPTION_NODE_ID:
+                if(string_to_int(optarg, &server_config.node_id) || server_config.node_id < 1
+                   || server_config.node_id > FEDERATION_MAX_NODE)
+                {
+                    free(ip);
+                    argument_error("Argument after --node-id is not an integer between 1 and 255.");
+                }
+                break;
+            case OPTION_FEDERATION_PORT:
+                if(string_to_int(optarg, &server_config.federation_port) || server_config.federation_port < 1
+                   || server_config.federation_port > 65535)
+                {
+                    free(ip);
+                    argument_error("Argument after --federation-port is not a port.");
+                }
+                break;
+            case OPTION_PEER:
+            {
+                char peer_ip[INET_ADDRSTRLEN];
+                uint16_t peer_port;
+                if(parse_peer_address(optarg, peer_ip, sizeof(peer_ip), &peer_port)
+                   || server_config.peer_count == FEDERATION_MAX_PEERS)
+                {
+                    free(ip);
+                    argument_error("Argument after --peer is not ip:port, e.g. '127.0.0.1:7001', or too many peers.");
+                }
+                server_config.peers[server_config.peer_count++] = optarg;
+                break;
+            }
+            case OPTION_HANDOFF:
+                server_config.handoff_path = optarg;
+                break;
+            case OPTION_REACTOR:
+                if(parse_reactor_backend(optarg, &server_config.reactor_backend))
+                {
+                    free(ip);
+                    argument_error("Argument after --reactor must be poll or epoll.");
+                }
+                break;
+            case OPTION_CPUS_ACCEPT:
+            case OPTION_CPUS_IO:
+            case OPTION_CPUS_WORKER:
+            {
+                struct cpu_list* cpus = opt == OPTION_CPUS_ACCEPT ? &server_config.accept_cpus
+                                        : opt == OPTION_CPUS_IO ? &server_config.io_cpus
+                                        : &server_config.worker_cpus;
+                if(parse_cpu_list(optarg, cpus))
+                {
+                    free(ip);
+                    argument_error("Argument after --cpus-accept, --cpus-io or --cpus-worker is not a CPU list, "
+                                   "e.g. '0-3,8', or irq:IFACE names an interface without interrupts.");
+                }
+                break;
+            }
+            case OPTION_MAX_CONNECTIONS:
+                if(string_to_int(optarg, &server_config.max_connections) || server_config.max_connections < 1
+                   || server_config.max_connections > 1000000)
+                {
+                    free(ip);
+                    argument_error("Argument after --max-connections must be in [1-1000000].");
+                }
+                break;
+            case OPTION_RATE_LIMIT:
+            {
+                int messages;
+                if(string_to_int(optarg, &messages) || messages < 0)
+                {
+                    free(ip);
+                    argument_error("Argument after --rate-limit is not a non-negative integer.");
+                }
+                server_config.rate_messages = messages;
+                break;
+            }
+            case OPTION_RATE_LIMIT_BYTES:
+                if(parse_size(optarg, &server_config.rate_bytes))
+                {
+                    free(ip);
+                    argument_error("Argument after --rate-limit-bytes is not a size, e.g. 64k.");
+                }
+                break;
+            case OPTION_ZEROCOPY:
+                server_config.zerocopy_threshold = 16 * 1024;
+                if(optarg != NULL && (parse_size(optarg, &server_config.zerocopy_threshold)
+                                      || server_config.zerocopy_threshold == 0))
+                {
+                    free(ip);
+                    argument_error("Argument after --zerocopy is not a positive size, e.g. 16k.");
+                }
+                break;
+            case OPTION_SPOOL:
+                server_config.spool_dir = optarg;
+                break;
+            case OPTION_SPOOL_MAX:
+                if(parse_size(optarg, &server_config.spool_max_file))
+                {
+                    free(ip);
+                    argument_error("Argument after --spool-max is not a size, e.g. 256m.");
+                }
+                break;
+            case OPTION_FILE_RATE:
+                if(parse_size(optarg, &server_config.file_rate))
+                {
+                    free(ip);
+                    argument_error("Argument after --file-rate is not a size, e.g. 1m.");
+                }
+                break;
+            case OPTION_PRESENCE_INTERVAL:
+                if(string_to_int(optarg, &server_config.presence_interval_ms)
+                   || server_config.presence_interval_ms < 1 || server_config.presence_interval_ms > 60000)
+                {
+                    free(ip);
+                    argument_error("Argument after --presence-interval must be in [1-60000] milliseconds.");
+                }
+                break;
+            case OPTION_PRESENCE_SNAPSHOT:
+                server_config.presence_snapshot = 1;
+                break;
+            case OPTION_TRACE:
+                server_config.trace_path = optarg;
+                break;
+            case OPTION_REPLAY:
+                server_config.replay_path = optarg;
+                break;
             case 'h':
                 help();
             case 'v':
@@ -256,6 +717,87 @@ int main(int argc, char *argv[])
         argument_error("The client cannot be start with options -t, --thread and -e, --event.");
     }
 
+    if(server_config.outbound_low_water > server_config.outbound_high_water)
+    {
+        free(ip);
+        argument_error("--outbound-lwm must not be larger than --outbound-hwm.");
+    }
+
+    if(number_of_workers > 0 && (multithread_flag != 0 || server_config.acceptor_threads > 0
+                                 || server_config.multicast_group != NULL))
+    {
+        free(ip);
+        argument_error("--workers requires -e, --event and cannot be combined with --acceptors or --multicast.");
+    }
+
+    if((server_config.federation_port > 0 || server_config.peer_count > 0) != (server_config.node_id > 0))
+    {
+        free(ip);
+        argument_error("--node-id goes together with --federation-port or --peer.");
+    }
+
+    if(server_config.node_id > 0 && (multithread_flag != 0 || number_of_workers > 0))
+    {
+        free(ip);
+        argument_error("Federation requires -e, --event and cannot be combined with --workers.");
+    }
+
+    if(server_config.handoff_path != NULL && (multithread_flag != 0 || number_of_workers > 0
+                                              || server_config.acceptor_threads > 0))
+    {
+        free(ip);
+        argument_error("--handoff requires -e, --event and cannot be combined with --workers or --acceptors.");
+    }
+
+    if(server_config.reactor_backend != REACTOR_DEFAULT && multithread_flag != 0 && multithread_flag != SERVER_COROUTINES)
+    {
+        free(ip);
+        argument_error("--reactor requires -e, --event or -o, --coroutine.");
+    }
+
+    if(server_config.max_connections > 0 && multithread_flag != 0 && multithread_flag != SERVER_COROUTINES)
+    {
+        free(ip);
+        argument_error("--max-connections requires -e, --event or -o, --coroutine.");
+    }
+
+    //-t and -o would ignore them, a comparison of the servers would then
+    //measure more than the I/O model
+    if(event_option != NULL && multithread_flag > 0)
+    {
+        char message[64];
+        snprintf(message, sizeof(message), "--%s requires -e, --event.", event_option);
+        free(ip);
+        argument_error(message);
+    }
+
+    if(server_config.presence_snapshot && server_config.presence_interval_ms == 0)
+    {
+        free(ip);
+        argument_error("--presence-snapshot requires --presence-interval.");
+    }
+
+    if((server_config.trace_path != NULL || server_config.replay_path != NULL)
+       && (multithread_flag != 0 || number_of_workers > 0 || server_config.acceptor_threads > 0
+           || server_config.handoff_path != NULL))
+    {
+        free(ip);
+        argument_error("--trace and --replay require -e, --event and cannot be combined with --workers, "
+                       "--acceptors or --handoff.");
+    }
+
+    if(server_config.trace_path != NULL && server_config.replay_path != NULL)
+    {
+        free(ip);
+        argument_error("--trace and --replay cannot be combined.");
+    }
+
+    if(server_config.worker_cpus.count > 0 && (multithread_flag == 0 || multithread_flag == SERVER_COROUTINES))
+    {
+        free(ip);
+        argument_error("--cpus-worker requires -t, --thread.");
+    }
+
     printf("Starting ");
 
     //When arguments are ok
@@ -263,6 +805,12 @@ int main(int argc, char *argv[])
     {
         printf("Chat Client: Not implemented in this version\n");
     }
+    else if(server_flag && multithread_flag == SERVER_COROUTINES)
+    {
+        printf("Chat Server (coroutines)\n");
+
+        chat_server_coroutines(port);
+    }
     else if(server_flag && multithread_flag)
     {
         printf("Chat Server (multithreaded)\n");
@@ -272,7 +820,14 @@ int main(int argc, char *argv[])
     else if(server_flag && !multithread_flag)
     {
         printf("Chat Server (event loop)\n");
-        chat_server_event(port);
+        if(number_of_workers > 0)
+        {
+            chat_server_prefork(port, number_of_workers);
+        }
+        else
+        {
+            chat_server_event(port);
+        }
     }
 
     free(ip);
@@ -0,0 +1,812 @@
+/*
+ * Benchmark client for the chat servers. Connects one sender and a number of
+ * receivers, sends timestamped messages at a given rate and measures the
+ * end-to-end latency until each receiver has seen each message.
+ */
+
+#define _GNU_SOURCE
+#include "tcp_socket.h"
+#include "latency_histogram.h"
+#include "monotonic_clock.h"
+#include "wire_protocol.h"
+#include "multicast.h"
+#include "shm_transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/tcp.h>
+
+/// Receivers wait this long for outstanding messages after the last send
+#define DRAIN_TIMEOUT_NS (2000ULL * 1000 * 1000)
+
+#define RECEIVE_BUFFER_SIZE 65536
+
+/// Largest binary payload, a whole frame has to fit into a receiver's buffer
+#define MAX_BINARY_SIZE 60000
+
+/// Federated servers (-c given several times) the clients are spread over
+#define MAX_SERVERS 8
+
+struct bench_server
+{
+    char ip[64];
+    uint16_t port;
+};
+
+struct bench_options
+{
+    struct bench_server servers[MAX_SERVERS];
+    int server_count;
+    const char* unix_path;  // connect over AF_UNIX instead of TCP if set
+    int receivers;
+    int messages;
+    int rate;               // messages per second, 0 - as fast as possible
+    int size;               // bytes per message including the marker
+    int binary;             // use the binary protocol of the event server
+    const char* multicast_group;        // receivers get broadcasts from this group if set
+    const char* multicast_interface;
+    int shm;                // move clients to shared memory rings (needs -u)
+    struct socket_profile profile;
+};
+
+struct receiver
+{
+    int fd;
+    int multicast_fd;           // -1 - not a multicast listener
+    uint32_t next_sequence;     // expected from the group, 0 - none seen yet
+    shm_channel* shm;           // NULL - data arrives on fd
+    size_t used;
+    char buffer[RECEIVE_BUFFER_SIZE];
+};
+
+struct bench_result
+{
+    latency_histogram latency;
+    unsigned long long received;
+    unsigned long long receive_calls;
+    unsigned long long received_bytes;
+    unsigned long long send_calls;
+    unsigned long long data_segments;   // TCP segments with payload seen by the receivers
+    unsigned long long datagrams;
+    unsigned long long missed;          // sequences the receivers had to NACK
+    unsigned long long unrecoverable;   // sequences the server no longer had
+    unsigned long long wakeups;         // eventfd signals the ring receivers got
+};
+
+/// Prints instructions on how to start the benchmark.
+void bench_help(void)
+{
+    printf("Chat benchmark client\n\n"\
+    "\t-c, --connect  \tip:port of the chat server; given several times for\n"\
+    "\t\t\tfederated servers, the sender uses the first and the\n"\
+    "\t\t\treceivers are spread over all of them\n"\
+    "\t-u, --unix     \tUnix domain socket path of the chat server (@name for\n"\
+    "\t\t\tthe abstract namespace); one of -c and -u is required\n"\
+    "\t-n, --receivers\tnumber of receiving clients (default 10)\n"\
+    "\t-m, --messages \tnumber of messages to send (default 1000)\n"\
+    "\t-r, --rate     \tmessages per second, 0 for unpaced (default 1000)\n"\
+    "\t-s, --size     \tbytes per message (default 64, max 1000)\n"\
+    "\t-p, --profile  \tsocket profile of the clients, e.g. latency or\n"\
+    "\t\t\tthroughput,sndbuf=262144 (default: default)\n"\
+    "\t-b, --binary   \tspeak the binary protocol instead of text (event\n"\
+    "\t\t\tserver only); -s is then the payload size, max 60000\n"\
+    "\t-g, --multicast\treceivers get broadcasts from the server's multicast\n"\
+    "\t\t\tgroup ip:port and NACK gaps (implies -b)\n"\
+    "\t-i, --interface\taddress of the interface to join the group on\n"\
+    "\t\t\t(default 127.0.0.1)\n"\
+    "\t-S, --shm      \tmove all clients to shared memory rings after\n"\
+    "\t\t\tconnecting (needs -u, implies -b)\n\n"\
+    "Example calls:\n"\
+    "\tchat_bench -c 127.0.0.1:8080 -n 50 -m 10000 -r 5000 -p latency\n"\
+    "\tchat_bench -u @chat -n 50 -m 10000 -r 5000\n"\
+    "\tchat_bench -u @chat -n 50 -m 100000 -r 0 -S\n"\
+    "\tchat_bench -c 127.0.0.1:8080 -n 500 -m 10000 -g 239.1.2.3:5000\n"\
+    "\tchat_bench -c 127.0.0.1:8080 -c 127.0.0.1:8081 -c 127.0.0.1:8082 -n 30\n\n");
+}
+
+/// Parses "ip:port".
+/// \return 0 - success; -1 - failure
+int parse_address(const char* str, struct bench_server* server)
+{
+    const char* colon = strrchr(str, ':');
+
+    if(colon == NULL || (size_t) (colon - str) >= sizeof(server->ip))
+    {
+        return -1;
+    }
+
+    memcpy(server->ip, str, (size_t) (colon - str));
+    server->ip[colon - str] = '\0';
+
+    char* end;
+    long port = strtol(colon + 1, &end, 10);
+    if(*end != '\0' || port <= 0 || port > 65535)
+    {
+        return -1;
+    }
+
+    server->port = (uint16_t) port;
+    return 0;
+}
+
+/// Asks the server to move a binary client to shared memory and maps the
+/// rings it passes. Frames that arrive on the socket before are dropped.
+/// \return 0 - success; -1 - failure
+int attach_shm(int fd, shm_channel* channel)
+{
+    struct wire_header request = {WIRE_VERSION, WIRE_SHM, 0, 0, 0, 0};
+    unsigned char buffer[4096];
+    int passed[SHM_FD_COUNT];
+    int passed_count = 0;
+    size_t used = 0;
+
+    wire_encode_header(&request, buffer);
+    if(send(fd, buffer, WIRE_HEADER_SIZE, MSG_NOSIGNAL) != WIRE_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        int count = SHM_FD_COUNT;
+        ssize_t n = receive_with_descriptors(fd, buffer + used, sizeof(buffer) - used, passed, &count);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        used += (size_t) n;
+        if(count > 0)
+        {
+            passed_count = count;
+        }
+
+        // Skip complete frames up to the answer
+        struct wire_header header;
+        size_t offset = 0;
+        while(used - offset >= WIRE_HEADER_SIZE)
+        {
+            if(wire_decode_header(buffer + offset, &header) != 0 || header.length > sizeof(buffer) - WIRE_HEADER_SIZE)
+            {
+                return -1;
+            }
+            if(used - offset < WIRE_HEADER_SIZE + header.length)
+            {
+                break;
+            }
+            if(header.type == WIRE_SHM)
+            {
+                if(passed_count != SHM_FD_COUNT)
+                {
+                    return -1;
+                }
+                return shm_channel_attach(channel, passed);
+            }
+            offset += WIRE_HEADER_SIZE + header.length;
+        }
+        used -= offset;
+        memmove(buffer, buffer + offset, used);
+    }
+}
+
+/// Connects a client, applies the socket profile (TCP only) and makes it non-blocking.
+/// \param options - Benchmark options
+/// \param server - Index into options->servers, unused with -u
+/// \param shm - Receives the rings of the client if options->shm is set, may be NULL otherwise
+/// \return file descriptor - success; -1 - failure
+int connect_client(struct bench_options* options, int server, shm_channel* shm)
+{
+    socket_info* client;
+
+    if(options->unix_path != NULL)
+    {
+        if(create_active_unix_socket(&client, options->unix_path) != 0)
+        {
+            return -1;
+        }
+    }
+    else if(create_active_socket(&client, options->servers[server].ip, options->servers[server].port) != 0)
+    {
+        return -1;
+    }
+
+    int fd = client->socket_fd;
+    free(client);
+
+    if(options->unix_path == NULL)
+    {
+        apply_socket_profile(fd, &options->profile);
+    }
+
+    if(options->binary)
+    {
+        struct wire_header hello = {WIRE_VERSION, WIRE_HELLO, 0, 0, 0, 0};
+        unsigned char frame[WIRE_HEADER_SIZE];
+
+        wire_encode_header(&hello, frame);
+        if(send(fd, frame, sizeof(frame), MSG_NOSIGNAL) != sizeof(frame))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    if(options->shm && attach_shm(fd, shm) != 0)
+    {
+        fprintf(stderr, "The server did not pass shared memory rings\n");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+/// Scans the buffer for complete "<<B seq timestamp>>" markers and records
+/// their latency. An incomplete marker at the end is kept for the next read.
+void scan_markers(struct receiver* receiver, struct bench_result* result, uint64_t now)
+{
+    char* position = receiver->buffer;
+    char* end = receiver->buffer + receiver->used;
+    char* keep = end;
+
+    while(position < end)
+    {
+        char* marker = memmem(position, (size_t) (end - position), "<<B ", 4);
+        if(marker == NULL)
+        {
+            // A marker might start in the last 3 bytes
+            keep = end - 3 > position ? end - 3 : position;
+            break;
+        }
+
+        char* close = memmem(marker, (size_t) (end - marker), ">>", 2);
+        if(close == NULL)
+        {
+            keep = marker;
+            break;
+        }
+
+        // Markers split by the server's per-chunk prefix do not end in ">>"
+        unsigned long sequence;
+        unsigned long long sent;
+        int consumed = 0;
+        if(sscanf(marker, "<<B %lu %llu%n", &sequence, &sent, &consumed) == 2
+           && marker + consumed == close && sent <= now)
+        {
+            latency_histogram_record(&result->latency, now - sent);
+            result->received++;
+        }
+
+        position = close + 2;
+        keep = position;
+    }
+
+    receiver->used = (size_t) (end - keep);
+    memmove(receiver->buffer, keep, receiver->used);
+}
+
+/// Records the latency of a message frame that carries a marker, and the
+/// losses the server reports in answers to NACKs.
+void record_frame(const struct wire_header* header, const char* payload, struct bench_result* result, uint64_t now)
+{
+    unsigned long sequence;
+    unsigned long long sent;
+    int consumed = 0;
+
+    if(header->type == WIRE_NACK && header->length == 2 * sizeof(uint32_t))
+    {
+        uint32_t lost;
+        memcpy(&lost, payload + sizeof(uint32_t), sizeof(lost));
+        result->unrecoverable += ntohl(lost);
+    }
+    else if(header->type == WIRE_MESSAGE && header->length >= 4 && memcmp(payload, "<<B ", 4) == 0
+            && sscanf(payload, "<<B %lu %llu%n", &sequence, &sent, &consumed) == 2
+            && (uint32_t) consumed + 2 <= header->length && memcmp(payload + consumed, ">>", 2) == 0 && sent <= now)
+    {
+        latency_histogram_record(&result->latency, now - sent);
+        result->received++;
+    }
+}
+
+/// Handles the complete frames in the buffer of a binary receiver and records
+/// the latency of every message frame. A partial frame is kept for the next read.
+void scan_frames(struct receiver* receiver, struct bench_result* result, uint64_t now)
+{
+    size_t offset = 0;
+
+    while(receiver->used - offset >= WIRE_HEADER_SIZE)
+    {
+        struct wire_header header;
+        const char* frame = receiver->buffer + offset;
+
+        if(wire_decode_header((const unsigned char*) frame, &header) != 0)
+        {
+            // Lost the frame boundaries, e.g. by discard_pending()
+            receiver->used = 0;
+            return;
+        }
+        if(receiver->used - offset < WIRE_HEADER_SIZE + header.length)
+        {
+            break;
+        }
+
+        record_frame(&header, frame + WIRE_HEADER_SIZE, result, now);
+        offset += WIRE_HEADER_SIZE + header.length;
+    }
+
+    receiver->used -= offset;
+    memmove(receiver->buffer, receiver->buffer + offset, receiver->used);
+}
+
+/// Reads everything available on a receiver.
+void drain_receiver(struct receiver* receiver, struct bench_result* result, int binary)
+{
+    for(;;)
+    {
+        if(receiver->used == sizeof(receiver->buffer))
+        {
+            receiver->used = 0;
+        }
+
+        ssize_t n;
+        if(receiver->shm != NULL)
+        {
+            n = shm_channel_read(receiver->shm, receiver->buffer + receiver->used,
+                                 sizeof(receiver->buffer) - receiver->used);
+        }
+        else
+        {
+            n = recv(receiver->fd, receiver->buffer + receiver->used,
+                     sizeof(receiver->buffer) - receiver->used, 0);
+        }
+        result->receive_calls++;
+
+        if(n <= 0)
+        {
+            return;
+        }
+
+        receiver->used += (size_t) n;
+        result->received_bytes += (unsigned long long) n;
+        if(binary)
+        {
+            scan_frames(receiver, result, monotonic_time_ns());
+        }
+        else
+        {
+            scan_markers(receiver, result, monotonic_time_ns());
+        }
+    }
+}
+
+/// Sends a binary frame without payload, or with a uint32 as payload.
+/// \return 0 - success; -1 - failure
+int send_control_frame(int fd, uint8_t type, uint32_t sequence, const uint32_t* value)
+{
+    unsigned char frame[WIRE_HEADER_SIZE + sizeof(uint32_t)];
+    struct wire_header header = {WIRE_VERSION, type, 0, 0, sequence, value != NULL ? sizeof(uint32_t) : 0};
+    uint32_t payload = value != NULL ? htonl(*value) : 0;
+
+    size_t length = wire_encode_frame(&header, &payload, frame);
+    return send(fd, frame, length, MSG_NOSIGNAL) == (ssize_t) length ? 0 : -1;
+}
+
+/// Reads all datagrams a multicast listener got. A jump in the sequence
+/// numbers is NACKed over the connection, the server then resends there.
+void drain_multicast(struct receiver* receiver, struct bench_result* result)
+{
+    static char datagram[WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD];
+
+    for(;;)
+    {
+        ssize_t n = recv(receiver->multicast_fd, datagram, sizeof(datagram), 0);
+        struct wire_header header;
+
+        if(n <= 0)
+        {
+            return;
+        }
+        result->datagrams++;
+
+        if(n < WIRE_HEADER_SIZE || wire_decode_header((const unsigned char*) datagram, &header) != 0
+           || (size_t) n != WIRE_HEADER_SIZE + header.length || header.sequence < receiver->next_sequence)
+        {
+            continue;
+        }
+
+        if(receiver->next_sequence != 0 && header.sequence > receiver->next_sequence)
+        {
+            uint32_t count = header.sequence - receiver->next_sequence;
+            send_control_frame(receiver->fd, WIRE_NACK, receiver->next_sequence, &count);
+            result->missed += count;
+        }
+        receiver->next_sequence = header.sequence + 1;
+
+        record_frame(&header, datagram + WIRE_HEADER_SIZE, result, monotonic_time_ns());
+    }
+}
+
+/// Adds the number of data segments a receiver got to the result. The
+/// counter is kept by the kernel, so it includes the warm-up traffic.
+void count_segments(int fd, struct bench_result* result)
+{
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+    {
+        result->data_segments += info.tcpi_data_segs_in;
+    }
+}
+
+/// Builds a message of options->size bytes with the marker at the start. In
+/// binary mode the message is the payload of a frame.
+size_t build_message(char* message, const struct bench_options* options, int sequence)
+{
+    char* text = options->binary ? message + WIRE_HEADER_SIZE : message;
+    int length = snprintf(text, 1024, "<<B %d %llu>>", sequence, (unsigned long long) monotonic_time_ns());
+
+    while(length < options->size - 1)
+    {
+        text[length++] = 'x';
+    }
+    text[length++] = '\n';
+
+    if(options->binary)
+    {
+        struct wire_header header = {WIRE_VERSION, WIRE_MESSAGE, 0, 0, 0, (uint32_t) length};
+        wire_encode_header(&header, (unsigned char*) message);
+        length += WIRE_HEADER_SIZE;
+    }
+
+    return (size_t) length;
+}
+
+/// Sleeps until all join notices have arrived and discards them. Multicast
+/// listeners learn the current sequence number from them.
+void discard_pending(struct receiver* receivers, int count)
+{
+    struct bench_result discarded;
+
+    memset(&discarded, 0, sizeof(discarded));
+    usleep(300 * 1000);
+
+    for(int i = 0; i < count; i++)
+    {
+        char buffer[4096];
+        while(recv(receivers[i].fd, buffer, sizeof(buffer), 0) > 0)
+        {
+        }
+        while(receivers[i].shm != NULL && shm_channel_read(receivers[i].shm, buffer, sizeof(buffer)) > 0)
+        {
+        }
+        if(receivers[i].multicast_fd >= 0)
+        {
+            drain_multicast(&receivers[i], &discarded);
+        }
+    }
+}
+
+/// Sends a message, through the ring if the sender has one. A full ring is
+/// waited for like a blocking socket.
+/// \return 0 - success; -1 - failure
+int send_message(int fd, shm_channel* shm, const char* message, size_t length)
+{
+    if(shm == NULL)
+    {
+        return send(fd, message, length, MSG_NOSIGNAL) == (ssize_t) length ? 0 : -1;
+    }
+
+    size_t written = 0;
+    while(written < length)
+    {
+        ssize_t n = shm_channel_write(shm, message + written, length - written);
+        if(n < 0)
+        {
+            return -1;
+        }
+        written += (size_t) n;
+
+        if(written < length && !shm_channel_sleep(shm, 1))
+        {
+            struct pollfd wake = {shm->wake_fd, POLLIN, 0};
+            poll(&wake, 1, 100);
+        }
+        shm_channel_awake(shm, 1);
+    }
+
+    return 0;
+}
+
+int run_benchmark(struct bench_options* options, struct bench_result* result)
+{
+    shm_channel sender_shm;
+    int sender = connect_client(options, 0, &sender_shm);
+    shm_channel* sender_channel = options->shm ? &sender_shm : NULL;
+    struct receiver* receivers = calloc((size_t) options->receivers, sizeof(struct receiver));
+    shm_channel* channels = calloc((size_t) options->receivers, sizeof(shm_channel));
+    struct pollfd* poll_fds = calloc(2 * (size_t) options->receivers, sizeof(struct pollfd));
+    nfds_t poll_count = (nfds_t) options->receivers;
+
+    if(sender < 0 || receivers == NULL || channels == NULL || poll_fds == NULL)
+    {
+        fprintf(stderr, "Could not connect the sender\n");
+        return -1;
+    }
+
+    // A blocking sender never writes partial messages, which would break
+    // the framing of the binary protocol, and is paced by the server
+    fcntl(sender, F_SETFL, fcntl(sender, F_GETFL) & ~O_NONBLOCK);
+
+    for(int i = 0; i < options->receivers; i++)
+    {
+        receivers[i].fd = connect_client(options, options->server_count > 0 ? i % options->server_count : 0,
+                                         &channels[i]);
+        if(receivers[i].fd < 0)
+        {
+            fprintf(stderr, "Could not connect receiver %d\n", i);
+            return -1;
+        }
+        receivers[i].shm = options->shm ? &channels[i] : NULL;
+        poll_fds[i].fd = options->shm ? channels[i].wake_fd : receivers[i].fd;
+        poll_fds[i].events = POLLIN;
+        receivers[i].multicast_fd = -1;
+
+        if(options->multicast_group != NULL)
+        {
+            receivers[i].multicast_fd = create_multicast_receiver(options->multicast_group,
+                                                                  options->multicast_interface);
+            if(receivers[i].multicast_fd < 0
+               || send_control_frame(receivers[i].fd, WIRE_MULTICAST, 0, NULL) != 0)
+            {
+                fprintf(stderr, "Could not make receiver %d a multicast listener\n", i);
+                return -1;
+            }
+            poll_fds[poll_count].fd = receivers[i].multicast_fd;
+            poll_fds[poll_count].events = POLLIN;
+            poll_count++;
+        }
+    }
+
+    discard_pending(receivers, options->receivers);
+    {
+        char buffer[4096];
+        while(recv(sender, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+        {
+        }
+        while(sender_channel != NULL && shm_channel_read(sender_channel, buffer, sizeof(buffer)) > 0)
+        {
+        }
+    }
+
+    latency_histogram_reset(&result->latency);
+
+    uint64_t interval = options->rate > 0 ? 1000000000ULL / (uint64_t) options->rate : 0;
+    uint64_t start = monotonic_time_ns();
+    uint64_t last_send = start;
+    unsigned long long expected = (unsigned long long) options->messages * (unsigned long long) options->receivers;
+    int sent = 0;
+
+    while(result->received < expected)
+    {
+        uint64_t now = monotonic_time_ns();
+
+        while(sent < options->messages && now >= start + interval * (uint64_t) sent)
+        {
+            static char message[WIRE_HEADER_SIZE + MAX_BINARY_SIZE];
+            size_t length = build_message(message, options, sent);
+            if(send_message(sender, sender_channel, message, length) != 0)
+            {
+                perror("send");
+                return -1;
+            }
+            result->send_calls++;
+            sent++;
+            last_send = now;
+        }
+
+        if(sent == options->messages && now - last_send > DRAIN_TIMEOUT_NS)
+        {
+            break;
+        }
+
+        int wait_ms = 1;
+        if(sent == options->messages || interval >= 2000000)
+        {
+            wait_ms = sent == options->messages ? 100 : (int) (interval / 2000000);
+        }
+        else if(interval == 0)
+        {
+            wait_ms = 0;
+        }
+
+        // Receivers on rings are only signalled once they announced to sleep
+        for(int i = 0; i < options->receivers && options->shm; i++)
+        {
+            if(shm_channel_sleep(receivers[i].shm, 0))
+            {
+                wait_ms = 0;
+            }
+        }
+
+        if(poll(poll_fds, poll_count, wait_ms) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return -1;
+        }
+
+        for(int i = 0; i < options->receivers; i++)
+        {
+            if(options->shm)
+            {
+                result->wakeups += (poll_fds[i].revents & POLLIN) != 0;
+                shm_channel_awake(receivers[i].shm, poll_fds[i].revents & POLLIN);
+                drain_receiver(&receivers[i], result, options->binary);
+            }
+            else if(poll_fds[i].revents & POLLIN)
+            {
+                drain_receiver(&receivers[i], result, options->binary);
+            }
+        }
+        for(nfds_t k = (nfds_t) options->receivers; k < poll_count; k++)
+        {
+            if(poll_fds[k].revents & POLLIN)
+            {
+                drain_multicast(&receivers[k - (nfds_t) options->receivers], result);
+            }
+        }
+    }
+
+    uint64_t elapsed = monotonic_time_ns() - start;
+
+    printf("transport=%s protocol=%s profile=%s receivers=%d messages=%d size=%d rate=%d\n",
+           options->shm ? "shm" : options->unix_path != NULL ? "unix" : "tcp", options->binary ? "binary" : "text", options->profile.name, options->receivers, options->messages, options->size, options->rate);
+    if(options->multicast_group != NULL)
+    {
+        printf("multicast=%s datagrams=%llu missed=%llu unrecoverable=%llu\n", options->multicast_group,
+               result->datagrams, result->missed, result->unrecoverable);
+    }
+    printf("delivered %llu of %llu in %.3f s (%.0f deliveries/s)\n",
+           result->received, expected, elapsed / 1e9, result->received / (elapsed / 1e9));
+    printf("send calls=%llu recv calls=%llu bytes per recv=%.1f\n",
+           result->send_calls, result->receive_calls,
+           result->receive_calls ? (double) result->received_bytes / (double) result->receive_calls : 0.0);
+    for(int i = 0; i < options->receivers && options->unix_path == NULL; i++)
+    {
+        count_segments(receivers[i].fd, result);
+    }
+    if(options->unix_path == NULL)
+    {
+        printf("data segments=%llu deliveries per segment=%.2f\n", result->data_segments,
+               result->data_segments ? (double) result->received / (double) result->data_segments : 0.0);
+    }
+    if(options->shm)
+    {
+        unsigned long long signalled = sender_shm.wakeups_sent;
+        for(int i = 0; i < options->receivers; i++)
+        {
+            signalled += channels[i].wakeups_sent;
+        }
+        printf("receiver wakeups=%llu client wakeups of the server=%llu\n", result->wakeups, signalled);
+    }
+    latency_histogram_print(&result->latency, "latency", stdout);
+
+    for(int i = 0; i < options->receivers; i++)
+    {
+        close(receivers[i].fd);
+        if(receivers[i].shm != NULL)
+        {
+            shm_channel_close(receivers[i].shm);
+        }
+        if(receivers[i].multicast_fd >= 0)
+        {
+            close(receivers[i].multicast_fd);
+        }
+    }
+    close(sender);
+    if(sender_channel != NULL)
+    {
+        shm_channel_close(sender_channel);
+    }
+    free(receivers);
+    free(channels);
+    free(poll_fds);
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    struct bench_options options = {{{"", 0}}, 0, NULL, 10, 1000, 1000, 64, 0, NULL, "127.0.0.1", 0,
+                                    {"default", 0, 0, 0, 0, 0, 0}};
+    int have_address = 0;
+
+    static struct option long_options[] =
+        {
+            {"connect", required_argument, NULL, 'c'},
+            {"unix", required_argument, NULL, 'u'},
+            {"receivers", required_argument, NULL, 'n'},
+            {"messages", required_argument, NULL, 'm'},
+            {"rate", required_argument, NULL, 'r'},
+            {"size", required_argument, NULL, 's'},
+            {"profile", required_argument, NULL, 'p'},
+            {"binary", no_argument, NULL, 'b'},
+            {"multicast", required_argument, NULL, 'g'},
+            {"interface", required_argument, NULL, 'i'},
+            {"shm", no_argument, NULL, 'S'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+        };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "c:u:n:m:r:s:p:bg:i:Sh", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                if(options.server_count == MAX_SERVERS || parse_address(optarg, &options.servers[options.server_count++]))
+                {
+                    bench_help();
+                    return EXIT_FAILURE;
+                }
+                have_address = 1;
+                break;
+            case 'u':
+                options.unix_path = optarg;
+                have_address = 1;
+                break;
+            case 'n':
+                options.receivers = atoi(optarg);
+                break;
+            case 'm':
+                options.messages = atoi(optarg);
+                break;
+            case 'r':
+                options.rate = atoi(optarg);
+                break;
+            case 's':
+                options.size = atoi(optarg);
+                break;
+            case 'b':
+                options.binary = 1;
+                break;
+            case 'g':
+                options.multicast_group = optarg;
+                options.binary = 1;
+                break;
+            case 'i':
+                options.multicast_interface = optarg;
+                break;
+            case 'S':
+                options.shm = 1;
+                options.binary = 1;
+                break;
+            case 'p':
+                if(parse_socket_profile(optarg, &options.profile))
+                {
+                    fprintf(stderr, "Unknown socket profile '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                bench_help();
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if(!have_address || (options.shm && options.unix_path == NULL) || options.receivers < 1 || options.messages < 1 || options.rate < 0
+       || options.size < 40 || options.size > (options.binary ? MAX_BINARY_SIZE : 1000))
+    {
+        bench_help();
+        return EXIT_FAILURE;
+    }
+
+    struct bench_result result;
+    memset(&result, 0, sizeof(result));
+
+    return run_benchmark(&options, &result) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,727 @@
+#define _GNU_SOURCE
+#include "chat_core.h"
+#include "error_reporting.h"
+#include "monotonic_clock.h"
+#include "tcp_socket.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NS_PER_SECOND (1000ULL * 1000 * 1000)
+
+/// Formats what a client sent as one chat line for the others.
+/// \param text - Receives the text, to be freed by the caller
+/// \param peer - Address of the client
+/// \param fd - Descriptor of the client on the server
+/// \param data - What the client sent
+/// \param length - Bytes in data
+/// \return length of text - success; -1 - out of memory
+int chat_format_message(char** text, const char* peer, int fd, const char* data, size_t length)
+{
+    return asprintf(text, "%s:%d - %.*s\n", peer, fd, (int) length, data);
+}
+
+/// Formats a line typed on the server console.
+/// \param line - The line including its line break
+/// \return length of text - success; -1 - out of memory
+int chat_format_server(char** text, const char* line)
+{
+    return asprintf(text, "Server: %s", line);
+}
+
+/// \return length of text - success; -1 - out of memory
+int chat_format_join(char** text, int fd)
+{
+    return asprintf(text, "FD %d has entered the chat room.\n", fd);
+}
+
+/// \return length of text - success; -1 - out of memory
+int chat_format_leave(char** text, int fd)
+{
+    return asprintf(text, "FD %d has left the chat room.\n", fd);
+}
+
+/// Formats the notice of a file shared through the server's spool.
+/// \param peer - Address of the uploader, "ip:port" or "local"
+/// \param fd - Descriptor of the uploader on the server
+/// \param id - Id the file is downloaded with
+/// \return length of text - success; -1 - out of memory
+int chat_format_file(char** text, const char* peer, int fd, unsigned int id, const char* name,
+                     unsigned long long size)
+{
+    return asprintf(text, "%s:%d - shares file #%u '%s' (%llu bytes)\n", peer, fd, id, name, size);
+}
+
+static void list_fds(FILE* out, const int* fds, size_t count)
+{
+    for(size_t k = 0; k < count && k < CHAT_PRESENCE_LIST; k++)
+    {
+        fprintf(out, k == 0 ? "FD %d" : ", %d", fds[k]);
+    }
+    if(count > CHAT_PRESENCE_LIST)
+    {
+        fprintf(out, " and %zu more", count - CHAT_PRESENCE_LIST);
+    }
+}
+
+static int close_text(FILE* out, char** text, size_t* length)
+{
+    if(fclose(out) != 0)
+    {
+        free(*text);
+        return -1;
+    }
+    return (int) *length;
+}
+
+/// Formats the joins and leaves of one interval, e.g.
+/// "+15 joined (FD 4, 5, ...), -3 left (FD 7, 8, 9)".
+/// \param joined - Descriptors of the clients that entered
+/// \param left - Descriptors of the clients that left
+/// \return length of text - success; -1 - out of memory
+int chat_format_presence(char** text, const int* joined, size_t joined_count, const int* left, size_t left_count)
+{
+    size_t length;
+    FILE* out = open_memstream(text, &length);
+    if(out == NULL)
+    {
+        return -1;
+    }
+    if(joined_count > 0)
+    {
+        fprintf(out, "+%zu joined (", joined_count);
+        list_fds(out, joined, joined_count);
+        fprintf(out, ")");
+    }
+    if(left_count > 0)
+    {
+        fprintf(out, "%s-%zu left (", joined_count > 0 ? ", " : "", left_count);
+        list_fds(out, left, left_count);
+        fprintf(out, ")");
+    }
+    fprintf(out, "\n");
+    return close_text(out, text, &length);
+}
+
+/// Formats who is in the room, for a client that just entered it.
+/// \param fds - Descriptors of the members
+/// \return length of text - success; -1 - out of memory
+int chat_format_roster(char** text, const int* fds, size_t count)
+{
+    size_t length;
+    FILE* out = open_memstream(text, &length);
+    if(out == NULL)
+    {
+        return -1;
+    }
+    fprintf(out, "%zu in the chat room (", count);
+    list_fds(out, fds, count);
+    fprintf(out, ")\n");
+    return close_text(out, text, &length);
+}
+
+/// Tells console commands from lines to broadcast.
+/// \param line - The line including its line break
+/// \return command to run
+enum chat_console_command chat_console_command(const char* line)
+{
+    return strcmp(line, "/stats\n") == 0 ? CHAT_CONSOLE_STATS : CHAT_CONSOLE_SAY;
+}
+
+struct chat_text
+{
+    int refs;
+    size_t length;
+    char* data;
+};
+
+/// Turns the text of a chat_format_*() call into a message with one reference.
+/// \param text - Freed with the message
+/// \param length - What the call returned
+/// \return the message - success; NULL - out of memory
+chat_text* chat_text_adopt(char* text, int length)
+{
+    if(length < 0)
+    {
+        return NULL;
+    }
+    chat_text* message = malloc(sizeof(chat_text));
+    if(message == NULL)
+    {
+        free(text);
+        return NULL;
+    }
+    message->refs = 1;
+    message->length = (size_t) length;
+    message->data = text;
+    return message;
+}
+
+void chat_text_retain(void* text)
+{
+    ((chat_text*) text)->refs++;
+}
+
+void chat_text_release(void* text)
+{
+    chat_text* message = text;
+    if(--message->refs > 0)
+    {
+        return;
+    }
+    free(message->data);
+    free(message);
+}
+
+/// Every client gets the same bytes of a chat_text.
+void chat_text_encode(chat_client* client, void* text, const char** data, size_t* length)
+{
+    (void) client;
+    *data = ((chat_text*) text)->data;
+    *length = ((chat_text*) text)->length;
+}
+
+static chat_out* get_entry(chat_core* core)
+{
+    chat_out* entry = core->free_entries;
+    if(entry != NULL)
+    {
+        core->free_entries = entry->next;
+        core->pooled--;
+        core->stats.reused++;
+    }
+    else
+    {
+        entry = malloc(sizeof(chat_out));
+        if(entry == NULL)
+        {
+            print_error("chat_core: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        core->stats.allocated++;
+    }
+    core->stats.entries++;
+    return entry;
+}
+
+static void put_entry(chat_core* core, chat_out* entry)
+{
+    core->stats.entries--;
+    if(core->pooled == CHAT_POOL_MAX)
+    {
+        free(entry);
+        return;
+    }
+    entry->next = core->free_entries;
+    core->free_entries = entry;
+    core->pooled++;
+}
+
+/// Unlinks the head of the queue, the caller owns its reference.
+static chat_out* unlink_head(chat_client* client)
+{
+    chat_out* head = client->head;
+    client->head = head->next;
+    if(client->head == NULL)
+    {
+        client->tail = NULL;
+    }
+    client->queued -= head->length - head->sent;
+    return head;
+}
+
+static void recover(chat_core* core, chat_client* client)
+{
+    if(client->congested && client->queued <= core->low_water)
+    {
+        client->congested = 0;
+    }
+}
+
+/// Drops the oldest fully unsent messages until length more bytes fit below
+/// the high-water mark. A partially sent head is kept, dropping it would
+/// corrupt the stream, and so are control messages.
+static void drop_oldest(chat_core* core, chat_client* client, size_t length)
+{
+    chat_out* prev = NULL;
+    chat_out* victim = client->head;
+    if(victim != NULL && victim->sent > 0)
+    {
+        prev = victim;
+        victim = victim->next;
+    }
+
+    while(victim != NULL && client->queued + length > core->high_water)
+    {
+        chat_out* next = victim->next;
+        if(victim->control)
+        {
+            prev = victim;
+            victim = next;
+            continue;
+        }
+        if(prev == NULL)
+        {
+            client->head = next;
+        }
+        else
+        {
+            prev->next = next;
+        }
+        if(client->tail == victim)
+        {
+            client->tail = prev;
+        }
+        client->queued -= victim->length;
+        core->stats.dropped_oldest++;
+        core->stats.dropped_bytes += victim->length;
+        core->ops->release(victim->message);
+        put_entry(core, victim);
+        victim = next;
+    }
+}
+
+/// \param ops - Message type and callbacks of the backend
+/// \param high_water - Bytes queued for one client before the policy applies
+/// \param low_water - Bytes below which a congested client recovers
+void chat_core_init(chat_core* core, const struct chat_core_ops* ops, size_t high_water, size_t low_water,
+                    enum backpressure_policy policy)
+{
+    memset(core, 0, sizeof(chat_core));
+    core->ops = ops;
+    core->high_water = high_water;
+    core->low_water = low_water;
+    core->policy = policy;
+}
+
+/// Makes client a member of its room and announces it to the others there.
+/// \param client - With room and fd set
+/// \param announcement - Message of the join, NULL - none
+void chat_core_join(chat_core* core, chat_client* client, void* announcement)
+{
+    if(!client->member)
+    {
+        if(core->count == core->capacity)
+        {
+            size_t capacity = core->capacity == 0 ? 64 : core->capacity * 2;
+            struct chat_member* grown = realloc(core->members, capacity * sizeof(struct chat_member));
+            if(grown == NULL)
+            {
+                print_error("chat_core_join: out of memory");
+                exit(EXIT_FAILURE);
+            }
+            core->members = grown;
+            core->capacity = capacity;
+        }
+        core->members[core->count].client = client;
+        core->members[core->count].room = client->room;
+        core->members[core->count].recipient = !client->detached;
+        client->index = core->count++;
+        client->member = 1;
+    }
+    if(announcement != NULL)
+    {
+        chat_core_broadcast(core, announcement, client->room, client);
+    }
+}
+
+/// Takes client out of its room and announces that to the others there. Its
+/// queue stays until the backend clears it. A client changes rooms by leaving
+/// and joining again.
+/// \param announcement - Message of the leave, NULL - none
+void chat_core_leave(chat_core* core, chat_client* client, void* announcement)
+{
+    if(client->member)
+    {
+        struct chat_member* last = &core->members[--core->count];
+        core->members[client->index] = *last;
+        last->client->index = client->index;
+        client->member = 0;
+    }
+    if(announcement != NULL)
+    {
+        chat_core_broadcast(core, announcement, client->room, client);
+    }
+}
+
+/// A detached member stays in its room but gets no broadcasts queued.
+void chat_core_set_detached(chat_core* core, chat_client* client, int detached)
+{
+    client->detached = detached;
+    if(client->member)
+    {
+        core->members[client->index].recipient = !detached;
+    }
+}
+
+/// Passes message to ops->publish, then queues it for the local members.
+/// \param room - Room of the recipients, CHAT_ROOM_ALL - every room
+/// \param except - Member that does not get it, usually the sender; may be NULL
+void chat_core_broadcast(chat_core* core, void* message, int room, const chat_client* except)
+{
+    core->stats.broadcasts++;
+    if(core->ops->publish != NULL && core->ops->publish(message))
+    {
+        return;
+    }
+    chat_core_deliver(core, message, room, except);
+}
+
+/// Queues message for the local members of a room, without ops->publish.
+void chat_core_deliver(chat_core* core, void* message, int room, const chat_client* except)
+{
+    for(size_t k = 0; k < core->count; k++)
+    {
+        const struct chat_member* member = &core->members[k];
+        if(member->recipient && (room == CHAT_ROOM_ALL || member->room == room) && member->client != except)
+        {
+            chat_core_queue(core, member->client, message);
+        }
+    }
+}
+
+static void push(chat_core* core, chat_client* client, void* message, const char* data, size_t length,
+                 int control)
+{
+    chat_out* entry = get_entry(core);
+    entry->next = NULL;
+    entry->message = message;
+    entry->data = data;
+    entry->length = length;
+    entry->sent = 0;
+    entry->control = control;
+    core->ops->retain(message);
+    if(client->tail == NULL)
+    {
+        client->head = entry;
+        // a write stall is counted from here, not from the last write
+        if(core->stall_ns > 0)
+        {
+            client->last_progress = monotonic_time_ns();
+        }
+    }
+    else
+    {
+        client->tail->next = entry;
+    }
+    client->tail = entry;
+    client->queued += length;
+
+    core->ops->schedule(client);
+}
+
+/// Queues message for one client and applies the backpressure policy if the
+/// client does not keep up. A closing client gets nothing.
+void chat_core_queue(chat_core* core, chat_client* client, void* message)
+{
+    const char* data;
+    size_t length;
+
+    if(client->closing)
+    {
+        return;
+    }
+    core->ops->encode(client, message, &data, &length);
+
+    if(!client->congested && client->queued + length > core->high_water)
+    {
+        client->congested = 1;
+        core->stats.congestions++;
+        LOG_WARN("FD %d is a slow consumer (%zu bytes queued), applying %s\n",
+                 client->fd, client->queued, backpressure_policy_name(core->policy));
+    }
+
+    if(client->congested)
+    {
+        switch(core->policy)
+        {
+            case BACKPRESSURE_DROP_NEW:
+                core->stats.dropped_new++;
+                core->stats.dropped_bytes += length;
+                return;
+            case BACKPRESSURE_DISCONNECT:
+                core->stats.disconnects++;
+                chat_core_clear(core, client);
+                core->ops->disconnect(client);
+                return;
+            case BACKPRESSURE_DROP_OLDEST:
+                drop_oldest(core, client, length);
+                break;
+        }
+    }
+
+    push(core, client, message, data, length, 0);
+}
+
+/// Queues an answer the client waits for, e.g. to a request of the binary
+/// protocol. It bypasses the backpressure policy and is never dropped; it
+/// still counts towards the queued bytes.
+void chat_core_queue_control(chat_core* core, chat_client* client, void* message)
+{
+    const char* data;
+    size_t length;
+
+    if(client->closing)
+    {
+        return;
+    }
+    core->ops->encode(client, message, &data, &length);
+    push(core, client, message, data, length, 1);
+}
+
+/// Accounts bytes written from the head of the queue on.
+/// \param length - Bytes written, at most client->queued
+/// \return messages that were completely written
+size_t chat_core_sent(chat_core* core, chat_client* client, size_t length)
+{
+    size_t completed = 0;
+
+    while(length > 0)
+    {
+        chat_out* head = client->head;
+        size_t part = head->length - head->sent < length ? head->length - head->sent : length;
+        head->sent += part;
+        client->queued -= part;
+        length -= part;
+        if(head->sent == head->length)
+        {
+            unlink_head(client);
+            core->ops->release(head->message);
+            put_entry(core, head);
+            completed++;
+        }
+    }
+    recover(core, client);
+    return completed;
+}
+
+/// Takes the oldest message out of the queue, for backends that write it
+/// without holding on to the core.
+/// \param data - Receives what is left to write of it
+/// \return the message, its reference goes to the caller - success; NULL - queue empty
+void* chat_core_pop(chat_core* core, chat_client* client, const char** data, size_t* length)
+{
+    if(client->head == NULL)
+    {
+        return NULL;
+    }
+    chat_out* head = unlink_head(client);
+    void* message = head->message;
+    *data = head->data + head->sent;
+    *length = head->length - head->sent;
+    put_entry(core, head);
+    recover(core, client);
+    return message;
+}
+
+/// Encodes the queued messages again, after ops->encode changed its mind
+/// about client. Nothing of them may have been written.
+void chat_core_requeue(chat_core* core, chat_client* client)
+{
+    client->queued = 0;
+    for(chat_out* entry = client->head; entry != NULL; entry = entry->next)
+    {
+        core->ops->encode(client, entry->message, &entry->data, &entry->length);
+        client->queued += entry->length;
+    }
+}
+
+/// Drops everything queued for client.
+void chat_core_clear(chat_core* core, chat_client* client)
+{
+    while(client->head != NULL)
+    {
+        chat_out* head = unlink_head(client);
+        core->ops->release(head->message);
+        put_entry(core, head);
+    }
+}
+
+void chat_core_print_stats(const chat_core* core, FILE* stream)
+{
+    fprintf(stream, "policy=%s high_water=%zu low_water=%zu congestions=%llu dropped_oldest=%llu "
+                    "dropped_new=%llu dropped_bytes=%llu disconnects=%llu members=%zu broadcasts=%llu\n",
+            backpressure_policy_name(core->policy), core->high_water, core->low_water,
+            core->stats.congestions, core->stats.dropped_oldest, core->stats.dropped_new,
+            core->stats.dropped_bytes, core->stats.disconnects, core->count, core->stats.broadcasts);
+}
+
+/// Lets the core drive the liveness timers of its clients, before any is
+/// watched. A timeout of 0 turns its timer off.
+/// \param wheel - Timer wheel the backend advances
+/// \param idle_timeout - Seconds a client may send nothing
+/// \param heartbeat_interval - Seconds after the last write a quiet client is probed
+/// \param write_stall_timeout - Seconds a client may leave its queue unread
+void chat_core_set_timers(chat_core* core, timer_wheel* wheel, int idle_timeout, int heartbeat_interval,
+                          int write_stall_timeout)
+{
+    core->wheel = wheel;
+    core->idle_ns = (uint64_t) idle_timeout * NS_PER_SECOND;
+    core->heartbeat_ns = (uint64_t) heartbeat_interval * NS_PER_SECOND;
+    core->stall_ns = (uint64_t) write_stall_timeout * NS_PER_SECOND;
+}
+
+static chat_client* timer_client(timer_entry* timer, size_t offset)
+{
+    return (chat_client*) ((char*) timer - offset);
+}
+
+/// Drops a client a liveness timer gave up on, the way the disconnect policy does
+static void drop_client(chat_core* core, chat_client* client)
+{
+    chat_core_clear(core, client);
+    core->ops->disconnect(client);
+}
+
+// Timers are not moved on every byte: they fire at the original deadline,
+// compare it with the last activity and re-arm for the remainder.
+static void on_idle_timeout(timer_entry* timer)
+{
+    chat_core* core = timer->context;
+    chat_client* client = timer_client(timer, offsetof(chat_client, idle_timer));
+
+    if(client->closing)
+    {
+        return;
+    }
+    if(monotonic_time_ns() - client->last_receive < core->idle_ns)
+    {
+        timer_wheel_arm(core->wheel, timer, client->last_receive + core->idle_ns);
+        return;
+    }
+
+    LOG_INFO("FD %d sent nothing for %llu s, disconnecting\n", client->fd,
+             (unsigned long long) (core->idle_ns / NS_PER_SECOND));
+    core->stats.idle_disconnects++;
+    drop_client(core, client);
+}
+
+static void on_heartbeat(timer_entry* timer)
+{
+    chat_core* core = timer->context;
+    chat_client* client = timer_client(timer, offsetof(chat_client, heartbeat_timer));
+    uint64_t now = monotonic_time_ns();
+
+    if(client->closing)
+    {
+        return;
+    }
+    if(now - client->last_send < core->heartbeat_ns)
+    {
+        timer_wheel_arm(core->wheel, timer, client->last_send + core->heartbeat_ns);
+        return;
+    }
+
+    // a client with something queued is probed by that already
+    if(client->head == NULL)
+    {
+        void* heartbeat = core->ops->heartbeat(client);
+        core->stats.heartbeats++;
+        chat_core_queue(core, client, heartbeat);
+        core->ops->release(heartbeat);
+    }
+    timer_wheel_arm(core->wheel, timer, now + core->heartbeat_ns);
+}
+
+static void on_write_stall(timer_entry* timer)
+{
+    chat_core* core = timer->context;
+    chat_client* client = timer_client(timer, offsetof(chat_client, stall_timer));
+
+    if(client->closing || client->head == NULL)
+    {
+        return;
+    }
+    if(monotonic_time_ns() - client->last_progress < core->stall_ns)
+    {
+        timer_wheel_arm(core->wheel, timer, client->last_progress + core->stall_ns);
+        return;
+    }
+
+    LOG_WARN("FD %d did not read for %llu s (%zu bytes pending), disconnecting\n", client->fd,
+             (unsigned long long) (core->stall_ns / NS_PER_SECOND), client->queued);
+    core->stats.stall_disconnects++;
+    drop_client(core, client);
+}
+
+/// Starts the idle and heartbeat timers of a new connection, the write stall
+/// timer follows chat_core_blocked(). Until chat_core_unwatch() the client
+/// must not move in memory.
+void chat_core_watch(chat_core* core, chat_client* client)
+{
+    uint64_t now = monotonic_time_ns();
+
+    client->last_receive = now;
+    client->last_send = now;
+    client->last_progress = now;
+    timer_entry_init(&client->idle_timer, on_idle_timeout, core);
+    timer_entry_init(&client->heartbeat_timer, on_heartbeat, core);
+    timer_entry_init(&client->stall_timer, on_write_stall, core);
+    if(core->idle_ns > 0)
+    {
+        timer_wheel_arm(core->wheel, &client->idle_timer, now + core->idle_ns);
+    }
+    if(core->heartbeat_ns > 0)
+    {
+        timer_wheel_arm(core->wheel, &client->heartbeat_timer, now + core->heartbeat_ns);
+    }
+}
+
+/// Stops the liveness timers of client, also one that was never watched.
+void chat_core_unwatch(chat_core* core, chat_client* client)
+{
+    if(core->wheel == NULL)
+    {
+        return;
+    }
+    timer_wheel_cancel(core->wheel, &client->idle_timer);
+    timer_wheel_cancel(core->wheel, &client->heartbeat_timer);
+    timer_wheel_cancel(core->wheel, &client->stall_timer);
+}
+
+/// Notes data from client, it is not idle.
+void chat_core_received(chat_client* client)
+{
+    client->last_receive = monotonic_time_ns();
+}
+
+/// Notes data written to client, of its queue or of anything else the
+/// backend sends it.
+void chat_core_written(chat_client* client)
+{
+    client->last_send = monotonic_time_ns();
+    client->last_progress = client->last_send;
+}
+
+/// The socket of client is full with data left to write: unless it reads
+/// again within the write stall timeout, it is dropped.
+void chat_core_blocked(chat_core* core, chat_client* client)
+{
+    if(core->stall_ns > 0 && !timer_entry_armed(&client->stall_timer))
+    {
+        timer_wheel_arm(core->wheel, &client->stall_timer, client->last_progress + core->stall_ns);
+    }
+}
+
+/// accept() failed. For want of descriptors or memory the connection stays
+/// pending and the listener readable; the backend leaves it alone until
+/// timer expired instead of spinning on it or giving up.
+/// \param timer - Armed on the core's wheel for CHAT_ACCEPT_PAUSE_NS
+/// \param fd - The listener
+/// \return 0 - paused; -1 - errno is not transient, the listener failed
+int chat_core_pause_accepting(chat_core* core, timer_entry* timer, int fd)
+{
+    int error = errno;
+
+    if(!accept_error_is_transient(error))
+    {
+        return -1;
+    }
+    core->stats.accept_pauses++;
+    LOG_WARN("Cannot accept on FD %d: %s, pausing for %llu ms\n", fd, strerror(error),
+             CHAT_ACCEPT_PAUSE_NS / 1000000ULL);
+    timer_wheel_arm(core->wheel, timer, monotonic_time_ns() + CHAT_ACCEPT_PAUSE_NS);
+    return 0;
+}
@@ -0,0 +1,202 @@
+#ifndef CHAT_CHAT_CORE_H
+#define CHAT_CHAT_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "server_config.h"
+#include "timer_wheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// What the chat looks like to a text client, the same with every server:
+/// a client's line goes to all other clients prefixed with its address and
+/// descriptor, joins and leaves are announced to the others, and a line
+/// typed on the server console reaches everybody.
+///
+/// The chat core below is that logic for every backend: the members of the
+/// rooms, the outbound queue of each client with the backpressure policy,
+/// joins, leaves and the broadcast fan-out. `-e`, `-o` and `-t` only choose
+/// how the queued bytes are moved: the event loop and the coroutines on the
+/// reactor of reactor.h, the thread server with one blocking thread per
+/// client. The thread server is the one backend that stays outside the
+/// reactor, blocking thread-per-client I/O is the model it exists to
+/// measure; it calls the core under one lock.
+///
+/// The liveness of a client is the core's too: the idle timeout, the
+/// heartbeat and the write stall timeout run on the timer wheel of the
+/// backend, which reports what it read and wrote. A listener that runs out
+/// of descriptors rests for CHAT_ACCEPT_PAUSE_NS with every backend.
+///
+/// Joins and leaves can also be announced in batches, as one presence line
+/// per interval that names up to CHAT_PRESENCE_LIST descriptors of each kind.
+#define CHAT_PRESENCE_LIST 16
+
+/// Room of server messages, they reach every room
+#define CHAT_ROOM_ALL (-1)
+
+/// How long a listener rests after accept() ran out of descriptors or memory
+#define CHAT_ACCEPT_PAUSE_NS (100ULL * 1000 * 1000)
+
+typedef struct chat_out chat_out;
+typedef struct chat_client chat_client;
+typedef struct chat_core chat_core;
+
+/// Reference counted text that all recipients share, the message type of
+/// backends that send the same bytes to every client
+typedef struct chat_text chat_text;
+
+/// What the core needs to know about the message type of a backend. The core
+/// holds a reference on a message for every queue entry of it.
+struct chat_core_ops
+{
+    void (*retain)(void* message);
+    void (*release)(void* message);
+    /// The bytes of message for client, valid while a reference is held
+    void (*encode)(chat_client* client, void* message, const char** data, size_t* length);
+    /// Something was queued for client, the backend arranges the send
+    void (*schedule)(chat_client* client);
+    /// The backpressure policy or a liveness timer drops client, its queue is
+    /// already cleared. The backend closes it and calls chat_core_leave()
+    /// later; it must not change the members from here, a broadcast may be
+    /// walking them.
+    void (*disconnect)(chat_client* client);
+    /// A new reference to the message that probes a quiet client, a peer that
+    /// vanished without a FIN then fails the write or stalls
+    void* (*heartbeat)(chat_client* client);
+    /// Optional, gets every broadcast before the local clients do, e.g. to
+    /// pass it on to other servers. Nonzero - the backend delivers it itself.
+    int (*publish)(void* message);
+};
+
+/// A message in the outbound queue of a client
+struct chat_out
+{
+    chat_out* next;
+    void* message;              // holds a reference
+    const char* data;           // encoding of message for the client
+    size_t length;
+    size_t sent;                // bytes of data already written
+    int control;                // must be delivered, the backpressure policy leaves it alone
+};
+
+/// The core's part of a connection, embedded in the backend's connection.
+/// All zero is a client outside the chat.
+struct chat_client
+{
+    chat_out* head;             // outbound queue, oldest first
+    chat_out* tail;
+    size_t queued;              // unsent bytes in the queue
+    int congested;              // above the high-water mark until below the low-water mark
+    int closing;                // set by the backend once it drops the client, nothing is queued after
+    int detached;               // gets room broadcasts some other way, e.g. from a multicast group
+    int fd;                     // names the client in log lines
+    uint16_t room;
+    int member;                 // joined, index is its place in members
+    size_t index;
+    uint64_t last_receive;      // monotonic ns of the last data from the client
+    uint64_t last_send;         // monotonic ns of the last data written to it
+    uint64_t last_progress;     // like last_send, or when its queue filled up
+    timer_entry idle_timer;     // on the core's wheel while watched
+    timer_entry heartbeat_timer;
+    timer_entry stall_timer;
+};
+
+/// Kept dense for the fan-out, which only reads these
+struct chat_member
+{
+    chat_client* client;
+    uint16_t room;
+    uint8_t recipient;          // not detached
+};
+
+struct chat_core_stats
+{
+    unsigned long long broadcasts;
+    unsigned long long congestions;     // high-water mark crossings
+    unsigned long long dropped_oldest;
+    unsigned long long dropped_new;
+    unsigned long long dropped_bytes;
+    unsigned long long disconnects;
+    unsigned long long entries;         // queue entries in use
+    unsigned long long reused;          // entries taken from the free list
+    unsigned long long allocated;
+    unsigned long long idle_disconnects;
+    unsigned long long heartbeats;
+    unsigned long long stall_disconnects;
+    unsigned long long accept_pauses;
+};
+
+/// The rooms and queues of one server. Not thread-safe.
+struct chat_core
+{
+    const struct chat_core_ops* ops;
+    size_t high_water;
+    size_t low_water;
+    enum backpressure_policy policy;
+    struct chat_member* members;
+    size_t count;
+    size_t capacity;
+    chat_out* free_entries;     // recycled, at most CHAT_POOL_MAX
+    int pooled;
+    timer_wheel* wheel;         // the backend's, drives the liveness timers
+    uint64_t idle_ns;           // 0 - the timer is off
+    uint64_t heartbeat_ns;
+    uint64_t stall_ns;
+    struct chat_core_stats stats;
+};
+
+#define CHAT_POOL_MAX 1024
+
+enum chat_console_command
+{
+    CHAT_CONSOLE_SAY,           // broadcast the line
+    CHAT_CONSOLE_STATS          // "/stats": dump the server statistics
+};
+
+int chat_format_message(char** text, const char* peer, int fd, const char* data, size_t length);
+int chat_format_server(char** text, const char* line);
+int chat_format_join(char** text, int fd);
+int chat_format_leave(char** text, int fd);
+int chat_format_file(char** text, const char* peer, int fd, unsigned int id, const char* name,
+                     unsigned long long size);
+int chat_format_presence(char** text, const int* joined, size_t joined_count, const int* left, size_t left_count);
+int chat_format_roster(char** text, const int* fds, size_t count);
+enum chat_console_command chat_console_command(const char* line);
+
+chat_text* chat_text_adopt(char* text, int length);
+void chat_text_retain(void* text);
+void chat_text_release(void* text);
+void chat_text_encode(chat_client* client, void* text, const char** data, size_t* length);
+
+void chat_core_init(chat_core* core, const struct chat_core_ops* ops, size_t high_water, size_t low_water,
+                    enum backpressure_policy policy);
+void chat_core_join(chat_core* core, chat_client* client, void* announcement);
+void chat_core_leave(chat_core* core, chat_client* client, void* announcement);
+void chat_core_set_detached(chat_core* core, chat_client* client, int detached);
+void chat_core_broadcast(chat_core* core, void* message, int room, const chat_client* except);
+void chat_core_deliver(chat_core* core, void* message, int room, const chat_client* except);
+void chat_core_queue(chat_core* core, chat_client* client, void* message);
+void chat_core_queue_control(chat_core* core, chat_client* client, void* message);
+size_t chat_core_sent(chat_core* core, chat_client* client, size_t length);
+void* chat_core_pop(chat_core* core, chat_client* client, const char** data, size_t* length);
+void chat_core_requeue(chat_core* core, chat_client* client);
+void chat_core_clear(chat_core* core, chat_client* client);
+void chat_core_print_stats(const chat_core* core, FILE* stream);
+
+void chat_core_set_timers(chat_core* core, timer_wheel* wheel, int idle_timeout, int heartbeat_interval,
+                          int write_stall_timeout);
+void chat_core_watch(chat_core* core, chat_client* client);
+void chat_core_unwatch(chat_core* core, chat_client* client);
+void chat_core_received(chat_client* client);
+void chat_core_written(chat_client* client);
+void chat_core_blocked(chat_core* core, chat_client* client);
+int chat_core_pause_accepting(chat_core* core, timer_entry* timer, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_CHAT_CORE_H
@@ -0,0 +1,539 @@
+/*
+ * Coroutine server: every client is served by two C++20 coroutines, a reader
+ * and a writer, written like the loop of a client thread but suspending on
+ * co_await where a thread would block. One scheduler thread resumes them
+ * from the reactor, so a waiting client costs a coroutine frame instead of
+ * a stack and a thread, and switching clients is a function call, not a
+ * context switch. The chat itself is the one of chat_core.h.
+ */
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "chat_server_coroutines.h"
+#include "chat_core.h"
+#include "error_reporting.h"
+#include "server_config.h"
+#include "server_stats.h"
+#include "tcp_socket.h"
+#include "acceptor.h"
+#include "monotonic_clock.h"
+#include "timer_wheel.h"
+#include "reactor.h"
+
+#define TIMER_TICK_NS (10ULL * 1000 * 1000)
+#define MAX_POLL_TIMEOUT_MS 1000
+#define REACTOR_BATCH 256
+#define SEND_IOV_MAX 64
+
+//internal linkage, the other servers use the same names
+namespace {
+
+/*******************************************************/
+/* Scheduler                                           */
+/*******************************************************/
+//fire and forget: a task runs until its first co_await when it is called
+//and frees its frame when it returns, nobody waits for it
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+//coroutines that can run, resumed by the scheduler loop only, never
+//from inside another coroutine
+std::deque<std::coroutine_handle<>> readyQueue;
+
+//a coroutine parks its handle in a slot, whoever wakes it empties the
+//slot, so it is resumed at most once per suspension
+void wake(std::coroutine_handle<> &slot) {
+    if (slot) {
+        readyQueue.push_back(std::exchange(slot, nullptr));
+    }
+}
+
+struct parkIn {
+    std::coroutine_handle<> &slot;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept { slot = handle; }
+    void await_resume() const noexcept {}
+};
+
+//lets the other ready coroutines run first
+struct yield {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept { readyQueue.push_back(handle); }
+    void await_resume() const noexcept {}
+};
+
+//coroutines waiting on one descriptor. The reactor reports readiness
+//level-triggered, so the interest follows the parked coroutines: it is
+//added when one parks and dropped when a report finds nobody parked.
+struct ioWaiters {
+    int fd;
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+    uint32_t interest;
+};
+
+reactor *ioReactor = NULL;
+timer_wheel timers;
+size_t maxClients = SIZE_MAX;   //--max-connections, the open files limit otherwise
+
+struct coroutineStats {
+    unsigned long long resumes;
+    unsigned long long reactorWaits;
+    unsigned long long ioEvents;
+    unsigned long long interestChanges;
+    unsigned long long clients;         // currently connected
+    unsigned long long sends;           // sendmsg() system calls
+    unsigned long long rejected;        // over --max-connections
+};
+coroutineStats coStats;
+
+int watch(ioWaiters &io) {
+    io.interest = 0;
+    return reactor_add(ioReactor, io.fd, 0, &io);
+}
+
+void setInterest(ioWaiters &io, uint32_t interest) {
+    if (interest != io.interest) {
+        io.interest = interest;
+        coStats.interestChanges++;
+        reactor_modify(ioReactor, io.fd, interest, &io);
+    }
+}
+
+//parks the coroutine until the descriptor is readable or writable
+struct ready {
+    ioWaiters &io;
+    uint32_t events;            // REACTOR_READ or REACTOR_WRITE
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+        (events == REACTOR_READ ? io.reader : io.writer) = handle;
+        setInterest(io, io.interest | events);
+    }
+    void await_resume() const noexcept {}
+};
+
+//reads are tried first and only suspend on EAGAIN; readiness resumes the
+//reader, which reads again. Readiness reported before the data was already
+//consumed leaves it with EAGAIN once more.
+char receiveBuffer[1024];
+
+struct readSome {
+    ioWaiters &io;
+    ssize_t result;
+
+    bool await_ready() noexcept {
+        result = read(io.fd, receiveBuffer, sizeof(receiveBuffer) - 1);
+        return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+        io.reader = handle;
+        setInterest(io, io.interest | REACTOR_READ);
+    }
+    ssize_t await_resume() noexcept {
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            result = read(io.fd, receiveBuffer, sizeof(receiveBuffer) - 1);
+        }
+        return result;
+    }
+};
+
+bool wouldBlock(ssize_t result) {
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+/*******************************************************/
+/* Clients                                             */
+/*******************************************************/
+chat_core chat;
+
+//owned by its reader and writer coroutine, freed when both returned. The
+//chat core keeps its room and outbound queue.
+struct connection : chat_client {
+    ioWaiters io;
+    char peer[48];
+    std::coroutine_handle<> outputWaiter;   // writer with nothing to send
+
+    connection() : chat_client() {}
+
+    ~connection() {
+        chat_core_clear(&chat, this);
+        reactor_remove(ioReactor, io.fd);
+        close(io.fd);
+    }
+};
+
+//drops a client from the chat and wakes both of its coroutines so they
+//return; the reader leaves the room, the socket is closed once both did
+void closeConnection(connection &conn) {
+    if (conn.closing) {
+        return;
+    }
+    conn.closing = true;
+    coStats.clients--;
+    chat_core_clear(&chat, &conn);
+
+    chat_core_unwatch(&chat, &conn);
+    wake(conn.io.reader);
+    wake(conn.io.writer);
+    wake(conn.outputWaiter);
+}
+
+void wakeWriter(chat_client *client) {
+    wake(static_cast<connection *>(client)->outputWaiter);
+}
+
+void dropClient(chat_client *client) {
+    closeConnection(*static_cast<connection *>(client));
+}
+
+//one text encoding per broadcast, shared by its recipients; takes a text
+//from chat_core.h
+chat_text *makeMessage(char *text, int length) {
+    chat_text *msg = chat_text_adopt(text, length);
+    if (msg == NULL) {
+        print_error("makeMessage: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return msg;
+}
+
+//an empty line, the same for every client
+void *heartbeatMessage(chat_client *) {
+    static chat_text *heartbeat = makeMessage(strdup("\n"), 1);
+    chat_text_retain(heartbeat);
+    return heartbeat;
+}
+
+const chat_core_ops chatOps = {
+    chat_text_retain, chat_text_release, chat_text_encode, wakeWriter, dropClient, heartbeatMessage, nullptr
+};
+
+task readClient(std::shared_ptr<connection> conn) {
+    int fd = conn->io.fd;
+    char *text;
+    int length = chat_format_join(&text, fd);
+    chat_text *msg = makeMessage(text, length);
+    chat_core_join(&chat, conn.get(), msg);
+    chat_text_release(msg);
+
+    while (!conn->closing) {
+        ssize_t received = co_await readSome{conn->io, 0};
+        if (wouldBlock(received)) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        chat_core_received(conn.get());
+        length = chat_format_message(&text, conn->peer, fd, receiveBuffer, (size_t) received);
+        msg = makeMessage(text, length);
+        chat_core_broadcast(&chat, msg, conn->room, conn.get());
+        chat_text_release(msg);
+    }
+
+    closeConnection(*conn);
+    LOG_INFO("FD %d has left the chat room.\n", fd);
+    length = chat_format_leave(&text, fd);
+    msg = makeMessage(text, length);
+    chat_core_leave(&chat, conn.get(), msg);
+    chat_text_release(msg);
+}
+
+struct iovec sendVector[SEND_IOV_MAX];
+
+task writeClient(std::shared_ptr<connection> conn) {
+    while (!conn->closing) {
+        if (conn->head == NULL) {
+            co_await parkIn{conn->outputWaiter};
+            continue;
+        }
+
+        //everything queued, up to SEND_IOV_MAX messages, in one system call
+        size_t count = 0;
+        for (chat_out *out = conn->head; out != NULL && count < SEND_IOV_MAX; out = out->next, count++) {
+            sendVector[count].iov_base = (void *) (out->data + out->sent);
+            sendVector[count].iov_len = out->length - out->sent;
+        }
+        msghdr header = {};
+        header.msg_iov = sendVector;
+        header.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn->io.fd, &header, MSG_NOSIGNAL);
+        coStats.sends++;
+
+        if (wouldBlock(sent)) {
+            //the client stopped reading, it has write_stall_timeout to resume
+            chat_core_blocked(&chat, conn.get());
+            co_await ready{conn->io, REACTOR_WRITE};
+            continue;
+        }
+        if (sent < 0) {
+            closeConnection(*conn);
+            break;
+        }
+
+        chat_core_sent(&chat, conn.get(), (size_t) sent);
+        chat_core_written(conn.get());
+    }
+}
+
+void startClient(int fd) {
+    if (coStats.clients >= maxClients) {
+        LOG_WARN("FD %d rejected, connection limit of %zu reached\n", fd, maxClients);
+        coStats.rejected++;
+        close(fd);
+        return;
+    }
+    auto conn = std::make_shared<connection>();
+    conn->io.fd = fd;
+    conn->fd = fd;
+    if (watch(conn->io) != 0) {
+        print_error("startClient: reactor_add");
+        return;
+    }
+    format_peer_address(fd, conn->peer, sizeof(conn->peer));
+    LOG_INFO("FD %d has entered the chat room.\n", fd);
+
+    coStats.clients++;
+
+    chat_core_watch(&chat, conn.get());
+
+    writeClient(conn);
+    readClient(conn);
+}
+
+
+/*******************************************************/
+/* Listeners and Console                               */
+/*******************************************************/
+//out of descriptors or memory the connection stays pending, the acceptor
+//sleeps for a moment instead of spinning on the readable listener
+struct acceptPause {
+    timer_entry timer;
+    std::coroutine_handle<> waiter;
+};
+
+void onAcceptPause(timer_entry *timer) {
+    wake(static_cast<acceptPause *>(timer->context)->waiter);
+}
+
+//takes up to accept_batch clients per wake-up, a full batch yields so a
+//connect storm does not starve the clients
+task acceptClients(ioWaiters &io, socket_info *listener, bool acceptorHandoff) {
+    std::vector<int> accepted(server_config.accept_batch);
+    acceptPause pause;
+    timer_entry_init(&pause.timer, onAcceptPause, &pause);
+
+    for (;;) {
+        int count = acceptorHandoff
+                    ? receive_accepted_connections(io.fd, accepted.data(), server_config.accept_batch)
+                    : accept_connections(&listener, accepted.data(), server_config.accept_batch);
+        if (count < 0) {
+            if (chat_core_pause_accepting(&chat, &pause.timer, io.fd) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            co_await parkIn{pause.waiter};
+            continue;
+        }
+        for (int k = 0; k < count; k++) {
+            startClient(accepted[k]);
+        }
+
+        if (count == server_config.accept_batch) {
+            co_await yield{};
+        } else {
+            co_await ready{io, REACTOR_READ};
+        }
+    }
+}
+
+//lines typed on the server console go to every client
+task readConsole(ioWaiters &io) {
+    for (;;) {
+        ssize_t received = co_await readSome{io, 0};
+        if (wouldBlock(received)) {
+            continue;
+        }
+        if (received <= 0) {
+            //a console at end of file stays readable, level-triggered
+            reactor_remove(ioReactor, io.fd);
+            co_return;
+        }
+        receiveBuffer[received] = '\0';
+        if (chat_console_command(receiveBuffer) == CHAT_CONSOLE_STATS) {
+            stats_dump(stdout);
+            continue;
+        }
+        char *text;
+        int length = chat_format_server(&text, receiveBuffer);
+        chat_text *msg = makeMessage(text, length);
+        chat_core_broadcast(&chat, msg, CHAT_ROOM_ALL, NULL);
+        chat_text_release(msg);
+    }
+}
+
+void printCoroutineStats(FILE *stream) {
+    fprintf(stream, "reactor=%s clients=%llu resumes=%llu reactor_waits=%llu io_events=%llu "
+                    "interest_changes=%llu broadcasts=%llu sends=%llu congestions=%llu dropped=%llu "
+                    "disconnects=%llu rejected=%llu\n",
+            reactor_backend_name(reactor_get_backend(ioReactor)), coStats.clients, coStats.resumes,
+            coStats.reactorWaits, coStats.ioEvents, coStats.interestChanges, chat.stats.broadcasts,
+            coStats.sends, chat.stats.congestions, chat.stats.dropped_oldest + chat.stats.dropped_new,
+            chat.stats.disconnects + chat.stats.stall_disconnects, coStats.rejected);
+}
+
+void printBackpressureStats(FILE *stream) {
+    chat_core_print_stats(&chat, stream);
+}
+
+void printTimerStats(FILE *stream) {
+    fprintf(stream, "armed=%zu expired=%llu idle_timeout=%d heartbeat=%d write_stall_timeout=%d\n",
+            timers.armed, timers.expired, server_config.idle_timeout,
+            server_config.heartbeat_interval, server_config.write_stall_timeout);
+}
+
+void wakeReactor(void *argument) {
+    reactor_wakeup((reactor *) argument);
+}
+
+} //namespace
+
+extern "C" void chat_server_coroutines(int serverPort) {
+    static ioWaiters listenIo = {-1, nullptr, nullptr, 0};
+    static ioWaiters unixIo = {-1, nullptr, nullptr, 0};
+    static ioWaiters consoleIo = {0, nullptr, nullptr, 0};
+    socket_info *listener = NULL;
+    socket_info *unixListener = NULL;
+    struct listen_options listenOptions = {server_config.listen_backlog, 0, &server_config.socket_profile};
+    bool acceptorHandoff = server_config.acceptor_threads > 0;
+
+    printf("Starting coroutine server \n");
+    cpu_pin_current_thread(cpu_list_pick(&server_config.io_cpus, 0), "Scheduler");
+    timer_wheel_init(&timers, TIMER_TICK_NS, monotonic_time_ns());
+    chat_core_init(&chat, &chatOps, server_config.outbound_high_water, server_config.outbound_low_water,
+                   server_config.backpressure_policy);
+    chat_core_set_timers(&chat, &timers, server_config.idle_timeout, server_config.heartbeat_interval,
+                         server_config.write_stall_timeout);
+    ioReactor = reactor_create(server_config.reactor_backend == REACTOR_DEFAULT
+                               ? REACTOR_EPOLL : server_config.reactor_backend, &timers);
+    if (ioReactor == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Using the %s reactor\n", reactor_backend_name(reactor_get_backend(ioReactor)));
+
+    //a client is a descriptor, a few more go to listeners, the console and the reactor
+    if (server_config.max_connections > 0) {
+        long needed = server_config.max_connections + 64L;
+        long fileLimit = raise_file_limit(needed);
+        maxClients = (size_t) server_config.max_connections;
+        if (fileLimit >= 0 && fileLimit < needed) {
+            maxClients = fileLimit > 128 ? (size_t) (fileLimit - 64) : 64;
+            LOG_WARN("Open files limited to %ld, serving at most %zu connections\n", fileLimit, maxClients);
+        }
+    }
+
+    //acceptor threads hand their connections over through a pipe
+    if (acceptorHandoff) {
+        listenIo.fd = start_acceptor_threads(server_config.acceptor_threads, (uint16_t) serverPort,
+                                             &listenOptions, server_config.accept_batch, &server_config.accept_cpus);
+    } else if (create_passive_socket_with_options(&listener, (uint16_t) serverPort, &listenOptions) == 0) {
+        listenIo.fd = listener->socket_fd;
+    }
+    if (listenIo.fd < 0 || watch(listenIo) != 0) {
+        printf("Couldn't create passive socket \n");
+        exit(EXIT_FAILURE);
+    }
+    acceptClients(listenIo, listener, acceptorHandoff);
+
+    if (server_config.unix_socket_path != NULL) {
+        if (create_passive_unix_socket(&unixListener, server_config.unix_socket_path, &listenOptions) != 0) {
+            printf("Couldn't create unix domain socket \n");
+            exit(EXIT_FAILURE);
+        }
+        unixIo.fd = unixListener->socket_fd;
+        if (watch(unixIo) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        acceptClients(unixIo, unixListener, false);
+    }
+
+    //epoll refuses regular files, a console redirected from one is ignored;
+    //poll takes it and readConsole stops at its end
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+    if (watch(consoleIo) == 0) {
+        readConsole(consoleIo);
+    }
+
+    stats_register("coroutines", printCoroutineStats);
+    stats_register("backpressure", printBackpressureStats);
+    stats_register("timers", printTimerStats);
+    stats_install_signal_handler(SIGUSR1);
+    stats_set_wakeup(wakeReactor, ioReactor);
+
+    reactor_event events[REACTOR_BATCH];
+    for (;;) {
+        if (stats_dump_requested()) {
+            stats_dump(stderr);
+        }
+
+        //only what was ready before this round, coroutines that yield run in the next
+        for (size_t n = readyQueue.size(); n > 0; n--) {
+            std::coroutine_handle<> handle = readyQueue.front();
+            readyQueue.pop_front();
+            coStats.resumes++;
+            handle.resume();
+        }
+
+        //the reactor runs the timers and sleeps no longer than the next one
+        uint64_t timeout = readyQueue.empty() ? MAX_POLL_TIMEOUT_MS * 1000000ULL : 0;
+        int count = reactor_wait(ioReactor, timeout, events, REACTOR_BATCH);
+        coStats.reactorWaits++;
+        if (count < 0 && errno != EINTR) {
+            print_error("reactor_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int k = 0; k < count; k++) {
+            ioWaiters *io = (ioWaiters *) events[k].data;
+            uint32_t interest = io->interest;
+            coStats.ioEvents++;
+            if (events[k].events & (REACTOR_READ | REACTOR_HANGUP | REACTOR_ERROR)) {
+                if (!io->reader) {
+                    interest &= ~REACTOR_READ;
+                }
+                wake(io->reader);
+            }
+            if (events[k].events & (REACTOR_WRITE | REACTOR_HANGUP | REACTOR_ERROR)) {
+                if (!io->writer) {
+                    interest &= ~REACTOR_WRITE;
+                }
+                wake(io->writer);
+            }
+            setInterest(*io, interest);
+        }
+    }
+}
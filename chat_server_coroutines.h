@@ -0,0 +1,14 @@
+#ifndef CHAT_CHAT_SERVER_COROUTINES_H
+#define CHAT_CHAT_SERVER_COROUTINES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void chat_server_coroutines(int serverPort);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_CHAT_SERVER_COROUTINES_H
@@ -1,27 +1,70 @@
 //
 // Created by andi on 09.11.17.
 //
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <errno.h>
 #include "tcp_socket.h"
+#include "error_reporting.h"
+#include "latency_histogram.h"
+#include "monotonic_clock.h"
+#include "server_stats.h"
+#include "server_config.h"
+#include "acceptor.h"
+#include "timer_wheel.h"
+#include "wire_protocol.h"
+#include "multicast.h"
+#include "shm_transport.h"
+#include "broadcast_log.h"
+#include "prefork.h"
+#include "federation.h"
+#include "hot_restart.h"
+#include "reactor.h"
+#include "chat_core.h"
+#include "token_bucket.h"
+#include "event_trace.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #define TRUE             1
 #define FALSE            0
+#define MAX_POLL_FDS     200    // without --max-connections
+/* Listeners, eventfds and links on top of --max-connections */
+#define POLL_RESERVED    64
+/* Ready descriptors taken from the reactor per wait */
+#define READY_BATCH      1024
+#define TIMER_TICK_NS    (10ULL * 1000 * 1000)
+#define NS_PER_SECOND    (1000ULL * 1000 * 1000)
+/* Upper bound for a reactor wait. SIGUSR1 wakes the
+ * reactor up, this only keeps the loop from sleeping
+ * for hours with nothing armed                         */
+#define MAX_POLL_TIMEOUT_MS 1000
+/* Queued messages gathered into one sendmsg() */
+#define SEND_IOV_MAX     64
+/* A client that sent nothing after this long is a text
+ * client, output to it is held until then             */
+#define NEGOTIATION_TIMEOUT_NS (100ULL * 1000 * 1000)
 
 typedef enum Eventtypes{
     NEW_CONNECTION,
     MSG_RECEIVED,
     MSG_TO_SEND,
     DISCONNECT,
-    KEYPRESS
+    KEYPRESS,
+    EVENT_TYPE_COUNT
 }e_type;
 
 const char* getEventName(enum Eventtypes eventtype)
@@ -39,7 +82,9 @@ const char* getEventName(enum Eventtypes eventtype)
 
 struct event {
     e_type type;
-    //struct timeval t; // the timestamp
+    uint64_t created_ns; // monotonic timestamp of createEvent
+    int external;        // queued by the loop, not by a handler
+    uint32_t connectionId; // receives and sends: the connection at fd when queued
     int fd;
     char* message;
     ssize_t msglen;
@@ -56,23 +101,105 @@ struct subscription* subscriptions[100];
 int subscrCounter = 0;
 
 struct socket_info* listenInfo;
+struct socket_info* unixListenInfo = NULL;
 ssize_t  dataSize = 1;
 int    rc = 1;
 int    end_server = FALSE;
 int    listen_sd = -1;
+int    unix_listen_sd = -1;
 int    timeout;
-struct pollfd fds[200];
+struct timer_wheel timers;  // see Connection Timers
+/* The descriptor table is grown on demand up to
+ * maxPollFds: fds[] is what the reactor watches. The
+ * fanout walks the compact member table of the chat
+ * core instead of every struct connection. Removal moves
+ * the last slot into the gap, pollIndex[] maps a
+ * descriptor to its slot.                              */
+struct pollfd* fds = NULL;
+int    pollCapacity = 0;
+int    maxPollFds = MAX_POLL_FDS;
+int    maxConnections = MAX_POLL_FDS - 2;
+int    connectionCount = 0;
+int*   pollIndex = NULL;
+int    pollIndexCapacity = 0;
 nfds_t nfds = 2;
 int    current_size = 0, j, i;
+int    acceptorHandoff = FALSE; // listen_sd is the handoff pipe of acceptor threads
+int*   acceptBuffer;
+broadcast_log* bus = NULL;  // prefork mode: shared by all worker processes
+int    workerIndex = 0;     // worker 0 owns the terminal and the Unix listener
+int    busWakeFd = -1;
+int    handoffListenSd = -1;    // the next server of a hot restart connects here
+reactor* ioReactor = NULL;
+struct reactor_event readyEvents[READY_BATCH];
+int    readyCount = 0;
 
 
 
+/*******************************************************/
+/* Event Traces                                        */
+/*******************************************************/
+/* With --trace every round of the loop is recorded, see
+ * event_trace.h: the events the loop queued, what it
+ * dispatched and every byte the handlers read. Records
+ * go into a buffer, a round costs a copy per event.
+ * --replay feeds a trace back, see Trace Replay.        */
+event_trace* eventTrace = NULL;
+int dispatching = FALSE;    // handlers run, what they queue is not external
+volatile sig_atomic_t traceStopRequested = 0;
+
+/* SIGINT and SIGTERM end a traced server through the
+ * loop, so the end of the trace is written           */
+void requestTraceStop(int signalNumber){
+    (void) signalNumber;
+    traceStopRequested = 1;
+}
+
+void traceRecord(uint8_t kind, uint8_t type, int fd, uint32_t length, const void* data){
+    struct event_trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.time_ns = monotonic_time_ns();
+    record.kind = kind;
+    record.type = type;
+    record.fd = fd;
+    record.length = length;
+    event_trace_write(eventTrace, &record, data);
+}
+
+void traceDispatch(const struct event* evp, uint64_t dispatched){
+    struct event_trace_record record;
+    memset(&record, 0, sizeof(record));
+    uint64_t queued = dispatched - evp->created_ns;
+    record.time_ns = dispatched;
+    record.kind = EVENT_TRACE_DISPATCH;
+    record.type = (uint8_t) evp->type;
+    record.fd = evp->fd;
+    record.length = (uint32_t) evp->msglen;
+    record.flags = evp->external ? EVENT_TRACE_EXTERNAL : 0;
+    record.queued_ns = queued > UINT32_MAX ? UINT32_MAX : (uint32_t) queued;
+    event_trace_write(eventTrace, &record, NULL);
+}
+
+/* What a handler read from fd; len <= 0 ends the stream.
+ * Keeps errno for the caller's error handling.          */
+void traceData(int fd, const void* data, ssize_t len){
+    if(eventTrace != NULL){
+        int savedErrno = errno;
+        traceRecord(EVENT_TRACE_DATA, 0, fd, len > 0 ? (uint32_t) len : 0, data);
+        errno = savedErrno;
+    }
+}
+
+
 /*******************************************************/
 /* Event Creation                                      */
 /*******************************************************/
 struct event* createEvent(e_type type, int fd, char* message, ssize_t msglen){
     struct event* evp = malloc(sizeof(struct event));
     evp->type = type;
+    evp->created_ns = monotonic_time_ns();
+    evp->external = !dispatching;
+    evp->connectionId = 0;
     evp->fd = fd;
     evp->message = message;
     evp->msglen = msglen;
@@ -94,334 +221,4505 @@ void subscribe(e_type type, callback cb){
 
 
 /*******************************************************/
-/* Event Queue                                      */
+/* Latency Histograms                                  */
 /*******************************************************/
-const int qmax = 1000000;
-struct event* evtQ[1000000];
-int qfront = 0;
-int qrear = -1;
-int qCount = 0;
+/* Per event type: time spent queued before dispatch and
+ * time spent in the subscribed handlers.                */
+latency_histogram queueWaitHistograms[EVENT_TYPE_COUNT];
+latency_histogram handlerHistograms[EVENT_TYPE_COUNT];
 
-int qIsFull(){
-    return qCount == qmax;
+void resetLatencyHistograms(){
+    for(int t=0; t<EVENT_TYPE_COUNT; t++){
+        latency_histogram_reset(&queueWaitHistograms[t]);
+        latency_histogram_reset(&handlerHistograms[t]);
+    }
 }
 
-void qInsert(struct event* val){
-    if(!qIsFull()){
-        if(qrear == qmax-1){
-            qrear = -1;
+void printLatencyHistograms(FILE* stream){
+    char name[64];
+    for(int t=0; t<EVENT_TYPE_COUNT; t++){
+        snprintf(name, sizeof(name), "queue_wait %s", getEventName((e_type) t));
+        latency_histogram_print(&queueWaitHistograms[t], name, stream);
+        snprintf(name, sizeof(name), "handler %s", getEventName((e_type) t));
+        latency_histogram_print(&handlerHistograms[t], name, stream);
+    }
+}
+
+
+/*******************************************************/
+/* Chat Messages                                       */
+/*******************************************************/
+/* A message is created once per broadcast and shared by
+ * its recipients. The text and the binary (see
+ * wire_protocol.h) encoding are built on first use, so
+ * each format costs at most one encoding per message.   */
+enum protocolMode {
+    PROTOCOL_UNDECIDED, // nothing received yet, output is held
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY
+};
+
+struct chatMessage {
+    int refs;
+    struct wire_header header;  // type, sender id, room and sequence
+    int senderFd;               // the text format names senders by fd
+    char senderPeer[48];
+    char* payload;              // header.length bytes, NUL-terminated
+    char* text;
+    size_t textLen;
+    unsigned char* frame;
+    size_t frameLen;
+};
+
+uint32_t nextSequence = 1;
+
+struct protocolStats {
+    unsigned long long textConnections;
+    unsigned long long binaryConnections;
+    unsigned long long textEncodings;
+    unsigned long long binaryEncodings;
+    unsigned long long protocolErrors;
+};
+struct protocolStats protoStats;
+
+/* Workers of the prefork server number messages and
+ * connections from counters in the shared bus          */
+uint32_t allocateSequence(){
+    return bus != NULL ? broadcast_log_next_sequence(bus) : nextSequence++;
+}
+
+/* Like createMessage(), with the sequence already known */
+struct chatMessage* buildMessage(uint8_t type, uint16_t room, uint32_t sender, uint32_t sequence,
+                                 int senderFd, const char* peer, const char* payload, size_t len){
+    struct chatMessage* msg = malloc(sizeof(struct chatMessage));
+    msg->refs = 1;
+    msg->header.version = WIRE_VERSION;
+    msg->header.type = type;
+    msg->header.room = room;
+    msg->header.sender = sender;
+    msg->header.sequence = sequence;
+    msg->header.length = (uint32_t) len;
+    msg->senderFd = senderFd;
+    snprintf(msg->senderPeer, sizeof(msg->senderPeer), "%s", peer);
+    msg->payload = malloc(len + 1);
+    if(len > 0){
+        memcpy(msg->payload, payload, len);
+    }
+    msg->payload[len] = '\0';
+    msg->text = NULL;
+    msg->frame = NULL;
+    return msg;
+}
+
+/* The caller owns the returned reference and releases it
+ * after handing the message to queueSend()              */
+struct chatMessage* createMessage(uint8_t type, uint16_t room, uint32_t sender,
+                                  int senderFd, const char* peer, const char* payload, size_t len){
+    uint32_t sequence = (type == WIRE_MESSAGE || type == WIRE_JOIN || type == WIRE_LEAVE) ? allocateSequence() : 0;
+    return buildMessage(type, room, sender, sequence, senderFd, peer, payload, len);
+}
+
+void releaseMessage(struct chatMessage* msg){
+    if(--msg->refs > 0){
+        return;
+    }
+    free(msg->payload);
+    free(msg->text);
+    free(msg->frame);
+    free(msg);
+}
+
+void encodeText(struct chatMessage* msg){
+    int len;
+    switch(msg->header.type){
+        case WIRE_MESSAGE:
+            if(msg->header.sender == 0){
+                len = chat_format_server(&msg->text, msg->payload);
+            }else{
+                len = chat_format_message(&msg->text, msg->senderPeer, msg->senderFd,
+                                          msg->payload, msg->header.length);
+            }
+            break;
+        case WIRE_JOIN:
+            len = chat_format_join(&msg->text, msg->senderFd);
+            break;
+        case WIRE_LEAVE:
+            len = chat_format_leave(&msg->text, msg->senderFd);
+            break;
+        case WIRE_HEARTBEAT:
+            len = asprintf(&msg->text, "\n");
+            break;
+        case WIRE_FILE: {
+            uint32_t fields[3];
+            char name[WIRE_FILE_NAME_MAX + 1];
+            size_t nameLen = msg->header.length - WIRE_FILE_INFO_SIZE;
+            memcpy(fields, msg->payload, sizeof(fields));
+            memcpy(name, msg->payload + WIRE_FILE_INFO_SIZE, nameLen);
+            name[nameLen] = '\0';
+            len = chat_format_file(&msg->text, msg->senderPeer, msg->senderFd, ntohl(fields[0]), name,
+                                   (unsigned long long) ntohl(fields[1]) << 32 | ntohl(fields[2]));
+            break;
         }
+        default:
+            len = asprintf(&msg->text, "%s", "");
+            break;
+    }
+    if(len < 0){
+        print_error("  encodeText: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    msg->textLen = (size_t) len;
+    protoStats.textEncodings++;
+}
+
+void encodeFrame(struct chatMessage* msg){
+    msg->frame = malloc(WIRE_HEADER_SIZE + msg->header.length);
+    msg->frameLen = wire_encode_frame(&msg->header, msg->payload, msg->frame);
+    protoStats.binaryEncodings++;
+}
 
-        evtQ[++qrear] = val;
-        qCount++;
+/* Returns the bytes to send to a client of the given mode,
+ * undecided clients get text until they turn binary      */
+void getEncoding(struct chatMessage* msg, enum protocolMode mode, const char** data, size_t* len){
+    if(mode == PROTOCOL_BINARY){
+        if(msg->frame == NULL){
+            encodeFrame(msg);
+        }
+        *data = (const char*) msg->frame;
+        *len = msg->frameLen;
+    }else{
+        if(msg->text == NULL){
+            encodeText(msg);
+        }
+        *data = msg->text;
+        *len = msg->textLen;
     }
 }
 
-int qIsEmpty(){
-    return qCount == 0;
+void printProtocolStats(FILE* stream){
+    fprintf(stream, "text_connections=%llu binary_connections=%llu text_encodings=%llu "
+                    "binary_encodings=%llu protocol_errors=%llu\n",
+            protoStats.textConnections, protoStats.binaryConnections, protoStats.textEncodings,
+            protoStats.binaryEncodings, protoStats.protocolErrors);
+}
+
+
+/*******************************************************/
+/* Multicast Fanout                                    */
+/*******************************************************/
+/* With --multicast every broadcast is written once to
+ * a UDP group, whatever the number of listeners, and
+ * skipped for connections that asked for the group.
+ * Broadcasts stay in a ring indexed by sequence, so
+ * listeners that lost datagrams recover them over
+ * their connection (WIRE_NACK).                         */
+#define MULTICAST_TTL 1
+
+int multicastFd = -1;
+struct chatMessage** history = NULL;    // holds a reference per entry
+size_t historySize = 0;
+
+struct multicastStats {
+    unsigned long long datagrams;
+    unsigned long long bytes;
+    unsigned long long sendErrors;      // datagrams the kernel refused, left to NACKs
+    unsigned long long listeners;       // connections currently using the group
+    unsigned long long nacks;
+    unsigned long long resent;
+    unsigned long long unrecoverable;   // requested but no longer in the history
+};
+struct multicastStats mcStats;
+
+struct chatMessage* findHistory(uint32_t sequence){
+    struct chatMessage* msg = history[sequence % historySize];
+    return msg != NULL && msg->header.sequence == sequence ? msg : NULL;
 }
 
-void qRemove(struct event** val){
-    if(qIsEmpty()){
-        perror("  qRemove failed: queue is empty!");
+/* Sends msg to the group and keeps it for resending */
+void publishMulticast(struct chatMessage* msg){
+    const char* data;
+    size_t len;
+
+    if(multicastFd < 0 || msg->header.sequence == 0){
         return;
     }
 
-    /* We have an element. Pop it normally and return it in val_r. */
-    *val = evtQ[qfront++];
+    struct chatMessage** slot = &history[msg->header.sequence % historySize];
+    if(*slot != NULL){
+        releaseMessage(*slot);
+    }
+    *slot = msg;
+    msg->refs++;
 
-    if(qfront == qmax){
-        qfront = 0;
+    /* A full socket buffer or an oversized frame costs the
+     * listeners a NACK round trip, not the server a retry  */
+    getEncoding(msg, PROTOCOL_BINARY, &data, &len);
+    if(send(multicastFd, data, len, 0) < 0){
+        mcStats.sendErrors++;
+        LOG_DEBUG("Multicast of sequence %u failed: %s\n", msg->header.sequence, strerror(errno));
+        return;
     }
+    mcStats.datagrams++;
+    mcStats.bytes += len;
+}
 
-    qCount--;
+void printMulticastStats(FILE* stream){
+    fprintf(stream, "group=%s history=%zu datagrams=%llu bytes=%llu send_errors=%llu listeners=%llu "
+                    "nacks=%llu resent=%llu unrecoverable=%llu\n",
+            server_config.multicast_group, historySize, mcStats.datagrams, mcStats.bytes,
+            mcStats.sendErrors, mcStats.listeners, mcStats.nacks, mcStats.resent, mcStats.unrecoverable);
 }
 
+/*******************************************************/
+/* Prefork Workers                                     */
+/*******************************************************/
+/* With --workers the server runs as several processes,
+ * each with its own SO_REUSEPORT listener. Broadcasts of
+ * one worker reach the clients of all others through a
+ * log in shared memory: every worker appends what it
+ * broadcasts and delivers what the others appended.
+ * Worker 0 also serves the terminal and --unix.        */
+#define BUS_READ_BATCH 256
 
+struct workerStats {
+    unsigned long long published;
+    unsigned long long received;
+    unsigned long long oversized;       // too large for a log slot, stayed local
+    unsigned long long busWakeups;
+};
+struct workerStats wkStats;
+broadcast_cursor busCursor;
 
-void writeToConsole(char* msg){
-    /*struct sockaddr_in address;
-    int addrlen;
-    // Get details
-    getpeername(fromFd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
-    printf("%s:%d - %s\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port), msg);*/
-    printf("%s\n", msg);
+/* Appends a broadcast of this worker to the bus */
+void publishBus(struct chatMessage* msg){
+    struct broadcast_record record;
+
+    if(bus == NULL){
+        return;
+    }
+    if(msg->header.length > BROADCAST_LOG_PAYLOAD){
+        wkStats.oversized++;
+        LOG_DEBUG("Message of %u bytes is not forwarded to other workers\n", msg->header.length);
+        return;
+    }
+
+    record.origin = workerIndex;
+    record.type = msg->header.type;
+    record.room = msg->header.room;
+    record.sender = msg->header.sender;
+    record.sequence = msg->header.sequence;
+    record.sender_fd = msg->senderFd;
+    snprintf(record.sender_peer, sizeof(record.sender_peer), "%s", msg->senderPeer);
+    record.length = msg->header.length;
+    memcpy(record.payload, msg->payload, msg->header.length);
+    broadcast_log_append(bus, &record);
+    wkStats.published++;
+}
+
+void printWorkerStats(FILE* stream){
+    fprintf(stream, "worker=%d pid=%d published=%llu received=%llu oversized=%llu lost=%llu "
+                    "bus_wakeups=%llu bus_records=%llu\n",
+            workerIndex, (int) getpid(), wkStats.published, wkStats.received, wkStats.oversized,
+            busCursor.lost, wkStats.busWakeups, broadcast_log_appended(bus));
 }
 
+/* Workers share stderr, each dump is written at once */
+void dumpStats(){
+    char* text;
+    size_t len;
+
+    if(bus == NULL){
+        stats_dump(stderr);
+        return;
+    }
+    FILE* stream = open_memstream(&text, &len);
+    if(stream == NULL){
+        return;
+    }
+    stats_dump(stream);
+    fclose(stream);
+    if(write(STDERR_FILENO, text, len) < 0){
+        LOG_DEBUG("Stats dump failed: %s\n", strerror(errno));
+    }
+    free(text);
+}
 
 /*******************************************************/
-/* Event Handlers                                      */
+/* Federation                                          */
 /*******************************************************/
-void handleConnect(struct event* evp) {
-    //printf("handleConnect\n");
-    int new_sd = accept_connection(&listenInfo);
+/* Servers started with --node-id link to each other
+ * (federation.h). A broadcast of a local sender is framed
+ * once for every link whose server has members in its
+ * room, and whatever a link collected during a loop
+ * iteration leaves in one send(). Broadcasts that arrive
+ * on links are numbered locally and delivered once:
+ * copies with the same origin and sequence are dropped.
+ * Link I/O is in Federation Links further down.         */
+#define LINK_HIGH_WATER  (8 * 1024 * 1024)
 
-    if (new_sd < 0) {
-        if (errno != EWOULDBLOCK) {
-            end_server = TRUE;
+struct peerLink {
+    int fd;                 // -1 while down
+    const char* address;    // configured peer to dial, NULL for accepted links
+    uint32_t node;          // from its WIRE_PEER_HELLO, 0 until then
+    uint32_t lastNode;      // node it linked to before, kept while down
+    int stalled;            // more than LINK_HIGH_WATER unsent, dropped at the next flush
+    room_set interest;      // rooms the linked server has members in
+    unsigned char* out;     // frames not yet sent
+    size_t outLen;
+    size_t outCapacity;
+    unsigned char* in;      // partial frames
+    size_t inLen;
+    timer_entry redialTimer;
+    uint64_t redialDelay;
+};
+
+struct peerLink links[FEDERATION_MAX_PEERS];
+int federationListenSd = -1;
+struct socket_info* federationListenInfo = NULL;
+uint32_t federationEpoch = 0;
+uint32_t* roomMembers = NULL;   // local members per room, only counted when federated
+federation_dedup dedup;
+
+struct federationStats {
+    unsigned long long linksUp;         // handshakes completed
+    unsigned long long linkDrops;
+    unsigned long long forwarded;       // frames queued on links
+    unsigned long long sends;           // send() calls on links
+    unsigned long long bytesOut;
+    unsigned long long received;        // broadcasts delivered from links
+    unsigned long long oversized;       // too large to forward with a route
+    unsigned long long stalls;          // links dropped at LINK_HIGH_WATER
+};
+struct federationStats fdStats;
+
+int isFederated(){
+    return server_config.node_id > 0;
+}
+
+struct peerLink* findLink(int fd){
+    if(!isFederated() || fd < 0){
+        return NULL;
+    }
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(links[k].fd == fd){
+            return &links[k];
         }
-        /*****************************************************/
-        /* If accept fails with EWOULDBLOCK, then we         */
-        /* have accepted all new connections.
-        /*****************************************************/
+    }
+    return NULL;
+}
+
+/* Queues one frame on a link, its payload is the route
+ * (if any) followed by len bytes of payload              */
+void appendLink(struct peerLink* link, const struct wire_header* header,
+                const struct federation_route* route, const void* payload, size_t len){
+    size_t routeLen = route != NULL ? FEDERATION_ROUTE_SIZE : 0;
+    size_t frameLen = WIRE_HEADER_SIZE + routeLen + len;
+
+    if(link->stalled){
+        return;
+    }
+    if(link->outLen + frameLen > LINK_HIGH_WATER){
+        LOG_WARN("Link to node %u stalled with %zu bytes unsent\n", link->node, link->outLen);
+        fdStats.stalls++;
+        link->stalled = TRUE;
         return;
     }
+    if(link->outLen + frameLen > link->outCapacity){
+        size_t capacity = link->outCapacity == 0 ? 65536 : link->outCapacity;
+        while(capacity < link->outLen + frameLen){
+            capacity *= 2;
+        }
+        unsigned char* grown = realloc(link->out, capacity);
+        if(grown == NULL){
+            print_error("  appendLink: could not grow link buffer");
+            exit(EXIT_FAILURE);
+        }
+        link->out = grown;
+        link->outCapacity = capacity;
+    }
 
-    /*****************************************************/
-    /* Add the new incoming connection to the            */
-    /* pollfd structure                                  */
-    /*****************************************************/
-    fds[nfds].fd = new_sd;
+    struct wire_header frame = *header;
+    frame.version = WIRE_VERSION;
+    frame.length = (uint32_t) (routeLen + len);
+    unsigned char* out = link->out + link->outLen;
+    wire_encode_header(&frame, out);
+    if(route != NULL){
+        federation_encode_route(route, out + WIRE_HEADER_SIZE);
+    }
+    if(len > 0){
+        memcpy(out + WIRE_HEADER_SIZE + routeLen, payload, len);
+    }
+    link->outLen += frameLen;
+}
+
+void sendInterest(struct peerLink* link, uint16_t room, int members){
+    struct wire_header header = {WIRE_VERSION, WIRE_PEER_INTEREST, room, 0, 0, 0};
+    unsigned char flag = members ? 1 : 0;
+    appendLink(link, &header, NULL, &flag, 1);
+}
+
+/* Tells the linked servers when a room gets its first
+ * or loses its last local member                        */
+void roomJoined(uint16_t room){
+    if(roomMembers == NULL || roomMembers[room]++ > 0){
+        return;
+    }
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(links[k].fd >= 0){
+            sendInterest(&links[k], room, TRUE);
+        }
+    }
+}
+
+void roomLeft(uint16_t room){
+    if(roomMembers == NULL || --roomMembers[room] > 0){
+        return;
+    }
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(links[k].fd >= 0){
+            sendInterest(&links[k], room, FALSE);
+        }
+    }
+}
+
+/* Forwards a broadcast of a local sender to the linked
+ * servers with members in its room, or to all of them
+ * for server messages                                    */
+void forwardToPeers(struct chatMessage* msg){
+    if(!isFederated() || msg->header.sequence == 0){
+        return;
+    }
+    if(msg->header.length + FEDERATION_ROUTE_SIZE > WIRE_MAX_PAYLOAD){
+        fdStats.oversized++;
+        return;
+    }
+
+    struct federation_route route;
+    route.origin = (uint32_t) server_config.node_id;
+    route.epoch = federationEpoch;
+    route.sender_fd = msg->senderFd;
+    snprintf(route.sender_peer, sizeof(route.sender_peer), "%s", msg->senderPeer);
+
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        struct peerLink* link = &links[k];
+        if(link->fd >= 0 && link->node != 0 &&
+           (msg->header.sender == 0 || room_set_contains(&link->interest, msg->header.room))){
+            appendLink(link, &msg->header, &route, msg->payload, msg->header.length);
+            fdStats.forwarded++;
+        }
+    }
+}
+
+/*******************************************************/
+/* Connections and Outbound Queues                     */
+/*******************************************************/
+/* Every connection owns a FIFO of messages that still
+ * have to be sent, kept by the chat core (chat_core.h)
+ * like the rooms and the backpressure policy. At most
+ * one MSG_TO_SEND event per connection is queued (or
+ * POLLOUT is armed), so a client that stops reading
+ * only grows its own queue.                             */
+/* A download in progress, served with sendfile() */
+struct fileStream {
+    struct fileStream* next;
+    uint32_t id;
+    int fileFd;         // opened once it is the connection's downloadHead, -1 before
+    off_t offset;       // content sent so far
+    off_t size;
+    unsigned char header[WIRE_HEADER_SIZE];
+    size_t headerLeft;  // of the frame being sent
+    size_t chunkLeft;
+};
+
+/* A zero-copy send whose pages the kernel still uses */
+struct zerocopySend {
+    struct zerocopySend* next;
+    struct chatMessage* msg;    // holds a reference
+    uint32_t id;
+};
+
+struct connection {
+    struct chat_client client;  // room, outbound queue; closing - DISCONNECT queued
+    int sendScheduled;  // MSG_TO_SEND queued or POLLOUT armed
+    int flushPending;   // in flushList, waiting for the coalesced flush
+    char peer[48];      // "ip:port" or "local", resolved once on connect
+    int fd;
+    uint32_t id;        // sender id in binary frames, never reused
+    enum protocolMode mode;
+    int greeted;        // binary client sent its WIRE_HELLO
+    int multicast;      // gets broadcasts from the multicast group instead
+    shm_channel* shm;   // shared-memory client, see Shared Memory Clients
+    int shmActive;      // WIRE_SHM answer sent, traffic goes through the rings
+    int shmSegmentFd;   // passed with the WIRE_SHM answer, then closed
+    int shmClosed;      // the socket of a shared-memory client became readable
+    unsigned char* inBuf;   // partial binary frames
+    size_t inLen;
+    size_t inCapacity;
+    timer_entry negotiateTimer;
+    token_bucket messageBucket; // ingress limits, see Ingress Rate Limits
+    token_bucket byteBucket;
+    int readsPaused;        // over a limit, POLLIN is off until throttleTimer
+    uint64_t pausedSince;
+    timer_entry throttleTimer;
+    int zerocopy;           // SO_ZEROCOPY is on, see Zero-Copy Sends
+    uint32_t zerocopyNext;  // id the kernel gives the next zero-copy send
+    struct zerocopySend* zerocopyHead;  // sends the kernel did not release yet
+    struct zerocopySend* zerocopyTail;
+    struct spoolFile* upload;   // see File Transfer, NULL - no upload
+    int uploadFd;
+    int uploadPipe[2];          // socket to file without user space
+    size_t uploadFrameLeft;     // content of the WIRE_FILE_DATA frame still to come
+    struct fileStream* downloadHead;
+    struct fileStream* downloadTail;
+    int downloadCount;
+    token_bucket fileBucket;
+    timer_entry fileTimer;
+    int presenceSnapshot;   // gets the members of its room with the next presence batch
+};
+
+uint32_t nextConnectionId = 1;  // 0 is the server
+
+/* Federated servers put their node id into the top bits */
+uint32_t allocateConnectionId(){
+    if(isFederated()){
+        return ((uint32_t) server_config.node_id << FEDERATION_NODE_SHIFT)
+               | (nextConnectionId++ & ((1U << FEDERATION_NODE_SHIFT) - 1));
+    }
+    return bus != NULL ? broadcast_log_next_id(bus) : nextConnectionId++;
+}
+
+/* Connections are allocated once per fd and never move,
+ * their timers stay linked into the wheel in place      */
+struct connection** connections = NULL;
+int connectionCapacity = 0;
+chat_core chat;     // rooms and outbound queues of the local clients
+
+/* Buffers on demand: an idle connection holds nothing but
+ * its struct. The input buffer is attached while a binary
+ * client has a partial frame, queue entries while data is
+ * unsent. Both come from bounded free lists, so a busy
+ * server recycles them instead of going to malloc.      */
+#define INPUT_BUFFER_SIZE 4096
+#define POOL_MAX          1024
+
+struct freeBlock {
+    struct freeBlock* next;
+};
+
+struct blockPool {
+    struct freeBlock* head;
+    int count;                  // blocks on the free list
+    size_t size;
+    unsigned long long inUse;
+    unsigned long long reused;
+    unsigned long long allocated;
+};
+struct blockPool inputPool = {NULL, 0, INPUT_BUFFER_SIZE, 0, 0, 0};
+struct blockPool zerocopyPool = {NULL, 0, sizeof(struct zerocopySend), 0, 0, 0};
+
+void* poolGet(struct blockPool* pool){
+    struct freeBlock* block = pool->head;
+    if(block != NULL){
+        pool->head = block->next;
+        pool->count--;
+        pool->reused++;
+    }else{
+        block = malloc(pool->size);
+        if(block == NULL){
+            print_error("  poolGet: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        pool->allocated++;
+    }
+    pool->inUse++;
+    return block;
+}
+
+void poolPut(struct blockPool* pool, void* memory){
+    pool->inUse--;
+    if(pool->count == POOL_MAX){
+        free(memory);
+        return;
+    }
+    struct freeBlock* block = memory;
+    block->next = pool->head;
+    pool->head = block;
+    pool->count++;
+}
+
+struct sendStats {
+    unsigned long long calls;           // sendmsg() system calls
+    unsigned long long messages;        // messages completely written
+    unsigned long long bytes;
+    unsigned long long flushes;         // coalesced flush rounds
+};
+struct sendStats sndStats;
+
+/* Coalescing: connections with new messages collect here
+ * and are flushed together at the end of a loop iteration
+ * once the oldest of them waited coalesce_budget_us     */
+int* flushList = NULL;
+int flushCount = 0;
+int flushCapacity = 0;
+uint64_t flushDeadline = 0;
+
+/* The eventfds of shared-memory clients sit in fds[] too,
+ * this maps them to the fd of the client they wake        */
+int* wakeOwners = NULL;
+int wakeCapacity = 0;
+
+int wakeOwner(int fd){
+    return fd < wakeCapacity ? wakeOwners[fd] : -1;
+}
+
+/* Everything in fds[] that is neither the terminal, a listener nor an eventfd */
+int isClientFd(int fd){
+    return fd != 0 && fd != listen_sd && fd != unix_listen_sd && fd != busWakeFd && wakeOwner(fd) < 0
+           && fd != federationListenSd && findLink(fd) == NULL && fd != handoffListenSd;
+}
+
+struct connection* getConnection(int fd){
+    if(fd >= connectionCapacity){
+        int newCapacity = connectionCapacity == 0 ? 256 : connectionCapacity;
+        while(newCapacity <= fd){
+            newCapacity *= 2;
+        }
+        struct connection** grown = realloc(connections, newCapacity * sizeof(struct connection*));
+        if(grown == NULL){
+            print_error("  getConnection: could not grow connection table");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + connectionCapacity, 0, (newCapacity - connectionCapacity) * sizeof(struct connection*));
+        connections = grown;
+        connectionCapacity = newCapacity;
+    }
+    if(connections[fd] == NULL){
+        connections[fd] = calloc(1, sizeof(struct connection));
+        if(connections[fd] == NULL){
+            print_error("  getConnection: could not allocate connection");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return connections[fd];
+}
+
+int findPollIndex(int fd){
+    return fd >= 0 && fd < pollIndexCapacity ? pollIndex[fd] : -1;
+}
+
+void setPollIndex(int fd, int index){
+    if(fd >= pollIndexCapacity){
+        int newCapacity = pollIndexCapacity == 0 ? 256 : pollIndexCapacity;
+        while(newCapacity <= fd){
+            newCapacity *= 2;
+        }
+        int* grown = realloc(pollIndex, newCapacity * sizeof(int));
+        if(grown == NULL){
+            print_error("  setPollIndex: could not grow descriptor map");
+            exit(EXIT_FAILURE);
+        }
+        for(int k = pollIndexCapacity; k < newCapacity; k++){
+            grown[k] = -1;
+        }
+        pollIndex = grown;
+        pollIndexCapacity = newCapacity;
+    }
+    pollIndex[fd] = index;
+}
+
+void growPollTable(){
+    int newCapacity = pollCapacity == 0 ? 64 : pollCapacity * 2;
+    if(newCapacity > maxPollFds){
+        newCapacity = maxPollFds;
+    }
+    struct pollfd* grownFds = realloc(fds, newCapacity * sizeof(struct pollfd));
+    if(grownFds == NULL){
+        print_error("  growPollTable: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    fds = grownFds;
+    pollCapacity = newCapacity;
+}
+
+/* fds[] lists what the reactor watches; revents is
+ * filled in from the reactor's report. Callers check
+ * maxPollFds, the setup stays within POLL_RESERVED.   */
+void addPollFd(int fd){
+    if(nfds == pollCapacity){
+        growPollTable();
+    }
+    fds[nfds].fd = fd;
     fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    setPollIndex(fd, (int) nfds);
     nfds++;
+    if(reactor_add(ioReactor, fd, REACTOR_READ, NULL) < 0){
+        // epoll refuses regular files, e.g. a terminal redirected from /dev/null
+        LOG_WARN("FD %d cannot be watched by the %s reactor: %s\n", fd,
+                 reactor_backend_name(reactor_get_backend(ioReactor)), strerror(errno));
+    }
+}
+
+/* Called from the SIGUSR1 handler */
+void wakeReactor(void* argument){
+    reactor_wakeup(argument);
+}
+
+/* Must come before close(), see reactor_remove() */
+void removePollFd(int fd){
+    int index = findPollIndex(fd);
+    if(index < 0){
+        return;
+    }
+    reactor_remove(ioReactor, fd);
+    setPollIndex(fd, -1);
+    nfds--;
+    if(index < nfds){
+        fds[index] = fds[nfds];
+        setPollIndex(fds[index].fd, index);
+    }
+}
+
+/* Switches one poll event of fd on or off in fds[] and
+ * in the reactor                                        */
+void setPollEvent(int fd, short event, int enabled){
+    int index = findPollIndex(fd);
+    if(index < 0){
+        return;
+    }
+    short events = enabled ? (fds[index].events | event) : (fds[index].events & ~event);
+    if(events != fds[index].events){
+        fds[index].events = events;
+        reactor_modify(ioReactor, fd, ((events & POLLIN) ? REACTOR_READ : 0) | ((events & POLLOUT) ? REACTOR_WRITE : 0),
+                       NULL);
+    }
+}
+
+void setPollOut(int fd, int enabled){
+    setPollEvent(fd, POLLOUT, enabled);
+}
+
+/* Reads of a rate limited client are paused by dropping
+ * POLLIN, errors and hangups are still reported         */
+void setPollIn(int fd, int enabled){
+    setPollEvent(fd, POLLIN, enabled);
+}
+
+/*******************************************************/
+/* Event Queue                                         */
+/*******************************************************/
+/* One FIFO per priority class. Under a large fanout the
+ * sends would bury an accept or a disconnect, so a round
+ * first runs the control events and then alternates
+ * batches of receives and sends by weight: a receive
+ * fans out into many sends, each of them cheap. A round
+ * only runs what was queued before it, events that keep
+ * requeueing themselves would block the loop otherwise.
+ * Disconnects are the exception: one queued by a handler
+ * runs before the next batch, and the receives and sends
+ * still queued for that connection are dropped unread.
+ * Only receives and control events are dropped when their
+ * queue is full, the poll loop reports them again. A send
+ * or disconnect is queued at most once per connection and
+ * its caller already set sendScheduled or closing, so
+ * those queues grow instead; losing one would wedge the
+ * connection for good.                                  */
+enum eventClass {
+    CLASS_DISCONNECT,
+    CLASS_CONTROL,      // NEW_CONNECTION, KEYPRESS
+    CLASS_RECEIVE,
+    CLASS_SEND,
+    EVENT_CLASS_COUNT
+};
+
+#define RECEIVE_WEIGHT   32
+#define SEND_WEIGHT      128
+
+struct eventQueue {
+    struct event** slots;
+    int capacity;
+    int front;
+    int count;
+};
+
+struct queueStats {
+    unsigned long long dispatched[EVENT_CLASS_COUNT];
+    unsigned long long stale[EVENT_CLASS_COUNT];    // connection closed or replaced while queued
+    unsigned long long dropped[EVENT_CLASS_COUNT];  // queue full
+    int maxDepth[EVENT_CLASS_COUNT];
+};
+struct queueStats qStats;
+
+const int qmax = 1000000;   // per class, receives and control events
+struct eventQueue eventQueues[EVENT_CLASS_COUNT];
+int qCount = 0;             // all classes
+
+int eventClassOf(e_type type){
+    switch(type){
+        case DISCONNECT: return CLASS_DISCONNECT;
+        case MSG_RECEIVED: return CLASS_RECEIVE;
+        case MSG_TO_SEND: return CLASS_SEND;
+        default: return CLASS_CONTROL;
+    }
+}
+
+int qIsFull(const struct eventQueue* queue, int eventClass){
+    return (eventClass == CLASS_RECEIVE || eventClass == CLASS_CONTROL) && queue->count >= qmax;
+}
+
+void qInsert(struct event* val){
+    int eventClass = eventClassOf(val->type);
+    struct eventQueue* queue = &eventQueues[eventClass];
+    if(qIsFull(queue, eventClass)){
+        qStats.dropped[eventClass]++;
+        destroyEvent(val);
+        return;
+    }
+    if(queue->count == queue->capacity){
+        int newCapacity = queue->capacity == 0 ? 1024 : queue->capacity * 2;
+        struct event** grown = malloc((size_t) newCapacity * sizeof(struct event*));
+        if(grown == NULL){
+            print_error("  qInsert: could not grow event queue");
+            exit(EXIT_FAILURE);
+        }
+        for(int k = 0; k < queue->count; k++){
+            grown[k] = queue->slots[(queue->front + k) % queue->capacity];
+        }
+        free(queue->slots);
+        queue->slots = grown;
+        queue->capacity = newCapacity;
+        queue->front = 0;
+    }
+
+    /* Receives and sends belong to the connection at fd now */
+    if(eventClass == CLASS_RECEIVE || eventClass == CLASS_SEND){
+        val->connectionId = getConnection(val->fd)->id;
+    }
+    queue->slots[(queue->front + queue->count) % queue->capacity] = val;
+    queue->count++;
+    qCount++;
+    if(queue->count > qStats.maxDepth[eventClass]){
+        qStats.maxDepth[eventClass] = queue->count;
+    }
+    if(eventTrace != NULL && val->external){
+        traceRecord(EVENT_TRACE_INSERT, (uint8_t) val->type, val->fd, (uint32_t) val->msglen, NULL);
+    }
+}
+
+struct event* qRemove(struct eventQueue* queue){
+    if(queue->count == 0){
+        print_error("  qRemove failed: queue is empty!");
+        return NULL;
+    }
+    struct event* val = queue->slots[queue->front];
+    queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
+    qCount--;
+    return val;
+}
+
+/* A receive or send for a connection that is closing,
+ * closed or whose fd went to a new client since        */
+int isStale(const struct event* evp){
+    if(findPollIndex(evp->fd) < 0){
+        return TRUE;
+    }
+    struct connection* conn = getConnection(evp->fd);
+    return conn->client.closing || conn->id != evp->connectionId;
+}
+
+void dispatchEvent(struct event* event){
+    //printf("Handling event %s - overall %d subscriptions\n", getEventName(event->type), subscrCounter);
+    e_type type = event->type;
+    uint64_t dispatched = monotonic_time_ns();
+    latency_histogram_record(&queueWaitHistograms[type], dispatched - event->created_ns);
+    if(eventTrace != NULL){
+        traceDispatch(event, dispatched);
+    }
 
-    char* msg = malloc(1024*sizeof(char));
-    sprintf(msg, "FD %d has entered the chat room.\n", new_sd);
-    printf("%s", msg);
+    for(int j=0; j<subscrCounter; j++){
+        if(subscriptions[j]->type == type){
+            //printf("Found subscription\n");
+            subscriptions[j]->cb(event);
+            //printf("Subscription handled\n");
+        }
+    }
+
+    latency_histogram_record(&handlerHistograms[type], monotonic_time_ns() - dispatched);
+}
+
+/* Runs up to limit events of a class, returns how many it took */
+int dispatchClass(int eventClass, int limit){
+    int taken = 0;
+    while(taken < limit && eventQueues[eventClass].count > 0){
+        struct event* event = qRemove(&eventQueues[eventClass]);
+        taken++;
+        if((eventClass == CLASS_RECEIVE || eventClass == CLASS_SEND) && isStale(event)){
+            qStats.stale[eventClass]++;
+            destroyEvent(event);
+            continue;
+        }
+        qStats.dispatched[eventClass]++;
+        dispatchEvent(event);
+    }
+    return taken;
+}
+
+/* Runs the handlers of the queued events, see above */
+void dispatchEvents(){
+    if(eventTrace != NULL && qCount > 0){
+        traceRecord(EVENT_TRACE_ROUND, 0, -1, 0, NULL);
+    }
+    dispatching = TRUE;
+    int receives = eventQueues[CLASS_RECEIVE].count;
+    int sends = eventQueues[CLASS_SEND].count;
+
+    dispatchClass(CLASS_DISCONNECT, INT_MAX);
+    dispatchClass(CLASS_CONTROL, eventQueues[CLASS_CONTROL].count);
+    while(receives > 0 || sends > 0){
+        dispatchClass(CLASS_DISCONNECT, INT_MAX);
+        receives -= dispatchClass(CLASS_RECEIVE, receives < RECEIVE_WEIGHT ? receives : RECEIVE_WEIGHT);
+        dispatchClass(CLASS_DISCONNECT, INT_MAX);
+        sends -= dispatchClass(CLASS_SEND, sends < SEND_WEIGHT ? sends : SEND_WEIGHT);
+    }
+    dispatchClass(CLASS_DISCONNECT, INT_MAX);
+    dispatching = FALSE;
+}
+
+void printQueueStats(FILE* stream){
+    static const char* names[EVENT_CLASS_COUNT] = {"disconnect", "control", "receive", "send"};
+    for(int c = 0; c < EVENT_CLASS_COUNT; c++){
+        fprintf(stream, "%s dispatched=%llu stale=%llu dropped=%llu queued=%d max_depth=%d\n", names[c],
+                qStats.dispatched[c], qStats.stale[c], qStats.dropped[c], eventQueues[c].count, qStats.maxDepth[c]);
+    }
+}
+
+void queueDisconnect(int fd){
+    struct connection* conn = getConnection(fd);
+    if(!conn->client.closing){
+        conn->client.closing = TRUE;
+        qInsert(createEvent(DISCONNECT, fd, "", 0));
+    }
+}
+
+void clearOutbound(struct connection* conn){
+    chat_core_clear(&chat, &conn->client);
+}
+
+void scheduleSend(int fd, struct connection* conn){
+    if(conn->sendScheduled || conn->flushPending || conn->mode == PROTOCOL_UNDECIDED){
+        return;
+    }
+    if(server_config.coalesce_sends){
+        if(flushCount == flushCapacity){
+            flushCapacity = flushCapacity == 0 ? 64 : flushCapacity * 2;
+            flushList = realloc(flushList, flushCapacity * sizeof(int));
+            if(flushList == NULL){
+                print_error("  queueSend: could not grow flush list");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(flushCount == 0){
+            flushDeadline = monotonic_time_ns() + server_config.coalesce_budget_us * 1000ULL;
+        }
+        conn->flushPending = TRUE;
+        flushList[flushCount++] = fd;
+    }else{
+        conn->sendScheduled = TRUE;
+        qInsert(createEvent(MSG_TO_SEND, fd, NULL, 0));
+    }
+}
+
+/* The chat core keeps the queue and applies the policy,
+ * these let it handle chatMessages and connections      */
+struct connection* connectionOf(struct chat_client* client){
+    return (struct connection*) ((char*) client - offsetof(struct connection, client));
+}
+
+struct chatMessage* queuedMessage(const struct chat_out* out){
+    return out->message;
+}
+
+void retainQueued(void* msg){
+    ((struct chatMessage*) msg)->refs++;
+}
+
+void releaseQueued(void* msg){
+    releaseMessage(msg);
+}
+
+void encodeQueued(struct chat_client* client, void* msg, const char** data, size_t* len){
+    getEncoding(msg, connectionOf(client)->mode, data, len);
+}
+
+void scheduleQueued(struct chat_client* client){
+    struct connection* conn = connectionOf(client);
+    scheduleSend(conn->fd, conn);
+}
+
+void disconnectQueued(struct chat_client* client){
+    queueDisconnect(connectionOf(client)->fd);
+}
+
+void* heartbeatQueued(struct chat_client* client){
+    return createMessage(WIRE_HEARTBEAT, client->room, 0, 0, "", NULL, 0);
+}
+
+/* Queues msg (a reference is taken) for fd and applies
+ * the backpressure policy if the client does not keep up */
+void queueSend(int fd, struct chatMessage* msg){
+    chat_core_queue(&chat, &getConnection(fd)->client, msg);
+}
+
+/* Answers the client waits for bypass the policy, a
+ * dropped one would leave it hanging                   */
+void queueControl(int fd, struct chatMessage* msg){
+    chat_core_queue_control(&chat, &getConnection(fd)->client, msg);
+}
+
+/*******************************************************/
+/* Presence Deltas                                     */
+/*******************************************************/
+/* With --presence-interval, joins and leaves are not
+ * delivered one by one but noted for their room, and
+ * once per interval each room gets one WIRE_PRESENCE of
+ * who joined and who left. N clients reconnecting then
+ * cost N notes and one pass over the connections per
+ * interval, not N broadcasts to N clients. Those from
+ * other workers and federated servers are noted alike.
+ * With --presence-snapshot, a client that entered a
+ * room gets the members instead of the delta.          */
+#define PRESENCE_IDS_PER_FRAME ((WIRE_MAX_PAYLOAD - WIRE_PRESENCE_SIZE) / sizeof(uint32_t))
+#define ROOM_COUNT             65536
+
+struct memberList {
+    uint32_t* ids;
+    int* fds;           // for the text line
+    size_t count;
+    size_t capacity;
+};
+
+struct frameList {
+    struct chatMessage** items;
+    size_t count;
+    size_t capacity;
+};
+
+struct presenceDelta {
+    uint16_t room;
+    int snapshots;              // newcomers waiting for the members
+    struct memberList joined;
+    struct memberList left;
+    struct memberList members;  // collected only for snapshots
+    struct frameList delta;
+    struct frameList snapshot;
+};
+
+/* Entries past deltaCount keep their buffers for later intervals */
+struct presenceDelta* deltas = NULL;
+size_t deltaCount = 0;
+size_t deltaCapacity = 0;
+int32_t* deltaOfRoom = NULL;    // by room, -1 - nothing noted
+timer_entry presenceTimer;
+unsigned char presencePayload[WIRE_MAX_PAYLOAD];
+
+struct presenceStats {
+    unsigned long long joins;
+    unsigned long long leaves;
+    unsigned long long batches;
+    unsigned long long frames;      // WIRE_PRESENCE built, each shared by a room
+    unsigned long long deltas;      // batches queued to a client
+    unsigned long long snapshots;
+};
+struct presenceStats prStats;
+
+int presenceBatched(){
+    return server_config.presence_interval_ms > 0;
+}
+
+void appendMember(struct memberList* list, uint32_t id, int fd){
+    if(list->count == list->capacity){
+        size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        uint32_t* ids = realloc(list->ids, capacity * sizeof(uint32_t));
+        int* fds = ids == NULL ? NULL : realloc(list->fds, capacity * sizeof(int));
+        if(fds == NULL){
+            print_error("  appendMember: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        list->ids = ids;
+        list->fds = fds;
+        list->capacity = capacity;
+    }
+    list->ids[list->count] = id;
+    list->fds[list->count] = fd;
+    list->count++;
+}
+
+void appendFrame(struct frameList* list, struct chatMessage* msg){
+    if(list->count == list->capacity){
+        size_t capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        struct chatMessage** items = realloc(list->items, capacity * sizeof(struct chatMessage*));
+        if(items == NULL){
+            print_error("  appendFrame: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = msg;
+}
+
+/* The delta of a room in this interval, started on demand */
+struct presenceDelta* roomDelta(uint16_t room){
+    if(deltaOfRoom == NULL){
+        deltaOfRoom = malloc(ROOM_COUNT * sizeof(int32_t));
+        if(deltaOfRoom == NULL){
+            print_error("  roomDelta: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        memset(deltaOfRoom, 0xff, ROOM_COUNT * sizeof(int32_t));
+    }
+    if(deltaOfRoom[room] >= 0){
+        return &deltas[deltaOfRoom[room]];
+    }
+
+    if(deltaCount == deltaCapacity){
+        size_t capacity = deltaCapacity == 0 ? 4 : deltaCapacity * 2;
+        struct presenceDelta* grown = realloc(deltas, capacity * sizeof(struct presenceDelta));
+        if(grown == NULL){
+            print_error("  roomDelta: out of memory");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + deltaCapacity, 0, (capacity - deltaCapacity) * sizeof(struct presenceDelta));
+        deltas = grown;
+        deltaCapacity = capacity;
+    }
+    if(deltaCount == 0){
+        timer_wheel_arm(&timers, &presenceTimer,
+                        monotonic_time_ns() + (uint64_t) server_config.presence_interval_ms * 1000000ULL);
+    }
+    deltaOfRoom[room] = (int32_t) deltaCount;
+    struct presenceDelta* delta = &deltas[deltaCount++];
+    delta->room = room;
+    return delta;
+}
+
+/* Takes the place of delivering a WIRE_JOIN or WIRE_LEAVE */
+void notePresence(const struct chatMessage* msg){
+    struct presenceDelta* delta = roomDelta(msg->header.room);
+    if(msg->header.type == WIRE_JOIN){
+        appendMember(&delta->joined, msg->header.sender, msg->senderFd);
+        prStats.joins++;
+    }else{
+        appendMember(&delta->left, msg->header.sender, msg->senderFd);
+        prStats.leaves++;
+    }
+}
+
+/* A client entered conn->client.room, the next batch tells it who is there */
+void requestSnapshot(struct connection* conn){
+    if(!presenceBatched() || !server_config.presence_snapshot){
+        return;
+    }
+    conn->presenceSnapshot = TRUE;
+    roomDelta(conn->client.room)->snapshots++;
+}
+
+/* Splits joined and left over as many WIRE_PRESENCE as
+ * needed; only the first carries the text line         */
+void buildPresence(struct frameList* out, uint16_t room, uint32_t flags,
+                   const struct memberList* joined, const struct memberList* left){
+    size_t j = 0;
+    size_t l = 0;
+    while(j < joined->count || l < left->count){
+        size_t joinedPart = joined->count - j < PRESENCE_IDS_PER_FRAME ? joined->count - j : PRESENCE_IDS_PER_FRAME;
+        size_t leftPart = left->count - l < PRESENCE_IDS_PER_FRAME - joinedPart ? left->count - l
+                                                                                : PRESENCE_IDS_PER_FRAME - joinedPart;
+        int more = j + joinedPart < joined->count || l + leftPart < left->count;
+        uint32_t fields[3] = {htonl(flags | (more ? WIRE_PRESENCE_MORE : 0)),
+                              htonl((uint32_t) joinedPart), htonl((uint32_t) leftPart)};
+        memcpy(presencePayload, fields, sizeof(fields));
+        size_t len = WIRE_PRESENCE_SIZE;
+        for(size_t k = 0; k < joinedPart; k++, len += sizeof(uint32_t)){
+            uint32_t id = htonl(joined->ids[j + k]);
+            memcpy(presencePayload + len, &id, sizeof(id));
+        }
+        for(size_t k = 0; k < leftPart; k++, len += sizeof(uint32_t)){
+            uint32_t id = htonl(left->ids[l + k]);
+            memcpy(presencePayload + len, &id, sizeof(id));
+        }
+
+        struct chatMessage* msg = createMessage(WIRE_PRESENCE, room, 0, 0, "", (const char*) presencePayload, len);
+        if(out->count == 0){
+            int textLen = flags & WIRE_PRESENCE_SNAPSHOT
+                          ? chat_format_roster(&msg->text, joined->fds, joined->count)
+                          : chat_format_presence(&msg->text, joined->fds, joined->count, left->fds, left->count);
+            if(textLen < 0){
+                print_error("  buildPresence: out of memory");
+                exit(EXIT_FAILURE);
+            }
+            msg->textLen = (size_t) textLen;
+        }
+        appendFrame(out, msg);
+        prStats.frames++;
+        j += joinedPart;
+        l += leftPart;
+    }
+}
+
+/* Text clients get the line of the first frame only */
+void queuePresence(int fd, const struct connection* conn, const struct frameList* frames){
+    size_t count = conn->mode == PROTOCOL_BINARY ? frames->count : (frames->count > 0 ? 1 : 0);
+    for(size_t k = 0; k < count; k++){
+        queueSend(fd, frames->items[k]);
+    }
+}
+
+void releaseFrames(struct frameList* frames){
+    for(size_t k = 0; k < frames->count; k++){
+        releaseMessage(frames->items[k]);
+    }
+    frames->count = 0;
+}
+
+/* Due once per interval that noted something */
+void flushPresence(timer_entry* timer){
+    (void) timer;
+    prStats.batches++;
+
+    /* One pass collects the members of rooms with newcomers,
+     * a second one queues every client its room's batch    */
+    int snapshots = FALSE;
+    for(size_t k = 0; k < deltaCount; k++){
+        snapshots |= deltas[k].snapshots > 0;
+    }
+    for(size_t j = 0; snapshots && j < chat.count; j++){
+        int32_t index = deltaOfRoom[chat.members[j].room];
+        if(chat.members[j].recipient && index >= 0 && deltas[index].snapshots > 0){
+            struct connection* conn = connectionOf(chat.members[j].client);
+            appendMember(&deltas[index].members, conn->id, conn->fd);
+        }
+    }
+    for(size_t k = 0; k < deltaCount; k++){
+        struct presenceDelta* delta = &deltas[k];
+        buildPresence(&delta->delta, delta->room, 0, &delta->joined, &delta->left);
+        if(delta->snapshots > 0){
+            struct memberList none = {NULL, NULL, 0, 0};
+            buildPresence(&delta->snapshot, delta->room, WIRE_PRESENCE_SNAPSHOT, &delta->members, &none);
+        }
+    }
+
+    for(size_t j = 0; j < chat.count; j++){
+        int32_t index = deltaOfRoom[chat.members[j].room];
+        if(!chat.members[j].recipient || index < 0){
+            continue;
+        }
+        struct connection* conn = connectionOf(chat.members[j].client);
+        if(conn->presenceSnapshot){
+            conn->presenceSnapshot = FALSE;
+            queuePresence(conn->fd, conn, &deltas[index].snapshot);
+            prStats.snapshots++;
+        }else{
+            queuePresence(conn->fd, conn, &deltas[index].delta);
+            prStats.deltas++;
+        }
+    }
+
+    for(size_t k = 0; k < deltaCount; k++){
+        struct presenceDelta* delta = &deltas[k];
+        releaseFrames(&delta->delta);
+        releaseFrames(&delta->snapshot);
+        delta->joined.count = 0;
+        delta->left.count = 0;
+        delta->members.count = 0;
+        delta->snapshots = 0;
+        deltaOfRoom[delta->room] = -1;
+    }
+    deltaCount = 0;
+}
+
+void printPresenceStats(FILE* stream){
+    fprintf(stream, "interval_ms=%d snapshot=%d joins=%llu leaves=%llu batches=%llu frames=%llu "
+                    "deltas_queued=%llu snapshots_queued=%llu\n",
+            server_config.presence_interval_ms, server_config.presence_snapshot, prStats.joins, prStats.leaves,
+            prStats.batches, prStats.frames, prStats.deltas, prStats.snapshots);
+}
+
+/* Joins and leaves are noted for the next batch instead */
+int takePresence(struct chatMessage* msg){
+    if(presenceBatched() && (msg->header.type == WIRE_JOIN || msg->header.type == WIRE_LEAVE)){
+        notePresence(msg);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Server messages (sender 0) reach all rooms */
+int messageRoom(const struct chatMessage* msg){
+    return msg->header.sender == 0 ? CHAT_ROOM_ALL : msg->header.room;
+}
+
+const struct chat_client* clientOf(int fd){
+    return fd >= 0 && fd < connectionCapacity && connections[fd] != NULL ? &connections[fd]->client : NULL;
+}
+
+/* Queues msg for every local client in its room except
+ * one. Multicast listeners get it from the group.       */
+void deliverLocal(struct chatMessage* msg, int exceptFd){
+    if(!takePresence(msg)){
+        chat_core_deliver(&chat, msg, messageRoom(msg), clientOf(exceptFd));
+    }
+}
+
+/* Before the chat core delivers a broadcast locally it
+ * goes to the group, the other workers and the peers    */
+int publishMessage(void* message){
+    struct chatMessage* msg = message;
+    publishMulticast(msg);
+    publishBus(msg);
+    forwardToPeers(msg);
+    return takePresence(msg);
+}
+
+const struct chat_core_ops chatOps = {
+    retainQueued, releaseQueued, encodeQueued, scheduleQueued, disconnectQueued, heartbeatQueued,
+    publishMessage
+};
+
+void broadcast(struct chatMessage* msg, int exceptFd){
+    chat_core_broadcast(&chat, msg, messageRoom(msg), clientOf(exceptFd));
+}
+
+/* Called after poll(): delivers what the other workers
+ * broadcast. Their sequence numbers are kept.           */
+void pollBus(){
+    static struct broadcast_record record;
+
+    if(bus == NULL){
+        return;
+    }
+    int index = findPollIndex(busWakeFd);
+    int signalled = index >= 0 && (fds[index].revents & POLLIN);
+    wkStats.busWakeups += (unsigned long long) signalled;
+    broadcast_log_awake(bus, workerIndex, signalled);
+
+    for(int k=0; k<BUS_READ_BATCH && broadcast_log_read(bus, &busCursor, workerIndex, &record); k++){
+        struct chatMessage* msg = buildMessage(record.type, record.room, record.sender, record.sequence,
+                                               record.sender_fd, record.sender_peer, record.payload, record.length);
+        wkStats.received++;
+        deliverLocal(msg, -1);
+        releaseMessage(msg);
+    }
+}
+
+/* Called before poll() would sleep. Returns TRUE if the
+ * bus holds records and the worker must not sleep.      */
+int prepareBusSleep(){
+    return bus != NULL && broadcast_log_sleep(bus, &busCursor, workerIndex);
+}
+
+/* Fixes the protocol of a connection and releases the
+ * output that was held back while it was undecided      */
+void setProtocol(int fd, struct connection* conn, enum protocolMode mode){
+    conn->mode = mode;
+    if(mode == PROTOCOL_BINARY){
+        protoStats.binaryConnections++;
+
+        /* The server's WIRE_HELLO, with the client's sender id,
+         * goes ahead of everything that was held back          */
+        struct chat_out* held = conn->client.head;
+        struct chat_out* heldTail = conn->client.tail;
+        conn->client.head = NULL;
+        conn->client.tail = NULL;
+        conn->client.queued = 0;
+        struct chatMessage* hello = createMessage(WIRE_HELLO, conn->client.room, conn->id, fd, conn->peer, NULL, 0);
+        queueControl(fd, hello);
+        releaseMessage(hello);
+
+        if(held != NULL){
+            conn->client.tail->next = held;
+            conn->client.tail = heldTail;
+        }
+        chat_core_requeue(&chat, &conn->client);
+    }else{
+        protoStats.textConnections++;
+    }
+    if(conn->client.head != NULL){
+        scheduleSend(fd, conn);
+    }
+}
+
+void printSendStats(FILE* stream){
+    fprintf(stream, "coalesce=%s budget_us=%d send_calls=%llu messages=%llu bytes=%llu "
+                    "messages_per_call=%.2f flushes=%llu\n",
+            server_config.coalesce_sends ? "on" : "off", server_config.coalesce_budget_us,
+            sndStats.calls, sndStats.messages, sndStats.bytes,
+            sndStats.calls ? (double) sndStats.messages / (double) sndStats.calls : 0.0,
+            sndStats.flushes);
+}
+
+void printMemoryStats(FILE* stream){
+    fprintf(stream, "connections=%d max_connections=%d slots=%lu capacity=%d max_slots=%d "
+                    "connection_bytes=%zu input_buffers=%llu input_pooled=%d "
+                    "queue_entries=%llu queue_pooled=%d pool_reuses=%llu pool_allocations=%llu\n",
+            connectionCount, maxConnections, (unsigned long) nfds, pollCapacity, maxPollFds,
+            sizeof(struct connection), inputPool.inUse, inputPool.count,
+            chat.stats.entries, chat.pooled,
+            inputPool.reused + chat.stats.reused, inputPool.allocated + chat.stats.allocated);
+}
+
+void printBackpressureStats(FILE* stream){
+    chat_core_print_stats(&chat, stream);
+}
+
+
+/*******************************************************/
+/* Zero-Copy Sends                                     */
+/*******************************************************/
+/* A message of at least zerocopy_threshold bytes is sent
+ * on its own with MSG_ZEROCOPY: the kernel pins the pages
+ * of the encoding instead of copying it into the socket
+ * once per recipient. The encoding must then stay as it
+ * is until the kernel is done with it, so each such send
+ * keeps a reference to its message. The kernel numbers
+ * the zero-copy sends of a socket from 0 and reports the
+ * ranges it finished on the socket's error queue, which
+ * poll() signals with POLLERR.                          */
+struct zerocopyStats {
+    unsigned long long sends;
+    unsigned long long bytes;
+    unsigned long long notifications;
+    unsigned long long completed;   // sends released by the kernel
+    unsigned long long copied;      // of those, sends the kernel copied after all
+    unsigned long long pending;     // sends not released yet
+    unsigned long long fallbacks;   // ENOBUFS, sent with a copy instead
+};
+struct zerocopyStats zcStats;
+
+void enableZerocopy(int fd, struct connection* conn){
+    int on = 1;
+    /* Fails on Unix domain sockets, they keep copying */
+    conn->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+int wantsZerocopy(const struct connection* conn, const struct chat_out* out){
+    return conn->zerocopy && out->length - out->sent >= server_config.zerocopy_threshold;
+}
+
+/* Keeps msg alive until the kernel released the send */
+void holdZerocopy(struct connection* conn, struct chatMessage* msg){
+    struct zerocopySend* send = poolGet(&zerocopyPool);
+    send->next = NULL;
+    send->msg = msg;
+    send->id = conn->zerocopyNext++;
+    msg->refs++;
+    if(conn->zerocopyTail == NULL){
+        conn->zerocopyHead = send;
+    }else{
+        conn->zerocopyTail->next = send;
+    }
+    conn->zerocopyTail = send;
+    zcStats.pending++;
+}
+
+/* Releases the sends with ids from first to last, which
+ * may wrap around                                       */
+void releaseZerocopy(struct connection* conn, uint32_t first, uint32_t last, int copied){
+    struct zerocopySend* previous = NULL;
+    struct zerocopySend* send = conn->zerocopyHead;
+    while(send != NULL){
+        struct zerocopySend* next = send->next;
+        if(send->id - first <= last - first){
+            if(previous == NULL){
+                conn->zerocopyHead = next;
+            }else{
+                previous->next = next;
+            }
+            if(conn->zerocopyTail == send){
+                conn->zerocopyTail = previous;
+            }
+            releaseMessage(send->msg);
+            poolPut(&zerocopyPool, send);
+            zcStats.pending--;
+            zcStats.completed++;
+            zcStats.copied += copied != 0;
+        }else{
+            previous = send;
+        }
+        send = next;
+    }
+}
+
+/* A closed socket keeps the pages it pinned, only the
+ * references are dropped                                */
+void clearZerocopy(struct connection* conn){
+    while(conn->zerocopyHead != NULL){
+        struct zerocopySend* send = conn->zerocopyHead;
+        conn->zerocopyHead = send->next;
+        releaseMessage(send->msg);
+        poolPut(&zerocopyPool, send);
+        zcStats.pending--;
+    }
+    conn->zerocopyTail = NULL;
+}
+
+/* Reads the error queue after POLLERR. Returns 0 if it
+ * only held zero-copy notifications, -1 on a real error */
+int reapErrorQueue(int fd, struct connection* conn){
+    for(;;){
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &header, MSG_ERRQUEUE) < 0){
+            break;
+        }
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)){
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+               && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)){
+                continue;
+            }
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if(error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0){
+                return -1;
+            }
+            zcStats.notifications++;
+            releaseZerocopy(conn, error.ee_info, error.ee_data, error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+
+    /* POLLERR is also how a reset connection shows */
+    int pending = 0;
+    socklen_t length = sizeof(pending);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &pending, &length) != 0 || pending != 0){
+        return -1;
+    }
+    return 0;
+}
+
+void printZerocopyStats(FILE* stream){
+    fprintf(stream, "threshold=%zu sends=%llu bytes=%llu notifications=%llu completed=%llu copied=%llu "
+                    "pending=%llu fallbacks=%llu\n",
+            server_config.zerocopy_threshold, zcStats.sends, zcStats.bytes, zcStats.notifications,
+            zcStats.completed, zcStats.copied, zcStats.pending, zcStats.fallbacks);
+}
+
+
+/*******************************************************/
+/* Shared Memory Clients                               */
+/*******************************************************/
+/* A binary client on the Unix domain socket may move to
+ * rings in shared memory (WIRE_SHM). Its outbound queue
+ * then drains into the ring to the client with one copy
+ * per message, and frames it writes are read from the
+ * ring to the server. Neither side makes system calls
+ * while the other is busy: the rings are checked once
+ * per loop iteration, and only before poll() sleeps does
+ * the server ask clients to signal its eventfd.         */
+struct shmStats {
+    unsigned long long handovers;
+    unsigned long long refused;
+    unsigned long long active;
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long ringFull;        // flushes that stopped at a full ring
+    unsigned long long wakeupsReceived;
+    unsigned long long wakeupsSent;     // of closed channels, open ones count their own
+};
+struct shmStats shStats;
+
+void setWakeOwner(int wakeFd, int owner){
+    if(wakeFd >= wakeCapacity){
+        int newCapacity = wakeCapacity == 0 ? 256 : wakeCapacity;
+        while(newCapacity <= wakeFd){
+            newCapacity *= 2;
+        }
+        int* grown = realloc(wakeOwners, newCapacity * sizeof(int));
+        if(grown == NULL){
+            print_error("  setWakeOwner: could not grow eventfd table");
+            exit(EXIT_FAILURE);
+        }
+        for(int k = wakeCapacity; k < newCapacity; k++){
+            grown[k] = -1;
+        }
+        wakeOwners = grown;
+        wakeCapacity = newCapacity;
+    }
+    wakeOwners[wakeFd] = owner;
+}
+
+/* Answers a WIRE_SHM request. The channel is created now,
+ * the answer with its descriptors is queued like any other
+ * message and handed over by flushOutbound().
+ * Returns -1 on a repeated request.                      */
+int requestShm(int fd, struct connection* conn){
+    uint32_t ringSize = 0;
+    int passed[SHM_FD_COUNT];
+
+    if(conn->shm != NULL){
+        return -1;
+    }
+
+    /* Only Unix domain sockets can pass descriptors, and the
+     * eventfd needs a slot in fds[]                         */
+    if(strcmp(conn->peer, "local") == 0 && nfds < maxPollFds){
+        shm_channel* channel = malloc(sizeof(shm_channel));
+        if(channel != NULL && shm_channel_create(channel, server_config.shm_ring_size, passed) == 0){
+            conn->shm = channel;
+            conn->shmSegmentFd = passed[SHM_FD_SEGMENT];
+            ringSize = htonl((uint32_t) channel->tx.capacity);
+        }else{
+            free(channel);
+        }
+    }
+    if(conn->shm == NULL){
+        shStats.refused++;
+    }
+
+    struct chatMessage* reply = createMessage(WIRE_SHM, conn->client.room, 0, 0, "", (const char*) &ringSize,
+                                              conn->shm != NULL ? sizeof(ringSize) : 0);
+    queueControl(fd, reply);
+    releaseMessage(reply);
+    return 0;
+}
+
+/* The queued WIRE_SHM answer that carries the descriptors */
+int isShmHandover(struct connection* conn, struct chat_out* out){
+    return conn->shm != NULL && !conn->shmActive && queuedMessage(out)->header.type == WIRE_SHM;
+}
+
+/* Sends the WIRE_SHM answer at the head of the queue with
+ * the descriptors attached. Everything behind it goes to
+ * the ring. Returns 1 if the socket is full, -1 on error. */
+int handOverShm(int fd, struct connection* conn){
+    struct chat_out* out = conn->client.head;
+    int passed[SHM_FD_COUNT];
+
+    if(nfds == maxPollFds){
+        LOG_WARN("FD %d cannot move to shared memory, connection limit reached\n", fd);
+        return -1;
+    }
+
+    passed[SHM_FD_SEGMENT] = conn->shmSegmentFd;
+    passed[SHM_FD_CLIENT_WAKE] = conn->shm->peer_fd;
+    passed[SHM_FD_SERVER_WAKE] = conn->shm->wake_fd;
+    dataSize = send_with_descriptors(fd, out->data, out->length, passed, SHM_FD_COUNT);
+    sndStats.calls++;
+    if(dataSize < 0){
+        return errno == EWOULDBLOCK || errno == EAGAIN ? 1 : -1;
+    }
+    /* The descriptors arrived with the first byte, the rest
+     * of the answer must not end up in the ring             */
+    if((size_t) dataSize != out->length){
+        return -1;
+    }
+
+    close(conn->shmSegmentFd);
+    conn->shmSegmentFd = -1;
+    conn->shmActive = TRUE;
+    sndStats.bytes += out->length;
+    sndStats.messages += chat_core_sent(&chat, &conn->client, out->length);
+
+    addPollFd(conn->shm->wake_fd);
+    setWakeOwner(conn->shm->wake_fd, fd);
+
+    shStats.handovers++;
+    shStats.active++;
+    LOG_INFO("FD %d moved to shared memory (%llu byte rings)\n", fd, (unsigned long long) conn->shm->tx.capacity);
+    return 0;
+}
+
+/* Copies the outbound queue into the ring to the client.
+ * Returns -1 if the client corrupted the ring.            */
+int flushShm(struct connection* conn){
+    while(conn->client.head != NULL){
+        struct chat_out* out = conn->client.head;
+        ssize_t written = shm_channel_write(conn->shm, out->data + out->sent, out->length - out->sent);
+        if(written < 0){
+            return -1;
+        }
+        if(written == 0){
+            shStats.ringFull++;
+            conn->sendScheduled = TRUE;
+            return 0;
+        }
+
+        chat_core_written(&conn->client);
+        shStats.bytesOut += (unsigned long long) written;
+        sndStats.bytes += (unsigned long long) written;
+        sndStats.messages += chat_core_sent(&chat, &conn->client, (size_t) written);
+    }
+    return 0;
+}
+
+void closeShm(struct connection* conn){
+    if(conn->shm == NULL){
+        return;
+    }
+    if(conn->shmActive){
+        removePollFd(conn->shm->wake_fd);
+        wakeOwners[conn->shm->wake_fd] = -1;
+        shStats.active--;
+    }else{
+        close(conn->shmSegmentFd);
+    }
+    shStats.wakeupsSent += conn->shm->wakeups_sent;
+    shm_channel_close(conn->shm);
+    free(conn->shm);
+    conn->shm = NULL;
+}
+
+/* Called after poll(): withdraws the sleep announcements
+ * and queues work for every client whose rings changed   */
+void pollShmRings(){
+    for(int k=0; k<nfds; k++){
+        int owner = wakeOwner(fds[k].fd);
+        if(owner < 0){
+            continue;
+        }
+        struct connection* conn = getConnection(owner);
+        int signalled = (fds[k].revents & POLLIN) != 0;
+        shStats.wakeupsReceived += (unsigned long long) signalled;
+        shm_channel_awake(conn->shm, signalled);
+
+        if(shm_channel_readable(conn->shm) > 0){
+            qInsert(createEvent(MSG_RECEIVED, owner, "", 0));
+        }
+        if(conn->sendScheduled && shm_channel_writable(conn->shm) > 0){
+            qInsert(createEvent(MSG_TO_SEND, owner, NULL, 0));
+        }
+    }
+}
+
+/* Called before poll() would sleep: asks every client to
+ * signal its eventfd. Returns TRUE if a ring changed in
+ * the meantime and the server must not sleep.            */
+int prepareShmSleep(){
+    int ready = FALSE;
+    for(int k=0; k<nfds; k++){
+        int owner = wakeOwner(fds[k].fd);
+        if(owner >= 0 && shm_channel_sleep(getConnection(owner)->shm, getConnection(owner)->sendScheduled)){
+            ready = TRUE;
+        }
+    }
+    return ready;
+}
+
+void printShmStats(FILE* stream){
+    unsigned long long wakeupsSent = shStats.wakeupsSent;
+    for(int k=0; k<nfds; k++){
+        int owner = wakeOwner(fds[k].fd);
+        if(owner >= 0){
+            wakeupsSent += getConnection(owner)->shm->wakeups_sent;
+        }
+    }
+    fprintf(stream, "ring_size=%zu handovers=%llu refused=%llu active=%llu bytes_in=%llu bytes_out=%llu "
+                    "ring_full=%llu wakeups_received=%llu wakeups_sent=%llu\n",
+            server_config.shm_ring_size, shStats.handovers, shStats.refused, shStats.active,
+            shStats.bytesIn, shStats.bytesOut, shStats.ringFull, shStats.wakeupsReceived, wakeupsSent);
+}
+
+/*******************************************************/
+/* Connection Timers                                   */
+/*******************************************************/
+/* The chat core runs idle disconnects, heartbeats and
+ * write stalls on the wheel, see chat_core.h; these
+ * are the timers of the binary protocol and the limits */
+
+void onNegotiationTimeout(timer_entry* timer){
+    struct connection* conn = timer->context;
+    if(conn->mode == PROTOCOL_UNDECIDED){
+        setProtocol(conn->fd, conn, PROTOCOL_TEXT);
+    }
+}
+
+
+/*******************************************************/
+/* Ingress Rate Limits                                 */
+/*******************************************************/
+/* Every client has a token bucket for messages and one
+ * for bytes per second, each holding one second worth.
+ * They are refilled lazily from the wheel's clock, which
+ * moves once per loop iteration, and checked before a
+ * read: a client over a limit is not disconnected, its
+ * reads are paused until the buckets refilled. Its data
+ * waits in the socket buffer and TCP flow control slows
+ * the sender down. A read may overdraw the buckets (a
+ * chunk of binary frames holds several messages); the
+ * debt lengthens the next pause.                         */
+struct rateLimitStats {
+    unsigned long long pauses;
+    unsigned long long pausedNs;    // of finished pauses
+    unsigned long long pausedNow;
+};
+struct rateLimitStats rlStats;
+
+/* Time of the current wheel tick, a clock without a syscall */
+uint64_t wheelTime(){
+    return timers.start_ns + timers.current * timers.tick_ns;
+}
+
+void initRateLimits(struct connection* conn){
+    uint64_t now = wheelTime();
+    token_bucket_init(&conn->messageBucket, server_config.rate_messages, server_config.rate_messages, now);
+    token_bucket_init(&conn->byteBucket, (double) server_config.rate_bytes, (double) server_config.rate_bytes, now);
+}
+
+int rateLimited(){
+    return server_config.rate_messages > 0 || server_config.rate_bytes > 0;
+}
+
+void onThrottleExpired(timer_entry* timer){
+    struct connection* conn = timer->context;
+    conn->readsPaused = FALSE;
+    rlStats.pausedNow--;
+    rlStats.pausedNs += monotonic_time_ns() - conn->pausedSince;
+    /* Level-triggered: data that waited is reported again */
+    setPollIn(conn->fd, TRUE);
+}
+
+/* Refills the buckets and returns how many bytes the
+ * next read may take, 0 after pausing the client       */
+size_t admitRead(struct connection* conn, size_t capacity){
+    uint64_t now = wheelTime();
+    token_bucket_refill(&conn->messageBucket, now);
+    token_bucket_refill(&conn->byteBucket, now);
+    if(token_bucket_ready(&conn->messageBucket, 1) && token_bucket_ready(&conn->byteBucket, 1)){
+        if(server_config.rate_bytes > 0 && conn->byteBucket.tokens < (double) capacity){
+            capacity = (size_t) conn->byteBucket.tokens;
+        }
+        return capacity;
+    }
+
+    uint64_t messageDelay = token_bucket_delay_ns(&conn->messageBucket, 1);
+    uint64_t byteDelay = token_bucket_delay_ns(&conn->byteBucket, 1);
+    conn->readsPaused = TRUE;
+    conn->pausedSince = monotonic_time_ns();
+    rlStats.pauses++;
+    rlStats.pausedNow++;
+    setPollIn(conn->fd, FALSE);
+    timer_wheel_arm(&timers, &conn->throttleTimer, now + (messageDelay > byteDelay ? messageDelay : byteDelay));
+    LOG_DEBUG("FD %d is over its rate limit, pausing reads\n", conn->fd);
+    return 0;
+}
+
+void chargeMessage(struct connection* conn){
+    token_bucket_take(&conn->messageBucket, 1);
+}
+
+void printRateLimitStats(FILE* stream){
+    fprintf(stream, "messages_per_s=%g bytes_per_s=%zu pauses=%llu paused_now=%llu paused_ms=%.1f\n",
+            server_config.rate_messages, server_config.rate_bytes,
+            rlStats.pauses, rlStats.pausedNow, (double) rlStats.pausedNs / 1e6);
+}
+
+
+/*******************************************************/
+/* File Transfer                                       */
+/*******************************************************/
+/* Files never pass the chat queues or user space: an
+ * upload is spliced from the socket through a pipe into
+ * a file in the spool directory, and a download is sent
+ * from that file with sendfile(), one WIRE_FILE_DATA
+ * frame of up to FILE_CHUNK bytes at a time. Only the
+ * frame headers are written by the server, and only the
+ * bytes that arrived together with a frame header are
+ * copied. A client's chat messages go before its next
+ * chunk, and while it downloads, POLLOUT only comes once
+ * the socket holds less than a chunk not yet sent, so a
+ * large download delays them by about two chunks. See
+ * wire_protocol.h for the frames.                       */
+#define FILE_CHUNK        16384
+#define SPLICE_CHUNK      65536     // the default pipe capacity
+#define FILE_DOWNLOADS_MAX 16       // queued per connection, more are refused
+#define FILE_OPEN_RETRY_NS (100ULL * 1000 * 1000)
+
+struct spoolFile {
+    uint32_t id;
+    uint64_t size;
+    uint64_t received;
+    int complete;
+    char* path;
+    char name[WIRE_FILE_NAME_MAX + 1];
+};
+struct spoolFile** spool = NULL;    // by id - 1, NULL once aborted
+uint32_t spoolCount = 0;
+
+struct fileStats {
+    unsigned long long uploads;
+    unsigned long long uploadBytes;
+    unsigned long long splicedBytes;    // of those, moved without a copy
+    unsigned long long refused;
+    unsigned long long aborted;
+    unsigned long long downloads;
+    unsigned long long downloadsRefused;    // over FILE_DOWNLOADS_MAX
+    unsigned long long downloadBytes;
+    unsigned long long throttled;       // chunks held back by --file-rate
+};
+struct fileStats flStats;
+int fileFramesHeld = FALSE;     // a hot restart waits, no new file frames start
+
+void putFileInfo(unsigned char* out, uint32_t id, uint64_t size){
+    uint32_t fields[3] = {htonl(id), htonl((uint32_t) (size >> 32)), htonl((uint32_t) size)};
+    memcpy(out, fields, sizeof(fields));
+}
+
+void answerFrame(int fd, struct connection* conn, uint8_t type, const void* payload, size_t len){
+    struct chatMessage* reply = createMessage(type, conn->client.room, 0, 0, "", payload, len);
+    queueControl(fd, reply);
+    releaseMessage(reply);
+}
+
+void closeUpload(struct connection* conn){
+    close(conn->uploadFd);
+    close(conn->uploadPipe[0]);
+    close(conn->uploadPipe[1]);
+    conn->upload = NULL;
+}
+
+/* Shares a complete upload with the room, the uploader included */
+void finishUpload(int fd, struct connection* conn){
+    struct spoolFile* file = conn->upload;
+    closeUpload(conn);
+    file->complete = TRUE;
+    flStats.uploads++;
+
+    size_t nameLen = strlen(file->name);
+    unsigned char payload[WIRE_FILE_INFO_SIZE + WIRE_FILE_NAME_MAX];
+    putFileInfo(payload, file->id, file->size);
+    memcpy(payload + WIRE_FILE_INFO_SIZE, file->name, nameLen);
+    struct chatMessage* msg = createMessage(WIRE_FILE, conn->client.room, conn->id, fd, conn->peer,
+                                            (const char*) payload, WIRE_FILE_INFO_SIZE + nameLen);
+    deliverLocal(msg, -1);
+    releaseMessage(msg);
+}
+
+/* Opens a spool file for the upload a client offered */
+int offerFile(int fd, struct connection* conn, const struct wire_header* header, const char* payload){
+    if(header->length < WIRE_FILE_OFFER_SIZE || header->length > WIRE_FILE_OFFER_SIZE + WIRE_FILE_NAME_MAX){
+        return -1;
+    }
+    uint32_t halves[2];
+    memcpy(halves, payload, sizeof(halves));
+    uint64_t size = (uint64_t) ntohl(halves[0]) << 32 | ntohl(halves[1]);
+
+    struct spoolFile* file = NULL;
+    if(server_config.spool_dir != NULL && conn->upload == NULL && size <= server_config.spool_max_file){
+        file = calloc(1, sizeof(struct spoolFile));
+    }
+    if(file != NULL){
+        file->id = spoolCount + 1;
+        file->size = size;
+        size_t nameLen = header->length - WIRE_FILE_OFFER_SIZE;
+        for(size_t k = 0; k < nameLen; k++){
+            char c = payload[WIRE_FILE_OFFER_SIZE + k];
+            file->name[k] = c >= ' ' && c != 0x7f && c != '\'' ? c : '_';
+        }
+        if(asprintf(&file->path, "%s/chat-%d-%u", server_config.spool_dir, (int) getpid(), file->id) < 0){
+            file->path = NULL;
+        }
+    }
+    if(file != NULL && (file->path == NULL
+                        || (conn->uploadFd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)){
+        LOG_WARN("Couldn't create a file in the spool: %s\n", strerror(errno));
+        free(file->path);
+        free(file);
+        file = NULL;
+    }
+    if(file != NULL && pipe2(conn->uploadPipe, O_CLOEXEC) != 0){
+        close(conn->uploadFd);
+        unlink(file->path);
+        free(file->path);
+        free(file);
+        file = NULL;
+    }
+    if(file == NULL){
+        flStats.refused++;
+        answerFrame(fd, conn, WIRE_FILE_OFFER, NULL, 0);
+        return 0;
+    }
+
+    struct spoolFile** grown = realloc(spool, (spoolCount + 1) * sizeof(struct spoolFile*));
+    if(grown == NULL){
+        print_error("  offerFile: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    spool = grown;
+    spool[spoolCount++] = file;
+    conn->upload = file;
+    LOG_INFO("FD %d uploads file #%u '%s' (%llu bytes)\n", fd, file->id, file->name, (unsigned long long) size);
+
+    uint32_t id = htonl(file->id);
+    answerFrame(fd, conn, WIRE_FILE_OFFER, &id, sizeof(id));
+    if(size == 0){
+        finishUpload(fd, conn);
+    }
+    return 0;
+}
+
+/* A disconnect in the middle of an upload drops the file */
+void abortUpload(struct connection* conn){
+    struct spoolFile* file = conn->upload;
+    closeUpload(conn);
+    unlink(file->path);
+    spool[file->id - 1] = NULL;
+    free(file->path);
+    free(file);
+    flStats.aborted++;
+}
+
+/* A WIRE_FILE_DATA header arrived, its content follows */
+int startUploadFrame(struct connection* conn, const struct wire_header* header){
+    if(conn->upload != NULL && header->length > conn->upload->size - conn->upload->received){
+        return -1;
+    }
+    conn->uploadFrameLeft = header->length;
+    return 0;
+}
+
+/* Stores content that arrived with a frame header; that
+ * of a refused upload is dropped                       */
+int writeUpload(int fd, struct connection* conn, const unsigned char* data, size_t len){
+    conn->uploadFrameLeft -= len;
+    if(conn->upload == NULL){
+        return 0;
+    }
+    size_t written = 0;
+    while(written < len){
+        ssize_t n = write(conn->uploadFd, data + written, len - written);
+        if(n < 0){
+            LOG_WARN("Couldn't write to the spool: %s\n", strerror(errno));
+            return -1;
+        }
+        written += (size_t) n;
+    }
+    conn->upload->received += len;
+    flStats.uploadBytes += len;
+    if(conn->upload->received == conn->upload->size){
+        finishUpload(fd, conn);
+    }
+    return 0;
+}
+
+/* Moves up to max bytes of frame content from the socket
+ * into the spool file. Returns like recv().            */
+ssize_t spliceUpload(int fd, struct connection* conn, size_t max){
+    size_t len = conn->uploadFrameLeft < max ? conn->uploadFrameLeft : max;
+    if(len > SPLICE_CHUNK){
+        len = SPLICE_CHUNK;
+    }
+    if(conn->upload == NULL){
+        char discard[4096];
+        ssize_t n = recv(fd, discard, len < sizeof(discard) ? len : sizeof(discard), 0);
+        if(n > 0){
+            conn->uploadFrameLeft -= (size_t) n;
+        }
+        return n;
+    }
+
+    ssize_t n = splice(fd, NULL, conn->uploadPipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n <= 0){
+        return n;
+    }
+    for(ssize_t moved = 0; moved < n;){
+        ssize_t m = splice(conn->uploadPipe[0], NULL, conn->uploadFd, NULL, (size_t) (n - moved), SPLICE_F_MOVE);
+        if(m <= 0){
+            LOG_WARN("Couldn't write to the spool: %s\n", strerror(errno));
+            errno = EIO;
+            return -1;
+        }
+        moved += m;
+    }
+    conn->uploadFrameLeft -= (size_t) n;
+    conn->upload->received += (uint64_t) n;
+    flStats.uploadBytes += (unsigned long long) n;
+    flStats.splicedBytes += (unsigned long long) n;
+    if(conn->upload->received == conn->upload->size){
+        finishUpload(fd, conn);
+    }
+    return n;
+}
+
+/* Keeps the kernel from queueing a whole download ahead
+ * of the next chat message; 0 restores the default      */
+void limitUnsent(int fd, int bytes){
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+}
+
+/* Queues the answer and the content of a spooled file.
+ * The file is opened once the download is next, so
+ * queued requests hold no descriptors.                  */
+int requestFile(int fd, struct connection* conn, const struct wire_header* header, const char* payload){
+    if(header->length != sizeof(uint32_t)){
+        return -1;
+    }
+    uint32_t id;
+    memcpy(&id, payload, sizeof(id));
+    id = ntohl(id);
+
+    struct spoolFile* file = id >= 1 && id <= spoolCount ? spool[id - 1] : NULL;
+    int full = conn->downloadCount == FILE_DOWNLOADS_MAX;
+    if(file == NULL || !file->complete || conn->shmActive || full){
+        flStats.downloadsRefused += full && file != NULL && file->complete;
+        uint32_t unknown = htonl(id);
+        answerFrame(fd, conn, WIRE_FILE_GET, &unknown, sizeof(unknown));
+        return 0;
+    }
+
+    unsigned char info[WIRE_FILE_INFO_SIZE];
+    putFileInfo(info, id, file->size);
+    answerFrame(fd, conn, WIRE_FILE_GET, info, sizeof(info));
+
+    struct fileStream* stream = calloc(1, sizeof(struct fileStream));
+    if(stream == NULL){
+        print_error("  requestFile: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    stream->id = id;
+    stream->fileFd = -1;
+    stream->size = (off_t) file->size;
+    if(conn->downloadTail == NULL){
+        conn->downloadHead = stream;
+        limitUnsent(fd, FILE_CHUNK);
+        token_bucket_init(&conn->fileBucket, (double) server_config.file_rate,
+                          (double) (server_config.file_rate > FILE_CHUNK ? server_config.file_rate : FILE_CHUNK),
+                          wheelTime());
+    }else{
+        conn->downloadTail->next = stream;
+    }
+    conn->downloadTail = stream;
+    conn->downloadCount++;
+    flStats.downloads++;
+    return 0;
+}
+
+/* Opens the file of the download that is next. Files in
+ * the spool stay until the server exits once complete.  */
+int openDownload(struct fileStream* stream){
+    struct spoolFile* file = spool[stream->id - 1];
+    stream->fileFd = open(file->path, O_RDONLY | O_CLOEXEC);
+    return stream->fileFd < 0 ? -1 : 0;
+}
+
+void popDownload(struct connection* conn){
+    struct fileStream* stream = conn->downloadHead;
+    conn->downloadHead = stream->next;
+    if(conn->downloadHead == NULL){
+        conn->downloadTail = NULL;
+        limitUnsent(conn->fd, 0);
+    }
+    conn->downloadCount--;
+    if(stream->fileFd >= 0){
+        close(stream->fileFd);
+    }
+    free(stream);
+}
+
+void onFileRate(timer_entry* timer){
+    struct connection* conn = timer->context;
+    scheduleSend(conn->fd, conn);
+}
+
+/* Sends file content. Without newFrames it only finishes
+ * the frame under way, which other frames must not cut,
+ * with it one more frame, so one download cannot hold up
+ * the loop. Returns 1 if the socket is full or there is
+ * more to send, -1 on errors.                            */
+int sendFileContent(int fd, struct connection* conn, int newFrames){
+    while(conn->downloadHead != NULL){
+        struct fileStream* stream = conn->downloadHead;
+        if(stream->headerLeft == 0 && stream->chunkLeft == 0){
+            if(stream->offset == stream->size){
+                popDownload(conn);
+                continue;
+            }
+            if(!newFrames || fileFramesHeld){
+                return 0;
+            }
+            if(newFrames > 1){
+                return 1;
+            }
+            /* Out of descriptors the download waits, others may close theirs */
+            if(stream->fileFd < 0 && openDownload(stream) != 0){
+                if(errno != EMFILE && errno != ENFILE && errno != ENOMEM){
+                    return -1;
+                }
+                if(!timer_entry_armed(&conn->fileTimer)){
+                    timer_wheel_arm(&timers, &conn->fileTimer, wheelTime() + FILE_OPEN_RETRY_NS);
+                }
+                return 0;
+            }
+            size_t chunk = stream->size - stream->offset < FILE_CHUNK ? (size_t) (stream->size - stream->offset)
+                                                                       : FILE_CHUNK;
+            token_bucket_refill(&conn->fileBucket, wheelTime());
+            if(!token_bucket_ready(&conn->fileBucket, (double) chunk)){
+                if(!timer_entry_armed(&conn->fileTimer)){
+                    flStats.throttled++;
+                    timer_wheel_arm(&timers, &conn->fileTimer,
+                                    wheelTime() + token_bucket_delay_ns(&conn->fileBucket, (double) chunk));
+                }
+                return 0;
+            }
+            token_bucket_take(&conn->fileBucket, (double) chunk);
+
+            struct wire_header header = {WIRE_VERSION, WIRE_FILE_DATA, conn->client.room, 0, stream->id, (uint32_t) chunk};
+            wire_encode_header(&header, stream->header);
+            stream->headerLeft = WIRE_HEADER_SIZE;
+            stream->chunkLeft = chunk;
+            newFrames++;
+        }
+
+        if(stream->headerLeft > 0){
+            ssize_t n = send(fd, stream->header + WIRE_HEADER_SIZE - stream->headerLeft, stream->headerLeft,
+                             MSG_NOSIGNAL | MSG_MORE);
+            if(n < 0){
+                return errno == EWOULDBLOCK || errno == EAGAIN ? 1 : -1;
+            }
+            stream->headerLeft -= (size_t) n;
+            if(stream->headerLeft > 0){
+                return 1;
+            }
+        }
+
+        ssize_t n = sendfile(fd, stream->fileFd, &stream->offset, stream->chunkLeft);
+        if(n < 0){
+            return errno == EWOULDBLOCK || errno == EAGAIN ? 1 : -1;
+        }
+        if(n == 0){
+            /* The spool file was truncated behind our back */
+            errno = EIO;
+            return -1;
+        }
+        stream->chunkLeft -= (size_t) n;
+        flStats.downloadBytes += (unsigned long long) n;
+        chat_core_written(&conn->client);
+        if(stream->chunkLeft > 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void flushFiles(int fd, struct connection* conn, int newFrames){
+    int result = sendFileContent(fd, conn, newFrames);
+    if(result > 0){
+        conn->sendScheduled = TRUE;
+    }else if(result < 0){
+        print_error("  sending a file failed");
+        clearOutbound(conn);
+        queueDisconnect(fd);
+    }
+}
+
+void clearFileTransfers(struct connection* conn){
+    timer_wheel_cancel(&timers, &conn->fileTimer);
+    if(conn->upload != NULL){
+        abortUpload(conn);
+    }
+    while(conn->downloadHead != NULL){
+        popDownload(conn);
+    }
+}
+
+/* Spool files only live as long as the server */
+void removeSpool(){
+    for(uint32_t k = 0; k < spoolCount; k++){
+        if(spool[k] != NULL){
+            unlink(spool[k]->path);
+            free(spool[k]->path);
+            free(spool[k]);
+        }
+    }
+    free(spool);
+    spool = NULL;
+    spoolCount = 0;
+}
+
+void printFileStats(FILE* stream){
+    fprintf(stream, "spool=%s files=%u uploads=%llu upload_bytes=%llu spliced_bytes=%llu refused=%llu aborted=%llu "
+                    "downloads=%llu downloads_refused=%llu download_bytes=%llu throttled=%llu\n",
+            server_config.spool_dir, spoolCount, flStats.uploads, flStats.uploadBytes, flStats.splicedBytes,
+            flStats.refused, flStats.aborted, flStats.downloads, flStats.downloadsRefused, flStats.downloadBytes,
+            flStats.throttled);
+}
+
+/* Gives the input buffer back once no partial frame is pending */
+void detachInput(struct connection* conn){
+    if(conn->inCapacity == INPUT_BUFFER_SIZE){
+        poolPut(&inputPool, conn->inBuf);
+    }else{
+        free(conn->inBuf);
+    }
+    conn->inBuf = NULL;
+    conn->inLen = 0;
+    conn->inCapacity = 0;
+}
+
+/* Makes the input buffer hold at least needed bytes. A
+ * pooled block covers the usual small frames, larger
+ * ones get a private buffer. Returns -1 without memory. */
+int attachInput(struct connection* conn, size_t needed){
+    if(needed <= conn->inCapacity){
+        return 0;
+    }
+    if(needed <= INPUT_BUFFER_SIZE){
+        conn->inBuf = poolGet(&inputPool);
+        conn->inCapacity = INPUT_BUFFER_SIZE;
+        return 0;
+    }
+    size_t capacity = INPUT_BUFFER_SIZE;
+    while(capacity < needed){
+        capacity *= 2;
+    }
+    unsigned char* buffer = malloc(capacity);
+    if(buffer == NULL){
+        return -1;
+    }
+    size_t pending = conn->inLen;
+    if(pending > 0){
+        memcpy(buffer, conn->inBuf, pending);
+    }
+    detachInput(conn);
+    conn->inBuf = buffer;
+    conn->inLen = pending;
+    conn->inCapacity = capacity;
+    return 0;
+}
+
+/* Clears a connection slot for a new or closed fd */
+struct connection* resetConnection(int fd){
+    struct connection* conn = getConnection(fd);
+    chat_core_unwatch(&chat, &conn->client);
+    timer_wheel_cancel(&timers, &conn->negotiateTimer);
+    timer_wheel_cancel(&timers, &conn->throttleTimer);
+    if(conn->readsPaused){
+        rlStats.pausedNow--;
+    }
+    if(conn->multicast){
+        mcStats.listeners--;
+    }
+    closeShm(conn);
+    chat_core_leave(&chat, &conn->client, NULL);
+    clearOutbound(conn);
+    clearZerocopy(conn);
+    clearFileTransfers(conn);
+    detachInput(conn);
+    memset(conn, 0, sizeof(struct connection));
+
+    conn->fd = fd;
+    conn->client.fd = fd;
+    timer_entry_init(&conn->negotiateTimer, onNegotiationTimeout, conn);
+    timer_entry_init(&conn->throttleTimer, onThrottleExpired, conn);
+    timer_entry_init(&conn->fileTimer, onFileRate, conn);
+    initRateLimits(conn);
+    return conn;
+}
+
+void printTimerStats(FILE* stream){
+    fprintf(stream, "armed=%zu expired=%llu idle_timeout=%d heartbeat=%d write_stall_timeout=%d "
+                    "idle_disconnects=%llu heartbeats=%llu stall_disconnects=%llu\n",
+            timers.armed, timers.expired, server_config.idle_timeout,
+            server_config.heartbeat_interval, server_config.write_stall_timeout,
+            chat.stats.idle_disconnects, chat.stats.heartbeats, chat.stats.stall_disconnects);
+}
+
+/*******************************************************/
+/* Federation Links                                    */
+/*******************************************************/
+/* Links to peers given with --peer are dialed, and
+ * redialed with growing delays while they are down;
+ * links other servers dial arrive on --federation-port.
+ * If two servers dialed each other, both keep the link
+ * the smaller node id dialed.                           */
+#define REDIAL_MIN_NS    (1000ULL * 1000 * 1000)
+#define REDIAL_MAX_NS    (30ULL * 1000 * 1000 * 1000)
+#define LINK_READ_BURST  16
+
+/* Adds a connected link to fds[] and greets the server */
+void linkUp(struct peerLink* link, int fd){
+    if(nfds == maxPollFds){
+        LOG_WARN("Link refused, connection limit of %d reached\n", maxPollFds);
+        close(fd);
+        if(link->address != NULL){
+            timer_wheel_arm(&timers, &link->redialTimer, monotonic_time_ns() + REDIAL_MAX_NS);
+        }
+        return;
+    }
+
+    /* Batches are flushed explicitly, Nagle would only delay them */
+    int on = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    link->fd = fd;
+    link->node = 0;
+    link->stalled = FALSE;
+    link->outLen = 0;
+    link->inLen = 0;
+    memset(&link->interest, 0, sizeof(link->interest));
+    if(link->in == NULL){
+        link->in = malloc(WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD);
+    }
+    addPollFd(fd);
+
+    unsigned char hello[FEDERATION_HELLO_SIZE];
+    struct wire_header header = {WIRE_VERSION, WIRE_PEER_HELLO, 0, (uint32_t) server_config.node_id, 0, 0};
+    federation_encode_hello((uint32_t) server_config.node_id, federationEpoch, hello);
+    appendLink(link, &header, NULL, hello, sizeof(hello));
+    for(int room=0; room<FEDERATION_ROOMS; room++){
+        if(roomMembers[room] > 0){
+            sendInterest(link, (uint16_t) room, TRUE);
+        }
+    }
+}
+
+void dropLink(struct peerLink* link, const char* reason){
+    LOG_WARN("Link to node %u closed: %s\n", link->node, reason);
+    removePollFd(link->fd);
+    close(link->fd);
+    link->fd = -1;
+    link->node = 0;
+    link->stalled = FALSE;
+    link->outLen = 0;
+    link->inLen = 0;
+    fdStats.linkDrops++;
+    if(link->address != NULL){
+        timer_wheel_arm(&timers, &link->redialTimer, monotonic_time_ns() + link->redialDelay);
+    }
+}
+
+struct peerLink* findNodeLink(uint32_t node, struct peerLink* except){
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(&links[k] != except && links[k].fd >= 0 && links[k].node == node){
+            return &links[k];
+        }
+    }
+    return NULL;
+}
+
+void onRedial(timer_entry* timer){
+    struct peerLink* link = timer->context;
+    struct socket_info* info;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+
+    /* The server dialed us in the meantime and that link is kept */
+    if(link->lastNode != 0 && findNodeLink(link->lastNode, link) != NULL){
+        timer_wheel_arm(&timers, &link->redialTimer, monotonic_time_ns() + REDIAL_MAX_NS);
+        return;
+    }
+
+    if(parse_peer_address(link->address, ip, sizeof(ip), &port) != 0 ||
+       create_active_socket(&info, ip, port) != 0){
+        link->redialDelay = link->redialDelay * 2 < REDIAL_MAX_NS ? link->redialDelay * 2 : REDIAL_MAX_NS;
+        timer_wheel_arm(&timers, &link->redialTimer, monotonic_time_ns() + link->redialDelay);
+        return;
+    }
+    int fd = info->socket_fd;
+    free(info);
+    LOG_INFO("Linked to %s\n", link->address);
+    linkUp(link, fd);
+}
+
+void acceptLinks(){
+    int fd;
+    while((fd = accept_connection(&federationListenInfo)) >= 0){
+        struct peerLink* link = NULL;
+        for(int k=0; k<FEDERATION_MAX_PEERS && link == NULL; k++){
+            if(links[k].fd < 0 && links[k].address == NULL){
+                link = &links[k];
+            }
+        }
+        if(link == NULL){
+            LOG_WARN("Link refused, %d links at most\n", FEDERATION_MAX_PEERS);
+            close(fd);
+            continue;
+        }
+        linkUp(link, fd);
+    }
+}
+
+/* The link that survives when two servers dialed each other */
+int preferredLink(struct peerLink* link, uint32_t node){
+    return (link->address != NULL) == ((uint32_t) server_config.node_id < node);
+}
+
+/* Handles one frame from a link. Returns NULL, or why
+ * the link has to be dropped                          */
+const char* handleLinkFrame(struct peerLink* link, const struct wire_header* header, const unsigned char* payload){
+    struct federation_route route;
+
+    switch(header->type){
+        case WIRE_PEER_HELLO: {
+            uint32_t node;
+            uint32_t epoch;
+            if(header->length != FEDERATION_HELLO_SIZE || link->node != 0){
+                return "invalid hello";
+            }
+            federation_decode_hello(payload, &node, &epoch);
+            if(node == 0 || node > FEDERATION_MAX_NODE || node == (uint32_t) server_config.node_id){
+                return "invalid node id";
+            }
+            link->lastNode = node;
+            struct peerLink* other = findNodeLink(node, link);
+            if(other != NULL){
+                if(!preferredLink(link, node) || preferredLink(other, node)){
+                    return "duplicate link";
+                }
+                dropLink(other, "duplicate link");
+            }
+            link->node = node;
+            link->redialDelay = REDIAL_MIN_NS;
+            fdStats.linksUp++;
+            LOG_INFO("Link to node %u is up\n", node);
+            return NULL;
+        }
+        case WIRE_PEER_INTEREST:
+            if(header->length != 1){
+                return "invalid interest";
+            }
+            if(payload[0]){
+                room_set_add(&link->interest, header->room);
+            }else{
+                room_set_remove(&link->interest, header->room);
+            }
+            return NULL;
+        case WIRE_MESSAGE:
+        case WIRE_JOIN:
+        case WIRE_LEAVE: {
+            if(link->node == 0 || federation_decode_route(payload, header->length, &route) != 0){
+                return "invalid broadcast";
+            }
+            if(!federation_dedup_accept(&dedup, route.origin, route.epoch, header->sequence)){
+                return NULL;
+            }
+            struct chatMessage* msg = createMessage(header->type, header->room, header->sender, route.sender_fd,
+                                                    route.sender_peer, (const char*) payload + FEDERATION_ROUTE_SIZE,
+                                                    header->length - FEDERATION_ROUTE_SIZE);
+            fdStats.received++;
+            publishMulticast(msg);
+            deliverLocal(msg, -1);
+            releaseMessage(msg);
+            return NULL;
+        }
+        default:
+            return "unknown frame type";
+    }
+}
+
+/* Reads and handles the frames that arrived on a link */
+const char* readLink(struct peerLink* link){
+    size_t capacity = WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD;
+
+    for(int burst=0; burst<LINK_READ_BURST; burst++){
+        ssize_t n = recv(link->fd, link->in + link->inLen, capacity - link->inLen, 0);
+        if(n == 0){
+            return "closed by the other server";
+        }
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? NULL : strerror(errno);
+        }
+        link->inLen += (size_t) n;
+
+        size_t offset = 0;
+        struct wire_header header;
+        while(link->inLen - offset >= WIRE_HEADER_SIZE){
+            if(wire_decode_header(link->in + offset, &header) != 0){
+                return "invalid frame";
+            }
+            if(link->inLen - offset < WIRE_HEADER_SIZE + header.length){
+                break;
+            }
+            const char* error = handleLinkFrame(link, &header, link->in + offset + WIRE_HEADER_SIZE);
+            if(error != NULL){
+                return error;
+            }
+            offset += WIRE_HEADER_SIZE + header.length;
+        }
+        memmove(link->in, link->in + offset, link->inLen - offset);
+        link->inLen -= offset;
+    }
+    return NULL;
+}
+
+/* Writes what the link collected with one send() */
+const char* flushLink(struct peerLink* link){
+    if(link->stalled){
+        return "stalled";
+    }
+    if(link->outLen == 0){
+        return NULL;
+    }
+
+    ssize_t n = send(link->fd, link->out, link->outLen, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            return strerror(errno);
+        }
+        n = 0;
+    }else{
+        fdStats.sends++;
+        fdStats.bytesOut += (unsigned long long) n;
+    }
+    memmove(link->out, link->out + n, link->outLen - (size_t) n);
+    link->outLen -= (size_t) n;
+    setPollOut(link->fd, link->outLen > 0);
+    return NULL;
+}
+
+/* Called at the end of every loop iteration */
+void flushLinks(){
+    if(!isFederated()){
+        return;
+    }
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(links[k].fd >= 0 && (links[k].outLen > 0 || links[k].stalled)){
+            const char* error = flushLink(&links[k]);
+            if(error != NULL){
+                dropLink(&links[k], error);
+            }
+        }
+    }
+}
+
+/* Called after poll(): accepts links and serves the
+ * links that became readable or writable               */
+void pollLinks(){
+    if(!isFederated()){
+        return;
+    }
+    int index = federationListenSd >= 0 ? findPollIndex(federationListenSd) : -1;
+    if(index >= 0 && (fds[index].revents & POLLIN)){
+        acceptLinks();
+    }
+
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        struct peerLink* link = &links[k];
+        index = link->fd >= 0 ? findPollIndex(link->fd) : -1;
+        if(index < 0 || fds[index].revents == 0){
+            continue;
+        }
+        short revents = fds[index].revents;
+        const char* error = NULL;
+        if(revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)){
+            error = readLink(link);
+        }
+        if(error == NULL && (revents & POLLOUT)){
+            error = flushLink(link);
+        }
+        if(error != NULL){
+            dropLink(link, error);
+        }
+    }
+}
+
+void printFederationStats(FILE* stream){
+    fprintf(stream, "node=%d links=", server_config.node_id);
+    int linked = 0;
+    for(int k=0; k<FEDERATION_MAX_PEERS; k++){
+        if(links[k].fd >= 0 && links[k].node != 0){
+            fprintf(stream, "%s%u", linked++ > 0 ? "," : "", links[k].node);
+        }
+    }
+    fprintf(stream, "%s links_up=%llu link_drops=%llu forwarded=%llu sends=%llu bytes_out=%llu "
+                    "frames_per_send=%.2f received=%llu duplicates=%llu oversized=%llu stalls=%llu\n",
+            linked == 0 ? "none" : "", fdStats.linksUp, fdStats.linkDrops, fdStats.forwarded, fdStats.sends,
+            fdStats.bytesOut, fdStats.sends ? (double) fdStats.forwarded / (double) fdStats.sends : 0.0,
+            fdStats.received, dedup.duplicates, fdStats.oversized, fdStats.stalls);
+}
+
+
+void writeToConsole(struct chatMessage* msg){
+    /*struct sockaddr_in address;
+    int addrlen;
+    // Get details
+    getpeername(fromFd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
+    printf("%s:%d - %s\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port), msg);*/
+    LOG_DEBUG("%s:%d - %.*s\n", msg->senderPeer, msg->senderFd, (int) msg->header.length, msg->payload);
+}
+
+
+/*******************************************************/
+/* Event Handlers                                      */
+/*******************************************************/
+/* Adds a client socket to fds[] with a fresh connection
+ * slot and its timers. NULL if the limit is reached.     */
+struct connection* addConnection(int new_sd) {
+    if (nfds == maxPollFds || connectionCount == maxConnections) {
+        LOG_WARN("FD %d rejected, connection limit of %d reached\n", new_sd, maxConnections);
+        close(new_sd);
+        return NULL;
+    }
+
+    /*****************************************************/
+    /* Add the new incoming connection to the            */
+    /* pollfd structure                                  */
+    /*****************************************************/
+    addPollFd(new_sd);
+    connectionCount++;
+
+    struct connection* conn = resetConnection(new_sd);
+
+    /* Coalescing already batches small messages, Nagle on top
+     * would hold each flush back until the previous is acked.
+     * Fails harmlessly on Unix domain sockets.               */
+    if(server_config.coalesce_sends){
+        int on = 1;
+        setsockopt(new_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if(server_config.zerocopy_threshold > 0){
+        enableZerocopy(new_sd, conn);
+    }
+
+    chat_core_watch(&chat, &conn->client);
+    timer_wheel_arm(&timers, &conn->negotiateTimer, monotonic_time_ns() + NEGOTIATION_TIMEOUT_NS);
+    return conn;
+}
+
+void registerConnection(int new_sd) {
+    struct connection* conn = addConnection(new_sd);
+    if (conn == NULL) {
+        return;
+    }
+
+    LOG_INFO("FD %d has entered the chat room.\n", new_sd);
+
+    format_peer_address(new_sd, conn->peer, sizeof(conn->peer));
+    conn->id = allocateConnectionId();
+    roomJoined(conn->client.room);
+    requestSnapshot(conn);
+
+    struct chatMessage* msg = createMessage(WIRE_JOIN, conn->client.room, conn->id, new_sd, conn->peer, NULL, 0);
+    chat_core_join(&chat, &conn->client, msg);
+    releaseMessage(msg);
+}
+
+/* Out of descriptors or memory, accept() fails while the
+ * connection stays pending. The listeners stop polling
+ * until acceptPauseTimer instead of ending the server;
+ * the connection is taken once something was freed.     */
+timer_entry acceptPauseTimer;
+
+void onAcceptPause(timer_entry* timer){
+    (void) timer;
+    setPollIn(listen_sd, TRUE);
+    if (unix_listen_sd >= 0) {
+        setPollIn(unix_listen_sd, TRUE);
+    }
+}
+
+/* Returns -1 if the listener failed for good */
+int pauseAccepting(int fd){
+    if(chat_core_pause_accepting(&chat, &acceptPauseTimer, fd) != 0){
+        return -1;
+    }
+    setPollIn(fd, FALSE);
+    return 0;
+}
+
+void printAcceptStats(FILE* stream){
+    fprintf(stream, "batch=%d pauses=%llu paused=%d\n", server_config.accept_batch, chat.stats.accept_pauses,
+            timer_entry_armed(&acceptPauseTimer));
+}
+
+void handleConnect(struct event* evp) {
+    //printf("handleConnect\n");
+    /*****************************************************/
+    /* Take up to accept_batch connections per event,    */
+    /* either from the listener or from the acceptor     */
+    /* threads.                                          */
+    /*****************************************************/
+    int count;
+    if (evp->fd == unix_listen_sd) {
+        count = accept_connections(&unixListenInfo, acceptBuffer, server_config.accept_batch);
+    } else if (acceptorHandoff) {
+        count = receive_accepted_connections(listen_sd, acceptBuffer, server_config.accept_batch);
+    } else {
+        count = accept_connections(&listenInfo, acceptBuffer, server_config.accept_batch);
+    }
+
+    if (count < 0) {
+        if (pauseAccepting(evp->fd) != 0) {
+            end_server = TRUE;
+        }
+        destroyEvent(evp);
+        return;
+    }
+
+    for (int k = 0; k < count; k++) {
+        if (eventTrace != NULL) {
+            traceRecord(EVENT_TRACE_ACCEPT, 0, acceptBuffer[k], 0, NULL);
+        }
+        registerConnection(acceptBuffer[k]);
+    }
+
+    /*****************************************************/
+    /* A full batch means more connections may be        */
+    /* pending. Requeue instead of looping so other      */
+    /* events are not starved during a connect storm.    */
+    /*****************************************************/
+    if (count == server_config.accept_batch) {
+        qInsert(createEvent(NEW_CONNECTION, evp->fd, "", 0));
+    }
+
+    destroyEvent(evp);
+}
+
+
+/* Moves a binary client to another room and tells both rooms */
+void changeRoom(int fd, struct connection* conn, uint16_t room){
+    if(room == conn->client.room){
+        return;
+    }
+
+    struct chatMessage* leave = createMessage(WIRE_LEAVE, conn->client.room, conn->id, fd, conn->peer, NULL, 0);
+    chat_core_leave(&chat, &conn->client, leave);
+    releaseMessage(leave);
+
+    LOG_INFO("FD %d moved from room %u to room %u\n", fd, conn->client.room, room);
+    roomLeft(conn->client.room);
+    conn->client.room = room;
+    roomJoined(conn->client.room);
+    requestSnapshot(conn);
+
+    struct chatMessage* join = createMessage(WIRE_JOIN, conn->client.room, conn->id, fd, conn->peer, NULL, 0);
+    chat_core_join(&chat, &conn->client, join);
+    releaseMessage(join);
+}
+
+/* Switches a binary client to the multicast group. The
+ * answer is queued behind everything sent so far, so its
+ * sequence marks where the connection stops and the
+ * group takes over.                                    */
+void joinMulticast(int fd, struct connection* conn){
+    const char* group = multicastFd >= 0 ? server_config.multicast_group : "";
+    struct chatMessage* reply = createMessage(WIRE_MULTICAST, conn->client.room, 0, 0, "", group, strlen(group));
+    reply->header.sequence = nextSequence;
+    queueControl(fd, reply);
+    releaseMessage(reply);
+
+    if(multicastFd >= 0 && !conn->multicast){
+        conn->multicast = TRUE;
+        chat_core_set_detached(&chat, &conn->client, TRUE);
+        mcStats.listeners++;
+        LOG_INFO("FD %d receives broadcasts from %s\n", fd, group);
+    }
+}
+
+/* Resends the retained broadcasts of a sequence range
+ * that concern the client, then confirms the range.
+ * Returns -1 on a malformed request.                   */
+int resendRange(int fd, struct connection* conn, const struct wire_header* header, const char* payload){
+    uint32_t count;
+
+    if(header->length != WIRE_NACK_SIZE){
+        return -1;
+    }
+    memcpy(&count, payload, sizeof(count));
+    count = ntohl(count);
+    mcStats.nacks++;
+
+    /* Only the last historySize sequences can still be there */
+    uint64_t first = header->sequence;
+    uint64_t end = first + count;
+    uint64_t oldest = nextSequence > historySize ? nextSequence - historySize : 0;
+    uint32_t found = 0;
+    for(uint64_t sequence = first > oldest ? first : oldest; sequence < end && sequence < nextSequence; sequence++){
+        struct chatMessage* msg = findHistory((uint32_t) sequence);
+        if(msg == NULL){
+            continue;
+        }
+        found++;
+        if((msg->header.room == conn->client.room || msg->header.sender == 0) && msg->header.sender != conn->id){
+            queueSend(fd, msg);
+            mcStats.resent++;
+        }
+    }
+    mcStats.unrecoverable += count - found;
+
+    uint32_t answer[2] = {htonl(count), htonl(count - found)};
+    struct chatMessage* reply = createMessage(WIRE_NACK, conn->client.room, 0, 0, "", (const char*) answer, sizeof(answer));
+    reply->header.sequence = header->sequence;
+    queueControl(fd, reply);
+    releaseMessage(reply);
+    return 0;
+}
+
+/* Handles one complete frame of a binary client.
+ * Returns -1 on a protocol violation.                  */
+int handleFrame(int fd, struct connection* conn, const struct wire_header* header, const char* payload){
+    if(!conn->greeted && header->type != WIRE_HELLO){
+        return -1;
+    }
+
+    switch(header->type){
+        case WIRE_HELLO:
+            /* Answered by setProtocol() already */
+            conn->greeted = TRUE;
+            return 0;
+        case WIRE_MESSAGE: {
+            chargeMessage(conn);
+            struct chatMessage* msg = createMessage(WIRE_MESSAGE, conn->client.room, conn->id, fd, conn->peer,
+                                                    payload, header->length);
+            writeToConsole(msg);
+            broadcast(msg, fd);
+            releaseMessage(msg);
+            return 0;
+        }
+        case WIRE_JOIN:
+            changeRoom(fd, conn, header->room);
+            return 0;
+        case WIRE_MULTICAST:
+            joinMulticast(fd, conn);
+            return 0;
+        case WIRE_NACK:
+            return multicastFd >= 0 ? resendRange(fd, conn, header, payload) : -1;
+        case WIRE_SHM:
+            return requestShm(fd, conn);
+        case WIRE_FILE_OFFER:
+            return offerFile(fd, conn, header, payload);
+        case WIRE_FILE_GET:
+            return requestFile(fd, conn, header, payload);
+        case WIRE_LEAVE:
+        case WIRE_HEARTBEAT:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/* Handles every complete frame of the received bytes,
+ * straight from data unless a partial frame is pending.
+ * Only a remaining partial frame takes an input buffer.
+ * WIRE_FILE_DATA content goes to the upload as it comes,
+ * and while a frame of it is open, nothing is buffered.
+ * Returns -1 on a protocol error.                       */
+int receiveFrames(int fd, struct connection* conn, const char* data, size_t len){
+    const unsigned char* input = (const unsigned char*) data;
+    size_t available = len;
+    if(conn->inLen > 0){
+        if(attachInput(conn, conn->inLen + len) != 0){
+            return -1;
+        }
+        memcpy(conn->inBuf + conn->inLen, data, len);
+        conn->inLen += len;
+        input = conn->inBuf;
+        available = conn->inLen;
+    }
+
+    size_t offset = 0;
+    while(available > offset){
+        if(conn->uploadFrameLeft > 0){
+            size_t part = available - offset < conn->uploadFrameLeft ? available - offset : conn->uploadFrameLeft;
+            if(writeUpload(fd, conn, input + offset, part) != 0){
+                return -1;
+            }
+            offset += part;
+            continue;
+        }
+        if(available - offset < WIRE_HEADER_SIZE){
+            break;
+        }
+        struct wire_header header;
+        if(wire_decode_header(input + offset, &header) != 0){
+            return -1;
+        }
+        if(header.type == WIRE_FILE_DATA && conn->greeted){
+            if(startUploadFrame(conn, &header) != 0){
+                return -1;
+            }
+            offset += WIRE_HEADER_SIZE;
+            continue;
+        }
+        if(available - offset < WIRE_HEADER_SIZE + header.length){
+            break;
+        }
+        if(handleFrame(fd, conn, &header, (const char*) input + offset + WIRE_HEADER_SIZE) != 0){
+            return -1;
+        }
+        offset += WIRE_HEADER_SIZE + header.length;
+    }
+
+    size_t rest = available - offset;
+    if(rest == 0){
+        detachInput(conn);
+    }else if(input == conn->inBuf){
+        memmove(conn->inBuf, conn->inBuf + offset, rest);
+        conn->inLen = rest;
+    }else{
+        if(attachInput(conn, rest) != 0){
+            return -1;
+        }
+        memcpy(conn->inBuf, input + offset, rest);
+        conn->inLen = rest;
+    }
+    return 0;
+}
+
+
+/* Handles the frames a shared-memory client wrote to its
+ * ring. Its socket carries nothing after the handover, so
+ * it only becomes readable when the client goes away.    */
+void receiveShm(int fd, struct connection* conn){
+    char buffer[4096];
+    int closeConn = conn->shmClosed;
+    ssize_t len;
+
+    while((len = shm_channel_read(conn->shm, buffer, sizeof(buffer))) > 0){
+        shStats.bytesIn += (unsigned long long) len;
+        if(receiveFrames(fd, conn, buffer, (size_t) len) != 0){
+            break;
+        }
+    }
+    if(len != 0){
+        LOG_WARN("FD %d violated the binary protocol, disconnecting\n", fd);
+        protoStats.protocolErrors++;
+        closeConn = TRUE;
+    }
+
+    if(closeConn){
+        queueDisconnect(fd);
+    }
+}
+
+void handleReceive(struct event* evp){
+    /*******************************************************/
+    /* Receive all incoming data on this socket            */
+    /* before we loop back and call poll again.            */
+    /*******************************************************/
+    int close_conn = FALSE;
+    char buffer[1024];
+
+    /*******************************************************/
+    /* poll() may have queued several MSG_RECEIVED for one */
+    /* fd. Once it is closed, recv() on it would fail and  */
+    /* a second DISCONNECT could close whichever new       */
+    /* connection reuses the fd.                           */
+    /*******************************************************/
+    if(findPollIndex(evp->fd) < 0 || getConnection(evp->fd)->readsPaused){
+        destroyEvent(evp);
+        return;
+    }
+
+    struct connection* conn = getConnection(evp->fd);
+    chat_core_received(&conn->client);
+    if(conn->shmActive){
+        receiveShm(evp->fd, conn);
+        destroyEvent(evp);
+        return;
+    }
+    do
+    {
+        // Clear buffer
+        memset(&buffer[0],0,sizeof(buffer));
+
+        /*****************************************************/
+        /* Receive data on this connection until the         */
+        /* recv fails with EWOULDBLOCK. If any other        */
+        /* failure occurs, we will close the                 */
+        /* connection.                                       */
+        /*****************************************************/
+        /*****************************************************/
+        /* The rest of an upload frame skips the buffer,     */
+        /* unless a trace has to see it                      */
+        /*****************************************************/
+        int spliced = conn->uploadFrameLeft > 0 && eventTrace == NULL;
+        size_t admitted = spliced ? SPLICE_CHUNK : sizeof(buffer) - 1;
+        if(rateLimited()){
+            admitted = admitRead(conn, admitted);
+            if(admitted == 0){
+                break;
+            }
+        }
+        if(spliced){
+            dataSize = spliceUpload(evp->fd, conn, admitted);
+        }else{
+            dataSize = recv(evp->fd, buffer, admitted, 0);
+            if(dataSize >= 0 || errno != EWOULDBLOCK){
+                traceData(evp->fd, buffer, dataSize);
+            }
+        }
+        if (dataSize < 0)
+        {
+            if (errno != EWOULDBLOCK)
+            {
+                //perror("  recv() failed");
+                close_conn = TRUE;
+            }
+            break;
+        }
+
+        /*****************************************************/
+        /* Check to see if the connection has been           */
+        /* closed by the client                              */
+        /*****************************************************/
+        if (dataSize == 0)
+        {
+            LOG_INFO("  Connection closed\n");
+            close_conn = TRUE;
+            break;
+        }
+
+        /*****************************************************/
+        /* The first byte decides the protocol: binary       */
+        /* clients open with a frame header, whose version   */
+        /* byte is a control character no text client sends  */
+        /*****************************************************/
+        if(conn->mode == PROTOCOL_UNDECIDED){
+            timer_wheel_cancel(&timers, &conn->negotiateTimer);
+            setProtocol(evp->fd, conn, buffer[0] == WIRE_VERSION ? PROTOCOL_BINARY : PROTOCOL_TEXT);
+        }
+
+        token_bucket_take(&conn->byteBucket, (double) dataSize);
+        if(spliced){
+            continue;
+        }
+        if(conn->mode == PROTOCOL_BINARY){
+            if(receiveFrames(evp->fd, conn, buffer, (size_t) dataSize) != 0){
+                LOG_WARN("FD %d violated the binary protocol, disconnecting\n", evp->fd);
+                protoStats.protocolErrors++;
+                close_conn = TRUE;
+                break;
+            }
+            continue;
+        }
+
+        /*****************************************************/
+        /* Data was received                                 */
+        /*****************************************************/
+        chargeMessage(conn);
+        struct chatMessage* msg = createMessage(WIRE_MESSAGE, conn->client.room, conn->id, evp->fd, conn->peer,
+                                                buffer, (size_t) dataSize);
+
+        /*****************************************************/
+        /* Write message to terminal                         */
+        /*****************************************************/
+        //writeToConsole(evp->fd, buffer);
+        writeToConsole(msg);
+
+        /*****************************************************/
+        /* Create Write Event                                */
+        /*****************************************************/
+        broadcast(msg, evp->fd);
+        releaseMessage(msg);
+    } while(TRUE);
+
+    /*******************************************************/
+    /* If the close_conn flag was turned on, we need       */
+    /* to clean up this active connection. This           */
+    /* clean up process includes removing the              */
+    /* descriptor.                                         */
+    /*******************************************************/
+    if (close_conn){
+        queueDisconnect(evp->fd);
+    }
+    destroyEvent(evp);
+}
+
+
+void flushOutbound(int fd){
+    struct connection* conn = getConnection(fd);
+    conn->sendScheduled = FALSE;
+    conn->flushPending = FALSE;
+
+    /*****************************************************/
+    /* Write the outbound queue until it is empty or the */
+    /* socket buffer is full. In the latter case POLLOUT */
+    /* reschedules the send once the client reads again. */
+    /* Without coalescing every message is its own       */
+    /* system call, with it up to SEND_IOV_MAX messages  */
+    /* are gathered into one.                            */
+    /*****************************************************/
+    int batch = server_config.coalesce_sends ? SEND_IOV_MAX : 1;
+    if(conn->downloadHead != NULL && !conn->client.closing && !conn->shmActive){
+        flushFiles(fd, conn, FALSE);
+    }
+    while(conn->client.head != NULL && !conn->client.closing && !conn->sendScheduled){
+        /*************************************************/
+        /* Shared-memory clients: the WIRE_SHM answer is */
+        /* the last message on the socket                */
+        /*************************************************/
+        if(conn->shmActive){
+            if(flushShm(conn) != 0){
+                LOG_WARN("FD %d corrupted its shared memory ring, disconnecting\n", fd);
+                protoStats.protocolErrors++;
+                clearOutbound(conn);
+                queueDisconnect(fd);
+            }
+            break;
+        }
+        if(isShmHandover(conn, conn->client.head)){
+            int result = handOverShm(fd, conn);
+            if(result > 0){
+                conn->sendScheduled = TRUE;
+                break;
+            }
+            if(result < 0){
+                print_error("  send() failed");
+                clearOutbound(conn);
+                queueDisconnect(fd);
+                break;
+            }
+            continue;
+        }
+
+        /* A large message goes alone, zero-copy needs to know
+         * which message a send pinned                        */
+        struct iovec iov[SEND_IOV_MAX];
+        struct chat_out* out = conn->client.head;
+        int zerocopy = wantsZerocopy(conn, out);
+        size_t total = 0;
+        int count = 0;
+        for(; out != NULL && count < (zerocopy ? 1 : batch) && !isShmHandover(conn, out)
+              && (count == 0 || !wantsZerocopy(conn, out)); out = out->next, count++){
+            iov[count].iov_base = (char*) out->data + out->sent;
+            iov[count].iov_len = out->length - out->sent;
+            total += iov[count].iov_len;
+        }
+
+        /* With corking, all but the last queued message are sent with
+         * MSG_MORE so a burst of small messages leaves as few segments */
+        int flags = MSG_NOSIGNAL;
+        if(server_config.socket_profile.cork && out != NULL){
+            flags |= MSG_MORE;
+        }
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = count;
+        dataSize = sendmsg(fd, &header, flags | (zerocopy ? MSG_ZEROCOPY : 0));
+        sndStats.calls++;
+        if(dataSize < 0 && zerocopy && errno == ENOBUFS){
+            /* Out of option memory for the notifications */
+            zcStats.fallbacks++;
+            zerocopy = FALSE;
+            dataSize = sendmsg(fd, &header, flags);
+            sndStats.calls++;
+        }
+        if (dataSize < 0)
+        {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+            {
+                conn->sendScheduled = TRUE;
+                break;
+            }
+            print_error("  send() failed");
+            clearOutbound(conn);
+            queueDisconnect(fd);
+            break;
+        }
+
+        chat_core_written(&conn->client);
+        sndStats.bytes += (unsigned long long) dataSize;
+        if(zerocopy && dataSize > 0){
+            zcStats.sends++;
+            zcStats.bytes += (unsigned long long) dataSize;
+            holdZerocopy(conn, queuedMessage(conn->client.head));
+        }
+
+        sndStats.messages += chat_core_sent(&chat, &conn->client, (size_t) dataSize);
+        if((size_t) dataSize < total){
+            conn->sendScheduled = TRUE;
+            break;
+        }
+    }
+
+    /*****************************************************/
+    /* File content only goes out behind the messages    */
+    /*****************************************************/
+    if(conn->downloadHead != NULL && conn->client.head == NULL && !conn->sendScheduled && !conn->client.closing
+       && !conn->shmActive){
+        flushFiles(fd, conn, TRUE);
+    }
+
+    /*****************************************************/
+    /* A client that does not read for too long is       */
+    /* dropped, its queue would never drain otherwise    */
+    /*****************************************************/
+    if(conn->sendScheduled){
+        chat_core_blocked(&chat, &conn->client);
+    }
+
+    /* A full ring is retried by pollShmRings(), not POLLOUT */
+    setPollOut(fd, conn->sendScheduled && !conn->shmActive);
+}
+
+void handleSend(struct event* evp){
+    flushOutbound(evp->fd);
+    destroyEvent(evp);
+}
+
+/* Flushes every connection that collected messages since the last round */
+void flushCoalesced(){
+    sndStats.flushes++;
+    for(int k=0; k<flushCount; k++){
+        struct connection* conn = getConnection(flushList[k]);
+        if(conn->flushPending && !conn->sendScheduled){
+            flushOutbound(flushList[k]);
+        }
+    }
+    flushCount = 0;
+}
+
+
+void handleDisconnect(struct event* evp){
+    struct connection* conn = getConnection(evp->fd);
+    struct chatMessage* msg = createMessage(WIRE_LEAVE, conn->client.room, conn->id, evp->fd, conn->peer, NULL, 0);
+
+    roomLeft(conn->client.room);
+    removePollFd(evp->fd);
+    connectionCount--;
+    close(evp->fd);
+    LOG_INFO("FD %d has left the chat room.\n", evp->fd);
+
+    chat_core_leave(&chat, &conn->client, msg);
+    releaseMessage(msg);
+    resetConnection(evp->fd);
+
+    destroyEvent(evp);
+}
+
+
+void handleKeypress(struct event* evp){
+    char* c = malloc(1024*sizeof(char));
+    ssize_t len = read (0, c, 1023);
+    c[len > 0 ? len : 0] = '\0';
+    if(len >= 0){
+        traceData(0, c, len);
+    }
+
+    /*****************************************************/
+    /* A console at end of file stays readable, like the */
+    /* other servers stop listening to it                */
+    /*****************************************************/
+    if(len == 0){
+        removePollFd(0);
+        free(c);
+        destroyEvent(evp);
+        return;
+    }
+
+    /*****************************************************/
+    /* Console commands are not broadcast                */
+    /*****************************************************/
+    if(chat_console_command(c) == CHAT_CONSOLE_STATS){
+        if(bus != NULL){
+            /* The supervisor passes it on to every worker */
+            kill(getppid(), SIGUSR1);
+        }else{
+            stats_dump(stdout);
+        }
+        free(c);
+        destroyEvent(evp);
+        return;
+    }
+
+    /*****************************************************/
+    /* Server messages have sender 0 and reach all rooms */
+    /*****************************************************/
+    struct chatMessage* msg = createMessage(WIRE_MESSAGE, 0, 0, 0, "Server", c, strlen(c));
+    broadcast(msg, -1);
+    releaseMessage(msg);
+    free(c);
+
+    destroyEvent(evp);
+}
+
+
+
+/*******************************************************/
+/* Hot Restart                                         */
+/*******************************************************/
+/* With --handoff the server listens on a Unix socket
+ * for its successor, see hot_restart.h. The old server
+ * hands over at the end of a loop iteration and exits
+ * right after, so no event runs in between; whatever
+ * the clients send meanwhile waits in the kernel for
+ * the new server. Shared-memory clients are dropped and
+ * federation links are dialed again by the new server.
+ * File frames must not be cut: the handoff waits up to
+ * HANDOFF_DRAIN_MAX_NS for those under way and starts no
+ * new ones. Clients with uploads or downloads are then
+ * dropped, the spool does not move to the new server.  */
+#define HANDOFF_DRAIN_NS     (10ULL * 1000 * 1000)
+#define HANDOFF_DRAIN_MAX_NS (2ULL * NS_PER_SECOND)
+
+int handoffRequested = FALSE;   // the next server connected
+int handedOff = FALSE;          // sockets belong to the next server now
+uint64_t handoffDrainStart = 0; // waiting for file frames since, 0 - not waiting
+timer_entry handoffDrainTimer;
+
+void listenForHandoff(){
+    if(nfds == maxPollFds){
+        LOG_WARN("No hot restart possible, connection limit of %d reached\n", maxPollFds);
+        return;
+    }
+    handoffListenSd = hot_restart_listen(server_config.handoff_path);
+    if(handoffListenSd < 0){
+        LOG_WARN("No hot restart possible, %s is not available\n", server_config.handoff_path);
+        return;
+    }
+    addPollFd(handoffListenSd);
+}
+
+/* A WIRE_FILE_DATA frame partly sent or received */
+int frameInProgress(const struct connection* conn){
+    return conn->uploadFrameLeft > 0
+           || (conn->downloadHead != NULL && (conn->downloadHead->headerLeft > 0 || conn->downloadHead->chunkLeft > 0));
+}
+
+/* The new server knows nothing of the spool */
+int hasFileTransfers(const struct connection* conn){
+    return conn->upload != NULL || conn->downloadHead != NULL || frameInProgress(conn);
+}
+
+void onHandoffDrain(timer_entry* timer){
+    (void) timer;
+    handoffRequested = TRUE;
+}
+
+/* Holds the handoff back while file frames are under way.
+ * The listener is left out of poll() meanwhile, the drain
+ * timer checks again. Returns TRUE once it may go ahead. */
+int drainFileFrames(){
+    uint64_t now = monotonic_time_ns();
+    int busy = FALSE;
+    for(int k=0; k<nfds && !busy; k++){
+        busy = isClientFd(fds[k].fd) && frameInProgress(getConnection(fds[k].fd));
+    }
+    if(handoffDrainStart == 0){
+        handoffDrainStart = now;
+        fileFramesHeld = TRUE;
+    }
+    if(busy && now - handoffDrainStart < HANDOFF_DRAIN_MAX_NS){
+        setPollIn(handoffListenSd, FALSE);
+        timer_wheel_arm(&timers, &handoffDrainTimer, now + HANDOFF_DRAIN_NS);
+        return FALSE;
+    }
+    setPollIn(handoffListenSd, TRUE);
+    handoffDrainStart = 0;
+    fileFramesHeld = FALSE;
+    return TRUE;
+}
+
+/* Old server: one connection with its partial input and
+ * its outbound queue, the head maybe partly written    */
+int handOverConnection(int handoffSd, int fd, struct connection* conn){
+    struct hot_restart_connection record;
+    memset(&record, 0, sizeof(record));
+    record.type = HOT_RESTART_CONNECTION;
+    record.fd = fd;
+    record.id = conn->id;
+    record.room = conn->client.room;
+    record.mode = (uint8_t) conn->mode;
+    record.greeted = (uint8_t) conn->greeted;
+    record.multicast = (uint8_t) conn->multicast;
+    record.closing = (uint8_t) conn->client.closing;
+    memcpy(record.peer, conn->peer, sizeof(record.peer));
+    if(hot_restart_send(handoffSd, &record, sizeof(record), NULL, 0, &fd, 1) != 0){
+        return -1;
+    }
+
+    if(conn->inLen > 0){
+        uint32_t type = HOT_RESTART_INPUT;
+        if(hot_restart_send(handoffSd, &type, sizeof(type), conn->inBuf, conn->inLen, NULL, 0) != 0){
+            return -1;
+        }
+    }
+
+    for(struct chat_out* out = conn->client.head; out != NULL; out = out->next){
+        struct hot_restart_message message;
+        memset(&message, 0, sizeof(message));
+        message.type = HOT_RESTART_MESSAGE;
+        message.sent = (uint32_t) out->sent;
+        struct chatMessage* msg = queuedMessage(out);
+        message.sender_fd = msg->senderFd;
+        message.header = msg->header;
+        memcpy(message.sender_peer, msg->senderPeer, sizeof(message.sender_peer));
+        if(hot_restart_send(handoffSd, &message, sizeof(message), msg->payload, msg->header.length,
+                            NULL, 0) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Old server: passes everything to the server that
+ * connected. Returns 0 once it confirmed, the caller
+ * exits then; otherwise this server serves on.        */
+int handOver(){
+    int handoffSd = hot_restart_accept(handoffListenSd);
+    if(handoffSd < 0){
+        return -1;
+    }
+
+    /* The path belongs to the next server from now on */
+    removePollFd(handoffListenSd);
+    close(handoffListenSd);
+    handoffListenSd = -1;
+    if(server_config.handoff_path[0] != '@'){
+        unlink(server_config.handoff_path);
+    }
+
+    struct hot_restart_header header = {HOT_RESTART_HEADER, HOT_RESTART_MAGIC, HOT_RESTART_VERSION,
+                                        HOT_RESTART_TCP_LISTENER, nextConnectionId, nextSequence};
+    int listeners[3] = {listen_sd};
+    int count = 1;
+    if(unix_listen_sd >= 0){
+        header.listeners |= HOT_RESTART_UNIX_LISTENER;
+        listeners[count++] = unix_listen_sd;
+    }
+    if(federationListenSd >= 0){
+        header.listeners |= HOT_RESTART_FEDERATION_LISTENER;
+        listeners[count++] = federationListenSd;
+    }
+    int failed = hot_restart_send(handoffSd, &header, sizeof(header), NULL, 0, listeners, count) != 0;
+
+    int handed = 0;
+    int dropped = 0;
+    int transferring = 0;
+    for(int k=0; k<nfds && !failed; k++){
+        int fd = fds[k].fd;
+        if(!isClientFd(fd)){
+            continue;
+        }
+        struct connection* conn = getConnection(fd);
+        if(conn->shm != NULL){
+            dropped++;
+            continue;
+        }
+        if(hasFileTransfers(conn)){
+            transferring++;
+            continue;
+        }
+        failed = handOverConnection(handoffSd, fd, conn) != 0;
+        handed++;
+    }
+
+    uint32_t type = HOT_RESTART_END;
+    failed = failed || hot_restart_send(handoffSd, &type, sizeof(type), NULL, 0, NULL, 0) != 0;
+    failed = failed || recv(handoffSd, &type, sizeof(type), 0) != sizeof(type) || type != HOT_RESTART_ACK;
+    close(handoffSd);
+
+    if(failed){
+        LOG_WARN("Hot restart failed, serving on: %s\n", strerror(errno));
+        listenForHandoff();
+        return -1;
+    }
+    /* The new server did not get them, they end here   */
+    for(int k=0; k<nfds && transferring > 0; k++){
+        if(isClientFd(fds[k].fd) && getConnection(fds[k].fd)->shm == NULL
+           && hasFileTransfers(getConnection(fds[k].fd))){
+            shutdown(fds[k].fd, SHUT_RDWR);
+        }
+    }
+    LOG_INFO("Handed %d connections over to the new server, dropped %d on shared memory "
+             "and %d with file transfers\n", handed, dropped, transferring);
+    handedOff = TRUE;
+    return 0;
+}
+
+/* New server: the listeners of the old one, only those
+ * this server is configured for are kept. Failures end
+ * the new server, the old one serves on.               */
+void takeOverListeners(int handoffSd){
+    struct hot_restart_header header;
+    int listeners[MAX_PASSED_FDS];
+    int count = MAX_PASSED_FDS;
+    ssize_t received = receive_with_descriptors(handoffSd, &header, sizeof(header), listeners, &count);
+
+    if(received != sizeof(header) || header.type != HOT_RESTART_HEADER || header.magic != HOT_RESTART_MAGIC
+       || header.version != HOT_RESTART_VERSION || !(header.listeners & HOT_RESTART_TCP_LISTENER)
+       || count != __builtin_popcount(header.listeners)
+       || adopt_passive_socket(&listenInfo, listeners[0], &server_config.socket_profile) != 0){
+        printf("Couldn't take over from the running server \n");
+        exit(EXIT_FAILURE);
+    }
+    listen_sd = listeners[0];
+
+    int k = 1;
+    if(header.listeners & HOT_RESTART_UNIX_LISTENER){
+        int fd = listeners[k++];
+        if(server_config.unix_socket_path != NULL && adopt_passive_socket(&unixListenInfo, fd, NULL) == 0){
+            unix_listen_sd = fd;
+        }else{
+            close(fd);
+        }
+    }
+    if(header.listeners & HOT_RESTART_FEDERATION_LISTENER){
+        int fd = listeners[k++];
+        if(server_config.federation_port > 0 && adopt_passive_socket(&federationListenInfo, fd, NULL) == 0){
+            federationListenSd = fd;
+        }else{
+            close(fd);
+        }
+    }
+
+    nextConnectionId = header.next_connection_id;
+    nextSequence = header.next_sequence;
+    LOG_INFO("Taking over from the running server\n");
+}
+
+/* New server: a client of the old one. Text clients know
+ * each other by fd, so the old number is kept if free.  */
+struct connection* adoptConnection(int fd, const struct hot_restart_connection* record){
+    if(record->fd != fd && record->fd > 0 && fcntl(record->fd, F_GETFD) == -1
+       && dup2(fd, record->fd) == record->fd){
+        close(fd);
+        fd = record->fd;
+    }
+
+    struct connection* conn = addConnection(fd);
+    if(conn == NULL){
+        return NULL;
+    }
+    memcpy(conn->peer, record->peer, sizeof(conn->peer));
+    conn->peer[sizeof(conn->peer) - 1] = '\0';
+    conn->id = record->id;
+    conn->client.room = record->room;
+    conn->greeted = record->greeted;
+    conn->multicast = record->multicast && multicastFd >= 0;
+    conn->client.detached = conn->multicast;
+    chat_core_join(&chat, &conn->client, NULL);
+    mcStats.listeners += (unsigned long long) conn->multicast;
+    roomJoined(conn->client.room);
+
+    if(record->mode != PROTOCOL_UNDECIDED){
+        timer_wheel_cancel(&timers, &conn->negotiateTimer);
+        conn->mode = record->mode == PROTOCOL_BINARY ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+        if(conn->mode == PROTOCOL_BINARY){
+            protoStats.binaryConnections++;
+        }else{
+            protoStats.textConnections++;
+        }
+    }
+    /* Its DISCONNECT was still queued in the old server */
+    if(record->closing){
+        queueDisconnect(fd);
+    }
+    return conn;
+}
+
+/* New server: requeues a message, the encoding is built
+ * again and matches the bytes the old server wrote     */
+void adoptMessage(struct connection* conn, const struct hot_restart_message* record, const char* payload){
+    char peer[sizeof(record->sender_peer)];
+    memcpy(peer, record->sender_peer, sizeof(peer));
+    peer[sizeof(peer) - 1] = '\0';
+
+    struct chatMessage* msg = buildMessage(record->header.type, record->header.room, record->header.sender,
+                                           record->header.sequence, record->sender_fd, peer,
+                                           payload, record->header.length);
+    /* The old server's policy admitted it already, and a
+     * partly written head must stay                      */
+    queueControl(conn->fd, msg);
+    if(record->sent > 0 && conn->client.tail != NULL && conn->client.tail->message == msg
+       && record->sent < conn->client.tail->length){
+        conn->client.tail->sent = record->sent;
+        conn->client.queued -= record->sent;
+    }
+    releaseMessage(msg);
+}
+
+/* New server: the clients of the old one, confirmed once
+ * all arrived. Nothing is sent to them before that.     */
+void takeOverConnections(int handoffSd){
+    unsigned char* record = malloc(HOT_RESTART_MAX_RECORD);
+    struct connection* conn = NULL;    // receives the records that follow, NULL if rejected
+    int taken = 0;
+
+    for(;;){
+        int fd = -1;
+        int count = 1;
+        uint32_t type = 0;
+        ssize_t received = receive_with_descriptors(handoffSd, record, HOT_RESTART_MAX_RECORD, &fd, &count);
+        if(received >= (ssize_t) sizeof(type)){
+            memcpy(&type, record, sizeof(type));
+        }
+
+        if(type == HOT_RESTART_END && count == 0){
+            break;
+        }
+        if(type == HOT_RESTART_CONNECTION && received == sizeof(struct hot_restart_connection) && count == 1){
+            conn = adoptConnection(fd, (const struct hot_restart_connection*) record);
+            taken += conn != NULL;
+        }else if(type == HOT_RESTART_INPUT && count == 0){
+            if(conn != NULL && receiveFrames(conn->fd, conn, (const char*) record + sizeof(type),
+                                             (size_t) received - sizeof(type)) != 0){
+                queueDisconnect(conn->fd);
+            }
+        }else if(type == HOT_RESTART_MESSAGE && count == 0 && received >= (ssize_t) sizeof(struct hot_restart_message)
+                 && (size_t) received - sizeof(struct hot_restart_message)
+                    == ((const struct hot_restart_message*) record)->header.length){
+            if(conn != NULL){
+                adoptMessage(conn, (const struct hot_restart_message*) record,
+                             (const char*) record + sizeof(struct hot_restart_message));
+            }
+        }else{
+            printf("Couldn't take over the connections of the running server \n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(record);
+
+    uint32_t ack = HOT_RESTART_ACK;
+    if(hot_restart_send(handoffSd, &ack, sizeof(ack), NULL, 0, NULL, 0) != 0){
+        printf("Couldn't confirm the takeover \n");
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Took over %d connections\n", taken);
+}
+
+
+/*******************************************************/
+/* Trace Replay                                        */
+/*******************************************************/
+/* --replay runs a trace through the same handlers as
+ * fast as they go, without listeners or real clients.
+ * Each recorded client becomes a socketpair: the
+ * handlers get one end, the replay writes what the
+ * client sent into the other before the round that read
+ * it and drains what the server wrote. SOCK_SEQPACKET
+ * keeps every read the size it had, so text messages
+ * split the same way. Events the handlers queue are
+ * created again by the handlers, the dispatch counts of
+ * trace and replay show whether both went the same way.
+ * Timers run on the replay's own clock, so what they
+ * queue (sends after a negotiation timeout, presence
+ * batches) comes at other points than in the trace.     */
+#define REPLAY_DATA_MAX  65536
+#define REPLAY_SOCKET_BUFFER (4 * 1024 * 1024)
+
+struct replayBuffer {
+    struct event_trace_record* records;
+    size_t count;
+    size_t capacity;
+    unsigned char* data;    // the bytes of the DATA records, in order
+    size_t used;
+    size_t size;
+};
+
+struct replayStats {
+    unsigned long long rounds;
+    unsigned long long recorded[EVENT_TYPE_COUNT];  // DISPATCH records
+    unsigned long long clients;
+    unsigned long long bytesIn;         // written into the clients' ends
+    unsigned long long bytesOut;        // drained from them
+    unsigned long long unknownFds;      // records of clients the trace did not accept
+    unsigned long long droppedBytes;    // did not fit into a client's end
+    uint64_t elapsedNs;
+};
+struct replayStats rpStats;
+
+int* replayFds = NULL;      // by recorded descriptor: the handlers' end, -1 - none
+int replayFdCapacity = 0;
+int* replayPeers = NULL;    // by the handlers' end: the replay's end, -1 - none
+int replayPeerCapacity = 0;
+int replayEpoll = -1;       // the replay's ends that have output to drain
+
+/* ACCEPT records by the NEW_CONNECTION they followed */
+int* acceptedFds = NULL;
+size_t acceptedHead = 0;
+size_t acceptedCount = 0;
+size_t acceptedCapacity = 0;
+int* acceptGroups = NULL;
+size_t groupHead = 0;
+size_t groupCount = 0;
+size_t groupCapacity = 0;
+
+void growArray(void** array, size_t* capacity, size_t needed, size_t elementSize){
+    if(needed <= *capacity){
+        return;
+    }
+    size_t newCapacity = *capacity == 0 ? 64 : *capacity;
+    while(newCapacity < needed){
+        newCapacity *= 2;
+    }
+    void* grown = realloc(*array, newCapacity * elementSize);
+    if(grown == NULL){
+        print_error("  replay: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    *array = grown;
+    *capacity = newCapacity;
+}
 
-    for(int j=0; j<nfds; j++){
-        int fd = fds[j].fd;
-        if(fd != new_sd && fd != listen_sd && fd != 0){
-            char* mymsg = malloc(1024*sizeof(char));
-            strcpy(mymsg, msg);
-            qInsert(createEvent(MSG_TO_SEND, fd, mymsg, strlen(mymsg)));
+void setFdMap(int** map, int* capacity, int fd, int value){
+    if(fd >= *capacity){
+        size_t newCapacity = (size_t) *capacity;
+        growArray((void**) map, &newCapacity, (size_t) fd + 1, sizeof(int));
+        for(size_t k = (size_t) *capacity; k < newCapacity; k++){
+            (*map)[k] = -1;
         }
+        *capacity = (int) newCapacity;
     }
+    (*map)[fd] = value;
+}
 
-    /*****************************************************/
-    /* Check if there are more new connections           */
-    /*****************************************************/
-    qInsert(createEvent(NEW_CONNECTION, listen_sd, "", 0));
-
-    destroyEvent(evp);
+int getFdMap(const int* map, int capacity, int fd){
+    return fd >= 0 && fd < capacity ? map[fd] : -1;
 }
 
+void appendReplay(struct replayBuffer* buffer, const struct event_trace_record* record, const void* data){
+    growArray((void**) &buffer->records, &buffer->capacity, buffer->count + 1, sizeof(struct event_trace_record));
+    buffer->records[buffer->count++] = *record;
+    if(record->kind == EVENT_TRACE_DATA && record->length > 0){
+        growArray((void**) &buffer->data, &buffer->size, buffer->used + record->length, 1);
+        memcpy(buffer->data + buffer->used, data, record->length);
+        buffer->used += record->length;
+    }
+}
 
-void handleReceive(struct event* evp){
-    /*******************************************************/
-    /* Receive all incoming data on this socket            */
-    /* before we loop back and call poll again.            */
-    /*******************************************************/
-    int close_conn = FALSE;
-    char buffer[1024];
-    do
-    {
-        // Clear buffer
-        memset(&buffer[0],0,sizeof(buffer));
+/* A socketpair stands in for the client at a recorded descriptor */
+int openFakeClient(int recorded){
+    int ends[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, ends) != 0){
+        print_error("  replay: socketpair() failed");
+        return -1;
+    }
+    /* A round's input goes in at once, beyond the default limit as root */
+    int size = REPLAY_SOCKET_BUFFER;
+    if(setsockopt(ends[1], SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0){
+        setsockopt(ends[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    struct epoll_event interest;
+    memset(&interest, 0, sizeof(interest));
+    interest.events = EPOLLIN;
+    interest.data.fd = ends[0];
+    if(recorded != 0 && epoll_ctl(replayEpoll, EPOLL_CTL_ADD, ends[1], &interest) != 0){
+        print_error("  replay: epoll_ctl() failed");
+    }
+    setFdMap(&replayFds, &replayFdCapacity, recorded, ends[0]);
+    setFdMap(&replayPeers, &replayPeerCapacity, ends[0], ends[1]);
+    rpStats.clients += recorded != 0;
+    return ends[0];
+}
 
-        /*****************************************************/
-        /* Receive data on this connection until the         */
-        /* recv fails with EWOULDBLOCK. If any other        */
-        /* failure occurs, we will close the                 */
-        /* connection.                                       */
-        /*****************************************************/
-        dataSize = recv(evp->fd, buffer, sizeof(buffer), 0);
-        if (dataSize < 0)
-        {
-            if (errno != EWOULDBLOCK)
-            {
-                //perror("  recv() failed");
-                close_conn = TRUE;
-            }
-            break;
+/* Takes the place of handleConnect(): the clients the
+ * recorded NEW_CONNECTION accepted, in the same order   */
+void replayConnect(struct event* evp){
+    int count = groupHead < groupCount ? acceptGroups[groupHead++] : 0;
+    for(int k = 0; k < count; k++){
+        int fd = openFakeClient(acceptedFds[acceptedHead++]);
+        if(fd >= 0){
+            registerConnection(fd);
         }
+    }
+    if(count == server_config.accept_batch){
+        qInsert(createEvent(NEW_CONNECTION, -1, "", 0));
+    }
+    destroyEvent(evp);
+}
 
-        /*****************************************************/
-        /* Check to see if the connection has been           */
-        /* closed by the client                              */
-        /*****************************************************/
-        if (dataSize == 0)
-        {
-            printf("  Connection closed\n");
-            close_conn = TRUE;
-            break;
-        }
+/* Subscribed before handleDisconnect(), which closes the
+ * handlers' end and destroys the event                  */
+void replayDisconnect(struct event* evp){
+    int peer = getFdMap(replayPeers, replayPeerCapacity, evp->fd);
+    if(peer >= 0){
+        close(peer);
+        replayPeers[evp->fd] = -1;
+    }
+}
 
-        /*****************************************************/
-        /* Data was received                                 */
-        /*****************************************************/
-        struct sockaddr_in address;
-        int addrlen;
-        // Get details
-        getpeername(evp->fd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
+/* Writes what a client sent into its end of the pair */
+void feedClient(const struct event_trace_record* record, const unsigned char* data){
+    int fd = getFdMap(replayFds, replayFdCapacity, record->fd);
+    int peer = getFdMap(replayPeers, replayPeerCapacity, fd);
+    if(peer < 0){
+        rpStats.unknownFds++;
+        return;
+    }
+    if(record->length == 0){
+        shutdown(peer, SHUT_WR);
+        return;
+    }
+    if(send(peer, data, record->length, MSG_NOSIGNAL) != (ssize_t) record->length){
+        rpStats.droppedBytes += record->length;
+        return;
+    }
+    rpStats.bytesIn += record->length;
+}
 
-        char* msg = malloc(1024*sizeof(char));
-        sprintf(msg, "%s:%d:%d - %s\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port), evp->fd, buffer);
+/* Queues an event the recorded loop queued. Sends come
+ * from the clients' ends and the replay's own flushes.  */
+void insertRecorded(const struct event_trace_record* record){
+    int fd = record->fd;
+    if(record->type == MSG_TO_SEND){
+        return;
+    }
+    if(record->type == NEW_CONNECTION){
+        fd = -1;
+    }else if(record->type != KEYPRESS){
+        fd = getFdMap(replayFds, replayFdCapacity, record->fd);
+        if(fd < 0 || findPollIndex(fd) < 0){
+            rpStats.unknownFds++;
+            return;
+        }
+    }
 
-        /*****************************************************/
-        /* Write message to terminal                         */
-        /*****************************************************/
-        //writeToConsole(evp->fd, buffer);
-        writeToConsole(msg);
+    if(record->type == DISCONNECT){
+        queueDisconnect(fd);
+    }else{
+        qInsert(createEvent((e_type) record->type, fd, "", 0));
+    }
+}
 
-        /*****************************************************/
-        /* Create Write Event                                */
-        /*****************************************************/
-        for(int j=0; j<nfds; j++){
-            int fd = fds[j].fd;
-            if(fd != evp->fd && fd != listen_sd && fd != 0){
-                //printf("Adding to queue for fd %d", fd);
-                char* mymsg = malloc(1024*sizeof(char));
-                strcpy(mymsg, msg);
-                qInsert(createEvent(MSG_TO_SEND, fd, mymsg, strlen(mymsg)));
+/* Reads what the server wrote, after which every client
+ * the server waits on for POLLOUT is writable again     */
+void drainFakeClients(){
+    static char sink[REPLAY_DATA_MAX];
+    struct epoll_event ready[READY_BATCH];
+    int count;
+    do{
+        count = epoll_wait(replayEpoll, ready, READY_BATCH, 0);
+        for(int k = 0; k < count; k++){
+            int fd = ready[k].data.fd;
+            int peer = getFdMap(replayPeers, replayPeerCapacity, fd);
+            ssize_t len;
+            while(peer >= 0 && (len = recv(peer, sink, sizeof(sink), MSG_TRUNC)) > 0){
+                rpStats.bytesOut += (unsigned long long) len;
             }
         }
-    } while(TRUE);
+    }while(count == READY_BATCH);
 
-    /*******************************************************/
-    /* If the close_conn flag was turned on, we need       */
-    /* to clean up this active connection. This           */
-    /* clean up process includes removing the              */
-    /* descriptor.                                         */
-    /*******************************************************/
-    if (close_conn){
-        qInsert(createEvent(DISCONNECT, evp->fd, "", 0));
+    for(int k = 0; k < nfds; k++){
+        if((fds[k].events & POLLOUT) && isClientFd(fds[k].fd)){
+            setPollOut(fds[k].fd, FALSE);
+            qInsert(createEvent(MSG_TO_SEND, fds[k].fd, NULL, 0));
+        }
     }
-    destroyEvent(evp);
 }
 
+/* One recorded round: its input, the events the loop
+ * queued before it, the handlers and what the loop does
+ * after them                                            */
+void replayRound(const struct replayBuffer* inserts, const struct replayBuffer* round){
+    size_t offset = 0;
+    for(size_t k = 0; k < round->count; k++){
+        if(round->records[k].kind == EVENT_TRACE_DATA){
+            feedClient(&round->records[k], round->data + offset);
+            offset += round->records[k].length;
+        }
+    }
+    for(size_t k = 0; k < inserts->count; k++){
+        insertRecorded(&inserts->records[k]);
+    }
 
-void handleSend(struct event* evp){
-    dataSize = send(evp->fd, evp->message, (size_t) evp->msglen, 0);
-    if (dataSize < 0)
-    {
-        perror("  send() failed");
-        qInsert(createEvent(DISCONNECT, evp->fd, "", 0));
-        free(evp->message);
+    dispatchEvents();
+    if(flushCount > 0 && monotonic_time_ns() >= flushDeadline){
+        flushCoalesced();
     }
-    destroyEvent(evp);
+    drainFakeClients();
+    timer_wheel_advance(&timers, monotonic_time_ns());
+    rpStats.rounds++;
 }
 
+void printReplayStats(FILE* stream){
+    fprintf(stream, "trace=%s rounds=%llu clients=%llu bytes_in=%llu bytes_out=%llu unknown_fds=%llu "
+                    "dropped_bytes=%llu elapsed_ms=%.3f\n",
+            server_config.replay_path, rpStats.rounds, rpStats.clients, rpStats.bytesIn, rpStats.bytesOut,
+            rpStats.unknownFds, rpStats.droppedBytes, (double) rpStats.elapsedNs / 1e6);
+    for(int t = 0; t < EVENT_TYPE_COUNT; t++){
+        fprintf(stream, "%s recorded=%llu replayed=%llu\n", getEventName((e_type) t),
+                rpStats.recorded[t], (unsigned long long) handlerHistograms[t].total_count);
+    }
+}
 
-void handleDisconnect(struct event* evp){
-    close(evp->fd);
+/* Runs the trace at path, then the events it left queued */
+void replayTrace(const char* path){
+    event_trace* trace = event_trace_open(path);
+    unsigned char* data = malloc(REPLAY_DATA_MAX);
+    replayEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if(trace == NULL || data == NULL || replayEpoll < 0){
+        printf("Couldn't read trace %s \n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The console reads from fd 0, the recorded keys go there */
+    int console = openFakeClient(0);
+    if(console < 0 || dup2(console, 0) < 0){
+        printf("Couldn't replace the console \n");
+        exit(EXIT_FAILURE);
+    }
+    setFdMap(&replayPeers, &replayPeerCapacity, 0, replayPeers[console]);
+    replayPeers[console] = -1;
+    close(console);
+    setFdMap(&replayFds, &replayFdCapacity, 0, 0);
 
-    char* msg = malloc(1024*sizeof(char));
-    sprintf(msg, "FD %d has left the chat room.\n", evp->fd);
-    printf("%s", msg);
+    struct replayBuffer buffers[2];
+    memset(buffers, 0, sizeof(buffers));
+    struct replayBuffer* inserts = &buffers[0];
+    struct replayBuffer* nextInserts = &buffers[1];
+    struct replayBuffer round;
+    memset(&round, 0, sizeof(round));
 
-    for(int j=0; j<nfds; j++){
-        int fd = fds[j].fd;
-        if(fd != evp->fd && fd != listen_sd && fd != 0){
-            char* mymsg = malloc(1024*sizeof(char));
-            strcpy(mymsg, msg);
-            qInsert(createEvent(MSG_TO_SEND, fd, mymsg, strlen(mymsg)));
+    uint64_t started = monotonic_time_ns();
+    struct event_trace_record record;
+    int result;
+    while((result = event_trace_read(trace, &record, data, REPLAY_DATA_MAX)) > 0 && record.kind != EVENT_TRACE_ROUND){
+        if(record.kind == EVENT_TRACE_INSERT){
+            appendReplay(inserts, &record, NULL);
         }
     }
 
-    for(int i=0; i<nfds; i++){
-        if(evp->fd == fds[i].fd){
-            fds[i].fd = -1;
-
-            for(j = i; j < nfds; j++)
-            {
-                fds[j].fd = fds[j+1].fd;
+    /*****************************************************/
+    /* A round's records run up to the next ROUND; the   */
+    /* INSERTs among them belong to the next round       */
+    /*****************************************************/
+    while(result > 0 && end_server == FALSE){
+        round.count = 0;
+        round.used = 0;
+        nextInserts->count = 0;
+        while((result = event_trace_read(trace, &record, data, REPLAY_DATA_MAX)) > 0
+              && record.kind != EVENT_TRACE_ROUND){
+            switch(record.kind){
+                case EVENT_TRACE_INSERT:
+                    appendReplay(nextInserts, &record, NULL);
+                    break;
+                case EVENT_TRACE_DISPATCH:
+                    if(record.type < EVENT_TYPE_COUNT){
+                        rpStats.recorded[record.type]++;
+                    }
+                    if(record.type == NEW_CONNECTION){
+                        growArray((void**) &acceptGroups, &groupCapacity, groupCount + 1, sizeof(int));
+                        acceptGroups[groupCount++] = 0;
+                    }
+                    break;
+                case EVENT_TRACE_ACCEPT:
+                    if(groupCount > groupHead){
+                        growArray((void**) &acceptedFds, &acceptedCapacity, acceptedCount + 1, sizeof(int));
+                        acceptedFds[acceptedCount++] = record.fd;
+                        acceptGroups[groupCount - 1]++;
+                    }
+                    break;
+                case EVENT_TRACE_DATA:
+                    appendReplay(&round, &record, data);
+                    break;
             }
-            nfds--;
-            break;
         }
+        replayRound(inserts, &round);
+
+        struct replayBuffer* done = inserts;
+        inserts = nextInserts;
+        nextInserts = done;
+    }
+    if(result < 0){
+        LOG_WARN("Trace %s is truncated, replayed %llu rounds\n", path, rpStats.rounds);
     }
 
-    destroyEvent(evp);
+    /* What the handlers queued for after the trace ended */
+    while(qCount > 0 && end_server == FALSE){
+        dispatchEvents();
+        drainFakeClients();
+    }
+    if(flushCount > 0){
+        flushCoalesced();
+        drainFakeClients();
+    }
+    rpStats.elapsedNs = monotonic_time_ns() - started;
+
+    event_trace_close(trace);
+    for(int k = 0; k < 2; k++){
+        free(buffers[k].records);
+        free(buffers[k].data);
+    }
+    free(round.records);
+    free(round.data);
+    free(data);
+    stats_dump(stdout);
 }
 
+void chat_server_event(int port)
+{
+    printf("Starting event server \n");
+    /* Pinned before anything is allocated, see cpu_affinity.h */
+    cpu_pin_current_thread(cpu_list_pick(&server_config.io_cpus, workerIndex), "Event loop");
+    /* Workers of the prefork server share the port */
+    struct listen_options listenOptions = {server_config.listen_backlog, bus != NULL, &server_config.socket_profile};
+    acceptBuffer = malloc(server_config.accept_batch * sizeof(int));
+    chat_core_init(&chat, &chatOps, server_config.outbound_high_water, server_config.outbound_low_water,
+                   server_config.backpressure_policy);
+    chat_core_set_timers(&chat, &timers, server_config.idle_timeout, server_config.heartbeat_interval,
+                         server_config.write_stall_timeout);
 
-void handleKeypress(struct event* evp){
-    char* c = malloc(1024*sizeof(char));
-    read (0, c, 1024);
+    int handoffSd = -1;
+    if (server_config.handoff_path != NULL) {
+        handoffSd = hot_restart_connect(server_config.handoff_path);
+    }
 
-    for(int j=0; j<nfds; j++){
-        int fd = fds[j].fd;
-        if(fd != 0 && fd != listen_sd){
-            char* mymsg = malloc(1024*sizeof(char));
-            strcpy(mymsg, "Server: ");
-            strcat(mymsg, c);
-            qInsert(createEvent(MSG_TO_SEND, fd, mymsg, strlen(mymsg)));
+    if (server_config.replay_path != NULL) {
+        /* A replay has no listeners, the trace brings the clients */
+    } else if (handoffSd >= 0) {
+        /*********************************************************/
+        /* Hot restart: the running server passes its listeners, */
+        /* its clients follow once the rest is set up            */
+        /*********************************************************/
+        takeOverListeners(handoffSd);
+    } else if (server_config.acceptor_threads > 0) {
+        /*********************************************************/
+        /* Acceptor threads own SO_REUSEPORT listeners and hand  */
+        /* accepted sockets over through a pipe                  */
+        /*********************************************************/
+        listen_sd = start_acceptor_threads(server_config.acceptor_threads, (uint16_t) port,
+                                           &listenOptions, server_config.accept_batch, &server_config.accept_cpus);
+        if (listen_sd < 0) {
+            printf("Couldn't start acceptor threads \n");
+            exit(EXIT_FAILURE);
+        }
+        acceptorHandoff = TRUE;
+    } else {
+        if( (create_passive_socket_with_options(&listenInfo, (uint16_t ) port, &listenOptions)) != 0)
+        {
+            printf("Couldn't create passive socket \n");
+            exit(EXIT_FAILURE);
+        }
+        listen_sd = listenInfo->socket_fd;
+    }
+    /*************************************************************/
+    /* pollfd structure init and the reactor watching it          */
+    /*************************************************************/
+    if (server_config.max_connections > 0) {
+        maxConnections = server_config.max_connections;
+        maxPollFds = maxConnections + POLL_RESERVED;
+        /* every slot is a descriptor, plus those outside the table */
+        long fileLimit = raise_file_limit(maxPollFds + POLL_RESERVED);
+        if (fileLimit >= 0 && fileLimit < maxPollFds + POLL_RESERVED) {
+            maxPollFds = fileLimit > 3 * POLL_RESERVED ? (int) fileLimit - POLL_RESERVED : 2 * POLL_RESERVED;
+            maxConnections = maxPollFds - POLL_RESERVED;
+            LOG_WARN("Open files limited to %ld, serving at most %d connections\n", fileLimit, maxConnections);
         }
     }
+    /* poll() walks every descriptor on every wait */
+    enum reactor_backend backend = server_config.reactor_backend;
+    if (backend == REACTOR_DEFAULT) {
+        backend = maxPollFds > READY_BATCH ? REACTOR_EPOLL : REACTOR_POLL;
+    }
+    ioReactor = reactor_create(backend, &timers);
+    if (ioReactor == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Using the %s reactor\n", reactor_backend_name(reactor_get_backend(ioReactor)));
 
-    destroyEvent(evp);
-}
+    /*************************************************************/
+    /* Set up listening socket and terminal fd                   */
+    /*************************************************************/
+    nfds = 0;
+    if (server_config.replay_path == NULL) {
+        if (workerIndex == 0) {
+            addPollFd(0);
+            fcntl (0, F_SETFL, O_NONBLOCK);
+        }
+
+        addPollFd(listen_sd);
+    }
 
+    /*************************************************************/
+    /* Optional Unix domain listener next to the TCP port        */
+    /*************************************************************/
+    if (server_config.unix_socket_path != NULL && workerIndex == 0) {
+        if (unix_listen_sd < 0) {
+            if (create_passive_unix_socket(&unixListenInfo, server_config.unix_socket_path, &listenOptions) != 0) {
+                printf("Couldn't create unix domain socket \n");
+                exit(EXIT_FAILURE);
+            }
+            unix_listen_sd = unixListenInfo->socket_fd;
+        }
+        addPollFd(unix_listen_sd);
+    }
+    /*************************************************************/
+    /* Optional multicast group for broadcasts                   */
+    /*************************************************************/
+    if (server_config.multicast_group != NULL) {
+        multicastFd = create_multicast_sender(server_config.multicast_group,
+                                              server_config.multicast_interface, MULTICAST_TTL);
+        if (multicastFd < 0) {
+            printf("Couldn't create multicast socket \n");
+            exit(EXIT_FAILURE);
+        }
+        historySize = (size_t) server_config.multicast_history;
+        history = calloc(historySize, sizeof(struct chatMessage*));
+        LOG_INFO("Publishing broadcasts to %s\n", server_config.multicast_group);
+    }
+    /*************************************************************/
+    /* Prefork worker: eventfd of the bus between the workers    */
+    /*************************************************************/
+    if (bus != NULL) {
+        busWakeFd = broadcast_log_wake_fd(bus, workerIndex);
+        addPollFd(busWakeFd);
+        broadcast_cursor_init(bus, &busCursor);
+    }
+    /*************************************************************/
+    /* poll() sleeps until the next timer is due, or not at all  */
+    /* while events are still queued                             */
+    /*************************************************************/
+    timer_wheel_init(&timers, TIMER_TICK_NS, monotonic_time_ns());
+    timer_entry_init(&acceptPauseTimer, onAcceptPause, NULL);
+    timer_entry_init(&handoffDrainTimer, onHandoffDrain, NULL);
 
+    /*************************************************************/
+    /* Federation: links to the servers given with --peer and    */
+    /* a listener for those that link to this one               */
+    /*************************************************************/
+    if (isFederated()) {
+        federationEpoch = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+        roomMembers = calloc(FEDERATION_ROOMS, sizeof(uint32_t));
+        for (int k = 0; k < FEDERATION_MAX_PEERS; k++) {
+            links[k].fd = -1;
+            links[k].address = k < server_config.peer_count ? server_config.peers[k] : NULL;
+            links[k].redialDelay = REDIAL_MIN_NS;
+            timer_entry_init(&links[k].redialTimer, onRedial, &links[k]);
+            if (links[k].address != NULL) {
+                timer_wheel_arm(&timers, &links[k].redialTimer, monotonic_time_ns());
+            }
+        }
+        if (server_config.federation_port > 0) {
+            if (federationListenSd < 0) {
+                if (create_passive_socket_with_options(&federationListenInfo,
+                                                       (uint16_t) server_config.federation_port,
+                                                       &listenOptions) != 0) {
+                    printf("Couldn't create federation socket \n");
+                    exit(EXIT_FAILURE);
+                }
+                federationListenSd = federationListenInfo->socket_fd;
+            }
+            addPollFd(federationListenSd);
+        }
+        LOG_INFO("Federated as node %d\n", server_config.node_id);
+    }
 
-void chat_server_event(int port)
-{
-    printf("Starting event server \n");
-    if( (create_passive_socket(&listenInfo, (uint16_t ) port)) != 0)
-    {
-        printf("Couldn't create passive socket \n");
-        exit(EXIT_FAILURE);
+    /*************************************************************/
+    /* Hot restart: the clients of the previous server, then    */
+    /* the socket the next server connects to                   */
+    /*************************************************************/
+    if (handoffSd >= 0) {
+        takeOverConnections(handoffSd);
+        close(handoffSd);
+    }
+    if (server_config.handoff_path != NULL) {
+        listenForHandoff();
     }
-    listen_sd = listenInfo->socket_fd;
+
     /*************************************************************/
-    /* pollfd structure init                                      */
+    /* File transfer needs a spool directory we can write to     */
     /*************************************************************/
-    memset(fds, 0 , sizeof(fds));
+    if (server_config.spool_dir != NULL && access(server_config.spool_dir, W_OK | X_OK) != 0) {
+        fprintf(stderr, "Spool directory %s is not writable: %s\n", server_config.spool_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     /*************************************************************/
-    /* Set up listening socket and terminal fd                   */
+    /* Event trace: see "Event Traces" and event_trace.h         */
     /*************************************************************/
-    fds[0].fd = 0;
-    fds[0].events = POLLIN;
-    fcntl (0, F_SETFL, O_NONBLOCK);
+    if (server_config.trace_path != NULL) {
+        eventTrace = event_trace_create(server_config.trace_path);
+        if (eventTrace == NULL) {
+            printf("Couldn't create trace %s \n", server_config.trace_path);
+            exit(EXIT_FAILURE);
+        }
+        LOG_INFO("Tracing events to %s\n", server_config.trace_path);
 
-    fds[1].fd = listen_sd;
-    fds[1].events = POLLIN;
-    timeout = 0; // Now 0, because we want the event queue to be processed even if poll is not ready and we're not multithreading.... (10 * 60 * 1000);
+        struct sigaction stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.sa_handler = requestTraceStop;
+        sigemptyset(&stop.sa_mask);
+        sigaction(SIGINT, &stop, NULL);
+        sigaction(SIGTERM, &stop, NULL);
+    }
 
     /*************************************************************/
     /* Register Event Handlers                                  */
     /*************************************************************/
     //printf("Adding subscriptions\n");
-    subscribe(NEW_CONNECTION, handleConnect);
+    subscribe(NEW_CONNECTION, server_config.replay_path != NULL ? replayConnect : handleConnect);
     subscribe(MSG_RECEIVED, handleReceive);
     subscribe(MSG_TO_SEND, handleSend);
+    if (server_config.replay_path != NULL) {
+        subscribe(DISCONNECT, replayDisconnect);
+    }
     subscribe(DISCONNECT, handleDisconnect);
     subscribe(KEYPRESS, handleKeypress);
 
+    /*************************************************************/
+    /* Stats: dumped on SIGUSR1 or "/stats" on the console       */
+    /*************************************************************/
+    resetLatencyHistograms();
+    stats_register("event latency", printLatencyHistograms);
+    stats_register("event queue", printQueueStats);
+    stats_register("accept", printAcceptStats);
+    stats_register("backpressure", printBackpressureStats);
+    stats_register("timers", printTimerStats);
+    stats_register("sends", printSendStats);
+    stats_register("memory", printMemoryStats);
+    if (rateLimited()) {
+        stats_register("rate limits", printRateLimitStats);
+    }
+    if (server_config.zerocopy_threshold > 0) {
+        stats_register("zerocopy", printZerocopyStats);
+    }
+    if (server_config.spool_dir != NULL) {
+        stats_register("files", printFileStats);
+    }
+    if (presenceBatched()) {
+        timer_entry_init(&presenceTimer, flushPresence, NULL);
+        stats_register("presence", printPresenceStats);
+    }
+    stats_register("protocol", printProtocolStats);
+    if (multicastFd >= 0) {
+        stats_register("multicast", printMulticastStats);
+    }
+    if (unix_listen_sd >= 0) {
+        stats_register("shm", printShmStats);
+    }
+    if (bus != NULL) {
+        stats_register("worker", printWorkerStats);
+    }
+    if (isFederated()) {
+        stats_register("federation", printFederationStats);
+    }
+    if (server_config.replay_path != NULL) {
+        stats_register("replay", printReplayStats);
+    }
+    stats_install_signal_handler(SIGUSR1);
+    stats_set_wakeup(wakeReactor, ioReactor);
+
+    /*************************************************************/
+    /* A replay runs the trace instead of the event loop         */
+    /*************************************************************/
+    if (server_config.replay_path != NULL) {
+        replayTrace(server_config.replay_path);
+        end_server = TRUE;
+    }
+
     /*************************************************************/
     /* Event Loop   */
     /*************************************************************/
-    do
+    while (end_server == FALSE)
     {
+        if(stats_dump_requested()){
+            dumpStats();
+        }
+        if(traceStopRequested){
+            break;
+        }
+
+        /* The reactor shortens the sleep to the next timer itself */
+        uint64_t now = monotonic_time_ns();
+        timeout = qCount > 0 || prepareShmSleep() || prepareBusSleep() ? 0 : MAX_POLL_TIMEOUT_MS;
+
+        /* Coalesced messages must not wait longer than their budget,
+         * which is in microseconds                                  */
+        uint64_t timeoutNs = (uint64_t) timeout * 1000000ULL;
+        if(flushCount > 0 && timeoutNs > 0){
+            uint64_t remaining = flushDeadline > now ? flushDeadline - now : 0;
+            if(remaining < timeoutNs){
+                timeoutNs = remaining;
+            }
+        }
+
+        /* Readiness of the last round is stale now */
+        for(int k = 0; k < readyCount; k++){
+            int index = findPollIndex(readyEvents[k].fd);
+            if(index >= 0){
+                fds[index].revents = 0;
+            }
+        }
+
         //printf("Polling...\n");
-        rc = poll(fds, nfds, timeout);
+        rc = reactor_wait(ioReactor, timeoutNs, readyEvents, READY_BATCH);
 
         if (rc < 0) {
-            perror("  poll() failed");
+            readyCount = 0;
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("  reactor_wait() failed");
             break;
         }
+        readyCount = rc;
+        for(int k = 0; k < readyCount; k++){
+            int index = findPollIndex(readyEvents[k].fd);
+            if(index >= 0){
+                uint32_t ready = readyEvents[k].events;
+                fds[index].revents = (short) (((ready & REACTOR_READ) ? POLLIN : 0) | ((ready & REACTOR_WRITE) ? POLLOUT : 0)
+                                              | ((ready & REACTOR_ERROR) ? POLLERR : 0) | ((ready & REACTOR_HANGUP) ? POLLHUP : 0));
+            }
+        }
+        pollShmRings();
+        pollBus();
+        pollLinks();
+
         if (rc == 0)
         {
-            /* Poll time out (0 s) - nothing to read */
+            /* Poll time out - nothing to read */
             //printf("  poll() timed out\n");
         }else{
             /***********************************************************/
             /* Find and handle the active FDs                           */
             /***********************************************************/
-            current_size = nfds;
-            for (i = 0; i < current_size; i++)
+            for (int k = 0; k < readyCount; k++)
             {
-                if(fds[i].revents == 0){
+                i = findPollIndex(readyEvents[k].fd);
+                if(i < 0 || fds[i].revents == 0 || wakeOwner(fds[i].fd) >= 0 || fds[i].fd == busWakeFd
+                   || fds[i].fd == federationListenSd || findLink(fds[i].fd) != NULL){
                     //printf("FD not active\n");
                     continue;
                 }
 
 
                 /*********************************************************/
-                /* If revents is not POLLIN, it's an unexpected result,  */
-                /* log and end the server.                               */
+                /* An error on the listener or terminal is unexpected,   */
+                /* log and end the server. Errors on a client only end   */
+                /* that client.                                          */
+                /*********************************************************/
+                int isClient = isClientFd(fds[i].fd);
+                if(isClient && (fds[i].revents & POLLERR) && server_config.zerocopy_threshold > 0
+                   && reapErrorQueue(fds[i].fd, getConnection(fds[i].fd)) == 0){
+                    /* Only zero-copy notifications, possibly for sends
+                     * of the server this one took over from          */
+                    fds[i].revents &= ~POLLERR;
+                    if(fds[i].revents == 0){
+                        continue;
+                    }
+                }
+                /*********************************************************/
+                /* A closed console pipe reports a bare POLLHUP: the     */
+                /* console ends like on a read of 0 in handleKeypress(). */
+                /* Input still buffered in the pipe is read first.       */
                 /*********************************************************/
-                if(fds[i].revents != POLLIN){
-                    printf("  Error! revents = %d\n", fds[i].revents);
+                if(fds[i].fd == 0 && (fds[i].revents & POLLHUP) && !(fds[i].revents & (POLLERR | POLLNVAL))){
+                    if(!(fds[i].revents & POLLIN)){
+                        removePollFd(0);
+                        continue;
+                    }
+                    fds[i].revents &= ~POLLHUP;
+                }
+                if((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) && !isClient){
+                    fprintf_error("  Error! revents = %d\n", fds[i].revents);
                     end_server = TRUE;
                     break;
 
                 }
-                if (fds[i].fd == listen_sd){
+                if (isClient && (fds[i].revents & POLLOUT)){
+                    setPollOut(fds[i].fd, FALSE);
+                    qInsert(createEvent(MSG_TO_SEND, fds[i].fd, NULL, 0));
+                }
+                if (isClient && !(fds[i].revents & POLLIN)){
+                    if(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)){
+                        queueDisconnect(fds[i].fd);
+                    }
+                    continue;
+                }
+                if (fds[i].fd == handoffListenSd){
+                    handoffRequested = TRUE;
+                }
+                else if (fds[i].fd == listen_sd || fds[i].fd == unix_listen_sd){
                     //printf("  Listening socket is readable\n");
-                    qInsert(createEvent(NEW_CONNECTION, listen_sd, "", 0));
+                    qInsert(createEvent(NEW_CONNECTION, fds[i].fd, "", 0));
                 }
                 else if(fds[i].fd == 0){
                     // Writing on terminal
@@ -429,6 +4727,9 @@ void chat_server_event(int port)
                 }
                 else{
                     //printf("  Descriptor %d is readable\n", fds[i].fd);
+                    if(getConnection(fds[i].fd)->shmActive){
+                        getConnection(fds[i].fd)->shmClosed = TRUE;
+                    }
                     qInsert(createEvent(MSG_RECEIVED, fds[i].fd,"", 0));
                 }  /* End of existing connection is readable             */
             } /* End of loop through pollable descriptors              */
@@ -442,22 +4743,29 @@ void chat_server_event(int port)
          * we will create blocking behavior if we keep looping
          * when we always create a new write event if we cant write
         /*********************************************************/
-        for(int i=0; i<qCount; i++){
-            struct event* event;
-            qRemove(&event);
-            if(event != NULL){
-                //printf("Handling event %s - overall %d subscriptions\n", getEventName(event->type), subscrCounter);
-                for(int j=0; j<subscrCounter; j++){
-                    if(subscriptions[j]->type == event->type){
-                        //printf("Found subscription\n");
-                        subscriptions[j]->cb(event);
-                        //printf("Subscription handled\n");
-                    }
-                }
+        dispatchEvents();
+
+        /*********************************************************/
+        /* Coalescing: flush once the oldest message used up its */
+        /* budget, with a budget of 0 after every iteration      */
+        /*********************************************************/
+        if(flushCount > 0 && monotonic_time_ns() >= flushDeadline){
+            flushCoalesced();
+        }
+
+        /* Everything forwarded in this iteration, one send() per link */
+        flushLinks();
+
+        /* Hot restart: handed over after everything else, the
+         * new server serves from the next event on          */
+        if(handoffRequested){
+            handoffRequested = FALSE;
+            if(drainFileFrames() && handOver() == 0){
+                end_server = TRUE;
             }
         }
 
-    } while (end_server == FALSE); /* End of serving running.    */
+    } /* End of serving running.    */
 
     /*************************************************************/
     /* Clean up all of the sockets that are open                  */
@@ -467,5 +4775,52 @@ void chat_server_event(int port)
         if(fds[i].fd >= 0)
             close(fds[i].fd);
     }
+    if (multicastFd >= 0)
+    {
+        close(multicastFd);
+    }
+    stats_set_wakeup(NULL, NULL);
+    reactor_destroy(ioReactor);
+    ioReactor = NULL;
+    /* After a hot restart the paths belong to the new server */
+    if (unix_listen_sd >= 0 && server_config.unix_socket_path[0] != '@' && !handedOff)
+    {
+        unlink(server_config.unix_socket_path);
+    }
+    if (handoffListenSd >= 0 && server_config.handoff_path[0] != '@')
+    {
+        unlink(server_config.handoff_path);
+    }
+    removeSpool();
+    if (eventTrace != NULL && event_trace_close(eventTrace) != 0)
+    {
+        LOG_WARN("Trace %s is incomplete\n", server_config.trace_path);
+    }
+    eventTrace = NULL;
+}
+
+void runWorker(int worker, void* argument){
+    workerIndex = worker;
+    chat_server_event(*(int*) argument);
+}
+
+/* Prefork mode: the calling process becomes the supervisor
+ * of the workers and only returns once they are stopped  */
+void chat_server_prefork(int port, int workers)
+{
+    printf("Starting prefork server with %d workers \n", workers);
+    bus = broadcast_log_create(workers);
+    if (bus == NULL) {
+        printf("Couldn't create broadcast log \n");
+        exit(EXIT_FAILURE);
+    }
+
+    run_prefork_workers(workers, runWorker, &port);
+
+    /* Workers are stopped by a signal and leave the Unix socket behind */
+    if (server_config.unix_socket_path != NULL && server_config.unix_socket_path[0] != '@')
+    {
+        unlink(server_config.unix_socket_path);
+    }
 }
 
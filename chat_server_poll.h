@@ -7,4 +7,5 @@
 
 #endif //CHAT_CHAT_SERVER_POLL_H
 
-void chat_server_event(int port);
\ No newline at end of file
+void chat_server_event(int port);
+void chat_server_prefork(int port, int workers);
\ No newline at end of file
@@ -19,122 +19,334 @@ int port;
 
 
 #include "chat_server_threads.h"
+#include "chat_core.h"
+#include "error_reporting.h"
+#include "server_config.h"
+#include "tcp_socket.h"
+#include "acceptor.h"
+#include "monotonic_clock.h"
+#include "timer_wheel.h"
+#include "server_stats.h"
+#include <vector>
+#include <sys/time.h>
 
-
-int threadFileDescriptors[MAXTHREADS] = {};
-pthread_cond_t threadConditions[MAXTHREADS] = {};
-pthread_mutex_t threadMutexes[MAXTHREADS] = {};
-
+#define TIMER_TICK_NS (10ULL * 1000 * 1000)
 
 
+//>0 while the client is in the chat, only touched by the master thread
+int threadFileDescriptors[MAXTHREADS] = {};
+pthread_cond_t threadConditions[MAXTHREADS];
 
+//the chat core's idle and heartbeat timers, only advanced by the master
+//thread and under chatLock; write stalls end in SO_SNDTIMEO instead
+timer_wheel clientTimers;
+//armed while accept() is out of descriptors or memory, the listeners are
+//left out of select() until it expired
+static timer_entry acceptPauseTimer;
 
-char buffer[1025];  //data buffer of 1
+//the chat core of chat_core.h with a client per slot, shared by all threads
+//under chatLock like the flags below
+static pthread_mutex_t chatLock = PTHREAD_MUTEX_INITIALIZER;
+static chat_core chat;
+static chat_client chatClients[MAXTHREADS];
+static bool slotBusy[MAXTHREADS];      // from addClient() until the client thread ended
+static bool slotLeft[MAXTHREADS];      // the master thread took the client out of the chat
 
 
 struct arg_struct {
     int fd;
+    int slot;
 };
 
+//the slot's thread sends what was queued
+void wakeClientThread(chat_client *client) {
+    pthread_cond_signal(&threadConditions[client - chatClients]);
+}
 
-int findPositionInArray(int val, int *arr, int size) {
-    int i;
-    for (i = 0; i < size; i++) {
-        if (arr[i] == val)
-            return i;
+//a slow consumer: its thread stops writing and shuts the socket down, the
+//master thread then sees the disconnect
+void dropClient(chat_client *client) {
+    client->closing = 1;
+    pthread_cond_signal(&threadConditions[client - chatClients]);
+}
+
+//takes a text from chat_core.h
+chat_text *makeMessage(char *text, int length) {
+    chat_text *msg = chat_text_adopt(text, length);
+    if (msg == NULL) {
+        print_error("makeMessage: out of memory");
+        exit(EXIT_FAILURE);
     }
-    return -1;
+    return msg;
 }
 
+//an empty line, the same for every client
+void *heartbeatMessage(chat_client *) {
+    static chat_text *heartbeat = makeMessage(strdup("\n"), 1);
+    chat_text_retain(heartbeat);
+    return heartbeat;
+}
+
+const chat_core_ops chatOps = {
+    chat_text_retain, chat_text_release, chat_text_encode, wakeClientThread, dropClient, heartbeatMessage, NULL
+};
+
+//SO_SNDTIMEO turns a client that stopped reading into EAGAIN
+bool sendAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                LOG_WARN("fd %d did not read for %d s, disconnecting\n", fd, server_config.write_stall_timeout);
+            }
+            return false;
+        }
+        data += sent;
+        length -= (size_t) sent;
+    }
+    return true;
+}
+
+//sends the slot's queue one message at a time, the lock is not held while
+//writing. The slot and the socket stay with the thread until the master
+//thread took the client out of the chat, so neither goes to a new client
+//while the thread still uses them.
 void *socketThread(void *arguments) {
     struct arg_struct *args = (struct arg_struct *) arguments;
+    int fd = args->fd;
+    int slot = args->slot;
+    chat_client *client = &chatClients[slot];
+    bool shut = false;
+    delete args;
+
+    LOG_DEBUG("New Thread with fd: %d\n", fd);
+
+    pthread_mutex_lock(&chatLock);
+    while (!slotLeft[slot]) {
+        const char *data;
+        size_t length;
+        void *msg = client->closing ? NULL : chat_core_pop(&chat, client, &data, &length);
+
+        if (msg == NULL) {
+            //a failed write or the backpressure policy, the master thread
+            //sees the shut down socket as a disconnect
+            if (client->closing && !shut) {
+                shutdown(fd, SHUT_RDWR);
+                shut = true;
+            }
+            pthread_cond_wait(&threadConditions[slot], &chatLock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&chatLock);
+        bool sent = sendAll(fd, data, length);
+        pthread_mutex_lock(&chatLock);
+
+        chat_text_release(msg);
+        if (sent) {
+            chat_core_written(client);
+        } else {
+            client->closing = 1;
+            chat_core_clear(&chat, client);
+        }
+    }
 
-    std::cout << "New Thread with fd: " << args->fd << "\n";
+    chat_core_clear(&chat, client);
+    close(fd);
+    slotBusy[slot] = false;
+    pthread_mutex_unlock(&chatLock);
+    return NULL;
+}
 
-    int threadFileDescriptor = args->fd;
 
-    int positionOfClient = findPositionInArray(threadFileDescriptor, threadFileDescriptors, MAXTHREADS);
+//hands a text to the chat core for everybody but the client in exceptSlot,
+//the sender; -1 reaches everybody
+void writeMessageToAllUsers(char *text, int length, int exceptSlot) {
+    chat_text *msg = makeMessage(text, length);
 
+    pthread_mutex_lock(&chatLock);
+    chat_core_broadcast(&chat, msg, CHAT_ROOM_ALL, exceptSlot < 0 ? NULL : &chatClients[exceptSlot]);
+    chat_text_release(msg);
+    pthread_mutex_unlock(&chatLock);
+}
 
-    while (true) {
-        pthread_mutex_lock(&threadMutexes[positionOfClient]);
-        pthread_cond_wait(&threadConditions[positionOfClient], &threadMutexes[positionOfClient]);
-        // printf("Got SocketThread Cond \n");
-        pthread_mutex_unlock(&threadMutexes[positionOfClient]);
-
-        try {
-            send(threadFileDescriptor, buffer, strlen(buffer), 0);
-        } catch (std::string exception) {
-            threadFileDescriptors[positionOfClient] = 0;
-            pthread_exit(NULL);
+//add new socket to a free slot and start its thread
+void addClient(int new_socket) {
+    int slot = -1;
+
+    pthread_mutex_lock(&chatLock);
+    for (int i = 0; i < MAXTHREADS && slot < 0; i++) {
+        if (!slotBusy[i]) {
+            slot = i;
+            slotBusy[i] = true;
+            slotLeft[i] = false;
+            chatClients[i] = chat_client();
+            chatClients[i].fd = new_socket;
         }
     }
+    pthread_mutex_unlock(&chatLock);
 
+    if (slot < 0) {
+        LOG_WARN("fd %d rejected, all %d client slots are in use\n", new_socket, MAXTHREADS);
+        close(new_socket);
+        return;
+    }
+
+    struct arg_struct *args = new arg_struct;
+    args->fd = new_socket;
+    args->slot = slot;
+
+    pthread_t clientSocketThread;
+    if (cpu_thread_create(&clientSocketThread, cpu_list_pick(&server_config.worker_cpus, slot), "Client",
+                          socketThread, args) != 0) {
+        print_error("pthread_create");
+        close(new_socket);
+        delete args;
+        pthread_mutex_lock(&chatLock);
+        slotBusy[slot] = false;
+        pthread_mutex_unlock(&chatLock);
+        return;
+    }
+    pthread_detach(clientSocketThread);
+    threadFileDescriptors[slot] = new_socket;
+
+    char *text;
+    int length = chat_format_join(&text, new_socket);
+    chat_text *msg = makeMessage(text, length);
+    pthread_mutex_lock(&chatLock);
+    chat_core_watch(&chat, &chatClients[slot]);
+    chat_core_join(&chat, &chatClients[slot], msg);
+    chat_text_release(msg);
+    pthread_mutex_unlock(&chatLock);
 }
 
+//register connections taken from a listener or the acceptor threads
+void addClients(const int *sockets, int count) {
+    char peer[48];
 
-void writeMessageToAllUsers(std::string buffer) {
+    for (int k = 0; k < count; k++) {
+        int new_socket = sockets[k];
 
-    for (int i = 0; i < MAXTHREADS + 1; i++) {
-        if (threadFileDescriptors[i] > 0) {
-            pthread_mutex_lock(&threadMutexes[i]);
-            // printf("SocketThread Cond fire\n");
-            pthread_cond_signal(&threadConditions[i]);
-            pthread_mutex_unlock(&threadMutexes[i]);
+        //client threads use blocking I/O, bounded by the write stall timeout
+        fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) & ~O_NONBLOCK);
+        if (server_config.write_stall_timeout > 0) {
+            struct timeval stall = {server_config.write_stall_timeout, 0};
+            setsockopt(new_socket, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
         }
+
+        //inform user of socket number - used in send and receive commands
+        format_peer_address(new_socket, peer, sizeof(peer));
+        LOG_INFO("New connection , socket fd is %d , peer is : %s \n", new_socket, peer);
+
+        addClient(new_socket);
+    }
+}
+
+//take a client out of the chat and tell everybody else; its thread closes
+//the socket and frees the slot
+void disconnectClient(int i) {
+    int sd = threadFileDescriptors[i];
+
+    LOG_INFO("FD %d has left the chat room.\n", sd);
+
+    threadFileDescriptors[i] = 0;
+
+    //ends a send the client thread is blocked in
+    shutdown(sd, SHUT_RDWR);
+
+    char *text;
+    int length = chat_format_leave(&text, sd);
+    chat_text *msg = makeMessage(text, length);
+    pthread_mutex_lock(&chatLock);
+    chat_core_unwatch(&chat, &chatClients[i]);
+    chat_core_leave(&chat, &chatClients[i], msg);
+    chatClients[i].closing = 1;
+    slotLeft[i] = true;
+    pthread_cond_signal(&threadConditions[i]);
+    chat_text_release(msg);
+    pthread_mutex_unlock(&chatLock);
+}
+
+//nothing to do, select() takes the listeners again once it is not armed
+void onAcceptPause(timer_entry *timer) {
+    (void) timer;
+}
+
+//accept() failed for want of descriptors or memory: exits unless that
+//passes, otherwise the listeners rest for a moment
+void pauseAccepting(int fd) {
+    pthread_mutex_lock(&chatLock);
+    int paused = chat_core_pause_accepting(&chat, &acceptPauseTimer, fd);
+    pthread_mutex_unlock(&chatLock);
+    if (paused != 0) {
+        exit(EXIT_FAILURE);
     }
 }
 
 void *masterSocketThread(void *ptr) {
-    int master_socket, addrlen, new_socket, activity, valread, sd;
+    int master_socket, activity, valread, sd;
+    char received[1024];
+    int unix_socket = -1;
     fd_set readfds;
     int max_sd;
-    struct sockaddr_in address;
-    char *message = "Welcome!\n";
+    char peer[48];
+    socket_info *listener = NULL;
+    socket_info *unixListener = NULL;
+    struct listen_options listenOptions = {server_config.listen_backlog, 0, &server_config.socket_profile};
+    bool acceptorHandoff = server_config.acceptor_threads > 0;
+    std::vector<int> accepted(server_config.accept_batch);
 
     //initialise all client_socket[] to 0 so not checked
+    timer_wheel_init(&clientTimers, TIMER_TICK_NS, monotonic_time_ns());
     for (int i = 0; i < MAXTHREADS; i++) {
         threadFileDescriptors[i] = 0;
+        pthread_cond_init(&threadConditions[i], NULL);
     }
+    timer_entry_init(&acceptPauseTimer, onAcceptPause, NULL);
 
 
-    //create a master socket
-    if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-
-
-
-    //type of socket created
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    //bind the socket to localhost port 8888
-    if (bind(master_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+    //create a master socket, or let acceptor threads with their own
+    //SO_REUSEPORT sockets hand over new connections through a pipe
+    if (acceptorHandoff) {
+        master_socket = start_acceptor_threads(server_config.acceptor_threads, (uint16_t) port,
+                                               &listenOptions, server_config.accept_batch, &server_config.accept_cpus);
+        if (master_socket < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (create_passive_socket_with_options(&listener, (uint16_t) port, &listenOptions) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        master_socket = listener->socket_fd;
     }
     printf("Listener on port %d \n", port);
 
-    //try to specify maximum of 3 pending connections for the master socket
-    if (listen(master_socket, 3) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
+    //optional Unix domain listener for local clients
+    if (server_config.unix_socket_path != NULL) {
+        if (create_passive_unix_socket(&unixListener, server_config.unix_socket_path, &listenOptions) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        unix_socket = unixListener->socket_fd;
+        printf("Listener on %s \n", server_config.unix_socket_path);
     }
 
     //accept the incoming connection
-    addrlen = sizeof(address);
     puts("Wait for connections ...");
 
     for (;;) {
         //clear the socket set
         FD_ZERO(&readfds);
 
-        //add master socket to set
-        FD_SET(master_socket, &readfds);
+        //add master socket to set, unless accepting rests
         max_sd = master_socket;
+        if (!timer_entry_armed(&acceptPauseTimer)) {
+            FD_SET(master_socket, &readfds);
+            if (unix_socket >= 0) {
+                FD_SET(unix_socket, &readfds);
+                if (unix_socket > max_sd)
+                    max_sd = unix_socket;
+            }
+        }
 
         //add child sockets to set
         for (int i = 0; i < MAXTHREADS; i++) {
@@ -150,53 +362,48 @@ void *masterSocketThread(void *ptr) {
                 max_sd = sd;
         }
 
-        //wait for an activity on one of the sockets , timeout is NULL , so wait indefinitely
-        activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
+        //wait for an activity on one of the sockets or the next timer,
+        //without armed timers wait indefinitely
+        int timeout = timer_wheel_timeout_ms(&clientTimers, monotonic_time_ns());
+        struct timeval wait = {timeout / 1000, (timeout % 1000) * 1000};
+        activity = select(max_sd + 1, &readfds, NULL, NULL, timeout < 0 ? NULL : &wait);
 
 
         if ((activity < 0) && (errno != EINTR)) {
             printf("select error");
         }
 
-        //If something happened on the master socket , then its an incoming connection
-        if (FD_ISSET(master_socket, &readfds)) {
-            if ((new_socket = accept(master_socket, (struct sockaddr *) &address, (socklen_t *) &addrlen)) < 0) {
-                perror("accept");
-                exit(EXIT_FAILURE);
-            }
-
-            //inform user of socket number - used in send and receive commands
-            printf("New connection , socket fd is %d , ip is : %s , port : %d \n", new_socket,
-                   inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+        //the chat core's timers run under its lock like everything else of it
+        pthread_mutex_lock(&chatLock);
+        timer_wheel_advance(&clientTimers, monotonic_time_ns());
+        pthread_mutex_unlock(&chatLock);
+        if (activity <= 0) {
+            continue;
+        }
 
-            //send new connection greeting message
-            if (send(new_socket, message, strlen(message), 0) != strlen(message)) {
-                perror("send");
+        //If something happened on the master socket , then there are incoming connections,
+        //take up to accept_batch of them at once
+        bool tcpPending = FD_ISSET(master_socket, &readfds);
+        bool unixPending = unix_socket >= 0 && FD_ISSET(unix_socket, &readfds);
+        if (tcpPending || unixPending) {
+            if (tcpPending) {
+                int count = acceptorHandoff
+                            ? receive_accepted_connections(master_socket, accepted.data(), server_config.accept_batch)
+                            : accept_connections(&listener, accepted.data(), server_config.accept_batch);
+                if (count < 0) {
+                    pauseAccepting(master_socket);
+                    count = 0;
+                }
+                addClients(accepted.data(), count);
             }
 
-
-            //add new socket to array of sockets
-            for (int i = 0; i < MAXTHREADS; i++) {
-                //if position is empty
-                if (threadFileDescriptors[i] == 0) {
-
-                    //printf("Adding new socket to list %d\n", i);
-
-                    pthread_mutex_t new_mutex = PTHREAD_MUTEX_INITIALIZER;
-                    pthread_cond_t new_cond = PTHREAD_COND_INITIALIZER;
-
-                    struct arg_struct args;
-                    args.fd = new_socket;
-
-                    threadFileDescriptors[i] = new_socket;
-                    threadMutexes[i] = new_mutex;
-                    threadConditions[i] = new_cond;
-
-                    pthread_t clientSocketThread;
-                    int err = pthread_create(&clientSocketThread, NULL, socketThread, &args);
-
-                    break;
+            if (unixPending) {
+                int count = accept_connections(&unixListener, accepted.data(), server_config.accept_batch);
+                if (count < 0) {
+                    pauseAccepting(unix_socket);
+                    count = 0;
                 }
+                addClients(accepted.data(), count);
             }
 
 
@@ -205,41 +412,25 @@ void *masterSocketThread(void *ptr) {
             for (int i = 0; i < MAXTHREADS; i++) {
                 sd = threadFileDescriptors[i];
 
-                if (FD_ISSET(sd, &readfds)) {
-                    //Check if it was for closing , and also read the incoming message
-                    if ((valread = read(sd, buffer, 1024)) == 0) {
+                //the slot may have been closed by a timer after select returned
+                if (sd > 0 && FD_ISSET(sd, &readfds)) {
+                    //Check if it was for closing , and also read the incoming message,
+                    //errors such as ETIMEDOUT of a vanished peer count as disconnect
+                    if ((valread = read(sd, received, sizeof(received))) <= 0) {
                         //Somebody disconnected , get his details and print
-                        getpeername(sd, (struct sockaddr *) &address, (socklen_t *) &addrlen);
-
-                        std::string ipFromSender = inet_ntoa(address.sin_addr);
-                        std::string portFromSender = std::to_string(ntohs(address.sin_port));
-                        std::string messageFromSender = ipFromSender + ":" + portFromSender + " disconnected \n";
-
-
-                        strcpy(buffer, messageFromSender.c_str());
-                        std::cout << buffer << "\n";
-
-
-                        //Close the socket and mark as 0 in list for reuse
-                        close(sd);
-                        threadFileDescriptors[i] = 0;
-
-                        writeMessageToAllUsers(buffer);
+                        disconnectClient(i);
                     }
                         //Echo back the message that came in
                     else {
-                        getpeername(sd, (struct sockaddr *) &address, (socklen_t *) &addrlen);
-                        buffer[valread] = '\0';
-
-                        std::string ipFromSender = inet_ntoa(address.sin_addr);
-                        std::string portFromSender = std::to_string(ntohs(address.sin_port));
-
-                        std::string messageFromSender = ipFromSender + ":" + portFromSender + ": " + buffer;
-
-                        strcpy(buffer, messageFromSender.c_str());
-
-                        std::cout << buffer << "\n";
-                        writeMessageToAllUsers(buffer);
+                        pthread_mutex_lock(&chatLock);
+                        chat_core_received(&chatClients[i]);
+                        pthread_mutex_unlock(&chatLock);
+                        format_peer_address(sd, peer, sizeof(peer));
+
+                        char *text;
+                        int length = chat_format_message(&text, peer, sd, received, (size_t) valread);
+                        LOG_DEBUG("%.*s", length, text);
+                        writeMessageToAllUsers(text, length, i);
                     }
                 }
             }
@@ -252,20 +443,19 @@ void *serverChatThread(void *ptr) {
         std::string serverMessage = "";
 
         //mtx.lock();
-        std::getline(std::cin, serverMessage);
-
-        std::string portOfServer = std::to_string(port);
-
-        std::string ipFromSender = "Server";
-        std::string portFromSender = port + "";
-        std::string messageFromSender = ipFromSender + ":" + portOfServer + ": " + serverMessage + " \n";
-
-        strcpy(buffer, messageFromSender.c_str());
-        //std::cout << buffer << "\n";
+        if (!std::getline(std::cin, serverMessage)) {
+            return NULL;
+        }
+        serverMessage += "\n";
 
-        if (strlen(buffer) > 0) {
-            writeMessageToAllUsers(buffer);
+        if (chat_console_command(serverMessage.c_str()) == CHAT_CONSOLE_STATS) {
+            stats_dump(stdout);
+            continue;
         }
+
+        char *text;
+        int length = chat_format_server(&text, serverMessage.c_str());
+        writeMessageToAllUsers(text, length, -1);
     }
 }
 
@@ -273,14 +463,28 @@ void *serverChatThread(void *ptr) {
 
 
 
+void printBackpressureStats(FILE *stream) {
+    pthread_mutex_lock(&chatLock);
+    chat_core_print_stats(&chat, stream);
+    pthread_mutex_unlock(&chatLock);
+}
+
+
 extern "C" void chat_server_threads(int numberOfThreads, int serverPort) {
     port=serverPort;
+    chat_core_init(&chat, &chatOps, server_config.outbound_high_water, server_config.outbound_low_water,
+                   server_config.backpressure_policy);
+    chat_core_set_timers(&chat, &clientTimers, server_config.idle_timeout, server_config.heartbeat_interval,
+                         server_config.write_stall_timeout);
+    stats_register("backpressure", printBackpressureStats);
 
     //threadConditions=new pthread_cond_t[numberOfThreads];
     //threadMutexes = new pthread_mutex_t[numberOfThreads];
 
+    //the select() thread reads every client, it is the one to place
     pthread_t serverSocketThread;
-    int errorServerSocketThread = pthread_create(&serverSocketThread, NULL, masterSocketThread, NULL);
+    int errorServerSocketThread = cpu_thread_create(&serverSocketThread, cpu_list_pick(&server_config.io_cpus, 0),
+                                                    "Master", masterSocketThread, NULL);
 
     pthread_t chatServerThread;
     int errorChatServerThread = pthread_create(&chatServerThread, NULL, serverChatThread, NULL);
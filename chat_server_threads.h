@@ -7,6 +7,8 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+    /// Runs the chat core of chat_core.h with one blocking thread per client
+    /// instead of a reactor backend; the core is shared under one lock.
     void chat_server_threads(int numberOfThreads, int serverPort);
 
 
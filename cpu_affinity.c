@@ -0,0 +1,252 @@
+/*
+ * CPU placement of server threads, see cpu_affinity.h. Only the Linux
+ * interfaces are used: sched affinity, /proc/interrupts and sysfs.
+ */
+
+#define _GNU_SOURCE
+#include "cpu_affinity.h"
+#include "error_reporting.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Appends a CPU unless the list has it already.
+static int append_cpu(struct cpu_list* list, int cpu)
+{
+    for(int i = 0; i < list->count; i++)
+    {
+        if(list->cpus[i] == cpu)
+        {
+            return 0;
+        }
+    }
+    if(list->count == CPU_LIST_MAX)
+    {
+        return -1;
+    }
+    list->cpus[list->count++] = cpu;
+    return 0;
+}
+
+/// Parses "0-3,8" and appends the CPUs in the order given.
+static int parse_ranges(const char* text, struct cpu_list* list)
+{
+    const char* position = text;
+
+    while(*position != '\0' && *position != '\n')
+    {
+        char* end;
+        long first = strtol(position, &end, 10);
+        long last = first;
+
+        if(end == position || first < 0)
+        {
+            return -1;
+        }
+        if(*end == '-')
+        {
+            position = end + 1;
+            last = strtol(position, &end, 10);
+            if(end == position || last < first)
+            {
+                return -1;
+            }
+        }
+        if(last >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            if(append_cpu(list, (int) cpu) != 0)
+            {
+                return -1;
+            }
+        }
+
+        position = end;
+        if(*position == ',')
+        {
+            position++;
+        }
+        else if(*position != '\0' && *position != '\n')
+        {
+            return -1;
+        }
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+/// Collects the CPUs the interrupts of a network interface are routed to.
+/// Interrupts belong to the interface if their name in /proc/interrupts
+/// contains it as a whole word, e.g. "eth0-TxRx-3" for eth0.
+static int parse_irq_cpus(const char* interface, struct cpu_list* list)
+{
+    FILE* interrupts = fopen("/proc/interrupts", "r");
+    char line[4096];
+    size_t length = strlen(interface);
+    int found = 0;
+
+    if(interrupts == NULL || length == 0)
+    {
+        if(interrupts != NULL)
+        {
+            fclose(interrupts);
+        }
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), interrupts) != NULL)
+    {
+        char* end;
+        long irq = strtol(line, &end, 10);
+        if(end == line || *end != ':')
+        {
+            continue;
+        }
+
+        int matches = 0;
+        for(const char* hit = strstr(end, interface); hit != NULL && !matches; hit = strstr(hit + 1, interface))
+        {
+            matches = isspace((unsigned char) hit[-1]) && !isalnum((unsigned char) hit[length]);
+        }
+        if(!matches)
+        {
+            continue;
+        }
+
+        // effective_affinity_list is what the interrupt controller really uses
+        char path[64];
+        char affinity[1024];
+        FILE* file;
+        snprintf(path, sizeof(path), "/proc/irq/%ld/effective_affinity_list", irq);
+        file = fopen(path, "r");
+        if(file == NULL)
+        {
+            snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+            file = fopen(path, "r");
+        }
+        if(file == NULL)
+        {
+            continue;
+        }
+        if(fgets(affinity, sizeof(affinity), file) != NULL && parse_ranges(affinity, list) == 0)
+        {
+            found++;
+        }
+        fclose(file);
+    }
+
+    fclose(interrupts);
+    return found > 0 ? 0 : -1;
+}
+
+/// Parses a CPU list given on the command line.
+/// \param spec - "0-3,8" or "irq:IFACE"
+/// \param list - Receives the CPUs
+/// \return 0 - success; -1 - malformed, or no interrupts of the interface found
+int parse_cpu_list(const char* spec, struct cpu_list* list)
+{
+    list->count = 0;
+    if(strncmp(spec, "irq:", 4) == 0)
+    {
+        return parse_irq_cpus(spec + 4, list);
+    }
+    return parse_ranges(spec, list);
+}
+
+/// Picks the CPU of the index-th thread of a kind.
+/// \return CPU - success; -1 - the list is empty, the thread is not pinned
+int cpu_list_pick(const struct cpu_list* list, int index)
+{
+    return list->count > 0 ? list->cpus[index % list->count] : -1;
+}
+
+/// Starts a thread that runs on the given CPU from its first instruction on,
+/// so its stack and buffers come from the node of that CPU.
+/// \param thread - Receives the thread
+/// \param cpu - CPU to run on, -1 to leave it to the scheduler
+/// \param name - Kind of thread, for the log
+/// \return 0 - success; error number of pthread_create() - failure
+int cpu_thread_create(pthread_t* thread, int cpu, const char* name, void* (*start)(void*), void* argument)
+{
+    pthread_attr_t attributes;
+    cpu_set_t cpus;
+    int result;
+
+    pthread_attr_init(&attributes);
+    if(cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+    }
+
+    result = pthread_create(thread, &attributes, start, argument);
+    if(result == EINVAL && cpu >= 0)
+    {
+        // The CPU is offline or not in our cpuset, run unpinned
+        LOG_WARN("Could not pin %s thread to CPU %d\n", name, cpu);
+        pthread_attr_destroy(&attributes);
+        return cpu_thread_create(thread, -1, name, start, argument);
+    }
+    if(result == 0 && cpu >= 0)
+    {
+        LOG_INFO("%s thread runs on CPU %d (node %d)\n", name, cpu, cpu_node(cpu));
+    }
+    pthread_attr_destroy(&attributes);
+    return result;
+}
+
+/// Pins the calling thread, before it allocates the memory it works on.
+/// \param cpu - CPU to run on, -1 to leave it to the scheduler
+/// \param name - Kind of thread, for the log
+/// \return 0 - success or nothing to do; -1 - failure
+int cpu_pin_current_thread(int cpu, const char* name)
+{
+    cpu_set_t cpus;
+
+    if(cpu < 0)
+    {
+        return 0;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+        LOG_WARN("Could not pin %s thread to CPU %d\n", name, cpu);
+        return -1;
+    }
+    LOG_INFO("%s thread runs on CPU %d (node %d)\n", name, cpu, cpu_node(cpu));
+    return 0;
+}
+
+/// Looks up the NUMA node of a CPU in sysfs.
+/// \return node - success; -1 - unknown, e.g. a kernel without NUMA
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent* entry;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* directory = opendir(path);
+    if(directory == NULL)
+    {
+        return -1;
+    }
+    while(node < 0 && (entry = readdir(directory)) != NULL)
+    {
+        if(strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char) entry->d_name[4]))
+        {
+            node = atoi(entry->d_name + 4);
+        }
+    }
+    closedir(directory);
+    return node;
+}
@@ -0,0 +1,37 @@
+#ifndef CHAT_CPU_AFFINITY_H
+#define CHAT_CPU_AFFINITY_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// CPU placement of server threads. A CPU list is written like for
+/// taskset -c, e.g. "0-3,8", or as "irq:IFACE" for the CPUs that serve the
+/// interrupts of a network interface, in the order of its queues. Threads
+/// of one kind take the CPUs of their list round-robin; an empty list
+/// leaves them to the scheduler.
+///
+/// There is no explicit NUMA allocation: a thread is pinned before it
+/// allocates and touches its buffers, so the kernel's first-touch policy
+/// places them on the node of its CPU.
+#define CPU_LIST_MAX 256
+
+struct cpu_list
+{
+    int count;                  // 0 - not pinned
+    int cpus[CPU_LIST_MAX];
+};
+
+int parse_cpu_list(const char* spec, struct cpu_list* list);
+int cpu_list_pick(const struct cpu_list* list, int index);
+int cpu_thread_create(pthread_t* thread, int cpu, const char* name, void* (*start)(void*), void* argument);
+int cpu_pin_current_thread(int cpu, const char* name);
+int cpu_node(int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_CPU_AFFINITY_H
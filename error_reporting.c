@@ -1,37 +1,404 @@
 //
 // Created by robert on 29.09.17.
 //
+// Asynchronous error reporting and logging. Every thread formats its messages
+// into its own single-producer/single-consumer ring buffer, a background thread
+// drains all rings and writes them to stderr (errors, warnings) or stdout (info,
+// debug). Producers never take a lock and never block: when their ring is full
+// the message is dropped and counted.
+//
 
+#define _GNU_SOURCE
 #include "error_reporting.h"
+#include "server_stats.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <sched.h>
 
 /// Flag for error reporting; 1 - print, 0 - no print
 #define REPORT_ERROR 1
 
-/// Mutex securing stdout/stderr
-pthread_mutex_t mutex_print = PTHREAD_MUTEX_INITIALIZER;
+/// Number of messages a single thread can have in flight
+#define LOG_RING_SLOTS 128
+
+/// Maximum length of a single message, longer messages are truncated.
+/// Large enough for a full chat message echoed at debug level.
+#define LOG_RECORD_SIZE 1088
+
+/// How long the drain thread sleeps when no producer wakes it up
+#define LOG_IDLE_TIMEOUT_MS 100
+
+struct log_record
+{
+    uint64_t timestamp_ms;
+    uint16_t length;
+    uint8_t level;
+    char text[LOG_RECORD_SIZE];
+};
+
+/// Ring owned by one producer thread. Rings are never freed; when a thread
+/// exits its ring is released and can be claimed by the next new thread.
+struct log_ring
+{
+    _Atomic uint32_t head;      // next slot to write, advanced by the producer
+    _Atomic uint32_t tail;      // next slot to read, advanced by the drain thread
+    _Atomic int in_use;
+    struct log_ring* next;
+    struct log_record records[LOG_RING_SLOTS];
+};
+
+/// Lock-free list of all rings, new rings are pushed to the front
+static _Atomic(struct log_ring*) log_rings = NULL;
+
+static __thread struct log_ring* thread_ring = NULL;
+static pthread_key_t thread_ring_key;
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_t drain_thread;
+static _Atomic int drain_running = 0;
+
+/// Futex word: 1 while the drain thread sleeps and wants to be woken up
+static _Atomic int drain_sleeping = 0;
+
+/// Runtime threshold for messages that were not compiled out
+int log_level = LOG_LEVEL_INFO;
+
+static _Atomic uint64_t dropped_messages = 0;
+static _Atomic uint64_t written_messages = 0;
+
+/// Formatted timestamp of the last drained message; only touched by the drain thread
+static uint64_t cached_timestamp_ms = UINT64_MAX;
+static char cached_timestamp[40];
+static int cached_timestamp_length = 0;
+
+/// Returns the wall clock time in milliseconds from the coarse clock, which is a
+/// plain memory read in the vDSO.
+static uint64_t coarse_time_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+/// Returns the "[date time.ms] " prefix for the timestamp. strftime() is only
+/// called when the second changes, the millisecond part is patched in place.
+/// \param timestamp_ms - Wall clock time in milliseconds
+static const char* format_timestamp(uint64_t timestamp_ms)
+{
+    if(timestamp_ms == cached_timestamp_ms)
+    {
+        return cached_timestamp;
+    }
+
+    if(cached_timestamp_ms == UINT64_MAX || timestamp_ms / 1000 != cached_timestamp_ms / 1000)
+    {
+        time_t seconds = (time_t) (timestamp_ms / 1000);
+        struct tm time_struct;
+
+        if(localtime_r(&seconds, &time_struct) == NULL)
+        {
+            cached_timestamp[0] = '\0';
+            cached_timestamp_length = 0;
+            cached_timestamp_ms = timestamp_ms;
+            return cached_timestamp;
+        }
+
+        char buffer[30];
+        strftime(buffer, sizeof(buffer), "%F %T", &time_struct);
+        cached_timestamp_length = snprintf(cached_timestamp, sizeof(cached_timestamp), "[%s.000] ", buffer);
+    }
+
+    unsigned int milliseconds = (unsigned int) (timestamp_ms % 1000);
+    char* ms_digits = cached_timestamp + cached_timestamp_length - 5;
+    ms_digits[0] = (char) ('0' + milliseconds / 100);
+    ms_digits[1] = (char) ('0' + milliseconds / 10 % 10);
+    ms_digits[2] = (char) ('0' + milliseconds % 10);
+
+    cached_timestamp_ms = timestamp_ms;
+    return cached_timestamp;
+}
+
+/// Writes the whole buffer to the file descriptor, retrying on partial writes.
+static void write_all(int fd, const char* buffer, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        buffer += written;
+        length -= (size_t) written;
+    }
+}
+
+/// Output buffer of the drain thread for one file descriptor
+struct log_output
+{
+    int fd;
+    size_t used;
+    char buffer[16384];
+};
+
+static void append_output(struct log_output* output, const char* prefix, size_t prefix_length,
+                          const char* text, size_t text_length)
+{
+    if(output->used + prefix_length + text_length > sizeof(output->buffer))
+    {
+        write_all(output->fd, output->buffer, output->used);
+        output->used = 0;
+    }
+
+    memcpy(output->buffer + output->used, prefix, prefix_length);
+    memcpy(output->buffer + output->used + prefix_length, text, text_length);
+    output->used += prefix_length + text_length;
+}
+
+/// Moves all pending messages of all rings to stderr/stdout.
+/// \return number of drained messages
+static int drain_rings(void)
+{
+    static struct log_output error_output = {STDERR_FILENO, 0, {0}};
+    static struct log_output info_output = {STDOUT_FILENO, 0, {0}};
+    int drained = 0;
+
+    for(struct log_ring* ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while(tail != head)
+        {
+            struct log_record* record = &ring->records[tail % LOG_RING_SLOTS];
+            const char* prefix = format_timestamp(record->timestamp_ms);
+
+            append_output(record->level <= LOG_LEVEL_WARN ? &error_output : &info_output,
+                          prefix, (size_t) cached_timestamp_length, record->text, record->length);
+
+            tail++;
+            drained++;
+        }
+
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    if(error_output.used > 0)
+    {
+        write_all(error_output.fd, error_output.buffer, error_output.used);
+        error_output.used = 0;
+    }
+    if(info_output.used > 0)
+    {
+        write_all(info_output.fd, info_output.buffer, info_output.used);
+        info_output.used = 0;
+    }
+
+    atomic_fetch_add_explicit(&written_messages, (uint64_t) drained, memory_order_relaxed);
+    return drained;
+}
+
+/// Background thread draining the rings. Sleeps on a futex while all rings are
+/// empty; producers only issue the wake-up syscall when it actually sleeps.
+static void* drain_thread_main(void* argument)
+{
+    (void) argument;
+
+    while(atomic_load(&drain_running))
+    {
+        if(drain_rings() > 0)
+        {
+            continue;
+        }
+
+        atomic_store(&drain_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // A producer may have published between the drain and setting the flag
+        if(drain_rings() > 0)
+        {
+            atomic_store(&drain_sleeping, 0);
+            continue;
+        }
+
+        struct timespec timeout = {0, LOG_IDLE_TIMEOUT_MS * 1000000L};
+        syscall(SYS_futex, &drain_sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+        atomic_store(&drain_sleeping, 0);
+    }
+
+    drain_rings();
+    return NULL;
+}
+
+static void wake_drain_thread(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&drain_sleeping, memory_order_relaxed)
+       && atomic_exchange(&drain_sleeping, 0))
+    {
+        syscall(SYS_futex, &drain_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/// Stops the drain thread and flushes everything that is still queued.
+static void stop_logger(void)
+{
+    if(!atomic_exchange(&drain_running, 0))
+    {
+        return;
+    }
+
+    atomic_store(&drain_sleeping, 0);
+    syscall(SYS_futex, &drain_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(drain_thread, NULL);
+}
+
+static void print_logger_stats(FILE* stream)
+{
+    fprintf(stream, "written=%llu dropped=%llu\n",
+            (unsigned long long) atomic_load(&written_messages),
+            (unsigned long long) atomic_load(&dropped_messages));
+}
+
+/// Releases the ring of an exiting thread so a new thread can reuse it.
+static void release_thread_ring(void* ring)
+{
+    atomic_store(&((struct log_ring*) ring)->in_use, 0);
+}
+
+static void start_logger(void)
+{
+    pthread_key_create(&thread_ring_key, release_thread_ring);
+
+    atomic_store(&drain_running, 1);
+    if(pthread_create(&drain_thread, NULL, drain_thread_main, NULL) != 0)
+    {
+        atomic_store(&drain_running, 0);
+        return;
+    }
+
+    stats_register("logger", print_logger_stats);
+    atexit(stop_logger);
+}
+
+/// Returns the ring of the calling thread, claiming a released ring or
+/// allocating a new one on first use.
+static struct log_ring* get_thread_ring(void)
+{
+    if(thread_ring != NULL)
+    {
+        return thread_ring;
+    }
+
+    pthread_once(&logger_once, start_logger);
+
+    struct log_ring* ring;
+    for(ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+    {
+        int expected = 0;
+        if(atomic_compare_exchange_strong(&ring->in_use, &expected, 1))
+        {
+            break;
+        }
+    }
+
+    if(ring == NULL)
+    {
+        ring = calloc(1, sizeof(struct log_ring));
+        if(ring == NULL)
+        {
+            return NULL;
+        }
+
+        atomic_store(&ring->in_use, 1);
+        ring->next = atomic_load(&log_rings);
+        while(!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+        {
+        }
+    }
+
+    pthread_setspecific(thread_ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
 
-/// Prints the current time to stderr
-void print_time_error(void)
+/// Formats a message into the next free slot of the calling thread's ring.
+/// \param level - Log level, decides between stderr and stdout
+/// \param error_number - errno to append as ": strerror" or 0
+/// \param format - Format string
+/// \param arguments - Arguments for the format string
+static void log_message(int level, int error_number, const char* format, va_list arguments)
 {
-    char buffer[30];
-    time_t current_time;
-    struct tm *time_struct;
+    struct log_ring* ring = get_thread_ring();
 
-    current_time = time(NULL);
-    time_struct = localtime(&current_time);
+    if(ring == NULL || !atomic_load_explicit(&drain_running, memory_order_relaxed))
+    {
+        vfprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, format, arguments);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
 
-    if (time_struct == NULL)
+    if(head - tail == LOG_RING_SLOTS)
     {
+        atomic_fetch_add_explicit(&dropped_messages, 1, memory_order_relaxed);
         return;
     }
 
-    strftime(buffer, sizeof(buffer), "%F %T", time_struct);
-    fprintf(stderr, "[%s] ", buffer);
+    struct log_record* record = &ring->records[head % LOG_RING_SLOTS];
+    record->timestamp_ms = coarse_time_ms();
+
+    int length = vsnprintf(record->text, sizeof(record->text), format, arguments);
+    if(length < 0)
+    {
+        length = 0;
+    }
+    else if(length >= (int) sizeof(record->text))
+    {
+        length = sizeof(record->text) - 1;
+    }
+
+    if(error_number != 0)
+    {
+        char error_text[128];
+        const char* description = strerror_r(error_number, error_text, sizeof(error_text));
+        length += snprintf(record->text + length, sizeof(record->text) - (size_t) length, ": %s\n", description);
+        if(length >= (int) sizeof(record->text))
+        {
+            length = sizeof(record->text) - 1;
+            record->text[length - 1] = '\n';
+        }
+    }
+
+    record->length = (uint16_t) length;
+    record->level = (uint8_t) level;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    wake_drain_thread();
+}
+
+static void log_printf(int error_number, const char* format, ...)
+{
+    va_list arguments;
+
+    va_start(arguments, format);
+    log_message(LOG_LEVEL_ERROR, error_number, format, arguments);
+    va_end(arguments);
 }
 
 /// Prints the message to stderr, including errno information if available.
@@ -43,21 +410,15 @@ void print_error(const char* message)
         return;
     }
 
-    pthread_mutex_lock(&mutex_print);
-
-    print_time_error();
-
     if(errno != 0)
     {
-        perror(message);
+        log_printf(errno, "%s", message);
         errno = 0;
     }
     else
     {
-        fprintf(stderr, "%s\n", message);
+        log_printf(0, "%s\n", message);
     }
-
-    pthread_mutex_unlock(&mutex_print);
 }
 
 /// Formatted print for a variable number of arguments
@@ -71,15 +432,86 @@ void fprintf_error(const char *format, ...)
         return;
     }
 
-    pthread_mutex_lock(&mutex_print);
+    va_list arguments;
 
-    print_time_error();
+    va_start(arguments, format);
+    log_message(LOG_LEVEL_ERROR, 0, format, arguments);
+    va_end(arguments);
+}
 
+/// Formatted log message at the given level. Use the LOG_* macros instead,
+/// they drop messages below the compile-time and runtime thresholds.
+/// \param level - One of the LOG_LEVEL_* constants
+/// \param format - Format string
+/// \param ... - variadic arguments
+void log_write(int level, const char *format, ...)
+{
     va_list arguments;
 
     va_start(arguments, format);
-    vfprintf(stderr, format, arguments);
+    log_message(level, 0, format, arguments);
     va_end(arguments);
+}
+
+/// Parses a log level name (error, warn, info, debug) or number.
+/// \param name - String to parse
+/// \param level - Pointer to integer where the level is stored
+/// \return 0 - success; -1 - failure
+int parse_log_level(const char* name, int* level)
+{
+    static const char* names[] = {"error", "warn", "info", "debug"};
+
+    for(int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if(strcmp(name, names[i]) == 0 || (name[0] == '0' + i && name[1] == '\0'))
+        {
+            *level = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/// Returns the number of messages that were dropped because a ring was full.
+uint64_t dropped_error_messages(void)
+{
+    return atomic_load(&dropped_messages);
+}
 
-    pthread_mutex_unlock(&mutex_print);
-}
\ No newline at end of file
+/// Restarts the drain thread in a child process, fork() only copies the
+/// calling thread. Call flush_errors() before forking, or messages queued
+/// at that moment are written by parent and child.
+void logger_after_fork(void)
+{
+    atomic_store(&drain_sleeping, 0);
+    if(!atomic_load(&drain_running))
+    {
+        return;
+    }
+
+    if(pthread_create(&drain_thread, NULL, drain_thread_main, NULL) != 0)
+    {
+        atomic_store(&drain_running, 0);
+    }
+}
+
+/// Blocks until all messages queued so far have been written. Used before
+/// exiting or forking so no message is lost.
+void flush_errors(void)
+{
+    if(!atomic_load(&drain_running))
+    {
+        return;
+    }
+
+    for(struct log_ring* ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+    {
+        uint32_t head = atomic_load(&ring->head);
+        while((int32_t) (atomic_load(&ring->tail) - head) < 0)
+        {
+            wake_drain_thread();
+            sched_yield();
+        }
+    }
+}
@@ -1,7 +1,57 @@
 #ifndef CHAT_ERROR_REPORTING_H
 #define CHAT_ERROR_REPORTING_H
 
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+/// Compile-time log level; calls above it are removed by the preprocessor.
+/// Set with -DCHAT_LOG_LEVEL=<0-3> (see CMakeLists.txt).
+#ifndef CHAT_LOG_LEVEL
+#define CHAT_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Runtime log level, only consulted for calls that were compiled in
+extern int log_level;
+
 void print_error(const char* message);
 void fprintf_error(const char *fmt, ...);
+void log_write(int level, const char *fmt, ...);
+int parse_log_level(const char* name, int* level);
+uint64_t dropped_error_messages(void);
+void flush_errors(void);
+void logger_after_fork(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define LOG_AT_LEVEL(level, ...) \
+    do { if((level) <= log_level) log_write((level), __VA_ARGS__); } while(0)
+
+#if CHAT_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT_LEVEL(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { } while(0)
+#endif
+
+#if CHAT_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT_LEVEL(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while(0)
+#endif
+
+#if CHAT_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT_LEVEL(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while(0)
+#endif
 
 #endif //CHAT_ERROR_REPORTING_H
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include "event_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Records are collected in a buffer this large and written in one go
+#define EVENT_TRACE_BUFFER (1024 * 1024)
+
+struct event_trace
+{
+    FILE* file;
+    char* buffer;
+    int failed;                 // a write or read went wrong
+};
+
+static event_trace* event_trace_new(const char* path, const char* mode)
+{
+    event_trace* trace = calloc(1, sizeof(event_trace));
+    if(trace == NULL)
+    {
+        return NULL;
+    }
+    trace->file = fopen(path, mode);
+    trace->buffer = malloc(EVENT_TRACE_BUFFER);
+    if(trace->file == NULL || trace->buffer == NULL)
+    {
+        if(trace->file != NULL)
+        {
+            fclose(trace->file);
+        }
+        free(trace->buffer);
+        free(trace);
+        return NULL;
+    }
+    setvbuf(trace->file, trace->buffer, _IOFBF, EVENT_TRACE_BUFFER);
+    return trace;
+}
+
+/// Starts a trace file, replacing one at path.
+/// \param path - File to write
+/// \return trace to write - success; NULL - the file could not be created
+event_trace* event_trace_create(const char* path)
+{
+    event_trace* trace = event_trace_new(path, "wb");
+    if(trace != NULL && fwrite(EVENT_TRACE_MAGIC, 1, strlen(EVENT_TRACE_MAGIC), trace->file) != strlen(EVENT_TRACE_MAGIC))
+    {
+        trace->failed = 1;
+    }
+    return trace;
+}
+
+/// Appends a record. Only the buffer is touched until it is full, so
+/// tracing costs a copy per record; errors are reported by event_trace_close().
+/// \param record - Record to append
+/// \param data - record->length bytes of a DATA record, NULL for the others
+void event_trace_write(event_trace* trace, const struct event_trace_record* record, const void* data)
+{
+    if(fwrite_unlocked(record, sizeof(*record), 1, trace->file) != 1)
+    {
+        trace->failed = 1;
+    }
+    if(record->kind == EVENT_TRACE_DATA && record->length > 0
+       && fwrite_unlocked(data, 1, record->length, trace->file) != record->length)
+    {
+        trace->failed = 1;
+    }
+}
+
+/// Opens a trace file for reading.
+/// \param path - File written by event_trace_create()
+/// \return trace to read - success; NULL - missing or not a trace
+event_trace* event_trace_open(const char* path)
+{
+    char magic[sizeof(EVENT_TRACE_MAGIC)] = "";
+    event_trace* trace = event_trace_new(path, "rb");
+    if(trace != NULL && (fread(magic, 1, strlen(EVENT_TRACE_MAGIC), trace->file) != strlen(EVENT_TRACE_MAGIC)
+                         || strcmp(magic, EVENT_TRACE_MAGIC) != 0))
+    {
+        event_trace_close(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/// Reads the next record and, for DATA, the bytes that follow it.
+/// \param record - Receives the record
+/// \param data - Receives the bytes of a DATA record
+/// \param capacity - Size of data
+/// \return 1 - a record was read; 0 - end of the trace; -1 - truncated or corrupt
+int event_trace_read(event_trace* trace, struct event_trace_record* record, void* data, size_t capacity)
+{
+    size_t got = fread_unlocked(record, 1, sizeof(*record), trace->file);
+    if(got == 0 && feof(trace->file))
+    {
+        return 0;
+    }
+    if(got != sizeof(*record) || record->kind < EVENT_TRACE_INSERT || record->kind > EVENT_TRACE_DATA)
+    {
+        trace->failed = 1;
+        return -1;
+    }
+    if(record->kind == EVENT_TRACE_DATA
+       && (record->length > capacity || fread_unlocked(data, 1, record->length, trace->file) != record->length))
+    {
+        trace->failed = 1;
+        return -1;
+    }
+    return 1;
+}
+
+/// Flushes and closes a trace.
+/// \return 0 - everything was written or read; -1 - the trace is incomplete
+int event_trace_close(event_trace* trace)
+{
+    int failed = trace->failed;
+    if(fclose(trace->file) != 0)
+    {
+        failed = 1;
+    }
+    free(trace->buffer);
+    free(trace);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CHAT_EVENT_TRACE_H
+#define CHAT_EVENT_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Binary trace of the event server's evtQ, written with --trace and fed
+/// back into the handlers with --replay. A trace file starts with the 8
+/// bytes of EVENT_TRACE_MAGIC, followed by records in host byte order, so a
+/// trace is replayed on the kind of machine it was taken on. Each loop
+/// iteration is written as
+///
+///   INSERT...  the events the loop queued from outside the handlers
+///   ROUND      the loop starts dispatching evtQ
+///   DISPATCH, ACCEPT, DATA...  what the handlers took and read
+///
+/// Events that handlers queue themselves are only written as DISPATCH; a
+/// replay creates them again by running the same handlers on the same input.
+#define EVENT_TRACE_MAGIC "CHATTRC1"
+
+enum event_trace_kind
+{
+    EVENT_TRACE_INSERT = 1,     // type, fd and msglen of a queued event
+    EVENT_TRACE_ROUND,          // no fields
+    EVENT_TRACE_DISPATCH,       // type, fd, msglen, flags and queued_ns of a dispatched event
+    EVENT_TRACE_ACCEPT,         // fd of an accepted client
+    EVENT_TRACE_DATA            // length bytes read from fd follow, 0 - end of stream
+};
+
+/// Flags of a DISPATCH
+#define EVENT_TRACE_EXTERNAL 1  // queued by the loop, not by a handler
+
+struct event_trace_record
+{
+    uint64_t time_ns;           // monotonic clock when the record was written
+    int32_t fd;
+    uint32_t length;
+    uint8_t kind;               // enum event_trace_kind
+    uint8_t type;               // event type of INSERT and DISPATCH
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t queued_ns;         // DISPATCH: time spent in evtQ, saturated
+};
+
+typedef struct event_trace event_trace;
+
+event_trace* event_trace_create(const char* path);
+void event_trace_write(event_trace* trace, const struct event_trace_record* record, const void* data);
+event_trace* event_trace_open(const char* path);
+int event_trace_read(event_trace* trace, struct event_trace_record* record, void* data, size_t capacity);
+int event_trace_close(event_trace* trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_EVENT_TRACE_H
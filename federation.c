@@ -0,0 +1,154 @@
+#include "federation.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/// Parses "ip:port" of a server to link to.
+/// \param spec - String to parse
+/// \param ip - Receives the IPv4 address as a string
+/// \param ip_size - Size of ip, at least INET_ADDRSTRLEN
+/// \param port - Receives the port
+/// \return 0 - success; -1 - failure
+int parse_peer_address(const char* spec, char* ip, size_t ip_size, uint16_t* port)
+{
+    const char* colon = strrchr(spec, ':');
+    struct in_addr address;
+
+    if(colon == NULL || (size_t) (colon - spec) >= ip_size)
+    {
+        return -1;
+    }
+    memcpy(ip, spec, (size_t) (colon - spec));
+    ip[colon - spec] = '\0';
+
+    char* end;
+    long value = strtol(colon + 1, &end, 10);
+    if(*end != '\0' || value <= 0 || value > 65535 || inet_pton(AF_INET, ip, &address) != 1)
+    {
+        return -1;
+    }
+
+    *port = (uint16_t) value;
+    return 0;
+}
+
+/// Writes the route of a forwarded broadcast.
+/// \param route - Route to encode
+/// \param out - At least FEDERATION_ROUTE_SIZE bytes
+void federation_encode_route(const struct federation_route* route, unsigned char* out)
+{
+    uint32_t origin = htonl(route->origin);
+    uint32_t epoch = htonl(route->epoch);
+    uint32_t sender_fd = htonl((uint32_t) route->sender_fd);
+
+    memcpy(out, &origin, sizeof(origin));
+    memcpy(out + 4, &epoch, sizeof(epoch));
+    memcpy(out + 8, &sender_fd, sizeof(sender_fd));
+    memset(out + 12, 0, sizeof(route->sender_peer));
+    strncpy((char*) out + 12, route->sender_peer, sizeof(route->sender_peer) - 1);
+}
+
+/// Reads the route in front of a forwarded payload.
+/// \param in - Payload of the frame
+/// \param length - Bytes in the payload
+/// \param route - Pointer where the route is stored
+/// \return 0 - success; -1 - payload too short or origin out of range
+int federation_decode_route(const unsigned char* in, size_t length, struct federation_route* route)
+{
+    uint32_t origin;
+    uint32_t epoch;
+    uint32_t sender_fd;
+
+    if(length < FEDERATION_ROUTE_SIZE)
+    {
+        return -1;
+    }
+
+    memcpy(&origin, in, sizeof(origin));
+    memcpy(&epoch, in + 4, sizeof(epoch));
+    memcpy(&sender_fd, in + 8, sizeof(sender_fd));
+    route->origin = ntohl(origin);
+    route->epoch = ntohl(epoch);
+    route->sender_fd = (int32_t) ntohl(sender_fd);
+    memcpy(route->sender_peer, in + 12, sizeof(route->sender_peer));
+    route->sender_peer[sizeof(route->sender_peer) - 1] = '\0';
+
+    return route->origin == 0 || route->origin > FEDERATION_MAX_NODE ? -1 : 0;
+}
+
+/// Writes the payload of WIRE_PEER_HELLO.
+/// \param out - At least FEDERATION_HELLO_SIZE bytes
+void federation_encode_hello(uint32_t node, uint32_t epoch, unsigned char* out)
+{
+    uint32_t node_value = htonl(node);
+    uint32_t epoch_value = htonl(epoch);
+
+    memcpy(out, &node_value, sizeof(node_value));
+    memcpy(out + 4, &epoch_value, sizeof(epoch_value));
+}
+
+/// Reads the payload of WIRE_PEER_HELLO.
+/// \param in - FEDERATION_HELLO_SIZE bytes
+void federation_decode_hello(const unsigned char* in, uint32_t* node, uint32_t* epoch)
+{
+    uint32_t node_value;
+    uint32_t epoch_value;
+
+    memcpy(&node_value, in, sizeof(node_value));
+    memcpy(&epoch_value, in + 4, sizeof(epoch_value));
+    *node = ntohl(node_value);
+    *epoch = ntohl(epoch_value);
+}
+
+void room_set_add(room_set* set, uint16_t room)
+{
+    set->bits[room / 64] |= 1ULL << (room % 64);
+}
+
+void room_set_remove(room_set* set, uint16_t room)
+{
+    set->bits[room / 64] &= ~(1ULL << (room % 64));
+}
+
+int room_set_contains(const room_set* set, uint16_t room)
+{
+    return (set->bits[room / 64] >> (room % 64)) & 1;
+}
+
+/// Decides whether a forwarded broadcast is new. A new epoch of an origin,
+/// after it restarted, starts over.
+/// \param dedup - Filter state
+/// \param origin - Node id from the route, at most FEDERATION_MAX_NODE
+/// \param epoch - Epoch from the route
+/// \param sequence - Sequence number the origin assigned
+/// \return 1 - new, deliver it; 0 - duplicate or too old
+int federation_dedup_accept(federation_dedup* dedup, uint32_t origin, uint32_t epoch, uint32_t sequence)
+{
+    struct federation_origin* state = &dedup->origins[origin];
+
+    if(state->epoch != epoch || state->highest == 0)
+    {
+        state->epoch = epoch;
+        state->highest = sequence;
+        state->seen = 1;
+        return 1;
+    }
+
+    if(sequence > state->highest)
+    {
+        uint32_t shift = sequence - state->highest;
+        state->seen = shift >= FEDERATION_DEDUP_WINDOW ? 1 : (state->seen << shift) | 1;
+        state->highest = sequence;
+        return 1;
+    }
+
+    uint32_t age = state->highest - sequence;
+    if(age >= FEDERATION_DEDUP_WINDOW || (state->seen >> age) & 1)
+    {
+        dedup->duplicates++;
+        return 0;
+    }
+
+    state->seen |= 1ULL << age;
+    return 1;
+}
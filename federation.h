@@ -0,0 +1,72 @@
+#ifndef CHAT_FEDERATION_H
+#define CHAT_FEDERATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Server-to-server federation. Event servers link to each other over TCP
+/// connections of their own (see WIRE_PEER_HELLO in wire_protocol.h) and pass
+/// every broadcast to the linked servers that have members in its room.
+/// Servers are expected to form a full mesh: a broadcast travels one link,
+/// from the server of its sender to every other one, and is never passed on.
+///
+/// Node ids go up to FEDERATION_MAX_NODE; they also fill the top bits of the
+/// sender ids a federated server hands out, so those stay unique across nodes.
+#define FEDERATION_MAX_NODE 255
+#define FEDERATION_NODE_SHIFT 24
+#define FEDERATION_MAX_PEERS 32
+#define FEDERATION_ROUTE_SIZE 60
+#define FEDERATION_HELLO_SIZE 8
+#define FEDERATION_ROOMS 65536
+
+/// Origin of a forwarded broadcast, in front of its payload on a link
+struct federation_route
+{
+    uint32_t origin;            // node id of the server the sender is connected to
+    uint32_t epoch;             // changes whenever that server restarts
+    int32_t sender_fd;          // the text format names senders by fd
+    char sender_peer[48];
+};
+
+/// Set of rooms, one bit per room
+typedef struct room_set
+{
+    uint64_t bits[FEDERATION_ROOMS / 64];
+} room_set;
+
+/// Remembers the latest sequence numbers seen from every origin. Sequences
+/// more than FEDERATION_DEDUP_WINDOW behind the highest count as duplicates.
+#define FEDERATION_DEDUP_WINDOW 64
+
+struct federation_origin
+{
+    uint32_t epoch;
+    uint32_t highest;           // 0 - nothing seen in this epoch
+    uint64_t seen;              // bit i: highest - i was seen
+};
+
+typedef struct federation_dedup
+{
+    struct federation_origin origins[FEDERATION_MAX_NODE + 1];
+    unsigned long long duplicates;
+} federation_dedup;
+
+int parse_peer_address(const char* spec, char* ip, size_t ip_size, uint16_t* port);
+void federation_encode_route(const struct federation_route* route, unsigned char* out);
+int federation_decode_route(const unsigned char* in, size_t length, struct federation_route* route);
+void federation_encode_hello(uint32_t node, uint32_t epoch, unsigned char* out);
+void federation_decode_hello(const unsigned char* in, uint32_t* node, uint32_t* epoch);
+void room_set_add(room_set* set, uint16_t room);
+void room_set_remove(room_set* set, uint16_t room);
+int room_set_contains(const room_set* set, uint16_t room);
+int federation_dedup_accept(federation_dedup* dedup, uint32_t origin, uint32_t epoch, uint32_t sequence);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_FEDERATION_H
@@ -0,0 +1,158 @@
+/*
+ * Handoff socket of the hot restart, see hot_restart.h. The records are
+ * built and applied by the event server; this file only moves them.
+ */
+
+#define _GNU_SOURCE
+#include "hot_restart.h"
+#include "tcp_socket.h"
+#include "error_reporting.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/// Bounds every blocking send and receive, a stuck peer must not hang the server.
+static void set_timeouts(int socket_fd)
+{
+    struct timeval timeout = {HOT_RESTART_TIMEOUT_MS / 1000, (HOT_RESTART_TIMEOUT_MS % 1000) * 1000};
+
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/// Creates the listener the next server connects to. The socket is non-blocking.
+/// A stale socket file at path is removed first.
+/// \param path - File system path or "@name" for the abstract namespace
+/// \return file descriptor - success; -1 - failure
+int hot_restart_listen(const char* path)
+{
+    struct sockaddr_un address;
+    socklen_t address_size = fill_unix_address(&address, path);
+
+    if(address_size == 0)
+    {
+        fprintf_error("hot_restart_listen(): Invalid socket path '%s'.\n", path);
+        return -1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1)
+    {
+        print_error("hot_restart_listen(): Could not create socket.");
+        return -1;
+    }
+
+    if(path[0] != '@')
+    {
+        unlink(path);
+    }
+
+    if(bind(listen_fd, (struct sockaddr *) &address, address_size) == -1 || listen(listen_fd, 1) == -1)
+    {
+        print_error("hot_restart_listen(): Could not listen on socket.");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+/// Accepts the connection of the next server. The socket is blocking, with
+/// HOT_RESTART_TIMEOUT_MS on every send and receive.
+/// \param listen_fd - Socket from hot_restart_listen()
+/// \return file descriptor - success; -1 - failure or nobody connected
+int hot_restart_accept(int listen_fd)
+{
+    int socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if(socket_fd == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            print_error("hot_restart_accept(): Could not accept connection.");
+        }
+        return -1;
+    }
+
+    set_timeouts(socket_fd);
+    return socket_fd;
+}
+
+/// Connects to the server running with the same handoff path. The socket is
+/// blocking, with HOT_RESTART_TIMEOUT_MS on every send and receive.
+/// \param path - File system path or "@name" for the abstract namespace
+/// \return file descriptor - success; -1 - no server to take over from
+int hot_restart_connect(const char* path)
+{
+    struct sockaddr_un address;
+    socklen_t address_size = fill_unix_address(&address, path);
+
+    if(address_size == 0)
+    {
+        return -1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(socket_fd == -1)
+    {
+        print_error("hot_restart_connect(): Could not create socket.");
+        return -1;
+    }
+
+    if(connect(socket_fd, (struct sockaddr *) &address, address_size) == -1)
+    {
+        // No file or a stale one: nobody to take over from
+        if(errno != ENOENT && errno != ECONNREFUSED)
+        {
+            print_error("hot_restart_connect(): Could not connect.");
+        }
+        close(socket_fd);
+        return -1;
+    }
+
+    set_timeouts(socket_fd);
+    return socket_fd;
+}
+
+/// Sends one record, optionally followed by data and with descriptors.
+/// \param socket_fd - Handoff socket
+/// \param record - Fixed part of the record, starting with its type
+/// \param record_size - Size of record
+/// \param data - Appended to the record, may be NULL
+/// \param length - Size of data, record_size + length at most HOT_RESTART_MAX_RECORD
+/// \param fds - Descriptors to pass, the caller keeps them open
+/// \param count - Number of descriptors, at most MAX_PASSED_FDS
+/// \return 0 - success; -1 - failure
+int hot_restart_send(int socket_fd, const void* record, size_t record_size,
+                     const void* data, size_t length, const int* fds, int count)
+{
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec iov[2] = {{(void*) record, record_size}, {(void*) data, length}};
+    struct msghdr message;
+
+    if(count < 0 || count > MAX_PASSED_FDS || record_size + length > HOT_RESTART_MAX_RECORD)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = length > 0 ? 2 : 1;
+    if(count > 0)
+    {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    }
+
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL) == (ssize_t) (record_size + length) ? 0 : -1;
+}
@@ -0,0 +1,93 @@
+#ifndef CHAT_HOT_RESTART_H
+#define CHAT_HOT_RESTART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wire_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Hot restart of the event server. A server started with a handoff path
+/// first connects to the Unix socket at that path. If a running server
+/// listens there, it passes its listening sockets and its client connections
+/// with their state, and exits once the new server confirmed the handoff.
+/// The clients stay connected. Otherwise the server starts from scratch.
+/// Either way it then listens on the path for its own successor.
+///
+/// The handoff socket is SOCK_SEQPACKET, so every record is one message and
+/// descriptors travel with the record they belong to. Records are sent in
+/// host byte order, both processes run on the same host:
+///   HOT_RESTART_HEADER        with the listening sockets
+///   per connection:
+///     HOT_RESTART_CONNECTION  with the client socket
+///     HOT_RESTART_INPUT       partial binary frames, if any
+///     HOT_RESTART_MESSAGE     per queued message, payload appended
+///   HOT_RESTART_END
+/// The new server answers HOT_RESTART_ACK. Until the old server got it, it
+/// keeps serving, so a new server that fails half way loses nothing.
+#define HOT_RESTART_MAGIC 0x43485254        // "CHRT"
+#define HOT_RESTART_VERSION 1
+#define HOT_RESTART_TIMEOUT_MS 5000
+#define HOT_RESTART_MAX_RECORD (256 + WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD)
+
+enum hot_restart_record_type
+{
+    HOT_RESTART_HEADER = 1,
+    HOT_RESTART_CONNECTION,
+    HOT_RESTART_INPUT,
+    HOT_RESTART_MESSAGE,
+    HOT_RESTART_END,
+    HOT_RESTART_ACK
+};
+
+/// Listeners in the header, their descriptors follow in this order
+#define HOT_RESTART_TCP_LISTENER 1
+#define HOT_RESTART_UNIX_LISTENER 2
+#define HOT_RESTART_FEDERATION_LISTENER 4
+
+struct hot_restart_header
+{
+    uint32_t type;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t listeners;
+    uint32_t next_connection_id;
+    uint32_t next_sequence;
+};
+
+struct hot_restart_connection
+{
+    uint32_t type;
+    int32_t fd;                 // number in the old server, kept if it is free
+    uint32_t id;
+    uint16_t room;
+    uint8_t mode;
+    uint8_t greeted;
+    uint8_t multicast;
+    uint8_t closing;            // disconnect was queued, the new server finishes it
+    char peer[48];
+};
+
+/// Followed by header.length bytes of payload
+struct hot_restart_message
+{
+    uint32_t type;
+    uint32_t sent;              // bytes of the encoding already written
+    int32_t sender_fd;
+    struct wire_header header;
+    char sender_peer[48];
+};
+
+int hot_restart_listen(const char* path);
+int hot_restart_accept(int listen_fd);
+int hot_restart_connect(const char* path);
+int hot_restart_send(int socket_fd, const void* record, size_t record_size,
+                     const void* data, size_t length, const int* fds, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_HOT_RESTART_H
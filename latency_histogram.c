@@ -0,0 +1,118 @@
+#include "latency_histogram.h"
+#include <string.h>
+
+/// Maps a value to its bucket. Values below SUB_BUCKETS get an exact bucket,
+/// larger values keep only their SUB_BUCKET_BITS most significant bits.
+/// \param value - Value to map
+/// \return index into latency_histogram.counts
+static int bucket_index(uint64_t value)
+{
+    if(value < LATENCY_HISTOGRAM_SUB_BUCKETS)
+    {
+        return (int) value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS
+           + (int) ((value >> shift) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/// Returns the highest value that is mapped to the given bucket.
+/// \param index - Bucket index
+/// \return upper bound of the bucket
+static uint64_t bucket_upper_bound(int index)
+{
+    if(index < LATENCY_HISTOGRAM_SUB_BUCKETS)
+    {
+        return (uint64_t) index;
+    }
+
+    int shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t) (LATENCY_HISTOGRAM_SUB_BUCKETS + index % LATENCY_HISTOGRAM_SUB_BUCKETS) << shift;
+
+    return lower + ((1ULL << shift) - 1);
+}
+
+/// Clears all recorded values.
+/// \param histogram - Histogram to reset
+void latency_histogram_reset(latency_histogram* histogram)
+{
+    memset(histogram, 0, sizeof(latency_histogram));
+    histogram->min = UINT64_MAX;
+}
+
+/// Records a single value.
+/// \param histogram - Histogram to record into
+/// \param value - Value to record, usually nanoseconds
+void latency_histogram_record(latency_histogram* histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->total_count++;
+    histogram->sum += value;
+
+    if(value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/// Returns the value below which the given percentage of recorded values fall.
+/// The result is the upper bound of the matching bucket, capped at the maximum.
+/// \param histogram - Histogram to query
+/// \param percentile - Percentile in the range [0, 100]
+/// \return value at the percentile; 0 if the histogram is empty
+uint64_t latency_histogram_percentile(const latency_histogram* histogram, double percentile)
+{
+    if(histogram->total_count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->total_count + 0.5);
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen >= rank)
+        {
+            uint64_t upper = bucket_upper_bound(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+/// Prints a one line summary (count, min, mean, p50, p90, p99, p99.9, max) in microseconds.
+/// \param histogram - Histogram to print
+/// \param name - Label printed in front of the summary
+/// \param stream - Stream to print to
+void latency_histogram_print(const latency_histogram* histogram, const char* name, FILE* stream)
+{
+    if(histogram->total_count == 0)
+    {
+        fprintf(stream, "%-28s count=0\n", name);
+        return;
+    }
+
+    fprintf(stream, "%-28s count=%llu min=%.1f mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f (us)\n",
+            name,
+            (unsigned long long) histogram->total_count,
+            histogram->min / 1000.0,
+            (double) histogram->sum / (double) histogram->total_count / 1000.0,
+            latency_histogram_percentile(histogram, 50.0) / 1000.0,
+            latency_histogram_percentile(histogram, 90.0) / 1000.0,
+            latency_histogram_percentile(histogram, 99.0) / 1000.0,
+            latency_histogram_percentile(histogram, 99.9) / 1000.0,
+            histogram->max / 1000.0);
+}
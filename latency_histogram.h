@@ -0,0 +1,31 @@
+#ifndef CHAT_LATENCY_HISTOGRAM_H
+#define CHAT_LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/// Every power of two is split into 2^SUB_BUCKET_BITS linear sub buckets,
+/// which bounds the relative error of a recorded value to about 6%.
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 4
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define LATENCY_HISTOGRAM_BUCKETS ((64 - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct latency_histogram latency_histogram;
+
+/// Log-bucketed (HDR-style) histogram of nanosecond values with a fixed memory
+/// footprint, independent of the number of recorded values.
+struct latency_histogram
+{
+    uint64_t counts[LATENCY_HISTOGRAM_BUCKETS];
+    uint64_t total_count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+};
+
+void latency_histogram_reset(latency_histogram* histogram);
+void latency_histogram_record(latency_histogram* histogram, uint64_t value);
+uint64_t latency_histogram_percentile(const latency_histogram* histogram, double percentile);
+void latency_histogram_print(const latency_histogram* histogram, const char* name, FILE* stream);
+
+#endif //CHAT_LATENCY_HISTOGRAM_H
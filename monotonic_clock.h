@@ -0,0 +1,16 @@
+#ifndef CHAT_MONOTONIC_CLOCK_H
+#define CHAT_MONOTONIC_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/// Returns the current value of the monotonic clock in nanoseconds.
+/// Served from the vDSO, so it is cheap enough to call per event.
+static inline uint64_t monotonic_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+#endif //CHAT_MONOTONIC_CLOCK_H
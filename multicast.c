@@ -0,0 +1,143 @@
+#include "multicast.h"
+#include "error_reporting.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/// Parses "ip:port" and checks that ip is a multicast address.
+/// \param spec - String to parse
+/// \param group - Address receiving the group
+/// \return 0 - success; -1 - failure
+int parse_multicast_group(const char* spec, struct sockaddr_in* group)
+{
+    const char* colon = strrchr(spec, ':');
+    char ip[INET_ADDRSTRLEN];
+
+    if(colon == NULL || (size_t) (colon - spec) >= sizeof(ip))
+    {
+        return -1;
+    }
+    memcpy(ip, spec, (size_t) (colon - spec));
+    ip[colon - spec] = '\0';
+
+    char* end;
+    long port = strtol(colon + 1, &end, 10);
+    if(*end != '\0' || port <= 0 || port > 65535)
+    {
+        return -1;
+    }
+
+    memset(group, 0, sizeof(struct sockaddr_in));
+    group->sin_family = AF_INET;
+    group->sin_port = htons((uint16_t) port);
+    if(inet_pton(AF_INET, ip, &group->sin_addr) != 1 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/// Parses the address of a local interface, NULL selects any.
+static int parse_interface(const char* interface, struct in_addr* address)
+{
+    if(interface == NULL)
+    {
+        address->s_addr = htonl(INADDR_ANY);
+        return 0;
+    }
+
+    return inet_pton(AF_INET, interface, address) == 1 ? 0 : -1;
+}
+
+/// Creates a non-blocking UDP socket connected to a multicast group, so
+/// datagrams can be written with send(). Local listeners receive them too.
+/// \param group - "ip:port" of the group
+/// \param interface - Address of the outgoing interface, may be NULL
+/// \param ttl - Number of router hops, 1 stays on the local network
+/// \return file descriptor - success; -1 - failure
+int create_multicast_sender(const char* group, const char* interface, int ttl)
+{
+    struct sockaddr_in address;
+    struct in_addr interface_address;
+
+    if(parse_multicast_group(group, &address) || parse_interface(interface, &interface_address))
+    {
+        fprintf_error("create_multicast_sender(): Invalid group '%s' or interface.\n", group);
+        return -1;
+    }
+
+    int socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(socket_fd == -1)
+    {
+        perror("create_multicast_sender(): Could not create socket.");
+        return -1;
+    }
+
+    unsigned char hops = (unsigned char) ttl;
+    unsigned char loop = 1;
+    if(setsockopt(socket_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface_address, sizeof(interface_address)) ||
+       setsockopt(socket_fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops)) ||
+       setsockopt(socket_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)))
+    {
+        perror("create_multicast_sender(): Could not set multicast options.");
+        close(socket_fd);
+        return -1;
+    }
+
+    if(connect(socket_fd, (struct sockaddr *) &address, sizeof(address)) == -1)
+    {
+        perror("create_multicast_sender(): Could not connect socket.");
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/// Creates a non-blocking UDP socket that is bound to the port of a group and
+/// has joined it. Several receivers on one host may share the port.
+/// \param group - "ip:port" of the group
+/// \param interface - Address of the interface to join on, may be NULL
+/// \return file descriptor - success; -1 - failure
+int create_multicast_receiver(const char* group, const char* interface)
+{
+    struct sockaddr_in address;
+    struct ip_mreq membership;
+
+    if(parse_multicast_group(group, &address) || parse_interface(interface, &membership.imr_interface))
+    {
+        fprintf_error("create_multicast_receiver(): Invalid group '%s' or interface.\n", group);
+        return -1;
+    }
+    membership.imr_multiaddr = address.sin_addr;
+
+    int socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(socket_fd == -1)
+    {
+        perror("create_multicast_receiver(): Could not create socket.");
+        return -1;
+    }
+
+    // Bound to the group address, the socket only sees traffic of that group
+    int option = 1;
+    if(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) ||
+       bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) == -1)
+    {
+        perror("create_multicast_receiver(): Could not bind socket.");
+        close(socket_fd);
+        return -1;
+    }
+
+    if(setsockopt(socket_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)))
+    {
+        perror("create_multicast_receiver(): Could not join group.");
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
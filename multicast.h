@@ -0,0 +1,23 @@
+#ifndef CHAT_MULTICAST_H
+#define CHAT_MULTICAST_H
+
+#include <arpa/inet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// UDP multicast sockets for the fanout mode of the event server. Groups are
+/// given as "ip:port" with an IPv4 multicast address, e.g. 239.1.2.3:5000.
+/// The interface is the IPv4 address of a local interface; 127.0.0.1 keeps
+/// the traffic on the loopback device, NULL lets the routing table decide.
+
+int parse_multicast_group(const char* spec, struct sockaddr_in* group);
+int create_multicast_sender(const char* group, const char* interface, int ttl);
+int create_multicast_receiver(const char* group, const char* interface);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_MULTICAST_H
@@ -0,0 +1,215 @@
+/*
+ * Supervisor of the prefork server. Forks a fixed number of worker processes
+ * and replaces a worker that crashed, so a fault only costs the connections
+ * of that one worker. The supervisor serves nothing itself, it waits for
+ * signals: SIGCHLD reaps workers, SIGUSR1 is passed on to all of them and
+ * SIGINT or SIGTERM stop them.
+ */
+
+#define _GNU_SOURCE
+#include "prefork.h"
+#include "error_reporting.h"
+#include "monotonic_clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+/// A worker that dies within this time after its start is restarted only
+/// after the same delay, so a worker that crashes at once does not spin
+#define RESPAWN_BACKOFF_NS (1000ULL * 1000 * 1000)
+
+struct worker_slot
+{
+    pid_t pid;              // 0 - not running
+    uint64_t started;       // monotonic ns of the last fork
+    uint64_t respawn_at;    // monotonic ns the worker is forked again, 0 - not at all
+};
+
+/// Forks one worker. The child runs worker_main and exits, it never returns.
+/// \return pid of the worker - success; -1 - failure
+static pid_t spawn_worker(int worker, prefork_worker worker_main, void* argument, const sigset_t* original_mask)
+{
+    pid_t supervisor = getpid();
+
+    // Buffered output would otherwise be written by both processes
+    flush_errors();
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if(pid != 0)
+    {
+        if(pid < 0)
+        {
+            print_error("spawn_worker(): Could not fork worker.");
+        }
+        return pid;
+    }
+
+    // Workers do not outlive the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != supervisor)
+    {
+        _exit(EXIT_FAILURE);
+    }
+
+    sigprocmask(SIG_SETMASK, original_mask, NULL);
+    logger_after_fork();
+    worker_main(worker, argument);
+    exit(EXIT_SUCCESS);
+}
+
+/// Collects exited workers and schedules the restart of crashed ones.
+/// \return number of workers that exited
+static int reap_workers(struct worker_slot* slots, int workers, int stopping)
+{
+    int status;
+    int reaped = 0;
+    pid_t pid;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        int worker = 0;
+        while(worker < workers && slots[worker].pid != pid)
+        {
+            worker++;
+        }
+        if(worker == workers)
+        {
+            continue;
+        }
+
+        slots[worker].pid = 0;
+        reaped++;
+        if(stopping)
+        {
+            continue;
+        }
+
+        if(WIFSIGNALED(status))
+        {
+            uint64_t now = monotonic_time_ns();
+            int early = now - slots[worker].started < RESPAWN_BACKOFF_NS;
+
+            LOG_WARN("Worker %d (pid %d) was killed by signal %d, restarting it%s\n",
+                     worker, (int) pid, WTERMSIG(status), early ? " after a delay" : "");
+            slots[worker].respawn_at = early ? now + RESPAWN_BACKOFF_NS : now;
+        }
+        else
+        {
+            LOG_WARN("Worker %d (pid %d) exited with status %d\n", worker, (int) pid, WEXITSTATUS(status));
+        }
+    }
+
+    return reaped;
+}
+
+static void signal_workers(const struct worker_slot* slots, int workers, int signal_number)
+{
+    for(int worker = 0; worker < workers; worker++)
+    {
+        if(slots[worker].pid > 0)
+        {
+            kill(slots[worker].pid, signal_number);
+        }
+    }
+}
+
+/// Forks the workers and supervises them until a SIGINT or SIGTERM, or until
+/// every worker exited on its own. Workers killed by a signal are restarted.
+/// \param workers - Number of worker processes
+/// \param worker_main - Body of a worker, called in the child after fork()
+/// \param argument - Passed to worker_main
+/// \return 0 - stopped by a signal; -1 - all workers exited
+int run_prefork_workers(int workers, prefork_worker worker_main, void* argument)
+{
+    sigset_t handled;
+    sigset_t original_mask;
+
+    // Blocked before the first fork, so no SIGCHLD is lost
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &handled, &original_mask);
+
+    struct worker_slot* slots = calloc((size_t) workers, sizeof(struct worker_slot));
+    if(slots == NULL)
+    {
+        print_error("run_prefork_workers(): Could not allocate worker table.");
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        return -1;
+    }
+
+    uint64_t now = monotonic_time_ns();
+    for(int worker = 0; worker < workers; worker++)
+    {
+        slots[worker].respawn_at = now;
+    }
+
+    int running = 0;
+    int stopping = 0;
+    for(;;)
+    {
+        uint64_t wait = UINT64_MAX;
+
+        now = monotonic_time_ns();
+        for(int worker = 0; worker < workers && !stopping; worker++)
+        {
+            if(slots[worker].respawn_at == 0)
+            {
+                continue;
+            }
+            if(slots[worker].respawn_at > now)
+            {
+                uint64_t remaining = slots[worker].respawn_at - now;
+                wait = remaining < wait ? remaining : wait;
+                continue;
+            }
+
+            pid_t pid = spawn_worker(worker, worker_main, argument, &original_mask);
+            slots[worker].started = now;
+            slots[worker].respawn_at = pid > 0 ? 0 : now + RESPAWN_BACKOFF_NS;
+            if(pid > 0)
+            {
+                slots[worker].pid = pid;
+                running++;
+            }
+        }
+
+        if(running == 0 && (stopping || wait == UINT64_MAX))
+        {
+            break;
+        }
+
+        if(wait > RESPAWN_BACKOFF_NS)
+        {
+            wait = RESPAWN_BACKOFF_NS;
+        }
+        struct timespec timeout = {(time_t) (wait / 1000000000ULL), (long) (wait % 1000000000ULL)};
+        int signal_number = sigtimedwait(&handled, NULL, &timeout);
+
+        if(signal_number == SIGCHLD)
+        {
+            running -= reap_workers(slots, workers, stopping);
+        }
+        else if(signal_number == SIGUSR1)
+        {
+            signal_workers(slots, workers, SIGUSR1);
+        }
+        else if((signal_number == SIGINT || signal_number == SIGTERM) && !stopping)
+        {
+            LOG_INFO("Stopping %d workers\n", running);
+            stopping = 1;
+            signal_workers(slots, workers, SIGTERM);
+        }
+    }
+
+    free(slots);
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+    return stopping ? 0 : -1;
+}
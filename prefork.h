@@ -0,0 +1,17 @@
+#ifndef CHAT_PREFORK_H
+#define CHAT_PREFORK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// prefork_worker: body of a worker process, worker is its index
+typedef void (*prefork_worker) (int worker, void* argument);
+
+int run_prefork_workers(int workers, prefork_worker worker_main, void* argument);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_PREFORK_H
@@ -0,0 +1,449 @@
+/*
+ * Reactor of the event and coroutine servers, see reactor.h. Each backend
+ * fills in a table of operations; everything else, timers and wakeup, is
+ * shared.
+ */
+
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "monotonic_clock.h"
+#include "error_reporting.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+struct reactor_ops
+{
+    int (*add)(reactor* reactor, int fd, uint32_t events, void* data);
+    int (*modify)(reactor* reactor, int fd, uint32_t events, void* data);
+    int (*remove)(reactor* reactor, int fd);
+    int (*wait)(reactor* reactor, const struct timespec* timeout, struct reactor_event* events, int max_events);
+    void (*destroy)(reactor* reactor);
+};
+
+struct reactor
+{
+    const struct reactor_ops* ops;
+    enum reactor_backend backend;
+    timer_wheel* timers;        // may be NULL
+    int wake_fd;                // eventfd, registered with the backend
+
+    // poll: registered descriptors in the order they were added
+    struct pollfd* fds;
+    void** data;
+    int count;
+    int capacity;
+    int* slots;                 // descriptor -> index in fds, -1 if not registered
+    int slot_capacity;
+
+    // epoll
+    int epoll_fd;
+};
+
+/*
+ * poll backend
+ */
+
+static short to_poll_events(uint32_t events)
+{
+    return (short) (((events & REACTOR_READ) ? POLLIN : 0) | ((events & REACTOR_WRITE) ? POLLOUT : 0));
+}
+
+static uint32_t from_poll_events(short revents)
+{
+    return ((revents & POLLIN) ? REACTOR_READ : 0) | ((revents & POLLOUT) ? REACTOR_WRITE : 0)
+           | ((revents & (POLLERR | POLLNVAL)) ? REACTOR_ERROR : 0) | ((revents & POLLHUP) ? REACTOR_HANGUP : 0);
+}
+
+static int poll_slot(const reactor* reactor, int fd)
+{
+    return fd >= 0 && fd < reactor->slot_capacity ? reactor->slots[fd] : -1;
+}
+
+static int poll_add(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    if(fd < 0 || poll_slot(reactor, fd) >= 0)
+    {
+        errno = fd < 0 ? EBADF : EEXIST;
+        return -1;
+    }
+
+    if(fd >= reactor->slot_capacity)
+    {
+        int capacity = reactor->slot_capacity == 0 ? 256 : reactor->slot_capacity;
+        while(capacity <= fd)
+        {
+            capacity *= 2;
+        }
+        int* slots = realloc(reactor->slots, capacity * sizeof(int));
+        if(slots == NULL)
+        {
+            return -1;
+        }
+        for(int i = reactor->slot_capacity; i < capacity; i++)
+        {
+            slots[i] = -1;
+        }
+        reactor->slots = slots;
+        reactor->slot_capacity = capacity;
+    }
+
+    if(reactor->count == reactor->capacity)
+    {
+        int capacity = reactor->capacity == 0 ? 64 : reactor->capacity * 2;
+        struct pollfd* fds = realloc(reactor->fds, capacity * sizeof(struct pollfd));
+        if(fds == NULL)
+        {
+            return -1;
+        }
+        reactor->fds = fds;
+        void** slot_data = realloc(reactor->data, capacity * sizeof(void*));
+        if(slot_data == NULL)
+        {
+            return -1;
+        }
+        reactor->data = slot_data;
+        reactor->capacity = capacity;
+    }
+
+    reactor->fds[reactor->count].fd = fd;
+    reactor->fds[reactor->count].events = to_poll_events(events);
+    reactor->fds[reactor->count].revents = 0;
+    reactor->data[reactor->count] = data;
+    reactor->slots[fd] = reactor->count;
+    reactor->count++;
+    return 0;
+}
+
+static int poll_modify(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    int slot = poll_slot(reactor, fd);
+
+    if(slot < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    reactor->fds[slot].events = to_poll_events(events);
+    reactor->data[slot] = data;
+    return 0;
+}
+
+/// Moves the last descriptor into the gap, so a removal costs the same with
+/// 100 or 100000 descriptors. Readiness is reported in table order, which is
+/// no order the servers rely on.
+static int poll_remove(reactor* reactor, int fd)
+{
+    int slot = poll_slot(reactor, fd);
+
+    if(slot < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    reactor->slots[fd] = -1;
+    reactor->count--;
+    if(slot < reactor->count)
+    {
+        reactor->fds[slot] = reactor->fds[reactor->count];
+        reactor->data[slot] = reactor->data[reactor->count];
+        reactor->slots[reactor->fds[slot].fd] = slot;
+    }
+    return 0;
+}
+
+static int poll_wait(reactor* reactor, const struct timespec* timeout, struct reactor_event* events, int max_events)
+{
+    int ready = ppoll(reactor->fds, (nfds_t) reactor->count, timeout, NULL);
+    int count = 0;
+
+    for(int i = 0; i < reactor->count && ready > 0 && count < max_events; i++)
+    {
+        if(reactor->fds[i].revents == 0)
+        {
+            continue;
+        }
+        ready--;
+        events[count].fd = reactor->fds[i].fd;
+        events[count].events = from_poll_events(reactor->fds[i].revents);
+        events[count].data = reactor->data[i];
+        count++;
+    }
+    return ready < 0 ? -1 : count;
+}
+
+static void poll_destroy(reactor* reactor)
+{
+    free(reactor->fds);
+    free(reactor->data);
+    free(reactor->slots);
+}
+
+static const struct reactor_ops poll_ops = {poll_add, poll_modify, poll_remove, poll_wait, poll_destroy};
+
+/*
+ * epoll backend
+ */
+
+static int epoll_control(reactor* reactor, int operation, int fd, uint32_t events, void* data)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = ((events & REACTOR_READ) ? EPOLLIN : 0) | ((events & REACTOR_WRITE) ? EPOLLOUT : 0);
+    event.data.ptr = data;
+    // The descriptor is needed to report it, data only if the caller gave some
+    if(data == NULL)
+    {
+        event.data.u64 = (uint64_t) fd << 32 | 1;
+    }
+    return epoll_ctl(reactor->epoll_fd, operation, fd, &event);
+}
+
+static int epoll_add(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    return epoll_control(reactor, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int epoll_modify(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    return epoll_control(reactor, EPOLL_CTL_MOD, fd, events, data);
+}
+
+static int epoll_remove(reactor* reactor, int fd)
+{
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_wait_events(reactor* reactor, const struct timespec* timeout, struct reactor_event* events, int max_events)
+{
+    struct epoll_event ready[256];
+    int count;
+
+    if(max_events > 256)
+    {
+        max_events = 256;
+    }
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    count = epoll_pwait2(reactor->epoll_fd, ready, max_events, timeout, NULL);
+    if(count < 0 && errno == ENOSYS)
+#endif
+    {
+        // Millisecond resolution, rounded up so a timer is never early
+        int timeout_ms = timeout == NULL ? -1
+                         : (int) (timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000);
+        count = epoll_wait(reactor->epoll_fd, ready, max_events, timeout_ms);
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        uint32_t flags = ready[i].events;
+        events[i].events = ((flags & EPOLLIN) ? REACTOR_READ : 0) | ((flags & EPOLLOUT) ? REACTOR_WRITE : 0)
+                           | ((flags & EPOLLERR) ? REACTOR_ERROR : 0) | ((flags & EPOLLHUP) ? REACTOR_HANGUP : 0);
+        if(ready[i].data.u64 & 1)
+        {
+            events[i].fd = (int) (ready[i].data.u64 >> 32);
+            events[i].data = NULL;
+        }
+        else
+        {
+            events[i].fd = -1;
+            events[i].data = ready[i].data.ptr;
+        }
+    }
+    return count;
+}
+
+static void epoll_destroy(reactor* reactor)
+{
+    close(reactor->epoll_fd);
+}
+
+static const struct reactor_ops epoll_ops = {epoll_add, epoll_modify, epoll_remove, epoll_wait_events, epoll_destroy};
+
+/*
+ * Shared part
+ */
+
+/// Creates a reactor.
+/// \param backend - REACTOR_POLL or REACTOR_EPOLL, REACTOR_DEFAULT is poll
+/// \param timers - Wheel whose timers bound the sleep and run after it, may be NULL
+/// \return reactor - success; NULL - failure
+reactor* reactor_create(enum reactor_backend backend, timer_wheel* timers)
+{
+    reactor* created = calloc(1, sizeof(reactor));
+
+    if(created == NULL)
+    {
+        print_error("reactor_create(): Out of memory.");
+        return NULL;
+    }
+
+    created->backend = backend == REACTOR_EPOLL ? REACTOR_EPOLL : REACTOR_POLL;
+    created->timers = timers;
+    created->epoll_fd = -1;
+    if(created->backend == REACTOR_EPOLL)
+    {
+        created->ops = &epoll_ops;
+        created->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(created->epoll_fd == -1)
+        {
+            print_error("reactor_create(): Could not create epoll instance.");
+            free(created);
+            return NULL;
+        }
+    }
+    else
+    {
+        created->ops = &poll_ops;
+    }
+
+    created->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(created->wake_fd == -1 || created->ops->add(created, created->wake_fd, REACTOR_READ, &created->wake_fd) == -1)
+    {
+        print_error("reactor_create(): Could not create wakeup eventfd.");
+        if(created->wake_fd != -1)
+        {
+            close(created->wake_fd);
+        }
+        created->ops->destroy(created);
+        free(created);
+        return NULL;
+    }
+
+    return created;
+}
+
+/// Closes the reactor. Registered descriptors stay open.
+void reactor_destroy(reactor* reactor)
+{
+    if(reactor == NULL)
+    {
+        return;
+    }
+    close(reactor->wake_fd);
+    reactor->ops->destroy(reactor);
+    free(reactor);
+}
+
+enum reactor_backend reactor_get_backend(const reactor* reactor)
+{
+    return reactor->backend;
+}
+
+/// Watches a descriptor.
+/// \param fd - Descriptor, not yet registered
+/// \param events - REACTOR_READ and/or REACTOR_WRITE, 0 for errors and hangups only
+/// \param data - Reported with the events; NULL - the descriptor is reported
+/// \return 0 - success; -1 - failure, errno set
+int reactor_add(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    return reactor->ops->add(reactor, fd, events, data);
+}
+
+/// Changes interest and data of a registered descriptor.
+/// \return 0 - success; -1 - failure, errno set
+int reactor_modify(reactor* reactor, int fd, uint32_t events, void* data)
+{
+    return reactor->ops->modify(reactor, fd, events, data);
+}
+
+/// Stops watching a descriptor. Call it before closing the descriptor, epoll
+/// keeps watching a socket whose duplicate is still open elsewhere.
+/// \return 0 - success; -1 - failure, errno set
+int reactor_remove(reactor* reactor, int fd)
+{
+    return reactor->ops->remove(reactor, fd);
+}
+
+/// Sleeps until a descriptor is ready, the next timer is due, the timeout
+/// passed or reactor_wakeup() was called, and then runs the due timers.
+/// \param timeout_ns - Longest sleep, 0 to only check, REACTOR_FOREVER
+/// \param events - Receives the ready descriptors with the data they were
+///                 registered with; fd is only set for those registered without
+/// \param max_events - Size of events; more ready descriptors are reported by the next call
+/// \return number of events - success; -1 - failure, errno set (EINTR on a signal)
+int reactor_wait(reactor* reactor, uint64_t timeout_ns, struct reactor_event* events, int max_events)
+{
+    if(reactor->timers != NULL && timeout_ns > 0)
+    {
+        int timer_ms = timer_wheel_timeout_ms(reactor->timers, monotonic_time_ns());
+        if(timer_ms >= 0 && (uint64_t) timer_ms * 1000000ULL < timeout_ns)
+        {
+            timeout_ns = (uint64_t) timer_ms * 1000000ULL;
+        }
+    }
+
+    struct timespec timeout = {(time_t) (timeout_ns / 1000000000ULL), (long) (timeout_ns % 1000000000ULL)};
+    int count = reactor->ops->wait(reactor, timeout_ns == REACTOR_FOREVER ? NULL : &timeout, events, max_events);
+
+    if(reactor->timers != NULL)
+    {
+        timer_wheel_advance(reactor->timers, monotonic_time_ns());
+    }
+    if(count <= 0)
+    {
+        return count;
+    }
+
+    // The wakeup eventfd is drained here and not reported
+    int kept = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(events[i].data == &reactor->wake_fd)
+        {
+            uint64_t value;
+            while(read(reactor->wake_fd, &value, sizeof(value)) > 0)
+            {
+            }
+            continue;
+        }
+        events[kept++] = events[i];
+    }
+    return kept;
+}
+
+/// Ends the current or next reactor_wait() early. Safe from signal handlers
+/// and other threads.
+void reactor_wakeup(reactor* reactor)
+{
+    uint64_t one = 1;
+    int saved_errno = errno;
+
+    if(write(reactor->wake_fd, &one, sizeof(one)) < 0)
+    {
+        // Counter already non-zero, the reactor wakes up anyway
+    }
+    errno = saved_errno;
+}
+
+/// Parses the name of a backend as given on the command line.
+/// \param name - "poll" or "epoll"
+/// \param backend - Pointer where the backend is stored
+/// \return 0 - success; -1 - unknown name
+int parse_reactor_backend(const char* name, enum reactor_backend* backend)
+{
+    if(strcmp(name, "poll") == 0)
+    {
+        *backend = REACTOR_POLL;
+        return 0;
+    }
+    if(strcmp(name, "epoll") == 0)
+    {
+        *backend = REACTOR_EPOLL;
+        return 0;
+    }
+    return -1;
+}
+
+const char* reactor_backend_name(enum reactor_backend backend)
+{
+    return backend == REACTOR_EPOLL ? "epoll" : "poll";
+}
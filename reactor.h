@@ -0,0 +1,57 @@
+#ifndef CHAT_REACTOR_H
+#define CHAT_REACTOR_H
+
+#include <stdint.h>
+#include "timer_wheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// I/O backend the chat servers run on. A reactor watches descriptors for
+/// readiness, sleeps until one is ready, a timer of its wheel is due or it is
+/// woken up, and then runs the due timers. Readiness is level-triggered with
+/// every backend: a descriptor is reported as long as it is ready and the
+/// interest is registered. What the server does with a ready descriptor is
+/// up to the server; reads and writes stay plain system calls.
+enum reactor_backend
+{
+    REACTOR_DEFAULT = 0,        // the server picks its own
+    REACTOR_POLL,
+    REACTOR_EPOLL
+};
+
+/// Interest and readiness flags
+#define REACTOR_READ 1
+#define REACTOR_WRITE 2
+#define REACTOR_ERROR 4         // reported only, on errors and POLLNVAL
+#define REACTOR_HANGUP 8        // reported only
+
+/// Sleep in reactor_wait() until something happens
+#define REACTOR_FOREVER UINT64_MAX
+
+typedef struct reactor reactor;
+
+struct reactor_event
+{
+    int fd;
+    uint32_t events;            // REACTOR_* flags
+    void* data;                 // as registered
+};
+
+reactor* reactor_create(enum reactor_backend backend, timer_wheel* timers);
+void reactor_destroy(reactor* reactor);
+enum reactor_backend reactor_get_backend(const reactor* reactor);
+int reactor_add(reactor* reactor, int fd, uint32_t events, void* data);
+int reactor_modify(reactor* reactor, int fd, uint32_t events, void* data);
+int reactor_remove(reactor* reactor, int fd);
+int reactor_wait(reactor* reactor, uint64_t timeout_ns, struct reactor_event* events, int max_events);
+void reactor_wakeup(reactor* reactor);
+int parse_reactor_backend(const char* name, enum reactor_backend* backend);
+const char* reactor_backend_name(enum reactor_backend backend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_REACTOR_H
@@ -0,0 +1,108 @@
+/*
+ * Server configuration with its defaults and parsers for the values that
+ * can be given on the command line.
+ */
+
+#include "server_config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+struct server_config server_config =
+{
+    .outbound_high_water = 256 * 1024,
+    .outbound_low_water = 64 * 1024,
+    .backpressure_policy = BACKPRESSURE_DROP_OLDEST,
+    .listen_backlog = SOMAXCONN,
+    .accept_batch = 64,
+    .acceptor_threads = 0,
+    .socket_profile = {"default", 0, 0, 0, 0, 0, 0},
+    .unix_socket_path = NULL,
+    .idle_timeout = 0,
+    .heartbeat_interval = 0,
+    .write_stall_timeout = 30,
+    .coalesce_sends = 0,
+    .coalesce_budget_us = 0,
+    .multicast_group = NULL,
+    .multicast_interface = "127.0.0.1",
+    .multicast_history = 4096,
+    .shm_ring_size = 1024 * 1024,
+    .node_id = 0,
+    .federation_port = 0,
+    .peer_count = 0,
+    .handoff_path = NULL,
+    .reactor_backend = REACTOR_DEFAULT,
+    .max_connections = 0,
+    .rate_messages = 0,
+    .rate_bytes = 0,
+    .zerocopy_threshold = 0,
+    .spool_dir = NULL,
+    .spool_max_file = 256 * 1024 * 1024,
+    .file_rate = 0,
+    .presence_interval_ms = 0,
+    .presence_snapshot = 0,
+    .trace_path = NULL,
+    .replay_path = NULL
+};
+
+static const char* backpressure_policy_names[] = {"drop-oldest", "drop-new", "disconnect"};
+
+/// Parses the name of a backpressure policy.
+/// \param name - drop-oldest, drop-new or disconnect
+/// \param policy - Pointer where the parsed policy is stored
+/// \return 0 - success; -1 - failure
+int parse_backpressure_policy(const char* name, enum backpressure_policy* policy)
+{
+    for(int i = 0; i <= BACKPRESSURE_DISCONNECT; i++)
+    {
+        if(strcmp(name, backpressure_policy_names[i]) == 0)
+        {
+            *policy = (enum backpressure_policy) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/// Returns the name of a backpressure policy as accepted by parse_backpressure_policy().
+const char* backpressure_policy_name(enum backpressure_policy policy)
+{
+    return backpressure_policy_names[policy];
+}
+
+/// Parses a byte count with an optional k/K or m/M suffix, e.g. "256k".
+/// \param str - String to parse
+/// \param size - Pointer where the result is stored
+/// \return 0 - success; -1 - failure
+int parse_size(const char* str, size_t* size)
+{
+    char* end;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if(errno == ERANGE || end == str || str[0] == '-')
+    {
+        return -1;
+    }
+
+    if(*end == 'k' || *end == 'K')
+    {
+        value *= 1024;
+        end++;
+    }
+    else if(*end == 'm' || *end == 'M')
+    {
+        value *= 1024 * 1024;
+        end++;
+    }
+
+    if(*end != '\0')
+    {
+        return -1;
+    }
+
+    *size = (size_t) value;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef CHAT_SERVER_CONFIG_H
+#define CHAT_SERVER_CONFIG_H
+
+#include <stddef.h>
+#include "tcp_socket.h"
+#include "federation.h"
+#include "reactor.h"
+#include "cpu_affinity.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// What happens to a connection whose outbound queue exceeds the high-water mark
+enum backpressure_policy
+{
+    BACKPRESSURE_DROP_OLDEST,
+    BACKPRESSURE_DROP_NEW,
+    BACKPRESSURE_DISCONNECT
+};
+
+/// Tunables of the chat servers, filled from the command line in chat.c
+struct server_config
+{
+    size_t outbound_high_water;     // bytes queued for one client before the policy applies
+    size_t outbound_low_water;      // bytes below which a congested client recovers
+    enum backpressure_policy backpressure_policy;
+    int listen_backlog;             // accept queue length of listening sockets
+    int accept_batch;               // connections accepted per wake-up
+    int acceptor_threads;           // 0 - the server loop accepts itself
+    struct socket_profile socket_profile;   // tuning of listener and client sockets
+    const char* unix_socket_path;   // additional AF_UNIX listener ("@name" is abstract), may be NULL
+    int idle_timeout;               // seconds without data from a client until it is dropped, 0 - off
+    int heartbeat_interval;         // seconds without data to a client until a heartbeat is sent, 0 - off
+    int write_stall_timeout;        // seconds queued data may stay unread by a client, 0 - off
+    int coalesce_sends;             // event server: gather queued messages into one sendmsg() per flush
+    int coalesce_budget_us;         // microseconds a message may wait for others, 0 - one loop iteration
+    const char* multicast_group;    // event server: "ip:port" broadcasts are published to, may be NULL
+    const char* multicast_interface;    // address of the interface for multicast, NULL - routing table
+    int multicast_history;          // broadcasts kept for resending to listeners that missed them
+    size_t shm_ring_size;           // event server: bytes per direction of a shared-memory client
+    int node_id;                    // event server: id among federated servers, 0 - not federated
+    int federation_port;            // port other servers link to, 0 - accept no links
+    const char* peers[FEDERATION_MAX_PEERS];    // "ip:port" of servers to link to
+    int peer_count;
+    const char* handoff_path;       // event server: Unix socket of hot restarts ("@name" is abstract), may be NULL
+    enum reactor_backend reactor_backend;   // event and coroutine server: I/O backend, default - the server's own
+    int max_connections;            // event and coroutine server: clients served at once, 0 - the server's default
+    double rate_messages;           // event server: messages per second a client may send, 0 - unlimited
+    size_t rate_bytes;              // event server: bytes per second a client may send, 0 - unlimited
+    size_t zerocopy_threshold;      // event server: messages from this size go out with MSG_ZEROCOPY, 0 - off
+    const char* spool_dir;          // event server: directory of uploaded files, NULL - no file transfer
+    size_t spool_max_file;          // largest upload accepted
+    size_t file_rate;               // bytes per second of file content to one client, 0 - unlimited
+    int presence_interval_ms;       // event server: joins and leaves are announced in batches, 0 - one by one
+    int presence_snapshot;          // newcomers get the members of their room in the next batch
+    const char* trace_path;         // event server: events and their input are recorded here, NULL - off
+    const char* replay_path;        // event server: runs this trace instead of serving, NULL - off
+    struct cpu_list accept_cpus;    // acceptor threads
+    struct cpu_list io_cpus;        // server loop, one per prefork worker; thread server: its select() thread
+    struct cpu_list worker_cpus;    // thread server: client threads, by slot
+};
+
+extern struct server_config server_config;
+
+int parse_backpressure_policy(const char* name, enum backpressure_policy* policy);
+const char* backpressure_policy_name(enum backpressure_policy policy);
+int parse_size(const char* str, size_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_SERVER_CONFIG_H
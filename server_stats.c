@@ -0,0 +1,112 @@
+/*
+ * Stats surface of the chat server. Subsystems register a reporter that
+ * prints their counters/histograms; all reporters are run when the stats are
+ * dumped, either on request from the server console or on a signal.
+ */
+
+#include "server_stats.h"
+#include <signal.h>
+#include <string.h>
+
+#define MAX_STATS_REPORTERS 32
+
+struct stats_registration
+{
+    const char* name;
+    stats_reporter reporter;
+};
+
+struct stats_registration stats_reporters[MAX_STATS_REPORTERS];
+int stats_reporter_count = 0;
+
+/// Set from the signal handler, consumed by stats_dump_requested()
+static volatile sig_atomic_t stats_requested = 0;
+
+/// Called from the signal handler so a sleeping server loop notices the request
+static stats_wakeup stats_wakeup_function = NULL;
+static void* stats_wakeup_argument = NULL;
+
+/// Registers a reporter that is called on every stats dump.
+/// Registering the same name twice is ignored.
+/// \param name - Name of the section the reporter prints
+/// \param reporter - Function printing the section
+void stats_register(const char* name, stats_reporter reporter)
+{
+    for(int i = 0; i < stats_reporter_count; i++)
+    {
+        if(strcmp(stats_reporters[i].name, name) == 0)
+        {
+            return;
+        }
+    }
+
+    if(stats_reporter_count == MAX_STATS_REPORTERS)
+    {
+        return;
+    }
+
+    stats_reporters[stats_reporter_count].name = name;
+    stats_reporters[stats_reporter_count].reporter = reporter;
+    stats_reporter_count++;
+}
+
+/// Runs all registered reporters.
+/// \param stream - Stream to print to
+void stats_dump(FILE* stream)
+{
+    for(int i = 0; i < stats_reporter_count; i++)
+    {
+        fprintf(stream, "=== %s ===\n", stats_reporters[i].name);
+        stats_reporters[i].reporter(stream);
+    }
+    fflush(stream);
+}
+
+static void handle_stats_signal(int signal_number)
+{
+    (void) signal_number;
+    stats_requested = 1;
+    if(stats_wakeup_function != NULL)
+    {
+        stats_wakeup_function(stats_wakeup_argument);
+    }
+}
+
+/// Sets the function that wakes up the server loop when a stats dump is
+/// requested by a signal, e.g. reactor_wakeup().
+/// \param wakeup - Async-signal-safe function, NULL for none
+/// \param argument - Passed to wakeup
+void stats_set_wakeup(stats_wakeup wakeup, void* argument)
+{
+    stats_wakeup_argument = argument;
+    stats_wakeup_function = wakeup;
+}
+
+/// Installs a handler that requests a stats dump when the given signal arrives.
+/// The dump itself is done by the server loop via stats_dump_requested(), never
+/// from within the signal handler.
+/// \param signal_number - Signal to listen for, e.g. SIGUSR1
+/// \return 0 - success; -1 - failure
+int stats_install_signal_handler(int signal_number)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stats_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    return sigaction(signal_number, &action, NULL);
+}
+
+/// Checks whether a stats dump was requested by a signal and clears the request.
+/// \return 1 - dump requested; 0 - otherwise
+int stats_dump_requested(void)
+{
+    if(!stats_requested)
+    {
+        return 0;
+    }
+
+    stats_requested = 0;
+    return 1;
+}
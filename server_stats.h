@@ -0,0 +1,25 @@
+#ifndef CHAT_SERVER_STATS_H
+#define CHAT_SERVER_STATS_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// stats_reporter: prints the statistics of one subsystem
+typedef void (*stats_reporter) (FILE* stream);
+// stats_wakeup: wakes up the server loop, called from a signal handler
+typedef void (*stats_wakeup) (void* argument);
+
+void stats_register(const char* name, stats_reporter reporter);
+void stats_dump(FILE* stream);
+int stats_install_signal_handler(int signal_number);
+void stats_set_wakeup(stats_wakeup wakeup, void* argument);
+int stats_dump_requested(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_SERVER_STATS_H
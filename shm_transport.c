@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "shm_transport.h"
+#include "error_reporting.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_MAGIC 0x4348534dU  // "CHSM"
+#define SHM_VERSION 1
+#define CACHE_LINE 64
+
+/// Control block in front of the data of each ring. Producer and consumer
+/// fields live on separate cache lines.
+struct shm_ring
+{
+    _Atomic uint64_t head;              // bytes ever written, advanced by the producer
+    char pad0[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint64_t tail;              // bytes ever read, advanced by the consumer
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint32_t reader_waiting;    // consumer waits for data on its eventfd
+    _Atomic uint32_t writer_waiting;    // producer waits for space on its eventfd
+    char pad2[CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+/// Start of the segment, followed by the ring to the client and the ring to
+/// the server, each a control block and ring_size bytes of data
+struct shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+    char pad[CACHE_LINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+};
+
+static size_t segment_size(uint64_t ring_size)
+{
+    return sizeof(struct shm_header) + 2 * (sizeof(struct shm_ring) + ring_size);
+}
+
+/// Points tx and rx at the rings of a mapped segment.
+static void map_rings(shm_channel* channel, uint64_t ring_size, int server)
+{
+    unsigned char* to_client = (unsigned char*) channel->base + sizeof(struct shm_header);
+    unsigned char* to_server = to_client + sizeof(struct shm_ring) + ring_size;
+    struct shm_ring_view client_view = {(struct shm_ring*) to_client, to_client + sizeof(struct shm_ring), ring_size};
+    struct shm_ring_view server_view = {(struct shm_ring*) to_server, to_server + sizeof(struct shm_ring), ring_size};
+
+    channel->tx = server ? client_view : server_view;
+    channel->rx = server ? server_view : client_view;
+}
+
+/// Creates the segment and eventfds of a channel, server side.
+/// \param channel - Channel to initialise
+/// \param ring_size - Bytes per direction, rounded up to a power of two
+/// \param fds - Receives SHM_FD_COUNT descriptors for the client. fds[SHM_FD_SEGMENT]
+///              belongs to the caller and is closed once it was passed on, the
+///              eventfds belong to the channel.
+/// \return 0 - success; -1 - failure
+int shm_channel_create(shm_channel* channel, size_t ring_size, int* fds)
+{
+    uint64_t capacity = CACHE_LINE;
+    while(capacity < ring_size)
+    {
+        capacity *= 2;
+    }
+
+    memset(channel, 0, sizeof(shm_channel));
+    channel->wake_fd = -1;
+    channel->peer_fd = -1;
+    channel->mapped = segment_size(capacity);
+
+    int segment_fd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(segment_fd == -1)
+    {
+        print_error("shm_channel_create(): Could not create memfd.");
+        return -1;
+    }
+
+    // Sealed, the client cannot shrink the segment under the server's mapping
+    if(ftruncate(segment_fd, (off_t) channel->mapped) == -1 ||
+       fcntl(segment_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        print_error("shm_channel_create(): Could not size segment.");
+        close(segment_fd);
+        return -1;
+    }
+
+    channel->base = mmap(NULL, channel->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+    if(channel->base == MAP_FAILED)
+    {
+        print_error("shm_channel_create(): Could not map segment.");
+        channel->base = NULL;
+        close(segment_fd);
+        return -1;
+    }
+
+    struct shm_header* header = channel->base;
+    header->magic = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->ring_size = capacity;
+    map_rings(channel, capacity, 1);
+
+    channel->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(channel->wake_fd == -1 || channel->peer_fd == -1)
+    {
+        print_error("shm_channel_create(): Could not create eventfds.");
+        close(segment_fd);
+        shm_channel_close(channel);
+        return -1;
+    }
+
+    fds[SHM_FD_SEGMENT] = segment_fd;
+    fds[SHM_FD_CLIENT_WAKE] = channel->peer_fd;
+    fds[SHM_FD_SERVER_WAKE] = channel->wake_fd;
+    return 0;
+}
+
+/// Maps a channel the server passed, client side. Takes ownership of the
+/// descriptors and closes the segment descriptor.
+/// \param channel - Channel to initialise
+/// \param fds - SHM_FD_COUNT descriptors as received
+/// \return 0 - success; -1 - failure, all descriptors are closed
+int shm_channel_attach(shm_channel* channel, const int* fds)
+{
+    struct stat status;
+
+    memset(channel, 0, sizeof(shm_channel));
+    channel->wake_fd = fds[SHM_FD_CLIENT_WAKE];
+    channel->peer_fd = fds[SHM_FD_SERVER_WAKE];
+
+    if(fstat(fds[SHM_FD_SEGMENT], &status) == -1 || (size_t) status.st_size < sizeof(struct shm_header))
+    {
+        close(fds[SHM_FD_SEGMENT]);
+        shm_channel_close(channel);
+        return -1;
+    }
+
+    channel->mapped = (size_t) status.st_size;
+    channel->base = mmap(NULL, channel->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_SEGMENT], 0);
+    close(fds[SHM_FD_SEGMENT]);
+    if(channel->base == MAP_FAILED)
+    {
+        channel->base = NULL;
+        shm_channel_close(channel);
+        return -1;
+    }
+
+    const struct shm_header* header = channel->base;
+    uint64_t capacity = header->ring_size;
+    if(header->magic != SHM_MAGIC || header->version != SHM_VERSION || capacity == 0 ||
+       (capacity & (capacity - 1)) != 0 || segment_size(capacity) != channel->mapped)
+    {
+        shm_channel_close(channel);
+        return -1;
+    }
+
+    map_rings(channel, capacity, 0);
+    return 0;
+}
+
+/// Wakes the other side if it announced that it sleeps on a flag.
+static void signal_if_waiting(shm_channel* channel, _Atomic uint32_t* flag)
+{
+    // Pairs with the fence in shm_channel_sleep(): either the sleeper sees
+    // the new indices or this side sees its flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(flag, memory_order_relaxed) &&
+       atomic_exchange_explicit(flag, 0, memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        if(write(channel->peer_fd, &one, sizeof(one)) == sizeof(one))
+        {
+            channel->wakeups_sent++;
+        }
+    }
+}
+
+/// Copies as much of data into the outgoing ring as fits.
+/// \return bytes written, 0 if the ring is full; -1 - the peer corrupted the ring
+ssize_t shm_channel_write(shm_channel* channel, const void* data, size_t length)
+{
+    struct shm_ring_view* view = &channel->tx;
+    uint64_t head = atomic_load_explicit(&view->ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&view->ring->tail, memory_order_acquire);
+
+    if(head - tail > view->capacity)
+    {
+        return -1;
+    }
+
+    uint64_t space = view->capacity - (head - tail);
+    size_t count = length < space ? length : (size_t) space;
+    if(count == 0)
+    {
+        return 0;
+    }
+
+    size_t offset = (size_t) (head & (view->capacity - 1));
+    size_t first = count < view->capacity - offset ? count : (size_t) (view->capacity - offset);
+    memcpy(view->data + offset, data, first);
+    memcpy(view->data, (const unsigned char*) data + first, count - first);
+    atomic_store_explicit(&view->ring->head, head + count, memory_order_release);
+
+    signal_if_waiting(channel, &view->ring->reader_waiting);
+    return (ssize_t) count;
+}
+
+/// Copies up to length bytes out of the incoming ring.
+/// \return bytes read, 0 if the ring is empty; -1 - the peer corrupted the ring
+ssize_t shm_channel_read(shm_channel* channel, void* buffer, size_t length)
+{
+    struct shm_ring_view* view = &channel->rx;
+    uint64_t tail = atomic_load_explicit(&view->ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&view->ring->head, memory_order_acquire);
+
+    if(head - tail > view->capacity)
+    {
+        return -1;
+    }
+
+    size_t count = length < head - tail ? length : (size_t) (head - tail);
+    if(count == 0)
+    {
+        return 0;
+    }
+
+    size_t offset = (size_t) (tail & (view->capacity - 1));
+    size_t first = count < view->capacity - offset ? count : (size_t) (view->capacity - offset);
+    memcpy(buffer, view->data + offset, first);
+    memcpy((unsigned char*) buffer + first, view->data, count - first);
+    atomic_store_explicit(&view->ring->tail, tail + count, memory_order_release);
+
+    signal_if_waiting(channel, &view->ring->writer_waiting);
+    return (ssize_t) count;
+}
+
+/// \return bytes waiting in the incoming ring
+size_t shm_channel_readable(const shm_channel* channel)
+{
+    uint64_t head = atomic_load_explicit(&channel->rx.ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&channel->rx.ring->tail, memory_order_relaxed);
+    return head - tail > channel->rx.capacity ? 0 : (size_t) (head - tail);
+}
+
+/// \return free bytes in the outgoing ring
+size_t shm_channel_writable(const shm_channel* channel)
+{
+    uint64_t head = atomic_load_explicit(&channel->tx.ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&channel->tx.ring->tail, memory_order_acquire);
+    return head - tail > channel->tx.capacity ? 0 : (size_t) (channel->tx.capacity - (head - tail));
+}
+
+/// Announces that this side is about to wait on wake_fd for data, and with
+/// for_space also for room in the outgoing ring.
+/// \return 0 - may sleep; 1 - the rings changed meanwhile, do not sleep
+int shm_channel_sleep(shm_channel* channel, int for_space)
+{
+    atomic_store_explicit(&channel->rx.ring->reader_waiting, 1, memory_order_relaxed);
+    if(for_space)
+    {
+        atomic_store_explicit(&channel->tx.ring->writer_waiting, 1, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(shm_channel_readable(channel) > 0 || (for_space && shm_channel_writable(channel) > 0))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/// Withdraws the announcement of shm_channel_sleep().
+/// \param signalled - wake_fd was readable, its counter is reset
+void shm_channel_awake(shm_channel* channel, int signalled)
+{
+    uint64_t count;
+
+    atomic_store_explicit(&channel->rx.ring->reader_waiting, 0, memory_order_relaxed);
+    atomic_store_explicit(&channel->tx.ring->writer_waiting, 0, memory_order_relaxed);
+    if(signalled)
+    {
+        while(read(channel->wake_fd, &count, sizeof(count)) == sizeof(count))
+        {
+        }
+    }
+}
+
+/// Unmaps the segment and closes the eventfds.
+void shm_channel_close(shm_channel* channel)
+{
+    if(channel->base != NULL)
+    {
+        munmap(channel->base, channel->mapped);
+        channel->base = NULL;
+    }
+    if(channel->wake_fd >= 0)
+    {
+        close(channel->wake_fd);
+        channel->wake_fd = -1;
+    }
+    if(channel->peer_fd >= 0)
+    {
+        close(channel->peer_fd);
+        channel->peer_fd = -1;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CHAT_SHM_TRANSPORT_H
+#define CHAT_SHM_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Shared-memory transport for clients on the same host. The server creates
+/// a memfd segment per client holding one single-producer/single-consumer
+/// byte ring per direction, and passes it together with two eventfds over the
+/// client's Unix domain socket (see WIRE_SHM in wire_protocol.h).
+///
+/// Reading and writing never enter the kernel. A side that runs out of work
+/// announces with shm_channel_sleep() that it is going to wait on its eventfd;
+/// only then does the other side signal it after its next read or write.
+
+/// Descriptors handed to the client, in this order
+#define SHM_FD_SEGMENT 0        // memfd, sealed against resizing
+#define SHM_FD_CLIENT_WAKE 1    // eventfd the client waits on
+#define SHM_FD_SERVER_WAKE 2    // eventfd the server waits on
+#define SHM_FD_COUNT 3
+
+struct shm_ring;
+
+/// One direction of a channel as seen by this process. The capacity is kept
+/// locally so a misbehaving peer cannot change it.
+struct shm_ring_view
+{
+    struct shm_ring* ring;
+    unsigned char* data;
+    uint64_t capacity;          // power of two
+};
+
+typedef struct shm_channel
+{
+    void* base;
+    size_t mapped;
+    struct shm_ring_view tx;    // written by this side
+    struct shm_ring_view rx;    // read by this side
+    int wake_fd;                // eventfd this side waits on
+    int peer_fd;                // eventfd that wakes the other side
+    unsigned long long wakeups_sent;
+} shm_channel;
+
+int shm_channel_create(shm_channel* channel, size_t ring_size, int* fds);
+int shm_channel_attach(shm_channel* channel, const int* fds);
+ssize_t shm_channel_write(shm_channel* channel, const void* data, size_t length);
+ssize_t shm_channel_read(shm_channel* channel, void* buffer, size_t length);
+size_t shm_channel_readable(const shm_channel* channel);
+size_t shm_channel_writable(const shm_channel* channel);
+int shm_channel_sleep(shm_channel* channel, int for_space);
+void shm_channel_awake(shm_channel* channel, int signalled);
+void shm_channel_close(shm_channel* channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_SHM_TRANSPORT_H
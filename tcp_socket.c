@@ -1,18 +1,184 @@
 #define _GNU_SOURCE
 #include "tcp_socket.h"
+#include "error_reporting.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/resource.h>
 
-/// Creates a passive/listener socket for the server. The socket is non-blocking.
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+/// Named socket profiles that parse_socket_profile() starts from.
+/// TCP_DEFER_ACCEPT is off everywhere: chat clients that only listen never
+/// send the first byte and would not be accepted until the kernel gives up.
+static const struct socket_profile socket_profiles[] =
+{
+    //name          nodelay sndbuf        rcvbuf        cork defer busy_poll
+    {"default",     0,      0,            0,            0,   0,    0},
+    {"latency",     1,      0,            0,            0,   0,    50},
+    {"throughput",  0,      1024 * 1024,  1024 * 1024,  1,   0,    0}
+};
+
+/// Parses a socket profile of the form "name[,key=value...]", e.g.
+/// "latency" or "throughput,sndbuf=4194304,busy_poll=0". Keys are nodelay,
+/// sndbuf, rcvbuf, cork, defer_accept and busy_poll.
+/// \param spec - String to parse
+/// \param profile - Pointer to the structure receiving the profile
+/// \return 0 - success; -1 - failure
+int parse_socket_profile(const char* spec, struct socket_profile* profile)
+{
+    char copy[256];
+    char* safe_ptr;
+
+    if(strlen(spec) >= sizeof(copy))
+    {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    char* token = strtok_r(copy, ",", &safe_ptr);
+    if(token == NULL)
+    {
+        return -1;
+    }
+
+    size_t count = sizeof(socket_profiles) / sizeof(socket_profiles[0]);
+    size_t i;
+    for(i = 0; i < count; i++)
+    {
+        if(strcmp(token, socket_profiles[i].name) == 0)
+        {
+            *profile = socket_profiles[i];
+            break;
+        }
+    }
+    if(i == count)
+    {
+        return -1;
+    }
+
+    while((token = strtok_r(NULL, ",", &safe_ptr)) != NULL)
+    {
+        char* value = strchr(token, '=');
+        if(value == NULL)
+        {
+            return -1;
+        }
+        *value++ = '\0';
+
+        char* end;
+        long number = strtol(value, &end, 10);
+        if(*value == '\0' || *end != '\0' || number < 0)
+        {
+            return -1;
+        }
+
+        if(strcmp(token, "nodelay") == 0)           profile->nodelay = (int) number;
+        else if(strcmp(token, "sndbuf") == 0)       profile->send_buffer = (int) number;
+        else if(strcmp(token, "rcvbuf") == 0)       profile->receive_buffer = (int) number;
+        else if(strcmp(token, "cork") == 0)         profile->cork = (int) number;
+        else if(strcmp(token, "defer_accept") == 0) profile->defer_accept = (int) number;
+        else if(strcmp(token, "busy_poll") == 0)    profile->busy_poll = (int) number;
+        else return -1;
+    }
+
+    return 0;
+}
+
+/// Applies the per-connection options of a profile to a socket. Failing
+/// options (e.g. SO_BUSY_POLL without CAP_NET_ADMIN) are reported, the
+/// remaining options are still applied.
+/// \param socket_fd - Socket to tune
+/// \param profile - Profile to apply, NULL is a no-op
+/// \return 0 - success; -1 - at least one option could not be set
+int apply_socket_profile(int socket_fd, const struct socket_profile* profile)
+{
+    int result = 0;
+
+    if(profile == NULL)
+    {
+        return 0;
+    }
+
+    if(profile->nodelay &&
+       setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &profile->nodelay, sizeof(profile->nodelay)))
+    {
+        print_error("apply_socket_profile(): Could not set TCP_NODELAY.");
+        result = -1;
+    }
+
+    if(profile->send_buffer &&
+       setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &profile->send_buffer, sizeof(profile->send_buffer)))
+    {
+        print_error("apply_socket_profile(): Could not set SO_SNDBUF.");
+        result = -1;
+    }
+
+    if(profile->receive_buffer &&
+       setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &profile->receive_buffer, sizeof(profile->receive_buffer)))
+    {
+        print_error("apply_socket_profile(): Could not set SO_RCVBUF.");
+        result = -1;
+    }
+
+    if(profile->busy_poll &&
+       setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll, sizeof(profile->busy_poll)))
+    {
+        print_error("apply_socket_profile(): Could not set SO_BUSY_POLL.");
+        result = -1;
+    }
+
+    return result;
+}
+
+/// Applies a profile to a listener. Buffer sizes are set before listen() so
+/// accepted sockets inherit them and the window scale is negotiated for them.
+static void apply_listener_profile(int socket_fd, const struct socket_profile* profile)
+{
+    if(profile == NULL)
+    {
+        return;
+    }
+
+    apply_socket_profile(socket_fd, profile);
+
+    if(profile->defer_accept &&
+       setsockopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &profile->defer_accept, sizeof(profile->defer_accept)))
+    {
+        print_error("create_passive_socket(): Could not set TCP_DEFER_ACCEPT.");
+    }
+}
+
+/// Creates a passive/listener socket for the server with the default backlog.
+/// The socket is non-blocking.
 /// The caller must free allocated memory for the listener_socket.
 /// \param listener_socket - Pointer to a structure holding socket information
 /// \param port - Port the socket will listen on
 /// \return 0 - success; -1 - failure
 int create_passive_socket(socket_info** listener_socket, uint16_t port)
+{
+    struct listen_options options = {SOMAXCONN, 0, NULL};
+
+    return create_passive_socket_with_options(listener_socket, port, &options);
+}
+
+/// Creates a passive/listener socket for the server. The socket is non-blocking.
+/// The caller must free allocated memory for the listener_socket.
+/// \param listener_socket - Pointer to a structure holding socket information
+/// \param port - Port the socket will listen on
+/// \param options - Backlog and SO_REUSEPORT setting
+/// \return 0 - success; -1 - failure
+int create_passive_socket_with_options(socket_info** listener_socket, uint16_t port,
+                                       const struct listen_options* options)
 {
     *listener_socket = malloc(sizeof(socket_info));
 
@@ -25,6 +191,7 @@ int create_passive_socket(socket_info** listener_socket, uint16_t port)
     (*listener_socket)->address.sin_family = AF_INET;
     (*listener_socket)->address.sin_port   = htons(port);
     (*listener_socket)->address.sin_addr.s_addr = INADDR_ANY;
+    (*listener_socket)->profile = options->profile;
 
     (*listener_socket)->socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if((*listener_socket)->socket_fd == -1)
@@ -36,7 +203,14 @@ int create_passive_socket(socket_info** listener_socket, uint16_t port)
     int option = 1;
     if(setsockopt((*listener_socket)->socket_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)))
     {
-        perror("create_active_socket(): Could not set socket options.");
+        perror("create_passive_socket(): Could not set socket options.");
+        goto on_error;
+    }
+
+    if(options->reuse_port &&
+       setsockopt((*listener_socket)->socket_fd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)))
+    {
+        perror("create_passive_socket(): Could not set SO_REUSEPORT.");
         goto on_error;
     }
 
@@ -49,7 +223,9 @@ int create_passive_socket(socket_info** listener_socket, uint16_t port)
         goto on_error;
     }
 
-    if(listen((*listener_socket)->socket_fd, SOMAXCONN) == -1)
+    apply_listener_profile((*listener_socket)->socket_fd, options->profile);
+
+    if(listen((*listener_socket)->socket_fd, options->backlog) == -1)
     {
         perror("create_passive_socket(): Could not listen on socket.");
         goto on_error;
@@ -62,6 +238,336 @@ int create_passive_socket(socket_info** listener_socket, uint16_t port)
         return -1;
 }
 
+/// Fills a Unix domain socket address. A leading '@' selects the abstract
+/// namespace (Linux), which needs no file and vanishes with the socket.
+/// \param address - Address to fill
+/// \param path - File system path or "@name"
+/// \return length of the address - success; 0 - path too long
+socklen_t fill_unix_address(struct sockaddr_un* address, const char* path)
+{
+    size_t length = strlen(path);
+
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    if(length == 0 || length >= sizeof(address->sun_path))
+    {
+        return 0;
+    }
+
+    memcpy(address->sun_path, path, length);
+    if(path[0] == '@')
+    {
+        address->sun_path[0] = '\0';
+        return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length);
+    }
+
+    return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length + 1);
+}
+
+/// Creates a passive/listener Unix domain stream socket. The socket is non-blocking.
+/// A stale socket file at path is removed first. Socket profiles do not apply.
+/// The caller must free allocated memory for the listener_socket.
+/// \param listener_socket - Pointer to a structure holding socket information
+/// \param path - File system path or "@name" for the abstract namespace
+/// \param options - Backlog setting
+/// \return 0 - success; -1 - failure
+int create_passive_unix_socket(socket_info** listener_socket, const char* path,
+                               const struct listen_options* options)
+{
+    *listener_socket = calloc(1, sizeof(socket_info));
+
+    if(*listener_socket == NULL)
+    {
+        perror("create_passive_unix_socket(): Could not allocate memory.");
+        return -1;
+    }
+
+    (*listener_socket)->address.sin_family = AF_UNIX;
+    (*listener_socket)->profile = NULL;
+
+    socklen_t socket_address_size = fill_unix_address(&(*listener_socket)->unix_address, path);
+    if(socket_address_size == 0)
+    {
+        fprintf_error("create_passive_unix_socket(): Invalid socket path '%s'.\n", path);
+        goto on_error;
+    }
+
+    (*listener_socket)->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if((*listener_socket)->socket_fd == -1)
+    {
+        perror("create_passive_unix_socket(): Could not create socket.");
+        goto on_error;
+    }
+
+    if(path[0] != '@')
+    {
+        unlink(path);
+    }
+
+    if(bind((*listener_socket)->socket_fd, (struct sockaddr *) &(*listener_socket)->unix_address,
+            socket_address_size) == -1)
+    {
+        perror("create_passive_unix_socket(): Could not bind socket.");
+        close((*listener_socket)->socket_fd);
+        goto on_error;
+    }
+
+    if(listen((*listener_socket)->socket_fd, options->backlog) == -1)
+    {
+        perror("create_passive_unix_socket(): Could not listen on socket.");
+        close((*listener_socket)->socket_fd);
+        goto on_error;
+    }
+
+    return 0;
+
+    on_error:
+        free(*listener_socket);
+        return -1;
+}
+
+/// Creates an active Unix domain socket for the client. The socket is blocking.
+/// The caller must free allocated memory for the active_socket.
+/// \param active_socket - Pointer to a structure holding socket information
+/// \param path - File system path or "@name" for the abstract namespace
+/// \return 0 - success; -1 - failure
+int create_active_unix_socket(socket_info** active_socket, const char* path)
+{
+    *active_socket = calloc(1, sizeof(socket_info));
+
+    if(*active_socket == NULL)
+    {
+        perror("create_active_unix_socket(): Could not allocate memory.");
+        return -1;
+    }
+
+    // The address is kept local: only listeners own (and unlink) the path
+    struct sockaddr_un server_address;
+
+    (*active_socket)->address.sin_family = AF_UNIX;
+
+    socklen_t socket_address_size = fill_unix_address(&server_address, path);
+    if(socket_address_size == 0)
+    {
+        fprintf_error("create_active_unix_socket(): Invalid socket path '%s'.\n", path);
+        goto on_error;
+    }
+
+    (*active_socket)->socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((*active_socket)->socket_fd == -1)
+    {
+        perror("create_active_unix_socket(): Could not create socket.");
+        goto on_error;
+    }
+
+    if(connect((*active_socket)->socket_fd, (struct sockaddr *) &server_address, socket_address_size) == -1)
+    {
+        perror("create_active_unix_socket(): Could not connect to server.");
+        close((*active_socket)->socket_fd);
+        goto on_error;
+    }
+
+    return 0;
+
+    on_error:
+        free(*active_socket);
+        return -1;
+}
+
+/// Raises the soft limit of open descriptors to at least needed, but not
+/// beyond the hard limit, which only root could raise.
+/// \param needed - Descriptors the process wants to have open
+/// \return The soft limit in effect afterwards; -1 - failure
+long raise_file_limit(long needed)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        perror("raise_file_limit(): Could not get RLIMIT_NOFILE.");
+        return -1;
+    }
+
+    if(limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t) needed)
+    {
+        limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && limit.rlim_max < (rlim_t) needed
+                         ? limit.rlim_max : (rlim_t) needed;
+        if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        {
+            perror("raise_file_limit(): Could not set RLIMIT_NOFILE.");
+            return -1;
+        }
+    }
+
+    return limit.rlim_cur == RLIM_INFINITY ? needed : (long) limit.rlim_cur;
+}
+
+/// Formats the peer of a connected socket as "ip:port", or "local" for
+/// Unix domain sockets.
+/// \param socket_fd - Connected socket
+/// \param buffer - Buffer receiving the string
+/// \param size - Size of buffer
+/// \return 0 - success; -1 - failure (buffer holds "unknown")
+int format_peer_address(int socket_fd, char* buffer, size_t size)
+{
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+
+    if(getpeername(socket_fd, (struct sockaddr *) &address, &address_length) == -1)
+    {
+        snprintf(buffer, size, "unknown");
+        return -1;
+    }
+
+    if(address.ss_family == AF_INET)
+    {
+        struct sockaddr_in* inet_address = (struct sockaddr_in *) &address;
+        char ip[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &inet_address->sin_addr, ip, sizeof(ip));
+        snprintf(buffer, size, "%s:%d", ip, ntohs(inet_address->sin_port));
+    }
+    else
+    {
+        snprintf(buffer, size, "local");
+    }
+
+    return 0;
+}
+
+/// Sends data together with open file descriptors over a Unix domain socket.
+/// The receiver gets duplicates, the caller keeps its descriptors.
+/// \param socket_fd - Connected Unix domain socket
+/// \param data - At least one byte, the descriptors travel with its first byte
+/// \param length - Size of data
+/// \param fds - Descriptors to pass
+/// \param count - Number of descriptors, at most MAX_PASSED_FDS
+/// \return bytes sent - success; -1 - failure (errno is set)
+ssize_t send_with_descriptors(int socket_fd, const void* data, size_t length, const int* fds, int count)
+{
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec iov = {(void*) data, length};
+    struct msghdr message;
+
+    if(count < 1 || count > MAX_PASSED_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+}
+
+/// Receives data and the file descriptors that came with it over a Unix
+/// domain socket. Descriptors beyond *count are closed by the kernel.
+/// \param socket_fd - Connected Unix domain socket
+/// \param data - Buffer for the data
+/// \param length - Size of data
+/// \param fds - Array receiving the descriptors, which are close-on-exec
+/// \param count - Size of fds on input, number of received descriptors on return
+/// \return bytes received - success; -1 - failure (errno is set)
+ssize_t receive_with_descriptors(int socket_fd, void* data, size_t length, int* fds, int* count)
+{
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec iov = {data, length};
+    struct msghdr message;
+    int capacity = *count < MAX_PASSED_FDS ? *count : MAX_PASSED_FDS;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    *count = 0;
+    ssize_t received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    if(received < 0)
+    {
+        return -1;
+    }
+
+    for(struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int passed = (int) ((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int* passed_fds = (int*) CMSG_DATA(header);
+        for(int i = 0; i < passed; i++)
+        {
+            if(*count < capacity)
+            {
+                fds[(*count)++] = passed_fds[i];
+            }
+            else
+            {
+                close(passed_fds[i]);
+            }
+        }
+    }
+
+    return received;
+}
+
+/// Wraps a listening socket that was passed from another process, e.g. by a
+/// hot restart. Accepted sockets get profile, like with create_passive_socket().
+/// The caller must free allocated memory for the listener_socket.
+/// \param listener_socket - Pointer to a structure holding socket information
+/// \param socket_fd - Listening socket
+/// \param profile - Socket tuning of accepted sockets, may be NULL
+/// \return 0 - success; -1 - failure
+int adopt_passive_socket(socket_info** listener_socket, int socket_fd, const struct socket_profile* profile)
+{
+    *listener_socket = calloc(1, sizeof(socket_info));
+
+    if(*listener_socket == NULL)
+    {
+        perror("adopt_passive_socket(): Could not allocate memory.");
+        return -1;
+    }
+
+    (*listener_socket)->socket_fd = socket_fd;
+    (*listener_socket)->profile = profile;
+
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    if(getsockname(socket_fd, (struct sockaddr *) &address, &address_length) == -1)
+    {
+        perror("adopt_passive_socket(): Could not get socket address.");
+        free(*listener_socket);
+        return -1;
+    }
+
+    if(address.ss_family == AF_INET)
+    {
+        memcpy(&(*listener_socket)->address, &address, sizeof(struct sockaddr_in));
+    }
+    else
+    {
+        // Profiles do not apply to Unix domain sockets
+        (*listener_socket)->address.sin_family = AF_UNIX;
+        (*listener_socket)->profile = NULL;
+        memcpy(&(*listener_socket)->unix_address, &address, sizeof(struct sockaddr_un));
+    }
+
+    return 0;
+}
+
 /// Creates an active socket for the client. The socket is blocking.
 /// The caller must free allocated memory for the active_socket.
 /// \param active_socket - Pointer to a structure holding socket information
@@ -80,11 +586,13 @@ int create_active_socket(socket_info** active_socket, char* ip_address, uint16_t
 
     (*active_socket)->address.sin_family = AF_INET;
     (*active_socket)->address.sin_port   = htons(port);
+    (*active_socket)->profile = NULL;
 
+    (*active_socket)->socket_fd = -1;
     if(inet_pton(AF_INET, ip_address, &(*active_socket)->address.sin_addr) != 1)
     {
         perror("create_active_socket(): Could not parse ip address.");
-        return -1;
+        goto on_error;
     }
 
     (*active_socket)->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -113,10 +621,43 @@ int create_active_socket(socket_info** active_socket, char* ip_address, uint16_t
     return 0;
 
     on_error:
+        // Callers retry, e.g. federation links, so the descriptor must not leak
+        if((*active_socket)->socket_fd != -1)
+        {
+            close((*active_socket)->socket_fd);
+        }
         free(*active_socket);
         return -1;
 }
 
+/// Tells whether a failed accept() only lost one pending connection: a client
+/// that aborted, or a network error Linux passes on from the new socket.
+/// accept(2) says to retry these like EAGAIN.
+/// \param error - errno of the failed accept()
+/// \return 1 - retry; 0 - otherwise
+static int accept_error_is_retryable(int error)
+{
+    switch(error)
+    {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case ECONNABORTED:
+        case EPROTO:
+        case ENOPROTOOPT:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENONET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 /// Accepts an incoming connection on a passive/listening socket.
 /// \param socket - Pointer to a structure holding socket information
 /// \return file descriptor for the socket - success; -1 - failure
@@ -126,16 +667,58 @@ int accept_connection(socket_info** socket)
     int socket_fd = accept4((*socket)->socket_fd, NULL, NULL, SOCK_NONBLOCK);
     if(socket_fd == -1)
     {
-        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        if(!accept_error_is_retryable(errno))
         {
-            perror("accept_connection(): Could not accept connection.");
+            int error_number = errno;
+            print_error("accept_connection(): Could not accept connection.");
+            errno = error_number;
         }
         return -1;
     }
 
+    apply_socket_profile(socket_fd, (*socket)->profile);
+
     return socket_fd;
 }
 
+/// Accepts up to max_connections pending connections on a non-blocking
+/// passive/listening socket, stopping early when no more are pending.
+/// \param socket - Pointer to a structure holding socket information
+/// \param socket_fds - Array receiving the file descriptors of the accepted sockets
+/// \param max_connections - Size of socket_fds
+/// \return number of accepted connections - success; -1 - failure before any connection was accepted
+int accept_connections(socket_info** socket, int* socket_fds, int max_connections)
+{
+    int accepted = 0;
+
+    while(accepted < max_connections)
+    {
+        int socket_fd = accept_connection(socket);
+        if(socket_fd == -1)
+        {
+            if(accept_error_is_retryable(errno) || accepted > 0)
+            {
+                break;
+            }
+            return -1;
+        }
+        socket_fds[accepted++] = socket_fd;
+    }
+
+    return accepted;
+}
+
+/// Tells whether a failed accept() only ends this attempt: the process or the
+/// system ran out of descriptors or memory. The connection stays pending, so
+/// the listener stays readable; a server stops polling it for a moment
+/// instead of spinning or giving up.
+/// \param error - errno of the failed accept()
+/// \return 1 - transient; 0 - the listener failed
+int accept_error_is_transient(int error)
+{
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
 /// Closes and frees socket
 /// \param socket - Pointer to a structure holding socket information
 /// \return 0 - success; -1 - failure
@@ -147,6 +730,12 @@ int destroy_socket(socket_info** socket)
         return -1;
     }
 
+    // Remove the file of a Unix domain listener, abstract names start with '\0'
+    if((*socket)->address.sin_family == AF_UNIX && (*socket)->unix_address.sun_path[0] != '\0')
+    {
+        unlink((*socket)->unix_address.sun_path);
+    }
+
     free(*socket);
     *socket = NULL;
 
@@ -2,19 +2,72 @@
 #define EVENT_VS_THREAD_CHAT_SOCKET_H
 
 #include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct socket_info socket_info;
 
+/// Most descriptors send_with_descriptors() passes in one message
+#define MAX_PASSED_FDS 8
+
+/// Socket tuning applied to listeners and accepted/connected sockets.
+/// A value of 0 keeps the kernel default.
+struct socket_profile
+{
+    char name[16];
+    int nodelay;        // TCP_NODELAY: 1 - disable Nagle's algorithm
+    int send_buffer;    // SO_SNDBUF in bytes
+    int receive_buffer; // SO_RCVBUF in bytes
+    int cork;           // 1 - batch queued messages with MSG_MORE
+    int defer_accept;   // TCP_DEFER_ACCEPT in seconds (listeners only)
+    int busy_poll;      // SO_BUSY_POLL in microseconds
+};
+
 struct socket_info
 {
     int socket_fd;
-    struct sockaddr_in address;
+    struct sockaddr_in address;             // sin_family is AF_UNIX for Unix domain sockets
+    struct sockaddr_un unix_address;        // only used for Unix domain sockets
+    const struct socket_profile* profile;   // applied to accepted sockets, may be NULL
 };
 
+/// Options for passive/listener sockets
+struct listen_options
+{
+    int backlog;        // length of the accept queue passed to listen()
+    int reuse_port;     // 1 - set SO_REUSEPORT so several sockets can share the port
+    const struct socket_profile* profile;   // may be NULL
+};
+
+int parse_socket_profile(const char* spec, struct socket_profile* profile);
+int apply_socket_profile(int socket_fd, const struct socket_profile* profile);
+
 int create_passive_socket(struct socket_info** listener_socket, uint16_t port);
+int create_passive_socket_with_options(struct socket_info** listener_socket, uint16_t port,
+                                       const struct listen_options* options);
+int create_passive_unix_socket(struct socket_info** listener_socket, const char* path,
+                               const struct listen_options* options);
+int adopt_passive_socket(struct socket_info** listener_socket, int socket_fd,
+                         const struct socket_profile* profile);
+socklen_t fill_unix_address(struct sockaddr_un* address, const char* path);
 int create_active_socket(struct socket_info** active_socket, char* ip_address, uint16_t port);
+int create_active_unix_socket(struct socket_info** active_socket, const char* path);
+int format_peer_address(int socket_fd, char* buffer, size_t size);
+long raise_file_limit(long needed);
+ssize_t send_with_descriptors(int socket_fd, const void* data, size_t length, const int* fds, int count);
+ssize_t receive_with_descriptors(int socket_fd, void* data, size_t length, int* fds, int* count);
 int accept_connection(struct socket_info** socket);
+int accept_connections(struct socket_info** socket, int* socket_fds, int max_connections);
+int accept_error_is_transient(int error);
 int destroy_socket(struct socket_info** socket);
 
+#ifdef __cplusplus
+}
+#endif
+
 
 #endif //EVENT_VS_THREAD_CHAT_SOCKET_H
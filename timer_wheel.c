@@ -0,0 +1,246 @@
+#include "timer_wheel.h"
+#include <limits.h>
+
+#define SLOT_MASK ((uint64_t) TIMER_WHEEL_SLOTS - 1)
+
+/// Ticks covered by the whole wheel
+#define WHEEL_SPAN (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))
+
+static void list_init(timer_entry* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static int list_empty(const timer_entry* head)
+{
+    return head->next == head;
+}
+
+static void list_append(timer_entry* head, timer_entry* timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(timer_entry* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/// Moves all entries of a slot to an empty list head.
+static void list_take(timer_entry* head, timer_entry* slot)
+{
+    list_init(head);
+    if(!list_empty(slot))
+    {
+        head->next = slot->next;
+        head->prev = slot->prev;
+        head->next->prev = head;
+        head->prev->next = head;
+        list_init(slot);
+    }
+}
+
+/// Links an armed timer into the slot matching its distance from the current
+/// tick. Timers that are already due go to the slot processed next.
+/// \param wheel - Wheel to insert into
+/// \param timer - Timer with its expires tick set
+static void place(timer_wheel* wheel, timer_entry* timer)
+{
+    uint64_t expires = timer->expires < wheel->current ? wheel->current : timer->expires;
+    uint64_t delta = expires - wheel->current;
+    int level = 0;
+
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1)))
+    {
+        level++;
+    }
+
+    if(delta >= WHEEL_SPAN)
+    {
+        expires = wheel->current + WHEEL_SPAN - 1;
+    }
+
+    uint64_t slot = (expires >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+/// Re-sorts all timers of one slot into the lower levels.
+static void cascade(timer_wheel* wheel, int level, uint64_t slot)
+{
+    timer_entry pending;
+    list_take(&pending, &wheel->slots[level][slot]);
+
+    while(!list_empty(&pending))
+    {
+        timer_entry* timer = pending.next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+/// Prepares an empty wheel.
+/// \param wheel - Wheel to initialise
+/// \param tick_ns - Resolution of the wheel in nanoseconds
+/// \param now_ns - Current monotonic time, becomes tick 0
+void timer_wheel_init(timer_wheel* wheel, uint64_t tick_ns, uint64_t now_ns)
+{
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+
+    wheel->current = 0;
+    wheel->tick_ns = tick_ns;
+    wheel->start_ns = now_ns;
+    wheel->armed = 0;
+    wheel->expired = 0;
+}
+
+/// Prepares an unarmed timer.
+/// \param timer - Timer to initialise
+/// \param callback - Function called on expiry
+/// \param context - Pointer for the callback, e.g. the owning object
+void timer_entry_init(timer_entry* timer, timer_callback callback, void* context)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->context = context;
+}
+
+/// \return 1 - the timer is armed; 0 - it is not
+int timer_entry_armed(const timer_entry* timer)
+{
+    return timer->prev != NULL;
+}
+
+/// Arms a timer, or moves it if it is already armed.
+/// \param wheel - Wheel the timer belongs to
+/// \param timer - Initialised timer
+/// \param expires_ns - Monotonic time at which the timer fires (rounded up to the next tick)
+void timer_wheel_arm(timer_wheel* wheel, timer_entry* timer, uint64_t expires_ns)
+{
+    if(timer_entry_armed(timer))
+    {
+        list_unlink(timer);
+    }
+    else
+    {
+        wheel->armed++;
+    }
+
+    uint64_t offset = expires_ns > wheel->start_ns ? expires_ns - wheel->start_ns : 0;
+    timer->expires = (offset + wheel->tick_ns - 1) / wheel->tick_ns;
+    place(wheel, timer);
+}
+
+/// Disarms a timer. Cancelling an unarmed timer does nothing.
+void timer_wheel_cancel(timer_wheel* wheel, timer_entry* timer)
+{
+    if(timer_entry_armed(timer))
+    {
+        list_unlink(timer);
+        wheel->armed--;
+    }
+}
+
+/// Runs the callbacks of all timers that expired up to now.
+/// \param wheel - Wheel to advance
+/// \param now_ns - Current monotonic time
+/// \return number of expired timers
+size_t timer_wheel_advance(timer_wheel* wheel, uint64_t now_ns)
+{
+    uint64_t target = now_ns > wheel->start_ns ? (now_ns - wheel->start_ns) / wheel->tick_ns : 0;
+    size_t fired = 0;
+
+    if(wheel->armed == 0 && wheel->current <= target)
+    {
+        wheel->current = target + 1;
+        return 0;
+    }
+
+    while(wheel->current <= target)
+    {
+        uint64_t index = wheel->current & SLOT_MASK;
+
+        // At the start of a revolution the next slot of the level above
+        // moves down, and so on while that level starts a revolution too
+        if(index == 0)
+        {
+            for(int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+            {
+                uint64_t slot = (wheel->current >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+                cascade(wheel, level, slot);
+                if(slot != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        timer_entry due;
+        list_take(&due, &wheel->slots[0][index]);
+        wheel->current++;
+
+        // Callbacks may arm or cancel any timer, including the ones in due
+        while(!list_empty(&due))
+        {
+            timer_entry* timer = due.next;
+            list_unlink(timer);
+            wheel->armed--;
+            wheel->expired++;
+            fired++;
+            timer->callback(timer);
+        }
+    }
+
+    return fired;
+}
+
+/// Computes how long a poll() may sleep without delaying a timer. While only
+/// timers in the upper levels are armed, the wheel wakes up once per revolution
+/// of the first level to move them down.
+/// \param wheel - Wheel to inspect
+/// \param now_ns - Current monotonic time
+/// \return timeout in milliseconds; -1 - no timer is armed
+int timer_wheel_timeout_ms(const timer_wheel* wheel, uint64_t now_ns)
+{
+    if(wheel->armed == 0)
+    {
+        return -1;
+    }
+
+    // Without a due timer in the first level, sleep until the next
+    // revolution starts, which is the current tick if index is 0
+    uint64_t index = wheel->current & SLOT_MASK;
+    uint64_t ticks = (TIMER_WHEEL_SLOTS - index) & SLOT_MASK;
+
+    for(uint64_t slot = index; slot < TIMER_WHEEL_SLOTS; slot++)
+    {
+        if(!list_empty(&wheel->slots[0][slot]))
+        {
+            ticks = slot - index;
+            break;
+        }
+    }
+
+    uint64_t due = wheel->start_ns + (wheel->current + ticks) * wheel->tick_ns;
+    if(due <= now_ns)
+    {
+        return 0;
+    }
+
+    uint64_t timeout = (due - now_ns + 999999) / 1000000;
+    return timeout > INT_MAX ? INT_MAX : (int) timeout;
+}
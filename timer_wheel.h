@@ -0,0 +1,61 @@
+#ifndef CHAT_TIMER_WHEEL_H
+#define CHAT_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots. A slot of
+/// level n spans TIMER_WHEEL_SLOTS^n ticks, so four levels of 64 slots cover
+/// 2^24 ticks (about 46 hours at 10 ms per tick). Timers further out are parked
+/// in the last level and re-sorted when their slot comes up.
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timer_entry timer_entry;
+typedef struct timer_wheel timer_wheel;
+
+/// Called from timer_wheel_advance() once the timer expired. The timer is no
+/// longer armed and may be re-armed from the callback.
+typedef void (*timer_callback)(timer_entry* timer);
+
+/// Intrusive timer, embedded in the object it belongs to. It must not move in
+/// memory while it is armed.
+struct timer_entry
+{
+    timer_entry* next;
+    timer_entry* prev;          // NULL - not armed
+    uint64_t expires;           // tick at which the timer fires
+    timer_callback callback;
+    void* context;
+};
+
+/// Hierarchical hashed timer wheel. Arming and cancelling are O(1), a tick
+/// costs O(1) plus the timers that expire or move down one level.
+struct timer_wheel
+{
+    timer_entry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+    uint64_t current;           // next tick to be processed
+    uint64_t tick_ns;
+    uint64_t start_ns;          // monotonic time of tick 0
+    size_t armed;
+    unsigned long long expired;
+};
+
+void timer_wheel_init(timer_wheel* wheel, uint64_t tick_ns, uint64_t now_ns);
+void timer_entry_init(timer_entry* timer, timer_callback callback, void* context);
+int timer_entry_armed(const timer_entry* timer);
+void timer_wheel_arm(timer_wheel* wheel, timer_entry* timer, uint64_t expires_ns);
+void timer_wheel_cancel(timer_wheel* wheel, timer_entry* timer);
+size_t timer_wheel_advance(timer_wheel* wheel, uint64_t now_ns);
+int timer_wheel_timeout_ms(const timer_wheel* wheel, uint64_t now_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_TIMER_WHEEL_H
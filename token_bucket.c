@@ -0,0 +1,64 @@
+#include "token_bucket.h"
+
+#define NS_PER_SECOND 1e9
+
+/// Starts a full bucket.
+/// \param bucket - Bucket to initialize
+/// \param rate - Tokens added per second, 0 - unlimited
+/// \param burst - Capacity of the bucket
+/// \param now_ns - Current time in nanoseconds
+void token_bucket_init(token_bucket* bucket, double rate, double burst, uint64_t now_ns)
+{
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->refilled_ns = now_ns;
+}
+
+/// Adds the tokens that accrued since the last refill, up to the burst.
+/// \param bucket - Bucket to refill
+/// \param now_ns - Current time in nanoseconds, from the same clock as before
+void token_bucket_refill(token_bucket* bucket, uint64_t now_ns)
+{
+    if(now_ns <= bucket->refilled_ns)
+    {
+        return;
+    }
+
+    bucket->tokens += bucket->rate * (double) (now_ns - bucket->refilled_ns) / NS_PER_SECOND;
+    if(bucket->tokens > bucket->burst)
+    {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->refilled_ns = now_ns;
+}
+
+/// Checks whether the bucket holds at least needed tokens.
+/// \return 1 - ready, always for an unlimited bucket; 0 - not yet
+int token_bucket_ready(const token_bucket* bucket, double needed)
+{
+    return bucket->rate == 0 || bucket->tokens >= needed;
+}
+
+/// Takes tokens, possibly more than the bucket holds.
+void token_bucket_take(token_bucket* bucket, double amount)
+{
+    if(bucket->rate > 0)
+    {
+        bucket->tokens -= amount;
+    }
+}
+
+/// Returns how long the refill takes until the bucket holds needed tokens.
+/// \param bucket - Bucket, refilled up to the current time
+/// \param needed - Tokens to wait for, at most the burst
+/// \return nanoseconds, 0 if the bucket is ready
+uint64_t token_bucket_delay_ns(const token_bucket* bucket, double needed)
+{
+    if(token_bucket_ready(bucket, needed))
+    {
+        return 0;
+    }
+
+    return (uint64_t) ((needed - bucket->tokens) / bucket->rate * NS_PER_SECOND) + 1;
+}
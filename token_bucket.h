@@ -0,0 +1,34 @@
+#ifndef CHAT_TOKEN_BUCKET_H
+#define CHAT_TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct token_bucket token_bucket;
+
+/// Token bucket for rate limiting. It is refilled lazily from the time the
+/// caller passes in, so a coarse clock that is read once per loop iteration
+/// is enough. Taking more tokens than there are leaves the bucket in debt,
+/// which the refill pays off before the bucket is ready again.
+struct token_bucket
+{
+    double rate;                // tokens per second, 0 - unlimited
+    double burst;               // most tokens the bucket holds
+    double tokens;
+    uint64_t refilled_ns;       // time of the last refill
+};
+
+void token_bucket_init(token_bucket* bucket, double rate, double burst, uint64_t now_ns);
+void token_bucket_refill(token_bucket* bucket, uint64_t now_ns);
+int token_bucket_ready(const token_bucket* bucket, double needed);
+void token_bucket_take(token_bucket* bucket, double amount);
+uint64_t token_bucket_delay_ns(const token_bucket* bucket, double needed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_TOKEN_BUCKET_H
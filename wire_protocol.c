@@ -0,0 +1,68 @@
+#include "wire_protocol.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+/// Writes a header in wire format.
+/// \param header - Header to encode
+/// \param out - At least WIRE_HEADER_SIZE bytes
+void wire_encode_header(const struct wire_header* header, unsigned char* out)
+{
+    uint16_t room = htons(header->room);
+    uint32_t sender = htonl(header->sender);
+    uint32_t sequence = htonl(header->sequence);
+    uint32_t length = htonl(header->length);
+
+    out[0] = header->version;
+    out[1] = header->type;
+    memcpy(out + 2, &room, sizeof(room));
+    memcpy(out + 4, &sender, sizeof(sender));
+    memcpy(out + 8, &sequence, sizeof(sequence));
+    memcpy(out + 12, &length, sizeof(length));
+}
+
+/// Reads a header in wire format and validates version and length.
+/// \param in - WIRE_HEADER_SIZE bytes received
+/// \param header - Pointer where the decoded header is stored
+/// \return 0 - success; -1 - unsupported version or oversized payload
+int wire_decode_header(const unsigned char* in, struct wire_header* header)
+{
+    uint16_t room;
+    uint32_t sender;
+    uint32_t sequence;
+    uint32_t length;
+
+    memcpy(&room, in + 2, sizeof(room));
+    memcpy(&sender, in + 4, sizeof(sender));
+    memcpy(&sequence, in + 8, sizeof(sequence));
+    memcpy(&length, in + 12, sizeof(length));
+
+    header->version = in[0];
+    header->type = in[1];
+    header->room = ntohs(room);
+    header->sender = ntohl(sender);
+    header->sequence = ntohl(sequence);
+    header->length = ntohl(length);
+
+    if(header->version != WIRE_VERSION || header->length > WIRE_MAX_PAYLOAD)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/// Writes a complete frame.
+/// \param header - Header of the frame, its length is the payload size
+/// \param payload - header->length bytes, may be NULL if the length is 0
+/// \param out - At least WIRE_HEADER_SIZE + header->length bytes
+/// \return size of the frame
+size_t wire_encode_frame(const struct wire_header* header, const void* payload, unsigned char* out)
+{
+    wire_encode_header(header, out);
+    if(header->length > 0)
+    {
+        memcpy(out + WIRE_HEADER_SIZE, payload, header->length);
+    }
+
+    return WIRE_HEADER_SIZE + header->length;
+}
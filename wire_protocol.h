@@ -0,0 +1,120 @@
+#ifndef CHAT_WIRE_PROTOCOL_H
+#define CHAT_WIRE_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Binary protocol of the event server. A connection is binary if the first
+/// byte it sends is WIRE_VERSION, which no text client sends; it starts with a
+/// WIRE_HELLO frame and the server answers with one carrying the client's
+/// sender id. Every frame is a WIRE_HEADER_SIZE header in network byte order
+/// followed by length bytes of opaque payload.
+#define WIRE_VERSION 1
+#define WIRE_HEADER_SIZE 16
+#define WIRE_MAX_PAYLOAD (64 * 1024)
+
+enum wire_frame_type
+{
+    WIRE_HELLO = 1,     // handshake, both directions
+    WIRE_MESSAGE,       // chat message, sender 0 is the server console
+    WIRE_JOIN,          // sender entered room; from a client: move me to room
+    WIRE_LEAVE,         // sender left room
+    WIRE_HEARTBEAT,     // keeps idle connections alive, no payload
+    WIRE_MULTICAST,     // receive broadcasts from the multicast group, see below
+    WIRE_NACK,          // resend a sequence range over the connection, see below
+    WIRE_SHM,           // move the connection to shared memory, see below
+    WIRE_PEER_HELLO,    // opens a link between two servers, see below
+    WIRE_PEER_INTEREST, // a linked server gained or lost its members in room
+    WIRE_FILE_OFFER,    // upload a file into the server's spool, see below
+    WIRE_FILE_DATA,     // content of a file, both directions
+    WIRE_FILE,          // a file in the spool was shared with the room
+    WIRE_FILE_GET,      // download a file from the spool
+    WIRE_PRESENCE       // joins and leaves of an interval in one frame, see below
+};
+
+/// Multicast fanout: a client sends WIRE_MULTICAST to have broadcasts of all
+/// rooms published once to the server's multicast group instead of written
+/// to its connection. The answer carries the group as "ip:port" (empty if
+/// the server has no group) and, as sequence, the first broadcast that only
+/// goes to the group. Every datagram is one frame; listeners keep the frames
+/// of their room and of sender 0 and skip their own.
+///
+/// A listener that sees the sequence jump sends WIRE_NACK with the first
+/// missing sequence and a payload of WIRE_NACK_SIZE bytes: the count as a
+/// uint32. The server resends the retained frames of the listener's room over
+/// the connection and then answers with a WIRE_NACK of the same range whose
+/// payload holds the count and the number of frames it no longer had.
+#define WIRE_NACK_SIZE 4
+
+/// Shared memory: a client on the Unix domain socket sends WIRE_SHM to move
+/// its traffic into rings in shared memory (shm_transport.h). The answer
+/// carries the segment and eventfds as SCM_RIGHTS; its payload is the ring
+/// size as a uint32. Every later frame in both directions goes through the
+/// rings, the socket only signals the end of the connection. An answer
+/// without payload and descriptors means the request was refused.
+
+/// Federation (federation.h): servers link to each other on a port of their
+/// own. Both ends open with WIRE_PEER_HELLO, whose payload of
+/// FEDERATION_HELLO_SIZE bytes is the node id and epoch, each a uint32. A
+/// WIRE_PEER_INTEREST with a payload byte of 1 announces the first member in
+/// room, 0 the last one leaving. Broadcasts cross links as WIRE_MESSAGE,
+/// WIRE_JOIN and WIRE_LEAVE frames with the sender, room and sequence of the
+/// originating server; their payload starts with a FEDERATION_ROUTE_SIZE
+/// route: origin node, epoch and sender fd as uint32, then the sender's
+/// address in 48 bytes.
+
+/// File transfer: a client uploads with WIRE_FILE_OFFER, whose payload is
+/// the file size as two uint32 (high, low) followed by the name, at most
+/// WIRE_FILE_NAME_MAX bytes. The content follows as WIRE_FILE_DATA frames
+/// of any length up to WIRE_MAX_PAYLOAD; the client may send them without
+/// waiting for the answer. The answer is a WIRE_FILE_OFFER with the file id
+/// as uint32, or without payload if the server refused the upload, in which
+/// case it discards the content. Once the content is complete the room gets
+/// a WIRE_FILE from the uploader with the id, size and name laid out like
+/// WIRE_FILE_INFO_SIZE bytes of a download answer followed by the name.
+///
+/// A client downloads with WIRE_FILE_GET and the id as uint32. The answer is
+/// a WIRE_FILE_GET with WIRE_FILE_INFO_SIZE bytes, the id and the size, or
+/// with the id alone if there is no such file or the client already has as
+/// many downloads queued as the server allows. The content follows as
+/// WIRE_FILE_DATA frames with the id as sequence; other frames may come in
+/// between, and downloads are served one after the other.
+#define WIRE_FILE_NAME_MAX 255
+#define WIRE_FILE_OFFER_SIZE 8
+#define WIRE_FILE_INFO_SIZE 12
+
+/// Presence: a server that batches joins and leaves sends the room one
+/// WIRE_PRESENCE per interval instead of a WIRE_JOIN or WIRE_LEAVE per
+/// client. Its payload is WIRE_PRESENCE_SIZE bytes of flags, the number of
+/// clients that joined and the number that left, each a uint32, followed by
+/// their sender ids, those that joined first. With WIRE_PRESENCE_SNAPSHOT
+/// the ids that "joined" are all members of the room, sent to a client that
+/// just entered it. WIRE_PRESENCE_MORE means the batch continues in the
+/// next WIRE_PRESENCE, as one frame holds at most WIRE_MAX_PAYLOAD bytes.
+#define WIRE_PRESENCE_SIZE 12
+#define WIRE_PRESENCE_SNAPSHOT 1
+#define WIRE_PRESENCE_MORE 2
+
+struct wire_header
+{
+    uint8_t version;
+    uint8_t type;       // enum wire_frame_type
+    uint16_t room;
+    uint32_t sender;
+    uint32_t sequence;  // assigned by the server to every broadcast
+    uint32_t length;    // payload bytes after the header
+};
+
+void wire_encode_header(const struct wire_header* header, unsigned char* out);
+int wire_decode_header(const unsigned char* in, struct wire_header* header);
+size_t wire_encode_frame(const struct wire_header* header, const void* payload, unsigned char* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHAT_WIRE_PROTOCOL_H